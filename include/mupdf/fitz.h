@@ -17,6 +17,7 @@ extern "C" {
 #include "mupdf/fitz/pool.h"
 #include "mupdf/fitz/string.h"
 #include "mupdf/fitz/tree.h"
+#include "mupdf/fitz/thread.h"
 #include "mupdf/fitz/ucdn.h"
 #include "mupdf/fitz/bidi.h"
 #include "mupdf/fitz/xml.h"
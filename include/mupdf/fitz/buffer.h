@@ -76,6 +76,34 @@ fz_buffer *fz_new_buffer_from_data(fz_context *ctx, unsigned char *data, size_t
 */
 fz_buffer *fz_new_buffer_from_shared_data(fz_context *ctx, const char *data, size_t size);
 
+/*
+	fz_new_buffer_slice: Create a buffer that refers to part of the
+	contents of another, without copying. The new buffer keeps a
+	reference to the storage of the original, and is read only:
+	attempts to resize it throw.
+
+	offset, len: The range of buf to use. This is clamped to the
+	length of buf.
+*/
+fz_buffer *fz_new_buffer_slice(fz_context *ctx, fz_buffer *buf, size_t offset, size_t len);
+
+/*
+	fz_new_buffer_from_mapped_file: Create a read only buffer holding
+	the contents of a file, by memory mapping it.
+
+	The mapping is private, so the file is never changed through it.
+	The contents of the buffer are undefined if the file is changed
+	by anyone else while it is mapped, and on some systems, if the
+	file is truncated, reading from the buffer will crash.
+
+	Where memory mapping is not supported, the file is read into
+	memory instead.
+
+	Throws if the file cannot be mapped (for instance if it is
+	empty, or is not a regular file).
+*/
+fz_buffer *fz_new_buffer_from_mapped_file(fz_context *ctx, const char *filename);
+
 /*
 	fz_new_buffer_from_base64: Create a new buffer with data decoded from a base64 input string.
 */
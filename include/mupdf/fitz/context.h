@@ -22,6 +22,7 @@ typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_tuning_context_s fz_tuning_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_glyph_front_s fz_glyph_front;
 typedef struct fz_document_handler_context_s fz_document_handler_context;
 typedef struct fz_output_context_s fz_output_context;
 typedef struct fz_context_s fz_context;
@@ -122,6 +123,7 @@ struct fz_context_s
 	fz_style_context *style;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_glyph_front *glyph_front;
 	fz_tuning_context *tuning;
 	fz_document_handler_context *handler;
 	fz_output_context *output;
@@ -277,6 +279,43 @@ void fz_tune_image_decode(fz_context *ctx, fz_tune_image_decode_fn *image_decode
 */
 void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, void *arg);
 
+/*
+	fz_tune_file_mapping: Set whether fz_open_file should memory map
+	files (where the platform supports it) rather than read them
+	through a small buffer. The default is not to.
+
+	A mapped file is read with no copying or system calls, and the
+	streams of a PDF can be passed around as slices of it (see
+	fz_new_buffer_slice). The catch is that a file that is truncated
+	while it is open (as some programs do when rewriting a file in
+	place) can cause reading from it to crash, so only enable this
+	if files will not be rewritten while they are open.
+
+	enable: 1 to map files, 0 to read them.
+*/
+void fz_tune_file_mapping(fz_context *ctx, int enable);
+
+/*
+	fz_tune_lazy_loading: Set whether document handlers may put off
+	reading a document's index structures (such as the cross
+	reference table of a PDF file) until the parts of them that are
+	needed are asked for. The default is to read them completely
+	when the document is opened.
+
+	This makes opening very large documents much cheaper, at the
+	cost of finding some kinds of damage later (and repairing the
+	file then) rather than when it is opened.
+
+	enable: 1 to load lazily, 0 to load everything up front.
+*/
+void fz_tune_lazy_loading(fz_context *ctx, int enable);
+
+/*
+	fz_lazy_loading: Return whether lazy loading has been enabled
+	with fz_tune_lazy_loading.
+*/
+int fz_lazy_loading(fz_context *ctx);
+
 /*
 	fz_aa_level: Get the number of bits of antialiasing we are
 	using (for graphics). Between 0 and 8.
@@ -367,8 +406,18 @@ void fz_set_user_css(fz_context *ctx, const char *text);
 	when we already hold any lock i, where 0 <= i <= n. In order
 	to verify this, we have some debugging code, that can be
 	enabled by defining FITZ_DEBUG_LOCKING.
+
+	The resource store is split into FZ_STORE_SHARDS shards, each
+	protected by its own lock (FZ_LOCK_STORE + shard number), so
+	that lookups in different shards do not contend with one
+	another, nor with the allocator. Building with
+	FZ_STORE_SHARDS=1 gives a single store lock.
 */
 
+#ifndef FZ_STORE_SHARDS
+#define FZ_STORE_SHARDS 8
+#endif
+
 struct fz_locks_context_s
 {
 	void *user;
@@ -378,6 +427,8 @@ struct fz_locks_context_s
 
 enum {
 	FZ_LOCK_REAP = 0,
+	FZ_LOCK_STORE,
+	FZ_LOCK_STORE_LAST = FZ_LOCK_STORE + FZ_STORE_SHARDS - 1,
 	FZ_LOCK_ALLOC,
 	FZ_LOCK_FREETYPE,
 	FZ_LOCK_GLYPHCACHE,
@@ -343,6 +343,18 @@ fz_device *fz_new_draw_device_with_bbox(fz_context *ctx, const fz_matrix *transf
 
 fz_device *fz_new_draw_device_type3(fz_context *ctx, const fz_matrix *transform, fz_pixmap *dest);
 
+/*
+	fz_set_draw_device_thread_pool: Allow a draw device to use a
+	pool of threads to paint large shadings (see
+	fz_paint_shade_with_pool).
+
+	The pool is borrowed, not kept; it must outlive the device, or be
+	unset by passing NULL. The device waits on the pool while it
+	paints, so it must not be given a pool that the device itself is
+	being run from a job of. Has no effect on other kinds of device.
+*/
+void fz_set_draw_device_thread_pool(fz_context *ctx, fz_device *dev, fz_thread_pool *pool);
+
 /*
 	struct fz_draw_options: Options for creating a pixmap and draw device.
 */
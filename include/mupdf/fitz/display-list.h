@@ -5,6 +5,9 @@
 #include "mupdf/fitz/context.h"
 #include "mupdf/fitz/math.h"
 #include "mupdf/fitz/device.h"
+#include "mupdf/fitz/buffer.h"
+#include "mupdf/fitz/stream.h"
+#include "mupdf/fitz/output.h"
 
 /*
 	Display list device -- record and play back device commands.
@@ -48,6 +51,23 @@ fz_display_list *fz_new_display_list(fz_context *ctx, const fz_rect *mediabox);
 */
 fz_device *fz_new_list_device(fz_context *ctx, fz_display_list *list);
 
+/*
+	fz_index_display_list: Build a spatial index over the contents
+	of a display list.
+
+	Running an indexed list over a small area only visits the
+	commands that can be visible there, rather than culling every
+	command in the list in turn. This is worthwhile for large lists
+	that will be rendered many times as small tiles or bands. The
+	output is the same with or without the index, which takes about
+	as much memory again as the list itself.
+
+	If called before the list has been populated, the index is built
+	when the list device is closed. As the index is kept in the list,
+	this must not be called while the list is being run elsewhere.
+*/
+void fz_index_display_list(fz_context *ctx, fz_display_list *list);
+
 /*
 	fz_run_display_list: (Re)-run a display list through a device.
 
@@ -116,4 +136,59 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 */
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+/*
+	fz_display_list_put_image_fn: Callback used by fz_save_display_list
+	to offer each image to the caller, so that images can be kept
+	outside the saved list (for instance shared between the lists
+	of many pages, or many documents).
+
+	digest: The MD5 digest of data, which identifies the image.
+
+	data: The image, in the form that fz_load_display_list will want
+	it back.
+
+	Return non-zero if the caller has kept the image, in which case
+	only its digest is written. Return zero to embed the image.
+*/
+typedef int (fz_display_list_put_image_fn)(fz_context *ctx, void *arg, const unsigned char digest[16], fz_buffer *data);
+
+/*
+	fz_display_list_get_image_fn: Callback used by fz_load_display_list
+	to fetch an image that was kept outside the saved list.
+
+	Return a new reference to the data given to the put_image callback
+	for this digest, or NULL if it cannot be found.
+*/
+typedef fz_buffer *(fz_display_list_get_image_fn)(fz_context *ctx, void *arg, const unsigned char digest[16]);
+
+/*
+	fz_save_display_list: Write a display list in a compact binary
+	form that fz_load_display_list can read back, in this process
+	or in another one.
+
+	Fonts, shades, stroke states, texts and colorspaces are written
+	once however often they are used. Images are written once per
+	distinct content, and are identified by their digest.
+
+	Colorspaces whose conversions call back into the interpreter
+	(Separation and DeviceN, for example) are saved as sampled
+	approximations, which are close to the original but not exact.
+	Throws if the list holds anything that cannot be saved.
+
+	put_image: Optional callback to keep images elsewhere (see
+	above), or NULL to embed them all.
+*/
+void fz_save_display_list(fz_context *ctx, fz_display_list *list, fz_output *out, fz_display_list_put_image_fn *put_image, void *arg);
+
+/*
+	fz_load_display_list: Read a display list written by
+	fz_save_display_list.
+
+	get_image: Callback to fetch the images that were kept elsewhere
+	when the list was saved; may be NULL if all were embedded.
+
+	Throws if the data is corrupt, or an image cannot be found.
+*/
+fz_display_list *fz_load_display_list(fz_context *ctx, fz_stream *stm, fz_display_list_get_image_fn *get_image, void *arg);
+
 #endif
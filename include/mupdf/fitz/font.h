@@ -135,6 +135,19 @@ const char *fz_font_name(fz_context *ctx, fz_font *font);
 */
 fz_rect *fz_font_bbox(fz_context *ctx, fz_font *font);
 
+/*
+	fz_font_digest: Retrieve the MD5 digest of the font data.
+
+	font: The font to query.
+
+	digest: Where to put the digest. Fonts without any data of
+	their own (such as Type 3 fonts) give a digest of all zeroes.
+
+	The digest is calculated the first time it is asked for, and
+	remembered.
+*/
+void fz_font_digest(fz_context *ctx, fz_font *font, unsigned char digest[16]);
+
 /*
 	fz_load_system_font_func: Type for user supplied system
 	font loading hook.
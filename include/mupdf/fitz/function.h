@@ -13,11 +13,58 @@
 typedef struct fz_function_s fz_function;
 
 void fz_eval_function(fz_context *ctx, fz_function *func, const float *in, int inlen, float *out, int outlen);
+
+/*
+	fz_eval_function_n: Evaluate a function for a run of inputs.
+
+	in: count input vectors of inlen values each, packed.
+
+	out: count output vectors of outlen values each, packed.
+*/
+void fz_eval_function_n(fz_context *ctx, fz_function *func, int count, const float *in, int inlen, float *out, int outlen);
 fz_function *fz_keep_function(fz_context *ctx, fz_function *func);
 void fz_drop_function(fz_context *ctx, fz_function *func);
 size_t fz_function_size(fz_context *ctx, fz_function *func);
 void fz_print_function(fz_context *ctx, fz_output *out, fz_function *func);
 
+/*
+	fz_function_lut: A function sampled on a regular grid over
+	inputs in the range 0 to 1.
+*/
+typedef struct fz_function_lut_s fz_function_lut;
+
+/*
+	fz_find_function_lut: Get a sampled copy of a function, for
+	repeated evaluation with inputs in the range 0 to 1.
+
+	A function with a single input is sampled at each multiple of
+	1/255, so 8 bit values map to samples exactly. Functions with
+	more inputs use a coarser grid, which still includes 0 and 1 on
+	each axis. The grid always has at least 6 points on each axis;
+	functions of more than 6 inputs are not sampled, as a coarser
+	grid cannot follow them closely enough.
+
+	Tables are kept in the store, so they are built once and
+	shared until the function is dropped or the store needs the
+	space.
+
+	Returns a new reference, or NULL if the function has too many
+	inputs to sample; evaluate it exactly instead.
+*/
+fz_function_lut *fz_find_function_lut(fz_context *ctx, fz_function *func);
+
+/*
+	fz_drop_function_lut: Drop a reference to a sampled function.
+*/
+void fz_drop_function_lut(fz_context *ctx, fz_function_lut *lut);
+
+/*
+	fz_eval_function_lut: Evaluate a sampled function, interpolating
+	between grid points. With several inputs, this interpolates over
+	the simplex of grid points around in.
+*/
+void fz_eval_function_lut(fz_context *ctx, fz_function_lut *lut, const float *in, float *out);
+
 enum
 {
 	FZ_FN_MAXN = FZ_MAX_COLORS,
@@ -30,12 +77,22 @@ enum
 */
 struct fz_function_s
 {
-	fz_storable storable;
+	fz_key_storable key_storable;
 	size_t size;
 	int m;					/* number of input values */
 	int n;					/* number of output values */
 	void (*evaluate)(fz_context *ctx, fz_function *func, const float *in, float *out);
+	void (*evaluate_n)(fz_context *ctx, fz_function *func, int count, const float *in, float *out); /* optional */
 	void (*print)(fz_context *ctx, fz_output *out, fz_function *func);
 };
 
+struct fz_function_lut_s
+{
+	fz_storable storable;
+	int m;			/* number of inputs */
+	int n;			/* number of outputs */
+	int size;		/* grid points along each input */
+	float *samples;		/* size^m points of n values, first input varying fastest */
+};
+
 #endif
@@ -7,6 +7,38 @@
 #include "mupdf/fitz/pixmap.h"
 
 void fz_purge_glyph_cache(fz_context *ctx);
+
+/*
+	fz_attach_glyph_cache_file: Back the glyph cache with a file, so
+	that rendered glyphs outlive the process, and can be shared
+	between several processes at once.
+
+	When a glyph is not in the in-memory cache, it is looked for in
+	the file before being rendered, and newly rendered glyphs are
+	added to the file. Glyphs in the file are keyed on the MD5 of the
+	font data (together with the face index and any synthetic
+	styling) rather than on the font object, so they are found again
+	when the same font is loaded by another document or process.
+	Only fonts rendered with FreeType are stored; Type 3 glyphs
+	depend on their resources and are never written to the file.
+
+	The file is memory mapped, and glyphs found in it are used in
+	place rather than copied. Any number of processes may attach the
+	same file; additions are serialised by locking the file. If the
+	file cannot be opened for writing it is opened read only, and
+	nothing is added to it.
+
+	filename: The file to use. It is created if it does not exist.
+
+	size: The size to create the file with, or 0 for a default of
+	64 Megabytes. The file does not grow; once it is full, glyphs
+	are no longer added to it. Ignored if the file already exists.
+
+	Throws if the file cannot be opened or is not a glyph cache
+	file, if a file is already attached to the glyph cache, or if
+	glyph cache files are not supported on this platform.
+*/
+void fz_attach_glyph_cache_file(fz_context *ctx, const char *filename, size_t size);
 fz_pixmap *fz_render_glyph_pixmap(fz_context *ctx, fz_font*, int, fz_matrix *, const fz_irect *scissor);
 void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, int gid, const fz_matrix *trm, void *gstate, int nestedDepth);
 void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid, int nestedDepth);
@@ -112,6 +112,9 @@ void fz_drop_glyph(fz_context *ctx, fz_glyph *pix);
 	 LLLLLE11 = A run of length L+1 intermediate pixels followed by L+1
 		bytes of literal pixel data. If E then this is the last run
 		on this line.
+
+	mapped: If non NULL, the compressed data is held here (in a
+	glyph cache file) rather than in the data block.
 */
 struct fz_glyph_s
 {
@@ -119,11 +122,31 @@ struct fz_glyph_s
 	int x, y, w, h;
 	fz_pixmap *pixmap;
 	size_t size;
+	const unsigned char *mapped;
 	unsigned char data[1];
 };
 
 fz_irect *fz_glyph_bbox_no_ctx(fz_glyph *src, fz_irect *bbox);
 
+/*
+	fz_new_glyph_from_mapped_data: Create a glyph that refers to data
+	held elsewhere, without copying it. Used for glyphs read from a
+	glyph cache file.
+
+	rle: If non zero, data is in the compressed format described
+	above, and is size bytes long. Otherwise data is w * h bytes of
+	8 bit coverage values.
+
+	The data must remain valid for as long as the glyph exists.
+*/
+fz_glyph *fz_new_glyph_from_mapped_data(fz_context *ctx, int x, int y, int w, int h, const unsigned char *data, size_t size, int rle);
+
+static inline const unsigned char *
+fz_glyph_data(const fz_glyph *glyph)
+{
+	return glyph->mapped ? glyph->mapped : glyph->data;
+}
+
 static inline size_t
 fz_glyph_size(fz_context *ctx, fz_glyph *glyph)
 {
@@ -100,4 +100,21 @@ void fz_write_pixmap_as_pwg_page(fz_context *ctx, fz_output *out, const fz_pixma
 */
 void fz_write_bitmap_as_pwg_page(fz_context *ctx, fz_output *out, const fz_bitmap *bitmap, const fz_pwg_options *pwg);
 
+/*
+	fz_new_pwg_band_writer: Obtain a fz_band_writer instance for
+	producing a contone pwg page, to follow a header or other pages.
+
+	pwg: NULL, or a pointer to an options structure, which is copied.
+*/
+fz_band_writer *fz_new_pwg_band_writer(fz_context *ctx, fz_output *out, const fz_pwg_options *pwg);
+
+/*
+	fz_new_mono_pwg_band_writer: Obtain a fz_band_writer instance for
+	producing a monochrome pwg page from bitmap bands, to follow a
+	header or other pages.
+
+	pwg: NULL, or a pointer to an options structure, which is copied.
+*/
+fz_band_writer *fz_new_mono_pwg_band_writer(fz_context *ctx, fz_output *out, const fz_pwg_options *pwg);
+
 #endif
@@ -5,6 +5,7 @@
 #include "mupdf/fitz/context.h"
 #include "mupdf/fitz/buffer.h"
 #include "mupdf/fitz/string.h"
+#include "mupdf/fitz/thread.h"
 
 /*
 	Generic output streams - generalise between outputting to a file,
@@ -184,6 +185,7 @@ struct fz_band_writer_s
 	int xres;
 	int yres;
 	int pagenum;
+	fz_thread_pool *pool;
 };
 
 fz_band_writer *fz_new_band_writer_of_size(fz_context *ctx, size_t size, fz_output *out);
@@ -193,4 +195,20 @@ void fz_write_band(fz_context *ctx, fz_band_writer *writer, int stride, int band
 void fz_write_trailer(fz_context *ctx, fz_band_writer *writer);
 void fz_drop_band_writer(fz_context *ctx, fz_band_writer *writer);
 
+/*
+	fz_set_band_writer_thread_pool: Allow a band writer to use a pool
+	of threads to compress the bands it is given.
+
+	Writers that can make use of it (PNG, PWG and PCL) split each band
+	into pieces that are compressed as jobs on the pool, and then write
+	the results out in order before fz_write_band returns. PWG and PCL
+	output is the same as without a pool. PNG output is an equally
+	valid encoding of the same image, but not the same bytes, as the
+	deflate stream is flushed at the end of every piece.
+
+	The pool is borrowed, not kept; it must outlive the writer, or be
+	unset by passing NULL. Set it before calling fz_write_header.
+*/
+void fz_set_band_writer_thread_pool(fz_context *ctx, fz_band_writer *writer, fz_thread_pool *pool);
+
 #endif
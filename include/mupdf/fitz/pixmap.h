@@ -271,6 +271,42 @@ void fz_unmultiply_pixmap(fz_context *ctx, fz_pixmap *pix);
 */
 void fz_convert_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src);
 
+/*
+	fz_pixmap_converter: A colorspace transform sampled over a grid
+	of 8 bit values, for converting whole pixmaps from a 3 or 4
+	component colorspace into one with at most 4 components.
+	Colours between grid points are interpolated over the enclosing
+	tetrahedron (or its 4 dimensional equivalent).
+
+	fz_convert_pixmap uses these for large pixmaps in colorspaces
+	without a dedicated conversion. Lab is never sampled, as its
+	conversion is too far from linear near black.
+*/
+typedef struct fz_pixmap_converter_s fz_pixmap_converter;
+
+/*
+	fz_find_pixmap_converter: Get the converter from ss to ds.
+
+	Converters are kept in the store, so each pair of colorspaces
+	is sampled once and then shared.
+
+	Returns a new reference, or NULL if the pair of colorspaces
+	cannot be sampled.
+*/
+fz_pixmap_converter *fz_find_pixmap_converter(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss);
+
+/*
+	fz_drop_pixmap_converter: Drop a reference to a converter.
+*/
+void fz_drop_pixmap_converter(fz_context *ctx, fz_pixmap_converter *pc);
+
+/*
+	fz_convert_pixmap_with_converter: Convert src into dst (the same
+	size, in the colorspaces pc was found for) using a converter.
+	Alpha is copied, or set to 255 if src has none.
+*/
+void fz_convert_pixmap_with_converter(fz_context *ctx, fz_pixmap_converter *pc, fz_pixmap *dst, fz_pixmap *src);
+
 /*
 	Pixmaps represent a set of pixels for a 2 dimensional region of a
 	plane. Each pixel has n components per pixel, the last of which is
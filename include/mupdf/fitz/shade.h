@@ -8,6 +8,7 @@
 #include "mupdf/fitz/colorspace.h"
 #include "mupdf/fitz/pixmap.h"
 #include "mupdf/fitz/compressed-buffer.h"
+#include "mupdf/fitz/thread.h"
 
 /*
  * The shading code uses gouraud shaded triangle meshes.
@@ -126,6 +127,23 @@ fz_rect *fz_bound_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm,
 */
 void fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap *dest, const fz_irect *bbox);
 
+/*
+	fz_paint_shade_with_pool: Render a shade to a given pixmap,
+	using a pool of threads.
+
+	As fz_paint_shade, which collects the triangles of the shade in
+	batches and paints each batch a tile of bbox at a time, except
+	that the tiles are painted as jobs on the pool. Batches of large
+	triangles, which fz_paint_shade paints as they are, are cut into
+	bands instead. Either way the result is the same as painting
+	without a pool. Small shades are painted on the calling thread.
+
+	pool: The pool to use, or NULL to paint on the calling thread.
+	This calls fz_thread_pool_wait, so must not be called from within
+	a job on the same pool.
+*/
+void fz_paint_shade_with_pool(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap *dest, const fz_irect *bbox, fz_thread_pool *pool);
+
 /*
  *	Handy routine for processing mesh based shades
  */
@@ -256,6 +256,15 @@ fz_stream *fz_keep_stream(fz_context *ctx, fz_stream *stm);
 */
 fz_buffer *fz_read_best(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated);
 
+/*
+	fz_read_shared: As fz_read_best, but if the stream reads directly
+	from a buffer (for instance, a section of a memory mapped file),
+	return a slice of that buffer rather than a copy of the data.
+
+	The returned buffer must be treated as read only.
+*/
+fz_buffer *fz_read_shared(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated);
+
 /*
 	fz_read_line: Read a line from stream into the buffer until either a
 	terminating newline or EOF, which it replaces with a null byte ('\0').
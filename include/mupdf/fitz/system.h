@@ -258,6 +258,26 @@ int fz_android_fprintf(FILE *file, const char *fmt, ...);
 #endif
 #endif
 
+/*
+	Atomic integer operations, where the compiler provides them.
+
+	FZ_HAVE_ATOMICS is defined if fz_atomic_add is available. It
+	atomically adds delta to *p (with full barrier semantics) and
+	returns the new value. Code that uses these must provide a locked
+	fallback for when FZ_HAVE_ATOMICS is not defined. Define
+	FZ_NO_ATOMICS to force the fallback.
+*/
+#ifndef FZ_NO_ATOMICS
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#include <intrin.h>
+#define FZ_HAVE_ATOMICS
+#define fz_atomic_add(p, delta) ((int)_InterlockedExchangeAdd((long volatile *)(p), (long)(delta)) + (delta))
+#elif __GNUC__ > 4 || __GNUC__ == 4 && __GNUC_MINOR__ >= 1
+#define FZ_HAVE_ATOMICS
+#define fz_atomic_add(p, delta) __sync_add_and_fetch((p), (delta))
+#endif
+#endif
+
 /* Flag unused parameters, for use with 'static inline' functions in headers. */
 #if __GNUC__ > 2 || __GNUC__ == 2 && __GNUC_MINOR__ >= 7
 #define FZ_UNUSED __attribute__((__unused__))
@@ -0,0 +1,99 @@
+#ifndef MUPDF_FITZ_THREAD_H
+#define MUPDF_FITZ_THREAD_H
+
+#include "mupdf/fitz/system.h"
+#include "mupdf/fitz/context.h"
+
+/*
+	Thread pools.
+
+	A thread pool runs jobs submitted to it on a set of worker
+	threads, each of which has its own context cloned from the one
+	the pool was created with. Every worker has a queue of its own;
+	a worker takes the most recently queued job from its own queue,
+	and when that is empty steals the oldest job from another queue.
+	Jobs submitted from within a job go onto the queue of the worker
+	running it.
+
+	The thread that calls fz_thread_pool_wait runs jobs too, so a
+	pool created with no threads (or in a build without thread
+	support, or from a context without locks) still works, running
+	every job on the waiting thread.
+
+	Pools are only available in builds with HAVE_PTHREADS defined,
+	or on Windows; otherwise they exist but never start threads.
+*/
+
+typedef struct fz_thread_pool_s fz_thread_pool;
+
+/*
+	fz_thread_job_fn: The type of a job.
+
+	ctx: The context of the thread running the job. This is a clone
+	of the context the pool was created with (or that context itself
+	if the job is run by fz_thread_pool_wait), and so shares its
+	allocator, store and locks.
+
+	arg: The argument given when the job was submitted.
+
+	Any exception thrown by a job is caught by the pool, and the
+	first one to be thrown is rethrown by fz_thread_pool_wait.
+*/
+typedef void (fz_thread_job_fn)(fz_context *ctx, void *arg);
+
+/*
+	fz_new_thread_pool: Create a pool and start its worker threads.
+
+	threads: The number of threads to start. The thread calling
+	fz_thread_pool_wait is not counted, so a pool with n threads
+	can run n+1 jobs at once while it is being waited on.
+
+	If fewer threads can be started than asked for (for instance
+	because ctx has no locks and so cannot be cloned), the pool is
+	created with as many as could be. Use fz_thread_pool_size to
+	find out how many that was.
+*/
+fz_thread_pool *fz_new_thread_pool(fz_context *ctx, int threads);
+
+/*
+	fz_drop_thread_pool: Wait for any jobs still queued to finish,
+	then stop the worker threads and free the pool. Errors from
+	those jobs are discarded.
+
+	Does not throw exceptions.
+*/
+void fz_drop_thread_pool(fz_context *ctx, fz_thread_pool *pool);
+
+/*
+	fz_thread_pool_size: Return the number of worker threads that
+	are running in the pool.
+*/
+int fz_thread_pool_size(fz_context *ctx, fz_thread_pool *pool);
+
+/*
+	fz_thread_pool_submit: Queue a job to be run by the pool.
+
+	The job may start at once, or may wait until
+	fz_thread_pool_wait is called. May be called from within a job,
+	with the context the job was given.
+
+	Does not throw exceptions. If the job cannot be queued, it is run
+	before this returns; any error it raises is thrown by
+	fz_thread_pool_wait as usual.
+*/
+void fz_thread_pool_submit(fz_context *ctx, fz_thread_pool *pool, fz_thread_job_fn *fn, void *arg);
+
+/*
+	fz_thread_pool_wait: Run queued jobs on the calling thread until
+	every job submitted to the pool has finished, including any
+	submitted by the jobs themselves.
+
+	Must not be called from within a job.
+
+	Throws the first error raised by any of the jobs since the last
+	call to fz_thread_pool_wait. The pool is usable again
+	afterwards.
+*/
+void fz_thread_pool_wait(fz_context *ctx, fz_thread_pool *pool);
+
+#endif
@@ -24,6 +24,39 @@ fz_pixmap *fz_new_pixmap_from_display_list(fz_context *ctx, fz_display_list *lis
 fz_pixmap *fz_new_pixmap_from_page(fz_context *ctx, fz_page *page, const fz_matrix *ctm, fz_colorspace *cs, int alpha);
 fz_pixmap *fz_new_pixmap_from_page_number(fz_context *ctx, fz_document *doc, int number, const fz_matrix *ctm, fz_colorspace *cs, int alpha);
 
+/*
+	fz_run_display_list_parallel: Render a display list into a pixmap,
+	splitting the pixmap into tiles that are drawn concurrently.
+
+	Each tile is drawn by its own draw device directly into the
+	samples of pix, so the pixmap should be cleared beforehand, as
+	for fz_new_draw_device. Tiles are shared out between 'threads'
+	workers; the calling thread is one of these, and the others run
+	on threads of their own with cloned contexts. If threading is not
+	available in this build, or the context cannot be cloned (it has
+	no locks), the tiles are all drawn on the calling thread.
+
+	ctm: Transform from display list space to pixmap space.
+
+	hints: Device hints (such as FZ_NO_CACHE) to enable on each of
+	the draw devices, or 0.
+
+	cookie: As for fz_run_display_list. Setting abort stops all the
+	workers; the progress fields are updated by several threads at
+	once and so are only approximate.
+
+	Throws the first error raised by any of the workers, after all
+	of them have finished.
+*/
+void fz_run_display_list_parallel(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_pixmap *pix, int hints, int threads, fz_cookie *cookie);
+
+/*
+	fz_new_pixmap_from_display_list_parallel: As for
+	fz_new_pixmap_from_display_list, but rendered in tiles by
+	'threads' workers using fz_run_display_list_parallel.
+*/
+fz_pixmap *fz_new_pixmap_from_display_list_parallel(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_colorspace *cs, int alpha, int threads);
+
 /*
 	fz_new_pixmap_from_page_contents: Render the page contents without annotations.
 */
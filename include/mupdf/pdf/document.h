@@ -12,6 +12,7 @@ typedef struct pdf_annot_s pdf_annot;
 typedef struct pdf_widget_s pdf_widget;
 typedef struct pdf_hotspot_s pdf_hotspot;
 typedef struct pdf_js_s pdf_js;
+typedef struct pdf_rev_page_map_s pdf_rev_page_map;
 
 enum
 {
@@ -42,6 +43,12 @@ struct pdf_hotspot_s
 	int state;
 };
 
+struct pdf_rev_page_map_s
+{
+	int object;
+	int page; /* or -1 if the object is used for more than one page */
+};
+
 /*
 	Document event structures are mostly opaque to the app. Only the type
 	is visible to the app.
@@ -309,12 +316,33 @@ struct pdf_document_s
 
 	int repair_attempted;
 
+	/* Set if parts of the xref are read on demand (see fz_tune_lazy_loading) */
+	int lazy_xref;
+	int lazy_xref_broken;
+
+	/* Set if objects are allocated in bulk (see pdf_enable_obj_arena) */
+	pdf_obj_arena *obj_arena;
+
+	/* Interned names (see pdf_new_name) */
+	int name_table_id;
+	int name_table_len;
+	int name_table_size;
+	pdf_obj **name_table;
+
 	/* State indicating which file parsing method we are using */
 	int file_reading_linearly;
 	fz_off_t file_length;
 
 	pdf_obj *linear_obj; /* Linearized object (if used) */
 	pdf_obj **linear_page_refs; /* Page objects for linear loading */
+
+	/* Flattened page tree (see pdf_load_page_tree) */
+	int map_page_count;
+	pdf_obj **fwd_page_map; /* page number to page object */
+	int rev_page_count;
+	pdf_rev_page_map *rev_page_map; /* indirect pages, sorted by object number */
+	unsigned char *page_map_unchecked; /* saved pages not yet checked against the tree */
+	int page_map_stale; /* a saved page did not match the tree */
 	int linear_page1_obj_num;
 
 	/* The state for the pdf_progressive_advance parser */
@@ -519,6 +547,7 @@ struct pdf_write_options_s
 	int do_clean; /* Sanitize content streams. */
 	int continue_on_error; /* If set, errors are (optionally) counted and writing continues. */
 	int *errors; /* Pointer to a place to store a count of errors */
+	fz_thread_pool *thread_pool; /* If set, borrowed to load object streams and compress streams in parallel. */
 };
 
 /*
@@ -5,6 +5,58 @@ int pdf_lookup_page_number(fz_context *ctx, pdf_document *doc, pdf_obj *pageobj)
 int pdf_count_pages(fz_context *ctx, pdf_document *doc);
 pdf_obj *pdf_lookup_page_obj(fz_context *ctx, pdf_document *doc, int needle);
 
+/*
+	pdf_load_page_tree: Flatten the page tree into an index from page
+	number to page object (and back), so that pdf_lookup_page_obj and
+	pdf_lookup_page_number no longer have to walk the tree.
+
+	This loads every page object once, so it is worth doing for
+	documents that will have many pages looked up, in any order. The
+	index is only used if the tree is consistent (every /Count agrees
+	with the pages beneath it), so that lookups give exactly the same
+	answers as walking the tree would. Inserting or deleting pages
+	drops the index again, and a saved index that has been found not
+	to match the tree is replaced.
+*/
+void pdf_load_page_tree(fz_context *ctx, pdf_document *doc);
+
+/*
+	pdf_drop_page_tree: Drop the index made by pdf_load_page_tree.
+	This must be called by anything that edits the page tree other
+	than through pdf_insert_page and pdf_delete_page.
+
+	Does not throw exceptions.
+*/
+void pdf_drop_page_tree(fz_context *ctx, pdf_document *doc);
+
+/*
+	pdf_save_page_tree: Write the page index (loading it first if
+	need be) to an output, to be reloaded the next time the same
+	file is opened with pdf_load_saved_page_tree. An index that was
+	itself loaded from a saved one is checked against the tree first.
+
+	Throws if the index cannot be made, or if any page object is not
+	an indirect object.
+*/
+void pdf_save_page_tree(fz_context *ctx, pdf_document *doc, fz_output *out);
+
+/*
+	pdf_load_saved_page_tree: Load a page index written by
+	pdf_save_page_tree.
+
+	The index is only used if it was saved from the same version of
+	the file (as judged by its size, the position of its last xref
+	and its page count). Returns 1 if the index was loaded, or 0 if
+	it does not match the document, in which case the document is
+	left as it was. Throws if the saved index cannot be read.
+
+	As the saved index may still be stale, or have been edited, each
+	page in it is checked to be a /Type /Page object at that place in
+	the page tree the first time it is looked up. If one is not, we
+	warn and go back to walking the tree.
+*/
+int pdf_load_saved_page_tree(fz_context *ctx, pdf_document *doc, fz_stream *stm);
+
 /*
 	pdf_lookup_anchor: Find the page number of a named destination.
 
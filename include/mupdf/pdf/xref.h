@@ -53,6 +53,7 @@ enum
 };
 
 typedef struct pdf_xref_subsec_s pdf_xref_subsec;
+typedef struct pdf_xref_lazy_s pdf_xref_lazy;
 
 struct pdf_xref_subsec_s
 {
@@ -60,6 +61,7 @@ struct pdf_xref_subsec_s
 	int len;
 	fz_off_t start;
 	pdf_xref_entry *table;
+	pdf_xref_lazy *lazy;	/* entries still to be read from the file, or NULL */
 };
 
 struct pdf_xref_s
@@ -80,6 +82,22 @@ pdf_obj *pdf_resolve_indirect(fz_context *ctx, pdf_obj *ref);
 pdf_obj *pdf_resolve_indirect_chain(fz_context *ctx, pdf_obj *ref);
 pdf_obj *pdf_load_object(fz_context *ctx, pdf_document *doc, int num);
 
+/*
+	pdf_prefetch_obj_stms: Load every object that is stored in an
+	object stream and has not been loaded yet, inflating and parsing
+	the object streams on a thread pool.
+
+	Worth doing before anything that visits the whole document (such
+	as saving it) when it uses cross reference streams. Object streams
+	that cannot be decoded without resolving other objects, or that
+	fail to parse, are skipped; their objects are loaded (and any
+	errors reported) when they are asked for, as usual.
+
+	pool: The pool to use. It is borrowed for the duration of the
+	call.
+*/
+void pdf_prefetch_obj_stms(fz_context *ctx, pdf_document *doc, fz_thread_pool *pool);
+
 fz_buffer *pdf_load_raw_stream_number(fz_context *ctx, pdf_document *doc, int num);
 fz_buffer *pdf_load_raw_stream(fz_context *ctx, pdf_obj *ref);
 fz_buffer *pdf_load_stream_number(fz_context *ctx, pdf_document *doc, int num);
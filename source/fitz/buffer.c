@@ -64,6 +64,28 @@ fz_new_buffer_from_shared_data(fz_context *ctx, const char *data, size_t size)
 	return b;
 }
 
+fz_buffer *
+fz_new_buffer_slice(fz_context *ctx, fz_buffer *buf, size_t offset, size_t len)
+{
+	fz_buffer *b;
+
+	if (offset > buf->len)
+		offset = buf->len;
+	if (len > buf->len - offset)
+		len = buf->len - offset;
+
+	b = fz_malloc_struct(ctx, fz_buffer);
+	b->refs = 1;
+	b->data = buf->data + offset;
+	b->cap = len;
+	b->len = len;
+	b->unused_bits = 0;
+	b->shared = 1;
+	b->parent = fz_keep_buffer(ctx, buf->parent ? buf->parent : buf);
+
+	return b;
+}
+
 fz_buffer *
 fz_new_buffer_from_base64(fz_context *ctx, const char *data, size_t size)
 {
@@ -106,7 +128,11 @@ fz_drop_buffer(fz_context *ctx, fz_buffer *buf)
 {
 	if (fz_drop_imp(ctx, buf, &buf->refs))
 	{
-		if (!buf->shared)
+		if (buf->parent)
+			fz_drop_buffer(ctx, buf->parent);
+		else if (buf->mapped)
+			fz_unmap_file(ctx, buf->data, buf->cap);
+		else if (!buf->shared)
 			fz_free(ctx, buf->data);
 		fz_free(ctx, buf);
 	}
@@ -178,6 +204,15 @@ fz_buffer_extract(fz_context *ctx, fz_buffer *buf, unsigned char **datap)
 	size_t len = buf ? buf->len : 0;
 	*datap = (buf ? buf->data : NULL);
 
+	/* The caller will free what we return, so don't hand out storage
+	 * that we do not own. */
+	if (buf && buf->shared)
+	{
+		*datap = fz_malloc(ctx, len);
+		memcpy(*datap, buf->data, len);
+		return len;
+	}
+
 	if (buf)
 	{
 		buf->data = NULL;
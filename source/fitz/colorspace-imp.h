@@ -3,7 +3,7 @@
 
 struct fz_colorspace_s
 {
-	fz_storable storable;
+	fz_key_storable key_storable;
 	size_t size;
 	char name[16];
 	int n;
@@ -11,6 +11,14 @@ struct fz_colorspace_s
 	fz_colorspace_convert_fn *from_rgb;
 	fz_colorspace_destruct_fn *free_data;
 	void *data;
+	/* For tint transform colorspaces: the alternate space and the
+	 * tint transform into it. Borrowed; owned by data. */
+	fz_colorspace *tint_base;
+	fz_function *tint;
 };
 
+/* Borrow the base colorspace, hival and lookup table of an indexed
+ * colorspace. Returns NULL if cs is not indexed. */
+fz_colorspace *fz_indexed_colorspace_base(fz_context *ctx, fz_colorspace *cs, int *high, unsigned char **lookup);
+
 #endif
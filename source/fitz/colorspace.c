@@ -1,6 +1,7 @@
 #include "mupdf/fitz.h"
 
 #include "colorspace-imp.h"
+#include "draw-simd.h"
 
 #define SLOWCMYK
 
@@ -18,7 +19,7 @@ fz_colorspace *
 fz_new_colorspace(fz_context *ctx, char *name, int n, fz_colorspace_convert_fn *to_rgb, fz_colorspace_convert_fn *from_rgb, fz_colorspace_destruct_fn *destruct, void *data, size_t size)
 {
 	fz_colorspace *cs = fz_malloc_struct(ctx, fz_colorspace);
-	FZ_INIT_STORABLE(cs, 1, fz_drop_colorspace_imp);
+	FZ_INIT_KEY_STORABLE(cs, 1, fz_drop_colorspace_imp);
 	cs->size = sizeof(fz_colorspace) + size;
 	fz_strlcpy(cs->name, name, sizeof cs->name);
 	cs->n = n;
@@ -32,13 +33,13 @@ fz_new_colorspace(fz_context *ctx, char *name, int n, fz_colorspace_convert_fn *
 fz_colorspace *
 fz_keep_colorspace(fz_context *ctx, fz_colorspace *cs)
 {
-	return fz_keep_storable(ctx, &cs->storable);
+	return fz_keep_key_storable(ctx, &cs->key_storable);
 }
 
 void
 fz_drop_colorspace(fz_context *ctx, fz_colorspace *cs)
 {
-	fz_drop_storable(ctx, &cs->storable);
+	fz_drop_key_storable(ctx, &cs->key_storable);
 }
 
 /* Device colorspace definitions */
@@ -215,11 +216,11 @@ fz_colorspace_is_lab(fz_context *ctx, fz_colorspace *cs)
 	return (cs && cs->to_rgb == lab_to_rgb);
 }
 
-static fz_colorspace k_default_gray = { {-1, fz_drop_colorspace_imp}, 0, "DeviceGray", 1, gray_to_rgb, rgb_to_gray };
-static fz_colorspace k_default_rgb = { {-1, fz_drop_colorspace_imp}, 0, "DeviceRGB", 3, rgb_to_rgb, rgb_to_rgb };
-static fz_colorspace k_default_bgr = { {-1, fz_drop_colorspace_imp}, 0, "DeviceBGR", 3, bgr_to_rgb, rgb_to_bgr };
-static fz_colorspace k_default_cmyk = { {-1, fz_drop_colorspace_imp}, 0, "DeviceCMYK", 4, cmyk_to_rgb, rgb_to_cmyk };
-static fz_colorspace k_default_lab = { {-1, fz_drop_colorspace_imp}, 0, "Lab", 3, lab_to_rgb, rgb_to_lab };
+static fz_colorspace k_default_gray = { { {-1, fz_drop_colorspace_imp} }, 0, "DeviceGray", 1, gray_to_rgb, rgb_to_gray };
+static fz_colorspace k_default_rgb = { { {-1, fz_drop_colorspace_imp} }, 0, "DeviceRGB", 3, rgb_to_rgb, rgb_to_rgb };
+static fz_colorspace k_default_bgr = { { {-1, fz_drop_colorspace_imp} }, 0, "DeviceBGR", 3, bgr_to_rgb, rgb_to_bgr };
+static fz_colorspace k_default_cmyk = { { {-1, fz_drop_colorspace_imp} }, 0, "DeviceCMYK", 4, cmyk_to_rgb, rgb_to_cmyk };
+static fz_colorspace k_default_lab = { { {-1, fz_drop_colorspace_imp} }, 0, "Lab", 3, lab_to_rgb, rgb_to_lab };
 
 static fz_colorspace *fz_default_gray = &k_default_gray;
 static fz_colorspace *fz_default_rgb = &k_default_rgb;
@@ -1501,11 +1502,454 @@ static void fast_rgb_to_bgr(fz_pixmap *dst, fz_pixmap *src)
 	}
 }
 
+/* Finish converting a colour in a tint transform colorspace, given the
+ * output of its tint transform. This matches separation_to_rgb and
+ * std_conv_color. */
+static void
+tint_conv_color(fz_context *ctx, fz_colorspace *ds, fz_colorspace *base, const float *alt, int altn, float *dstv)
+{
+	float fakealt[FZ_MAX_COLORS];
+	float rgb[3];
+	int k;
+
+	if (altn != base->n)
+	{
+		for (k = 0; k < base->n; k++)
+			fakealt[k] = k < altn ? alt[k] : 0;
+		alt = fakealt;
+	}
+
+	fz_convert_color(ctx, fz_device_rgb(ctx), rgb, base, alt);
+	ds->from_rgb(ctx, ds, rgb, dstv);
+	for (k = 0; k < ds->n; k++)
+		dstv[k] = fz_clamp(dstv[k], 0, 1);
+}
+
+static fz_function_lut *
+find_tint_lut(fz_context *ctx, fz_colorspace *ss, fz_colorspace *ds)
+{
+	if (ss->tint == NULL || ss->tint->m != ss->n || ss == ds || ds->from_rgb == NULL)
+		return NULL;
+	return fz_find_function_lut(ctx, ss->tint);
+}
+
+/* Pixmap converters */
+
+struct fz_pixmap_converter_s
+{
+	fz_storable storable;
+	int srcn;
+	int dstn;
+	int size;		/* grid points along each input */
+	int stride[4];		/* table values between grid points along each input */
+	int offset[4][256];	/* table offset of the cell holding each input value */
+	unsigned short weight[256];	/* position in the cell, from 0 to 256 */
+	unsigned char order[64][4];	/* axes by decreasing position, for each set of comparisons */
+	uint16_t *table;	/* 4 values per grid point, first input varying fastest */
+};
+
+typedef struct fz_pixmap_converter_key_s fz_pixmap_converter_key;
+
+struct fz_pixmap_converter_key_s
+{
+	int refs;
+	fz_colorspace *ds;
+	fz_colorspace *ss;
+};
+
+static int
+fz_make_hash_pixmap_converter_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_pixmap_converter_key *key = (fz_pixmap_converter_key *)key_;
+	hash->u.pp.ptr[0] = key->ds;
+	hash->u.pp.ptr[1] = key->ss;
+	return 1;
+}
+
+static void *
+fz_keep_pixmap_converter_key(fz_context *ctx, void *key_)
+{
+	fz_pixmap_converter_key *key = (fz_pixmap_converter_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_pixmap_converter_key(fz_context *ctx, void *key_)
+{
+	fz_pixmap_converter_key *key = (fz_pixmap_converter_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+	{
+		fz_drop_key_storable_key(ctx, &key->ds->key_storable);
+		fz_drop_key_storable_key(ctx, &key->ss->key_storable);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_pixmap_converter_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_pixmap_converter_key *k0 = (fz_pixmap_converter_key *)k0_;
+	fz_pixmap_converter_key *k1 = (fz_pixmap_converter_key *)k1_;
+	return k0->ds == k1->ds && k0->ss == k1->ss;
+}
+
+static void
+fz_print_pixmap_converter_key(fz_context *ctx, fz_output *out, void *key_)
+{
+	fz_pixmap_converter_key *key = (fz_pixmap_converter_key *)key_;
+	fz_printf(ctx, out, "(pixmap converter %s to %s) ", key->ss->name, key->ds->name);
+}
+
+static int
+fz_needs_reap_pixmap_converter_key(fz_context *ctx, void *key_)
+{
+	fz_pixmap_converter_key *key = (fz_pixmap_converter_key *)key_;
+	/* Only the store's keys still hold either colorspace. */
+	return key->ds->key_storable.storable.refs == key->ds->key_storable.store_key_refs ||
+		key->ss->key_storable.storable.refs == key->ss->key_storable.store_key_refs;
+}
+
+static fz_store_type fz_pixmap_converter_store_type =
+{
+	fz_make_hash_pixmap_converter_key,
+	fz_keep_pixmap_converter_key,
+	fz_drop_pixmap_converter_key,
+	fz_cmp_pixmap_converter_key,
+	fz_print_pixmap_converter_key,
+	fz_needs_reap_pixmap_converter_key
+};
+
+static void
+fz_drop_pixmap_converter_imp(fz_context *ctx, fz_storable *pc_)
+{
+	fz_pixmap_converter *pc = (fz_pixmap_converter *)pc_;
+	fz_free(ctx, pc->table);
+	fz_free(ctx, pc);
+}
+
+void
+fz_drop_pixmap_converter(fz_context *ctx, fz_pixmap_converter *pc)
+{
+	fz_drop_storable(ctx, &pc->storable);
+}
+
+/*
+	The grid spacing divides 255, so that 0 and 255 (and every
+	spacing'th value between) are sampled exactly: 52 points (a step
+	of 5) for 3 inputs, and 16 points (a step of 17) for 4.
+*/
+static int
+pixmap_converter_grid_size(int srcn)
+{
+	return srcn == 3 ? 52 : 16;
+}
+
+static size_t
+pixmap_converter_points(int srcn)
+{
+	size_t points = 1;
+	int k, size = pixmap_converter_grid_size(srcn);
+	for (k = 0; k < srcn; k++)
+		points *= size;
+	return points;
+}
+
+/* Lab is not sampled: its conversion to RGB takes a square root near
+ * black, which no grid we can afford follows (a 52 point grid is off
+ * by up to 32/255). It keeps its own exact path. */
+static int
+can_sample_pixmap_converter(fz_colorspace *ds, fz_colorspace *ss)
+{
+	return ds && ss && ds != ss && (ss->n == 3 || ss->n == 4) && ds->n <= 4 && strcmp(ss->name, "Lab");
+}
+
+static fz_pixmap_converter *
+fz_new_pixmap_converter(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss)
+{
+	fz_pixmap_converter *pc;
+	fz_color_converter cc;
+	float srcv[4], dstv[FZ_MAX_COLORS];
+	int pos[4] = { 0 };
+	size_t points, i;
+	uint16_t *e;
+	int size, step, k, v, c;
+
+	size = pixmap_converter_grid_size(ss->n);
+	step = 255 / (size - 1);
+	points = pixmap_converter_points(ss->n);
+
+	pc = fz_malloc_struct(ctx, fz_pixmap_converter);
+	FZ_INIT_STORABLE(pc, 1, fz_drop_pixmap_converter_imp);
+	pc->srcn = ss->n;
+	pc->dstn = ds->n;
+	pc->size = size;
+
+	fz_try(ctx)
+	{
+		/* Padded so that each point can be read as 8 values. */
+		pc->table = fz_malloc_array(ctx, points * 4 + 4, sizeof(uint16_t));
+
+		fz_lookup_color_converter(ctx, &cc, ds, ss);
+		e = pc->table;
+		for (i = 0; i < points; i++)
+		{
+			for (k = 0; k < pc->srcn; k++)
+			{
+				srcv[k] = pos[k] * step / 255.0f;
+			}
+			cc.convert(ctx, &cc, dstv, srcv);
+			for (k = 0; k < 4; k++)
+				*e++ = k < pc->dstn ? (int)(fz_clamp(dstv[k], 0, 1) * 255) : 0;
+
+			for (k = 0; k < pc->srcn && ++pos[k] == size; k++)
+				pos[k] = 0;
+		}
+		for (k = 0; k < 4; k++)
+			*e++ = 0;
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap_converter(ctx, pc);
+		fz_rethrow(ctx);
+	}
+
+	for (k = 0, c = 4; k < pc->srcn; k++, c *= size)
+		pc->stride[k] = c;
+	for (v = 0; v < 256; v++)
+	{
+		int cell = v / step;
+		int frac = v - cell * step;
+		if (cell == size - 1)
+		{
+			cell--;
+			frac = step;
+		}
+		pc->weight[v] = (frac * 256 + step / 2) / step;
+		for (k = 0; k < pc->srcn; k++)
+			pc->offset[k][v] = cell * pc->stride[k];
+	}
+
+	/* Bit p of m says whether the first axis of the p'th pair
+	 * (0,1), (0,2), (1,2), (0,3), ... is before the second. An axis
+	 * goes after every axis that beats it; ties go to the lower. */
+	for (v = 0; v < 64; v++)
+	{
+		int rank[4] = { 0 };
+		int i, j, p;
+		for (j = 1, p = 0; j < pc->srcn; j++)
+			for (i = 0; i < j; i++, p++)
+				rank[(v >> p) & 1 ? i : j]++;
+		for (k = 0; k < pc->srcn; k++)
+			pc->order[v][k] = k;
+		for (k = 0; k < pc->srcn; k++)
+			if (rank[k] < pc->srcn)
+				pc->order[v][rank[k]] = k;
+	}
+
+	return pc;
+}
+
+static fz_pixmap_converter *
+find_pixmap_converter(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss, size_t pixels)
+{
+	fz_pixmap_converter_key key, *keyp = NULL;
+	fz_pixmap_converter *pc, *existing;
+
+	if (!can_sample_pixmap_converter(ds, ss))
+		return NULL;
+
+	key.refs = 1;
+	key.ds = ds;
+	key.ss = ss;
+	pc = fz_find_item(ctx, fz_drop_pixmap_converter_imp, &key, &fz_pixmap_converter_store_type);
+	if (pc)
+		return pc;
+
+	/* Not worth sampling more colours than we have pixels. */
+	if (pixels < pixmap_converter_points(ss->n))
+		return NULL;
+
+	pc = fz_new_pixmap_converter(ctx, ds, ss);
+
+	/* Any failure here will just result in us not caching. */
+	fz_var(keyp);
+	fz_try(ctx)
+	{
+		keyp = fz_malloc_struct(ctx, fz_pixmap_converter_key);
+		keyp->refs = 1;
+		keyp->ds = fz_keep_key_storable_key(ctx, &ds->key_storable);
+		keyp->ss = fz_keep_key_storable_key(ctx, &ss->key_storable);
+		existing = fz_store_item(ctx, keyp, pc, sizeof(*pc) + pixmap_converter_points(ss->n) * 4 * sizeof(uint16_t), &fz_pixmap_converter_store_type);
+		if (existing)
+		{
+			/* Built by a racing thread; use that one. */
+			fz_drop_pixmap_converter(ctx, pc);
+			pc = existing;
+		}
+	}
+	fz_always(ctx)
+	{
+		if (keyp)
+			fz_drop_pixmap_converter_key(ctx, keyp);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+
+	return pc;
+}
+
+fz_pixmap_converter *
+fz_find_pixmap_converter(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss)
+{
+	return find_pixmap_converter(ctx, ds, ss, SIZE_MAX);
+}
+
+/* Find the corners of the simplex around the colour s, and their weights,
+ * which add up to 256. */
+static inline void
+pixmap_converter_simplex_n(fz_pixmap_converter *pc, const unsigned char *s, const uint16_t **c, int *w, int n)
+{
+	const unsigned char *order;
+	int f[4];
+	int i, j, p, m, prev, base = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		base += pc->offset[i][s[i]];
+		f[i] = pc->weight[s[i]];
+	}
+
+	/* Step through the cell along the axes in order of decreasing
+	 * position. The comparisons are too random to branch on, so
+	 * look the order up from their results. */
+	m = 0;
+	for (j = 1, p = 0; j < n; j++)
+		for (i = 0; i < j; i++, p++)
+			m |= (f[i] < f[j]) << p;
+	order = pc->order[m];
+
+	c[0] = pc->table + base;
+	prev = 256;
+	for (i = 0; i < n; i++)
+	{
+		w[i] = prev - f[order[i]];
+		prev = f[order[i]];
+		c[i + 1] = c[i] + pc->stride[order[i]];
+	}
+	w[n] = prev;
+}
+
+static inline void
+pixmap_converter_simplex(fz_pixmap_converter *pc, const unsigned char *s, const uint16_t **c, int *w)
+{
+	if (pc->srcn == 3)
+		pixmap_converter_simplex_n(pc, s, c, w, 3);
+	else
+		pixmap_converter_simplex_n(pc, s, c, w, 4);
+}
+
+/* Interpolate the colour s into out[0] to out[3]. */
+static inline void
+pixmap_converter_pixel(fz_pixmap_converter *pc, const unsigned char *s, unsigned char *out)
+{
+	const uint16_t *c[5];
+	int w[5];
+#ifdef FZ_SIMD
+	v32 acc = v32_splat(128);
+	unsigned char tmp[8];
+
+	pixmap_converter_simplex(pc, s, c, w);
+	acc = v32_madd(acc, v16_zip_lo(v16_load_u16(c[0]), v16_load_u16(c[1])), v16_splat2(w[0], w[1]));
+	acc = v32_madd(acc, v16_zip_lo(v16_load_u16(c[2]), v16_load_u16(c[3])), v16_splat2(w[2], w[3]));
+	if (pc->srcn == 4)
+		acc = v32_madd(acc, v16_zip_lo(v16_load_u16(c[4]), v16_splat(0)), v16_splat2(w[4], 0));
+	v16_store(tmp, v32_shr8_narrow(acc, acc));
+	memcpy(out, tmp, 4);
+#else
+	int j, k, sum;
+
+	pixmap_converter_simplex(pc, s, c, w);
+	for (k = 0; k < 4; k++)
+	{
+		sum = 128;
+		for (j = 0; j <= pc->srcn; j++)
+			sum += w[j] * c[j][k];
+		out[k] = sum >> 8;
+	}
+#endif
+}
+
+void
+fz_convert_pixmap_with_converter(fz_context *ctx, fz_pixmap_converter *pc, fz_pixmap *dst, fz_pixmap *src)
+{
+	unsigned char out[4];
+	size_t ww, width = src->w;
+	int h = src->h;
+	int srcn = pc->srcn;
+	int dstn = pc->dstn;
+	int sa = src->alpha;
+	int da = dst->alpha;
+	int sn = src->n;
+	int dn = dst->n;
+	ptrdiff_t s_line_inc = src->stride - width * sn;
+	ptrdiff_t d_line_inc = dst->stride - width * dn;
+	unsigned char *s = src->samples;
+	unsigned char *d = dst->samples;
+	uint32_t key, last;
+	int k;
+
+	if ((int)width <= 0 || h <= 0)
+		return;
+
+	assert(src->w == dst->w && src->h == dst->h);
+	assert(sn == srcn + sa);
+	assert(dn == dstn + da);
+
+	if (d_line_inc == 0 && s_line_inc == 0)
+	{
+		width *= h;
+		h = 1;
+	}
+
+#define PIXEL_KEY(s) ((s)[0] | ((s)[1] << 8) | ((uint32_t)(s)[2] << 16) | (srcn == 4 ? (uint32_t)(s)[3] << 24 : 0))
+
+	/* Runs of the same colour are common, so remember the last one. */
+	last = PIXEL_KEY(s);
+	pixmap_converter_pixel(pc, s, out);
+
+	while (h--)
+	{
+		ww = width;
+		while (ww--)
+		{
+			key = PIXEL_KEY(s);
+			if (key != last)
+			{
+				pixmap_converter_pixel(pc, s, out);
+				last = key;
+			}
+			for (k = 0; k < dstn; k++)
+				d[k] = out[k];
+			if (da)
+				d[dstn] = sa ? s[srcn] : 255;
+			s += sn;
+			d += dn;
+		}
+		s += s_line_inc;
+		d += d_line_inc;
+	}
+
+#undef PIXEL_KEY
+}
+
 static void
 fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 {
 	float srcv[FZ_MAX_COLORS];
 	float dstv[FZ_MAX_COLORS];
+	fz_pixmap_converter *pc;
 	int srcn, dstn;
 	int k, i;
 	size_t w = src->w;
@@ -1537,8 +1981,15 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 		h = 1;
 	}
 
+	/* Sampled transform for large 3 and 4 component images */
+	if (w*h >= 256 && (pc = find_pixmap_converter(ctx, ds, ss, w*h)) != NULL)
+	{
+		fz_convert_pixmap_with_converter(ctx, pc, dst, src);
+		fz_drop_pixmap_converter(ctx, pc);
+	}
+
 	/* Special case for Lab colorspace (scaling of components to float) */
-	if (!strcmp(ss->name, "Lab") && srcn == 3)
+	else if (!strcmp(ss->name, "Lab") && srcn == 3)
 	{
 		fz_color_converter cc;
 
@@ -1597,15 +2048,24 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 	{
 		unsigned char lookup[FZ_MAX_COLORS * 256];
 		fz_color_converter cc;
+		fz_function_lut *tint = find_tint_lut(ctx, ss, ds);
 
 		fz_lookup_color_converter(ctx, &cc, ds, ss);
 		for (i = 0; i < 256; i++)
 		{
-			srcv[0] = i / 255.0f;
-			cc.convert(ctx, &cc, dstv, srcv);
+			/* A sampled tint transform has an entry for each i. */
+			if (tint)
+				tint_conv_color(ctx, ds, ss->tint_base, tint->samples + i * tint->n, tint->n, dstv);
+			else
+			{
+				srcv[0] = i / 255.0f;
+				cc.convert(ctx, &cc, dstv, srcv);
+			}
 			for (k = 0; k < dstn; k++)
 				lookup[i * dstn + k] = dstv[k] * 255;
 		}
+		if (tint)
+			fz_drop_function_lut(ctx, tint);
 
 		while (h--)
 		{
@@ -1633,6 +2093,8 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 		unsigned char *sold = &dummy;
 		unsigned char *dold;
 		fz_color_converter cc;
+		fz_function_lut *tint = find_tint_lut(ctx, ss, ds);
+		float alt[FZ_MAX_COLORS];
 
 		fz_lookup_color_converter(ctx, &cc, ds, ss);
 		lookup = fz_new_hash_table(ctx, 509, srcn, -1);
@@ -1670,7 +2132,13 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 					{
 						for (k = 0; k < srcn; k++)
 							srcv[k] = *s++ / 255.0f;
-						cc.convert(ctx, &cc, dstv, srcv);
+						if (tint)
+						{
+							fz_eval_function_lut(ctx, tint, srcv, alt);
+							tint_conv_color(ctx, ds, ss->tint_base, alt, tint->n, dstv);
+						}
+						else
+							cc.convert(ctx, &cc, dstv, srcv);
 						for (k = 0; k < dstn; k++)
 							*d++ = dstv[k] * 255;
 
@@ -1687,6 +2155,8 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 		}
 
 		fz_drop_hash(ctx, lookup);
+		if (tint)
+			fz_drop_function_lut(ctx, tint);
 	}
 }
 
@@ -2008,6 +2478,19 @@ fz_colorspace_is_indexed(fz_context *ctx, fz_colorspace *cs)
 	return (cs && cs->to_rgb == indexed_to_rgb);
 }
 
+fz_colorspace *
+fz_indexed_colorspace_base(fz_context *ctx, fz_colorspace *cs, int *high, unsigned char **lookup)
+{
+	struct indexed *idx;
+
+	if (!fz_colorspace_is_indexed(ctx, cs))
+		return NULL;
+	idx = cs->data;
+	*high = idx->high;
+	*lookup = idx->lookup;
+	return idx->base;
+}
+
 fz_colorspace *
 fz_new_indexed_colorspace(fz_context *ctx, fz_colorspace *base, int high, unsigned char *lookup)
 {
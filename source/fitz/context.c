@@ -116,6 +116,21 @@ void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, v
 	ctx->tuning->image_scale_arg = arg;
 }
 
+void fz_tune_file_mapping(fz_context *ctx, int enable)
+{
+	ctx->tuning->map_files = enable;
+}
+
+void fz_tune_lazy_loading(fz_context *ctx, int enable)
+{
+	ctx->tuning->lazy_loading = enable;
+}
+
+int fz_lazy_loading(fz_context *ctx)
+{
+	return ctx->tuning->lazy_loading;
+}
+
 void
 fz_drop_context(fz_context *ctx)
 {
@@ -47,6 +47,7 @@ struct fz_draw_device_s
 	fz_draw_state *stack;
 	int stack_cap;
 	fz_draw_state init_stack[STACK_SIZE];
+	fz_thread_pool *pool;
 };
 
 #ifdef DUMP_GROUP_BLENDS
@@ -1139,7 +1140,7 @@ fz_draw_fill_shade(fz_context *ctx, fz_device *devp, fz_shade *shade, const fz_m
 		}
 	}
 
-	fz_paint_shade(ctx, shade, &ctm, dest, &bbox);
+	fz_paint_shade_with_pool(ctx, shade, &ctm, dest, &bbox, dev->pool);
 	if (shape)
 		fz_clear_pixmap_rect_with_value(ctx, shape, 255, &bbox);
 
@@ -2399,6 +2400,15 @@ fz_new_draw_device_type3(fz_context *ctx, const fz_matrix *transform, fz_pixmap
 	return (fz_device*)dev;
 }
 
+void
+fz_set_draw_device_thread_pool(fz_context *ctx, fz_device *devp, fz_thread_pool *pool)
+{
+	fz_draw_device *dev = (fz_draw_device*)devp;
+
+	if (devp->fill_shade == fz_draw_fill_shade)
+		dev->pool = pool;
+}
+
 fz_irect *
 fz_bound_path_accurate(fz_context *ctx, fz_irect *bbox, const fz_irect *scissor, const fz_path *path, const fz_stroke_state *stroke, const fz_matrix *ctm, float flatness, float linewidth)
 {
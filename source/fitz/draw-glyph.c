@@ -6,19 +6,11 @@
 #define MAX_CACHE_SIZE (1024*1024)
 
 #define GLYPH_HASH_LEN 509
+#define GLYPH_FRONT_SETS 256
+#define GLYPH_FRONT_WAYS 4
 
 typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
-typedef struct fz_glyph_key_s fz_glyph_key;
-
-struct fz_glyph_key_s
-{
-	fz_font *font;
-	int a, b;
-	int c, d;
-	unsigned short gid;
-	unsigned char e, f;
-	int aa;
-};
+typedef struct fz_glyph_front_entry_s fz_glyph_front_entry;
 
 struct fz_glyph_cache_entry_s
 {
@@ -42,6 +34,58 @@ struct fz_glyph_cache_s
 	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
 	fz_glyph_cache_entry *lru_head;
 	fz_glyph_cache_entry *lru_tail;
+	fz_glyph_file *file;
+
+	/* The front caches of all live contexts, and a count that is
+	 * bumped by every purge to tell them they must be emptied. */
+	fz_glyph_front *fronts;
+	volatile int generation;
+
+	/* Lookup counts, for fz_dump_glyph_cache_stats. */
+	size_t front_hits;
+	size_t hits;
+	size_t file_hits;
+	size_t rendered;
+};
+
+/*
+	Each context has a small cache of its own in front of the shared
+	one. It is only ever used by the thread that owns the context, so
+	a glyph found there is returned without taking any locks at all.
+	It is four way set associative, with the most recently used entry
+	of each set first.
+
+	Entries hold references to their glyph and font, so they stay
+	valid after the shared cache has evicted them; each context may
+	keep up to GLYPH_FRONT_SETS * GLYPH_FRONT_WAYS glyphs alive beyond
+	the shared cache's budget. Only FreeType glyphs go in the front
+	caches: Type 3 fonts refer to objects in their document, and must
+	not outlive the purge that happens when the document is dropped.
+
+	Purging must empty every front cache, not just that of the caller,
+	or idle contexts would keep their fonts alive. The front caches are
+	kept in a list on the shared cache, and each is claimed with an
+	atomic busy count around every use. A purge bumps the generation
+	and then, under the glyph cache lock, empties each front cache it
+	can claim. One it cannot claim is being used by its owner right
+	now, and the owner empties it on release when it sees that the
+	generation has moved on. Without atomics there are no front caches.
+*/
+struct fz_glyph_front_entry_s
+{
+	unsigned hash;
+	fz_glyph_key key;
+	fz_glyph *val;
+};
+
+struct fz_glyph_front_s
+{
+	fz_glyph_front *prev;
+	fz_glyph_front *next;
+	volatile int busy;
+	volatile int generation;
+	size_t hits;
+	fz_glyph_front_entry set[GLYPH_FRONT_SETS][GLYPH_FRONT_WAYS];
 };
 
 void
@@ -81,11 +125,78 @@ drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
 	fz_free(ctx, entry);
 }
 
+static void
+flush_front(fz_context *ctx, fz_glyph_front *front)
+{
+	int i;
+
+	for (i = 0; i < GLYPH_FRONT_SETS * GLYPH_FRONT_WAYS; i++)
+	{
+		fz_glyph_front_entry *entry = &front->set[0][0] + i;
+		if (entry->val)
+		{
+			fz_drop_glyph(ctx, entry->val);
+			fz_drop_font(ctx, entry->key.font);
+			entry->val = NULL;
+		}
+	}
+}
+
+#ifdef FZ_HAVE_ATOMICS
+
+/* Take a front cache for our sole use, emptying it first if the shared
+ * cache has been purged since it was last emptied. Returns 0 if someone
+ * else has it. */
+static int
+claim_front(fz_context *ctx, fz_glyph_front *front)
+{
+	int generation;
+
+	if (fz_atomic_add(&front->busy, 1) != 1)
+	{
+		fz_atomic_add(&front->busy, -1);
+		return 0;
+	}
+	generation = ctx->glyph_cache->generation;
+	if (front->generation != generation)
+	{
+		flush_front(ctx, front);
+		front->generation = generation;
+	}
+	return 1;
+}
+
+/* Release a front cache claimed by its owner. A purge that came along
+ * in the meantime will have left it alone, so empty it ourselves. */
+static void
+release_front(fz_context *ctx, fz_glyph_front *front)
+{
+	fz_atomic_add(&front->busy, -1);
+	while (front->generation != ctx->glyph_cache->generation && claim_front(ctx, front))
+		fz_atomic_add(&front->busy, -1);
+}
+
+#else
+
+static int
+claim_front(fz_context *ctx, fz_glyph_front *front)
+{
+	return 0;
+}
+
+static void
+release_front(fz_context *ctx, fz_glyph_front *front)
+{
+}
+
+#endif
+
 /* The glyph cache lock is always held when this function is called. */
 static void
 do_purge(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_front *front;
 	int i;
 
 	for (i = 0; i < GLYPH_HASH_LEN; i++)
@@ -95,6 +206,15 @@ do_purge(fz_context *ctx)
 	}
 
 	cache->total = 0;
+
+#ifdef FZ_HAVE_ATOMICS
+	fz_atomic_add(&cache->generation, 1);
+#else
+	cache->generation++;
+#endif
+	for (front = cache->fronts; front; front = front->next)
+		if (claim_front(ctx, front))
+			release_front(ctx, front);
 }
 
 void
@@ -108,18 +228,38 @@ fz_purge_glyph_cache(fz_context *ctx)
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
+	fz_glyph_front *front;
+
 	if (!ctx || !ctx->glyph_cache)
 		return;
 
+	front = ctx->glyph_front;
+
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (front)
+	{
+		/* Once unlinked, no purge can reach it. */
+		if (front->next)
+			front->next->prev = front->prev;
+		if (front->prev)
+			front->prev->next = front->next;
+		else
+			ctx->glyph_cache->fronts = front->next;
+		ctx->glyph_cache->front_hits += front->hits;
+		flush_front(ctx, front);
+	}
 	ctx->glyph_cache->refs--;
 	if (ctx->glyph_cache->refs == 0)
 	{
 		do_purge(ctx);
+		fz_drop_glyph_file(ctx, ctx->glyph_cache->file);
 		fz_free(ctx, ctx->glyph_cache);
 		ctx->glyph_cache = NULL;
 	}
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	fz_free(ctx, front);
+	ctx->glyph_front = NULL;
 }
 
 fz_glyph_cache *
@@ -131,6 +271,28 @@ fz_keep_glyph_cache(fz_context *ctx)
 	return ctx->glyph_cache;
 }
 
+void
+fz_attach_glyph_cache_file(fz_context *ctx, const char *filename, size_t size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_file *file = fz_open_glyph_file(ctx, filename, size);
+	int attached = 0;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (!cache->file)
+	{
+		cache->file = file;
+		attached = 1;
+	}
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	if (!attached)
+	{
+		fz_drop_glyph_file(ctx, file);
+		fz_throw(ctx, FZ_ERROR_GENERIC, "glyph cache already has a file attached");
+	}
+}
+
 float
 fz_subpixel_adjust(fz_context *ctx, fz_matrix *ctm, fz_matrix *subpix_ctm, unsigned char *qe, unsigned char *qf)
 {
@@ -221,6 +383,85 @@ static unsigned do_hash(unsigned char *s, int len)
 	return val;
 }
 
+/* Find (or make) the front cache for this context. Returns NULL if there
+ * is no memory for one, in which case we do without. */
+static fz_glyph_front *
+get_front(fz_context *ctx, fz_glyph_cache *cache)
+{
+	fz_glyph_front *front = ctx->glyph_front;
+
+#ifndef FZ_HAVE_ATOMICS
+	/* A purge could not safely empty another context's front cache. */
+	return NULL;
+#endif
+
+	if (!front)
+	{
+		front = fz_calloc_no_throw(ctx, 1, sizeof *front);
+		if (!front)
+			return NULL;
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+		front->generation = cache->generation;
+		front->next = cache->fronts;
+		if (front->next)
+			front->next->prev = front;
+		cache->fronts = front;
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+		ctx->glyph_front = front;
+	}
+	return front;
+}
+
+static fz_glyph *
+lookup_front(fz_context *ctx, fz_glyph_front *front, unsigned hash, const fz_glyph_key *key)
+{
+	fz_glyph_front_entry *set = front->set[hash % GLYPH_FRONT_SETS];
+	fz_glyph_front_entry tmp;
+	fz_glyph *val = NULL;
+	int i;
+
+	if (!claim_front(ctx, front))
+		return NULL;
+	for (i = 0; i < GLYPH_FRONT_WAYS; i++)
+	{
+		if (set[i].val && set[i].hash == hash && memcmp(&set[i].key, key, sizeof(*key)) == 0)
+		{
+			if (i > 0)
+			{
+				tmp = set[i];
+				memmove(&set[1], &set[0], i * sizeof(*set));
+				set[0] = tmp;
+			}
+			val = fz_keep_glyph(ctx, set[0].val);
+			front->hits++;
+			break;
+		}
+	}
+	release_front(ctx, front);
+	return val;
+}
+
+static void
+insert_front(fz_context *ctx, fz_glyph_front *front, unsigned hash, const fz_glyph_key *key, fz_glyph *val)
+{
+	fz_glyph_front_entry *set = front->set[hash % GLYPH_FRONT_SETS];
+	fz_glyph_front_entry *last = &set[GLYPH_FRONT_WAYS - 1];
+
+	if (!claim_front(ctx, front))
+		return;
+	if (last->val)
+	{
+		fz_drop_glyph(ctx, last->val);
+		fz_drop_font(ctx, last->key.font);
+	}
+	memmove(&set[1], &set[0], (GLYPH_FRONT_WAYS - 1) * sizeof(*set));
+	set[0].hash = hash;
+	set[0].key = *key;
+	set[0].val = fz_keep_glyph(ctx, val);
+	fz_keep_font(ctx, key->font);
+	release_front(ctx, front);
+}
+
 static inline void
 move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 {
@@ -250,13 +491,16 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	fz_irect subpix_scissor;
 	float size;
 	fz_glyph *val;
-	int do_cache, locked, caching;
+	int do_cache, locked, caching, cached;
 	fz_glyph_cache_entry *entry;
-	unsigned hash;
+	fz_glyph_front *front = NULL;
+	unsigned hash, full_hash;
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
+	int from_file = 0;
 
 	fz_var(locked);
 	fz_var(caching);
+	fz_var(cached);
 	fz_var(val);
 
 	memset(&key, 0, sizeof key);
@@ -288,8 +532,26 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = fz_text_aa_level(ctx);
 
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
+	full_hash = do_hash((unsigned char *)&key, sizeof(key));
+	hash = full_hash % GLYPH_HASH_LEN;
+
+	if (do_cache && is_ft_font)
+	{
+		front = get_front(ctx, cache);
+		if (front)
+		{
+			val = lookup_front(ctx, front, full_hash, &key);
+			if (val)
+				return val;
+		}
+	}
+
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (front)
+	{
+		cache->front_hits += front->hits;
+		front->hits = 0;
+	}
 	entry = cache->entry[hash];
 	while (entry)
 	{
@@ -297,7 +559,10 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		{
 			move_to_front(cache, entry);
 			val = fz_keep_glyph(ctx, entry->val);
+			cache->hits++;
 			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			if (front)
+				insert_front(ctx, front, full_hash, &key, val);
 			return val;
 		}
 		entry = entry->bucket_next;
@@ -305,13 +570,22 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 
 	locked = 1;
 	caching = 0;
+	cached = 0;
 	val = NULL;
 
 	fz_try(ctx)
 	{
 		if (is_ft_font)
 		{
-			val = fz_render_ft_glyph(ctx, font, gid, &subpix_ctm, key.aa);
+			/* Before rendering, see whether some other process
+			 * (or an earlier run) has already done so. */
+			if (do_cache && cache->file)
+			{
+				val = fz_lookup_glyph_file(ctx, cache->file, &key);
+				from_file = (val != NULL);
+			}
+			if (!val)
+				val = fz_render_ft_glyph(ctx, font, gid, &subpix_ctm, key.aa);
 		}
 		else if (fz_font_t3_procs(ctx, font))
 		{
@@ -334,6 +608,10 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		{
 			fz_warn(ctx, "assert: uninitialized font structure");
 		}
+		if (from_file)
+			cache->file_hits++;
+		else if (val)
+			cache->rendered++;
 		if (val && do_cache)
 		{
 			if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
@@ -341,6 +619,8 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 				/* If we throw an exception whilst caching,
 				 * just ignore the exception and carry on. */
 				caching = 1;
+				if (is_ft_font && cache->file && !from_file)
+					fz_insert_glyph_file(ctx, cache->file, &key, val);
 				if (!is_ft_font)
 				{
 					/* We had to unlock. Someone else might
@@ -385,7 +665,7 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 #endif
 					drop_glyph_cache_entry(ctx, cache->lru_tail);
 				}
-
+				cached = 1;
 			}
 		}
 unlock_and_return_val:
@@ -405,6 +685,9 @@ unlock_and_return_val:
 			fz_rethrow(ctx);
 	}
 
+	if (cached && front)
+		insert_front(ctx, front, full_hash, &key, val);
+
 	return val;
 }
 
@@ -455,9 +738,25 @@ void
 fz_dump_glyph_cache_stats(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	size_t lookups;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (ctx->glyph_front)
+	{
+		cache->front_hits += ctx->glyph_front->hits;
+		ctx->glyph_front->hits = 0;
+	}
+	lookups = cache->front_hits + cache->hits + cache->file_hits + cache->rendered;
 
 	fprintf(stderr, "Glyph Cache Size: " FMT_zu "\n", cache->total);
+	/* Counts for front caches of other live contexts are only added in
+	 * when those contexts next take the lock, so may lag a little. */
+	fprintf(stderr, "Glyph Cache Lookups: " FMT_zu " (%.1f%% hits: " FMT_zu " front, " FMT_zu " shared, " FMT_zu " file; " FMT_zu " rendered)\n",
+		lookups,
+		lookups ? 100.0 * (lookups - cache->rendered) / lookups : 0.0,
+		cache->front_hits, cache->hits, cache->file_hits, cache->rendered);
 #ifndef NDEBUG
 	fprintf(stderr, "Glyph Cache Evictions: %d (" FMT_zu " bytes)\n", cache->num_evictions, cache->evicted);
 #endif
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
@@ -1,15 +1,70 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "draw-simd.h"
 
 enum { MAXN = 2 + FZ_MAX_COLORS };
 
-static void paint_scan(fz_pixmap *restrict pix, int y, int fx0, int fx1, int cx0, int cx1, const int *restrict v0, const int *restrict v1, int n)
+#ifdef FZ_SIMD
+/*
+	Paint count runs of 8 pixels of n (1 to 4) bytes each, stepping
+	the 16.16 fixed point values in c by dc from pixel to pixel, and
+	leave c stepped on past them.
+
+	8 pixels make up n whole vectors of 8 bytes, so every lane
+	always holds the same component, and steps by 8 times its dc.
+	The lanes hold exactly the values that stepping one pixel at a
+	time would, so the results are identical.
+*/
+static inline unsigned char *
+paint_span8(unsigned char *restrict p, int *restrict c, const int *restrict dc, int count, int n)
+{
+	int lanes[32], steps[32];
+	v32 acc[8], step[8];
+	int i, k;
+
+	for (i = 0; i < 8; i++)
+	{
+		for (k = 0; k < n; k++)
+		{
+			lanes[i * n + k] = c[k] + i * dc[k];
+			steps[i * n + k] = 8 * dc[k];
+		}
+	}
+	for (i = 0; i < 2 * n; i++)
+	{
+		acc[i] = v32_load(lanes + 4 * i);
+		step[i] = v32_load(steps + 4 * i);
+	}
+	for (k = 0; k < n; k++)
+		c[k] += count * 8 * dc[k];
+
+	while (count--)
+	{
+		for (i = 0; i < n; i++)
+		{
+			v16_store(p + 8 * i, v32_shr16_narrow(acc[2 * i], acc[2 * i + 1]));
+			acc[2 * i] = v32_add(acc[2 * i], step[2 * i]);
+			acc[2 * i + 1] = v32_add(acc[2 * i + 1], step[2 * i + 1]);
+		}
+		p += 8 * n;
+	}
+	return p;
+}
+#endif
+
+/*
+	Paint the span from fx0 to fx1 on row y, clipped to cx0..cx1. The
+	colours are stepped from bx0 (or fx0, if further right), the left
+	edge of the whole area being painted, so that a span cut into
+	tiles gets the same values as when it is painted in one go.
+*/
+static void paint_scan(fz_pixmap *restrict pix, int y, int fx0, int fx1, int bx0, int cx0, int cx1, const int *restrict v0, const int *restrict v1, int n)
 {
 	unsigned char *p;
 	int c[MAXN], dc[MAXN];
 	int k, w;
 	float div, mul;
-	int x0, x1, pa;
+	int x0, x1;
 
 	/* Ensure that fx0 is left edge, and fx1 is right */
 	if (fx0 > fx1)
@@ -26,11 +81,10 @@ static void paint_scan(fz_pixmap *restrict pix, int y, int fx0, int fx1, int cx0
 		return;
 	if (fx1 <= cx0)
 		return;
-	x0 = (fx0 > cx0 ? fx0 : cx0);
+	x0 = (fx0 > bx0 ? fx0 : bx0);
 	x1 = (fx1 < cx1 ? fx1 : cx1);
 
-	w = x1 - x0;
-	if (w == 0)
+	if (x1 <= cx0 || x1 <= x0)
 		return;
 
 	div = 1.0f / (fx1 - fx0);
@@ -41,19 +95,46 @@ static void paint_scan(fz_pixmap *restrict pix, int y, int fx0, int fx1, int cx0
 		c[k] = v0[k] + dc[k] * mul;
 	}
 
+	if (x0 < cx0)
+	{
+		for (k = 0; k < n; k++)
+			c[k] += dc[k] * (cx0 - x0);
+		x0 = cx0;
+	}
+
+	w = x1 - x0;
+
+	/* Alpha is stepped along with the color, but never changes. */
+	if (pix->alpha)
+	{
+		c[n] = 255 << 16;
+		dc[n] = 0;
+		n++;
+	}
+
 	p = pix->samples + ((x0 - pix->x) * pix->n) + ((y - pix->y) * pix->stride);
-	pa = pix->alpha;
-	do
+
+#ifdef FZ_SIMD
+	if (w >= 8)
+	{
+		switch (n)
+		{
+		case 1: p = paint_span8(p, c, dc, w >> 3, 1); w &= 7; break;
+		case 2: p = paint_span8(p, c, dc, w >> 3, 2); w &= 7; break;
+		case 3: p = paint_span8(p, c, dc, w >> 3, 3); w &= 7; break;
+		case 4: p = paint_span8(p, c, dc, w >> 3, 4); w &= 7; break;
+		}
+	}
+#endif
+
+	while (w--)
 	{
 		for (k = 0; k < n; k++)
 		{
 			*p++ = c[k]>>16;
 			c[k] += dc[k];
 		}
-		if (pa)
-			*p++ = 255;
 	}
-	while (--w);
 }
 
 typedef struct edge_data_s edge_data;
@@ -95,13 +176,33 @@ static inline void step_edge(edge_data *edge, int n)
 	}
 }
 
+/* Step an edge on by count rows, exactly as stepping it row by row. */
+static inline void skip_edge(edge_data *edge, int count, int n)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		edge->x += edge->dx;
+
+	for (i = 0; i < n; i++)
+	{
+		edge->v[i] += edge->v[i + MAXN] * count;
+	}
+}
+
+/*
+	Paint a triangle into the part of bbox that lies within clip.
+	Edges are prepared where painting the whole of bbox would start,
+	and stepped on to the clip, so that a triangle painted tile by
+	tile gets exactly the same pixels as one painted in one go.
+*/
 static void
-fz_paint_triangle(fz_pixmap *pix, float *v[3], int n, const fz_irect *bbox)
+fz_paint_triangle(fz_pixmap *pix, float *v[3], int n, const fz_irect *bbox, const fz_irect *clip)
 {
 	edge_data e0, e1;
 	int top, mid, bot;
-	float y, y1;
-	int minx, maxx;
+	float y, ys, ym, y1;
+	int bx0, minx, maxx;
 
 	top = bot = 0;
 	if (v[1][1] < v[0][1]) top = 1; else bot = 1;
@@ -110,44 +211,52 @@ fz_paint_triangle(fz_pixmap *pix, float *v[3], int n, const fz_irect *bbox)
 	if (v[top][1] == v[bot][1]) return;
 
 	/* Test if the triangle is completely outside the scissor rect */
-	if (v[bot][1] < bbox->y0) return;
-	if (v[top][1] > bbox->y1) return;
+	if (v[bot][1] < clip->y0) return;
+	if (v[top][1] > clip->y1) return;
 
 	/* Magic! Ensure that mid/top/bot are all different */
 	mid = 3^top^bot;
 
 	assert(top != bot && top != mid && mid != bot);
 
-	minx = fz_maxi(bbox->x0, pix->x);
-	maxx = fz_mini(bbox->x1, pix->x + pix->w);
+	bx0 = fz_maxi(bbox->x0, pix->x);
+	minx = fz_maxi(clip->x0, pix->x);
+	maxx = fz_mini(clip->x1, pix->x + pix->w);
 
-	y = ceilf(fz_max(bbox->y0, v[top][1]));
-	y1 = ceilf(fz_min(bbox->y1, v[mid][1]));
+	/* Painting the whole bbox would start at row ys, and paint the
+	 * top half of the triangle down to row ym. */
+	ys = ceilf(fz_max(bbox->y0, v[top][1]));
+	ym = ceilf(fz_min(bbox->y1, v[mid][1]));
+	y = fz_max(ys, clip->y0);
 
 	n -= 2;
-	prepare_edge(v[top], v[bot], &e0, y, n);
-	if (y < y1)
+	prepare_edge(v[top], v[bot], &e0, ys, n);
+	skip_edge(&e0, y - ys, n);
+	if (y < ym)
 	{
-		prepare_edge(v[top], v[mid], &e1, y, n);
+		prepare_edge(v[top], v[mid], &e1, ys, n);
+		skip_edge(&e1, y - ys, n);
 
-		do
+		y1 = fz_min(ym, clip->y1);
+		while (y < y1)
 		{
-			paint_scan(pix, y, (int)e0.x, (int)e1.x, minx, maxx, &e0.v[0], &e1.v[0], n);
+			paint_scan(pix, y, (int)e0.x, (int)e1.x, bx0, minx, maxx, &e0.v[0], &e1.v[0], n);
 			step_edge(&e0, n);
 			step_edge(&e1, n);
 			y ++;
 		}
-		while (y < y1);
 	}
 
-	y1 = ceilf(fz_min(bbox->y1, v[bot][1]));
+	y1 = fz_min(ceilf(fz_min(bbox->y1, v[bot][1])), clip->y1);
 	if (y < y1)
 	{
-		prepare_edge(v[mid], v[bot], &e1, y, n);
+		ym = fz_max(ys, ym);
+		prepare_edge(v[mid], v[bot], &e1, ym, n);
+		skip_edge(&e1, y - ym, n);
 
 		do
 		{
-			paint_scan(pix, y, (int)e0.x, (int)e1.x, minx, maxx, &e0.v[0], &e1.v[0], n);
+			paint_scan(pix, y, (int)e0.x, (int)e1.x, bx0, minx, maxx, &e0.v[0], &e1.v[0], n);
 			y ++;
 			if (y >= y1)
 				break;
@@ -164,8 +273,32 @@ struct paint_tri_data
 	fz_pixmap *dest;
 	const fz_irect *bbox;
 	fz_color_converter cc;
+	int nv;
+
+	/* Triangles are queued up here, and painted a tile at a time
+	 * once there are enough of them. Tiles are painted as jobs on
+	 * the pool, if there is one. */
+	fz_thread_pool *pool;
+	float *tris;
+	int len, max;
 };
 
+/* Triangles queued before painting them in tiles. The queue starts
+ * small, as most shades have only a few triangles, and grows. */
+#define MIN_QUEUED_TRIS 64
+#define MAX_QUEUED_TRIS 16384
+
+/* Don't bother binning fewer triangles than this. */
+#define MIN_TILED_TRIS 256
+
+/* Tiles are TILE_HEIGHT rows high, and wide enough to fill about
+ * TILE_BYTES of the pixmap, so that painting one stays in cache. */
+#define TILE_HEIGHT 64
+#define TILE_BYTES 65536
+
+/* Don't cut the bbox into threads' bands of fewer rows than this. */
+#define MIN_BAND_HEIGHT 16
+
 static void
 prepare_mesh_vertex(fz_context *ctx, void *arg, fz_vertex *v, const float *input)
 {
@@ -186,23 +319,238 @@ prepare_mesh_vertex(fz_context *ctx, void *arg, fz_vertex *v, const float *input
 	}
 }
 
+static inline void
+paint_queued_tri(struct paint_tri_data *ptd, int i, const fz_irect *bbox)
+{
+	float *tri = ptd->tris + i * 3 * ptd->nv;
+	float *vertices[3];
+
+	vertices[0] = tri;
+	vertices[1] = tri + ptd->nv;
+	vertices[2] = tri + 2 * ptd->nv;
+	fz_paint_triangle(ptd->dest, vertices, ptd->nv, ptd->bbox, bbox);
+}
+
+struct paint_tile_data
+{
+	struct paint_tri_data *ptd;
+	fz_irect bbox;
+	int *index;
+	int count;
+};
+
+static void
+paint_tile(fz_context *ctx, void *arg)
+{
+	struct paint_tile_data *tile = (struct paint_tile_data *)arg;
+	int i;
+
+	for (i = 0; i < tile->count; i++)
+		paint_queued_tri(tile->ptd, tile->index[i], &tile->bbox);
+}
+
+/*
+	Sort the queued triangles into the tiles they reach into, nx
+	tiles of tile_w by tile_h pixels across the bbox. Either count
+	the triangles in each tile, or (once the tiles have their index
+	arrays) fill them in. With no tiles, just count the total, giving
+	up as soon as it passes limit.
+
+	Rows are painted from ceil(top) up to but not including
+	ceil(bottom), exactly as fz_paint_triangle does. Columns are
+	stepped along in floating point, so allow a pixel either side.
+*/
+static size_t
+bin_queued_tris(struct paint_tri_data *ptd, struct paint_tile_data *tiles, int fill, int nx, int tile_w, int tile_h, size_t limit)
+{
+	const fz_irect *bbox = ptd->bbox;
+	int nv = ptd->nv;
+	size_t total = 0;
+	int i, tx, ty;
+
+	for (i = 0; i < ptd->len; i++)
+	{
+		float *tri = ptd->tris + i * 3 * nv;
+		float top = fz_min(tri[1], fz_min(tri[nv + 1], tri[2 * nv + 1]));
+		float bot = fz_max(tri[1], fz_max(tri[nv + 1], tri[2 * nv + 1]));
+		float left = fz_min(tri[0], fz_min(tri[nv], tri[2 * nv]));
+		float right = fz_max(tri[0], fz_max(tri[nv], tri[2 * nv]));
+		int x0, x1, y0, y1;
+
+		top = ceilf(fz_max(top, bbox->y0));
+		bot = ceilf(fz_min(bot, bbox->y1));
+		left = fz_max(floorf(left) - 1, bbox->x0);
+		right = fz_min(floorf(right) + 1, bbox->x1 - 1);
+		if (top >= bot || left > right)
+			continue;
+
+		y0 = ((int)top - bbox->y0) / tile_h;
+		y1 = ((int)bot - 1 - bbox->y0) / tile_h;
+		x0 = ((int)left - bbox->x0) / tile_w;
+		x1 = ((int)right - bbox->x0) / tile_w;
+		if (!tiles)
+		{
+			total += (size_t)(y1 - y0 + 1) * (x1 - x0 + 1);
+			if (total > limit)
+				break;
+			continue;
+		}
+		for (ty = y0; ty <= y1; ty++)
+		{
+			for (tx = x0; tx <= x1; tx++)
+			{
+				struct paint_tile_data *tile = &tiles[ty * nx + tx];
+				if (fill)
+					tile->index[tile->count] = i;
+				tile->count++;
+			}
+		}
+	}
+
+	return total;
+}
+
+/*
+	Paint the queued triangles. The bbox is cut into tiles, and each
+	tile is painted with the triangles that reach into it, in the
+	order they were queued, so the result is the same as painting
+	them one by one. Each tile is a job on the pool, if there is one.
+
+	Large triangles reach into many tiles, and gain nothing from
+	being cut up; if there are too many of them, the triangles are
+	painted as they are, or in one band per job when using a pool.
+*/
+static void
+paint_queued_tris(fz_context *ctx, struct paint_tri_data *ptd)
+{
+	const fz_irect *bbox = ptd->bbox;
+	int w = bbox->x1 - bbox->x0;
+	int h = bbox->y1 - bbox->y0;
+	struct paint_tile_data *tiles = NULL;
+	int *index = NULL;
+	size_t total, limit;
+	int tile_w, tile_h, nx, ny, i;
+
+	if (ptd->len == 0)
+		return;
+
+	tile_w = fz_maxi(TILE_HEIGHT, TILE_BYTES / (TILE_HEIGHT * ptd->dest->n));
+	tile_h = TILE_HEIGHT;
+	nx = (w + tile_w - 1) / tile_w;
+	ny = (h + tile_h - 1) / tile_h;
+	limit = 4 * (size_t)ptd->len;
+	total = 0;
+	if (ptd->len >= MIN_TILED_TRIS && nx * ny > 1)
+		total = bin_queued_tris(ptd, NULL, 0, nx, tile_w, tile_h, limit);
+
+	if (total > limit && ptd->pool)
+	{
+		int nbands = fz_mini(4 * (fz_thread_pool_size(ctx, ptd->pool) + 1), h / MIN_BAND_HEIGHT);
+		/* A bbox too short to split into bands is painted serially. */
+		total = 0;
+		if (nbands >= 2)
+		{
+			tile_w = w;
+			tile_h = (h + nbands - 1) / nbands;
+			nx = 1;
+			ny = (h + tile_h - 1) / tile_h;
+			if (ny > 1)
+				total = bin_queued_tris(ptd, NULL, 0, nx, tile_w, tile_h, limit);
+		}
+	}
+
+	if (total == 0 || total > limit)
+	{
+		for (i = 0; i < ptd->len; i++)
+			paint_queued_tri(ptd, i, bbox);
+		ptd->len = 0;
+		return;
+	}
+
+	fz_var(tiles);
+	fz_var(index);
+
+	fz_try(ctx)
+	{
+		tiles = fz_calloc(ctx, nx * ny, sizeof(*tiles));
+		index = fz_malloc_array(ctx, total, sizeof(*index));
+
+		/* Count the triangles in each tile, then share out the
+		 * index array between the tiles and fill it in. */
+		bin_queued_tris(ptd, tiles, 0, nx, tile_w, tile_h, limit);
+		for (i = 0, total = 0; i < nx * ny; i++)
+		{
+			int tx = i % nx;
+			int ty = i / nx;
+			tiles[i].ptd = ptd;
+			tiles[i].bbox.x0 = bbox->x0 + tx * tile_w;
+			tiles[i].bbox.y0 = bbox->y0 + ty * tile_h;
+			tiles[i].bbox.x1 = fz_mini(bbox->x1, tiles[i].bbox.x0 + tile_w);
+			tiles[i].bbox.y1 = fz_mini(bbox->y1, tiles[i].bbox.y0 + tile_h);
+			tiles[i].index = index + total;
+			total += tiles[i].count;
+			tiles[i].count = 0;
+		}
+		bin_queued_tris(ptd, tiles, 1, nx, tile_w, tile_h, limit);
+
+		for (i = 0; i < nx * ny; i++)
+		{
+			if (tiles[i].count == 0)
+				continue;
+			if (ptd->pool)
+				fz_thread_pool_submit(ctx, ptd->pool, paint_tile, &tiles[i]);
+			else
+				paint_tile(ctx, &tiles[i]);
+		}
+		if (ptd->pool)
+			fz_thread_pool_wait(ctx, ptd->pool);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, index);
+		fz_free(ctx, tiles);
+		ptd->len = 0;
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
 static void
 do_paint_tri(fz_context *ctx, void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex *cv)
 {
 	struct paint_tri_data *ptd = (struct paint_tri_data *)arg;
-	float *vertices[3];
-	fz_pixmap *dest;
+	int nv = ptd->nv;
+	float *tri;
 
-	vertices[0] = (float *)av;
-	vertices[1] = (float *)bv;
-	vertices[2] = (float *)cv;
+	if (ptd->len == ptd->max)
+	{
+		if (ptd->max == MAX_QUEUED_TRIS)
+			paint_queued_tris(ctx, ptd);
+		else
+		{
+			int max = ptd->max ? ptd->max * 2 : MIN_QUEUED_TRIS;
+			ptd->tris = fz_resize_array(ctx, ptd->tris, max, 3 * nv * sizeof(float));
+			ptd->max = max;
+		}
+	}
 
-	dest = ptd->dest;
-	fz_paint_triangle(dest, vertices, 2 + fz_colorspace_n(ctx, dest->colorspace), ptd->bbox);
+	tri = ptd->tris + ptd->len * 3 * nv;
+	memcpy(tri, av, nv * sizeof(float));
+	memcpy(tri + nv, bv, nv * sizeof(float));
+	memcpy(tri + 2 * nv, cv, nv * sizeof(float));
+	ptd->len++;
 }
 
 void
 fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap *dest, const fz_irect *bbox)
+{
+	fz_paint_shade_with_pool(ctx, shade, ctm, dest, bbox, NULL);
+}
+
+void
+fz_paint_shade_with_pool(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap *dest, const fz_irect *bbox, fz_thread_pool *pool)
 {
 	unsigned char clut[256][FZ_MAX_COLORS];
 	fz_pixmap *temp = NULL;
@@ -246,9 +594,12 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 		ptd.dest = temp;
 		ptd.shade = shade;
 		ptd.bbox = bbox;
+		ptd.nv = 2 + fz_colorspace_n(ctx, temp->colorspace);
+		ptd.pool = pool;
 
 		fz_init_cached_color_converter(ctx, &ptd.cc, temp->colorspace, shade->colorspace);
 		fz_process_shade(ctx, shade, &local_ctm, &prepare_mesh_vertex, &do_paint_tri, &ptd);
+		paint_queued_tris(ctx, &ptd);
 
 		if (shade->use_function)
 		{
@@ -282,11 +633,13 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 	fz_always(ctx)
 	{
 		fz_fin_cached_color_converter(ctx, &ptd.cc);
+		fz_free(ctx, ptd.tris);
 	}
 	fz_catch(ctx)
 	{
 		fz_drop_pixmap(ctx, conv);
-		fz_drop_pixmap(ctx, temp);
+		if (temp != dest)
+			fz_drop_pixmap(ctx, temp);
 		fz_rethrow(ctx);
 	}
 }
@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "draw-simd.h"
 
 /*
 
@@ -73,6 +74,211 @@ and stick to using the premultiplied form.
 
 typedef unsigned char byte;
 
+#ifdef FZ_SIMD
+
+/*
+	Vector versions of the commonest painters. Each paints as many whole
+	groups of pixels as it can, moves the pointers past them, and returns
+	the number of pixels that are left for the scalar code to finish.
+	Since they use the same arithmetic, the results are identical.
+*/
+
+/* Fill pat with 24 samples of the color (with 255 for the alpha, if da),
+ * repeated for as many pixels as fit. */
+static void
+simd_pattern(uint16_t *pat, const byte * restrict color, int n, int da)
+{
+	int n1 = n - da;
+	int i;
+
+	for (i = 0; i < 24; i++)
+	{
+		int k = i % n;
+		pat[i] = (k < n1 ? color[k] : 255);
+	}
+}
+
+static inline int
+simd_all_zero(const byte * restrict mp, int len)
+{
+	while (len--)
+		if (*mp++)
+			return 0;
+	return 1;
+}
+
+/* Blend a color over pixels of 1 to 4 bytes by a constant amount. */
+static int
+simd_solid_color(byte * restrict *dpp, int n, int w, const byte * restrict color, int da, int sa)
+{
+	byte * restrict dp = *dpp;
+	int per = 24 / n;
+	uint16_t pat[24];
+	v16 c0, c1, c2, amount;
+
+	if (w < per)
+		return w;
+
+	simd_pattern(pat, color, n, da);
+	c0 = v16_load_u16(pat);
+	c1 = v16_load_u16(pat + 8);
+	c2 = v16_load_u16(pat + 16);
+	amount = v16_splat(sa);
+	do
+	{
+		v16_store(dp, v16_blend(c0, v16_load(dp), amount));
+		v16_store(dp + 8, v16_blend(c1, v16_load(dp + 8), amount));
+		v16_store(dp + 16, v16_blend(c2, v16_load(dp + 16), amount));
+		dp += 24;
+		w -= per;
+	}
+	while (w >= per);
+
+	*dpp = dp;
+	return w;
+}
+
+/* FZ_COMBINE(FZ_EXPAND(m), sa) on each lane. When sa is 256 the multiply
+ * could overflow 16 bits, but then it is a no-op anyway. */
+static inline v16
+simd_mask_amount(v16 m, int sa, v16 vsa)
+{
+	m = v16_expand(m);
+	return sa == 256 ? m : v16_combine(m, vsa);
+}
+
+/* Blend a color over pixels of 1 to 4 bytes through a mask. */
+static int
+simd_span_with_color(byte * restrict *dpp, const byte * restrict *mpp, int n, int w, const byte * restrict color, int da)
+{
+	byte * restrict dp = *dpp;
+	const byte * restrict mp = *mpp;
+	int sa = FZ_EXPAND(color[n - da]);
+	uint16_t pat[24];
+	v16 c0, c1, c2, vsa;
+
+	if (sa == 0)
+		return w;
+
+	simd_pattern(pat, color, n, da);
+	c0 = v16_load_u16(pat);
+	vsa = v16_splat(sa);
+	switch (n)
+	{
+	case 1:
+		for (; w >= 8; w -= 8, dp += 8, mp += 8)
+		{
+			if (simd_all_zero(mp, 8))
+				continue;
+			v16_store(dp, v16_blend(c0, v16_load(dp), simd_mask_amount(v16_load(mp), sa, vsa)));
+		}
+		break;
+	case 2:
+		for (; w >= 4; w -= 4, dp += 8, mp += 4)
+		{
+			if (simd_all_zero(mp, 4))
+				continue;
+			v16_store(dp, v16_blend(c0, v16_load(dp), simd_mask_amount(v16_load_x2(mp), sa, vsa)));
+		}
+		break;
+	case 3:
+		c1 = v16_load_u16(pat + 8);
+		c2 = v16_load_u16(pat + 16);
+		for (; w >= 8; w -= 8, dp += 24, mp += 8)
+		{
+			uint16_t ma[24];
+			int i;
+			if (simd_all_zero(mp, 8))
+				continue;
+			for (i = 0; i < 8; i++)
+				ma[3*i] = ma[3*i+1] = ma[3*i+2] = FZ_COMBINE(FZ_EXPAND(mp[i]), sa);
+			v16_store(dp, v16_blend(c0, v16_load(dp), v16_load_u16(ma)));
+			v16_store(dp + 8, v16_blend(c1, v16_load(dp + 8), v16_load_u16(ma + 8)));
+			v16_store(dp + 16, v16_blend(c2, v16_load(dp + 16), v16_load_u16(ma + 16)));
+		}
+		break;
+	case 4:
+		for (; w >= 2; w -= 2, dp += 8, mp += 2)
+		{
+			if (mp[0] == 0 && mp[1] == 0)
+				continue;
+			v16_store(dp, v16_blend(c0, v16_load(dp), simd_mask_amount(v16_load_x4(mp), sa, vsa)));
+		}
+		break;
+	}
+
+	*dpp = dp;
+	*mpp = mp;
+	return w;
+}
+
+/* Premultiplied source over destination, both with alpha, for pixels of
+ * 1, 2 or 4 bytes. */
+static int
+simd_span_da_sa(byte * restrict *dpp, const byte * restrict *spp, int n, int w)
+{
+	byte * restrict dp = *dpp;
+	const byte * restrict sp = *spp;
+	int per = 8 / n;
+	v16 k255 = v16_splat(255);
+	v16 k256 = v16_splat(256);
+
+	for (; w >= per; w -= per, dp += 8, sp += 8)
+	{
+		v16 s = v16_load(sp);
+		v16 d = v16_load(dp);
+		v16 a = (n == 1 ? s : n == 2 ? v16_dup2(s) : v16_dup4(s));
+		v16 r;
+		a = v16_expand(a);
+		r = v16_and(v16_add(s, v16_combine(d, v16_sub(k256, a))), k255);
+		v16_store(dp, v16_select0(a, d, r));
+	}
+
+	*dpp = dp;
+	*spp = sp;
+	return w;
+}
+
+/* As above, with a constant alpha applied to the source. */
+static int
+simd_span_da_sa_alpha(byte * restrict *dpp, const byte * restrict *spp, int n, int w, int alpha)
+{
+	byte * restrict dp = *dpp;
+	const byte * restrict sp = *spp;
+	int per = 8 / n;
+	v16 valpha = v16_splat(FZ_EXPAND(alpha));
+
+	for (; w >= per; w -= per, dp += 8, sp += 8)
+	{
+		v16 s = v16_load(sp);
+		v16 a = (n == 1 ? s : n == 2 ? v16_dup2(s) : v16_dup4(s));
+		v16_store(dp, v16_blend(s, v16_load(dp), v16_combine(a, valpha)));
+	}
+
+	*dpp = dp;
+	*spp = sp;
+	return w;
+}
+
+/* Opaque source over destination with a constant alpha, for any n. */
+static int
+simd_span_alpha(byte * restrict *dpp, const byte * restrict *spp, int n, int w, int alpha)
+{
+	byte * restrict dp = *dpp;
+	const byte * restrict sp = *spp;
+	v16 valpha = v16_splat(alpha);
+	int len = (w & ~7) * n;
+
+	for (; len > 0; len -= 8, dp += 8, sp += 8)
+		v16_store(dp, v16_blend(v16_load(sp), v16_load(dp), valpha));
+
+	*dpp = dp;
+	*spp = sp;
+	return w & 7;
+}
+
+#endif /* FZ_SIMD */
+
 /* These are used by the non-aa scan converter */
 
 static inline void
@@ -380,6 +586,11 @@ template_solid_color_0_da(byte * restrict dp, int w, int sa)
 static void paint_solid_color_1_alpha(byte * restrict dp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_solid_color(&dp, 1, w, color, 0, FZ_EXPAND(color[1]));
+	if (w == 0)
+		return;
+#endif
 	template_solid_color_N_sa(dp, 1, w, color, 0, FZ_EXPAND(color[1]));
 }
 
@@ -392,6 +603,11 @@ static void paint_solid_color_1(byte * restrict dp, int n, int w, const byte * r
 static void paint_solid_color_1_da(byte * restrict dp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_solid_color(&dp, 2, w, color, 1, FZ_EXPAND(color[1]));
+	if (w == 0)
+		return;
+#endif
 	template_solid_color_1_da(dp, 2, w, color, 1);
 }
 #endif /* FZ_PLOTTERS_G */
@@ -406,6 +622,11 @@ static void paint_solid_color_0_da(byte * restrict dp, int n, int w, const byte
 static void paint_solid_color_3_alpha(byte * restrict dp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_solid_color(&dp, 3, w, color, 0, FZ_EXPAND(color[3]));
+	if (w == 0)
+		return;
+#endif
 	template_solid_color_N_sa(dp, 3, w, color, 0, FZ_EXPAND(color[3]));
 }
 
@@ -418,6 +639,11 @@ static void paint_solid_color_3(byte * restrict dp, int n, int w, const byte * r
 static void paint_solid_color_3_da(byte * restrict dp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_solid_color(&dp, 4, w, color, 1, FZ_EXPAND(color[3]));
+	if (w == 0)
+		return;
+#endif
 	template_solid_color_3_da(dp, 4, w, color, 1);
 }
 #endif /* FZ_PLOTTERS_RGB */
@@ -426,6 +652,11 @@ static void paint_solid_color_3_da(byte * restrict dp, int n, int w, const byte
 static void paint_solid_color_4_alpha(byte * restrict dp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_solid_color(&dp, 4, w, color, 0, FZ_EXPAND(color[4]));
+	if (w == 0)
+		return;
+#endif
 	template_solid_color_N_sa(dp, 4, w, color, 0, FZ_EXPAND(color[4]));
 }
 
@@ -750,6 +981,11 @@ static void
 paint_span_with_color_0_da(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_with_color(&dp, &mp, 1, w, color, 1);
+	if (w == 0)
+		return;
+#endif
 	template_span_with_color_N_general(dp, mp, 1, w, color, 1);
 }
 
@@ -757,6 +993,11 @@ static void
 paint_span_with_color_1(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_with_color(&dp, &mp, 1, w, color, 0);
+	if (w == 0)
+		return;
+#endif
 	template_span_with_color_N_general(dp, mp, 1, w, color, 0);
 }
 
@@ -764,6 +1005,11 @@ static void
 paint_span_with_color_1_da(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_with_color(&dp, &mp, 2, w, color, 1);
+	if (w == 0)
+		return;
+#endif
 	template_span_with_color_1_da(dp, mp, 2, w, color, 1);
 }
 
@@ -772,6 +1018,11 @@ static void
 paint_span_with_color_3(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_with_color(&dp, &mp, 3, w, color, 0);
+	if (w == 0)
+		return;
+#endif
 	template_span_with_color_N_general(dp, mp, 3, w, color, 0);
 }
 
@@ -779,6 +1030,11 @@ static void
 paint_span_with_color_3_da(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_with_color(&dp, &mp, 4, w, color, 1);
+	if (w == 0)
+		return;
+#endif
 	template_span_with_color_3_da(dp, mp, 4, w, color, 1);
 }
 #endif /* FZ_PLOTTERS_RGB */
@@ -788,6 +1044,11 @@ static void
 paint_span_with_color_4(byte * restrict dp, const byte * restrict mp, int n, int w, const byte * restrict color, int da)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_with_color(&dp, &mp, 4, w, color, 0);
+	if (w == 0)
+		return;
+#endif
 	template_span_with_color_N_general(dp, mp, 4, w, color, 0);
 }
 
@@ -1428,6 +1689,11 @@ static void
 paint_span_0_da_sa(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_da_sa(&dp, &sp, 1, w);
+	if (w == 0)
+		return;
+#endif
 	do
 	{
 		int s = *sp++;
@@ -1442,6 +1708,11 @@ static void
 paint_span_0_da_sa_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_da_sa_alpha(&dp, &sp, 1, w, alpha);
+	if (w == 0)
+		return;
+#endif
 	alpha = FZ_EXPAND(alpha);
 	do
 	{
@@ -1471,6 +1742,11 @@ static void
 paint_span_1_da_sa(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_da_sa(&dp, &sp, 2, w);
+	if (w == 0)
+		return;
+#endif
 	template_span_1_general(dp, 1, sp, 1, w);
 }
 
@@ -1478,6 +1754,11 @@ static void
 paint_span_1_da_sa_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_da_sa_alpha(&dp, &sp, 2, w, alpha);
+	if (w == 0)
+		return;
+#endif
 	template_span_1_with_alpha_general(dp, 1, sp, 1, w, alpha);
 }
 
@@ -1500,13 +1781,19 @@ static void
 paint_span_1(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
-	template_span_1_general(dp, 0, sp, 0, w);
+	/* Opaque over opaque is a straight copy */
+	memcpy(dp, sp, (size_t)w * 1);
 }
 
 static void
 paint_span_1_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_alpha(&dp, &sp, 1, w, alpha);
+	if (w == 0)
+		return;
+#endif
 	template_span_1_with_alpha_general(dp, 0, sp, 0, w, alpha);
 }
 #endif /* FZ_PLOTTERS_G */
@@ -1516,6 +1803,11 @@ static void
 paint_span_3_da_sa(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_da_sa(&dp, &sp, 4, w);
+	if (w == 0)
+		return;
+#endif
 	template_span_3_general(dp, 1, sp, 1, w);
 }
 
@@ -1523,6 +1815,11 @@ static void
 paint_span_3_da_sa_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_da_sa_alpha(&dp, &sp, 4, w, alpha);
+	if (w == 0)
+		return;
+#endif
 	template_span_3_with_alpha_general(dp, 1, sp, 1, w, alpha);
 }
 
@@ -1558,13 +1855,19 @@ static void
 paint_span_3(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
-	template_span_3_general(dp, 0, sp, 0, w);
+	/* Opaque over opaque is a straight copy */
+	memcpy(dp, sp, (size_t)w * 3);
 }
 
 static void
 paint_span_3_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_alpha(&dp, &sp, 3, w, alpha);
+	if (w == 0)
+		return;
+#endif
 	template_span_3_with_alpha_general(dp, 0, sp, 0, w, alpha);
 }
 #endif /* FZ_PLOTTERS_RGB */
@@ -1616,13 +1919,19 @@ static void
 paint_span_4(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
-	template_span_4_general(dp, 0, sp, 0, w);
+	/* Opaque over opaque is a straight copy */
+	memcpy(dp, sp, (size_t)w * 4);
 }
 
 static void
 paint_span_4_alpha(byte * restrict dp, int da, const byte * restrict sp, int sa, int n, int w, int alpha)
 {
 	TRACK_FN();
+#ifdef FZ_SIMD
+	w = simd_span_alpha(&dp, &sp, 4, w, alpha);
+	if (w == 0)
+		return;
+#endif
 	template_span_4_with_alpha_general(dp, 0, sp, 0, w, alpha);
 }
 #endif /* FZ_PLOTTERS_CMYK */
@@ -1988,16 +2297,18 @@ fz_paint_pixmap_with_mask(fz_pixmap * restrict dst, const fz_pixmap * restrict s
 static inline void
 fz_paint_glyph_mask(int span, unsigned char *dp, int da, const fz_glyph *glyph, int w, int h, int skip_x, int skip_y)
 {
+	const unsigned char *data = fz_glyph_data(glyph);
+
 	while (h--)
 	{
 		int skip_xx, ww, len, extend;
 		const unsigned char *runp;
 		unsigned char *ddp = dp;
-		int offset = ((const int *)(glyph->data))[skip_y++];
+		int offset = ((const int *)data)[skip_y++];
 		if (offset >= 0)
 		{
 			int eol = 0;
-			runp = &glyph->data[offset];
+			runp = &data[offset];
 			extend = 0;
 			ww = w;
 			skip_xx = skip_x;
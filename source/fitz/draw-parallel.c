@@ -0,0 +1,156 @@
+#include "mupdf/fitz.h"
+
+/*
+	Tile-parallel rendering of display lists.
+
+	The destination pixmap is split into tiles. Each tile is drawn by
+	a draw device of its own, onto a pixmap that shares the samples of
+	the destination, so no assembly step is required. Each tile is a
+	job for a thread pool.
+*/
+
+#ifndef FZ_PARALLEL_TILE_SIZE
+#define FZ_PARALLEL_TILE_SIZE 256
+#endif
+
+typedef struct tile_job_s tile_job;
+typedef struct tile_s tile;
+
+struct tile_job_s
+{
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *pix;
+	int hints;
+	fz_cookie *cookie;
+	int cols;
+};
+
+struct tile_s
+{
+	tile_job *job;
+	int index;
+};
+
+static void
+render_tile(fz_context *ctx, void *arg)
+{
+	tile_job *job = ((tile *)arg)->job;
+	int i = ((tile *)arg)->index;
+	fz_pixmap *pix = job->pix;
+	fz_pixmap *sub = NULL;
+	fz_device *dev = NULL;
+	fz_irect r;
+	fz_rect area;
+	unsigned char *samples;
+
+	if (job->cookie && job->cookie->abort)
+		return;
+
+	fz_var(sub);
+	fz_var(dev);
+
+	r.x0 = pix->x + (i % job->cols) * FZ_PARALLEL_TILE_SIZE;
+	r.y0 = pix->y + (i / job->cols) * FZ_PARALLEL_TILE_SIZE;
+	r.x1 = fz_mini(r.x0 + FZ_PARALLEL_TILE_SIZE, pix->x + pix->w);
+	r.y1 = fz_mini(r.y0 + FZ_PARALLEL_TILE_SIZE, pix->y + pix->h);
+	fz_rect_from_irect(&area, &r);
+
+	samples = pix->samples + (r.y0 - pix->y) * (ptrdiff_t)pix->stride + (r.x0 - pix->x) * pix->n;
+
+	fz_try(ctx)
+	{
+		sub = fz_new_pixmap_with_data(ctx, pix->colorspace, r.x1 - r.x0, r.y1 - r.y0, pix->alpha, pix->stride, samples);
+		sub->x = r.x0;
+		sub->y = r.y0;
+		sub->xres = pix->xres;
+		sub->yres = pix->yres;
+
+		dev = fz_new_draw_device(ctx, NULL, sub);
+		if (job->hints)
+			fz_enable_device_hints(ctx, dev, job->hints);
+		fz_run_display_list(ctx, job->list, dev, &job->ctm, &area, job->cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, sub);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+void
+fz_run_display_list_parallel(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_pixmap *pix, int hints, int threads, fz_cookie *cookie)
+{
+	tile_job job;
+	tile *tiles;
+	fz_thread_pool *pool;
+	int rows, count, i;
+
+	job.list = list;
+	job.ctm = *ctm;
+	job.pix = pix;
+	job.hints = hints;
+	job.cookie = cookie;
+	job.cols = (pix->w + FZ_PARALLEL_TILE_SIZE - 1) / FZ_PARALLEL_TILE_SIZE;
+	rows = (pix->h + FZ_PARALLEL_TILE_SIZE - 1) / FZ_PARALLEL_TILE_SIZE;
+	count = job.cols * rows;
+	if (count == 0)
+		return;
+
+	/* The calling thread draws tiles too, while it waits. */
+	threads = fz_mini(threads, count);
+	tiles = fz_malloc_array(ctx, count, sizeof(*tiles));
+	pool = NULL;
+
+	fz_var(pool);
+
+	fz_try(ctx)
+	{
+		pool = fz_new_thread_pool(ctx, threads - 1);
+		for (i = 0; i < count; i++)
+		{
+			tiles[i].job = &job;
+			tiles[i].index = i;
+			fz_thread_pool_submit(ctx, pool, render_tile, &tiles[i]);
+		}
+		fz_thread_pool_wait(ctx, pool);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_thread_pool(ctx, pool);
+		fz_free(ctx, tiles);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+fz_pixmap *
+fz_new_pixmap_from_display_list_parallel(fz_context *ctx, fz_display_list *list, const fz_matrix *ctm, fz_colorspace *cs, int alpha, int threads)
+{
+	fz_rect rect;
+	fz_irect irect;
+	fz_pixmap *pix;
+
+	fz_bound_display_list(ctx, list, &rect);
+	fz_transform_rect(&rect, ctm);
+	fz_round_rect(&irect, &rect);
+
+	pix = fz_new_pixmap_with_bbox(ctx, cs, &irect, alpha);
+	if (alpha)
+		fz_clear_pixmap(ctx, pix);
+	else
+		fz_clear_pixmap_with_value(ctx, pix, 0xFF);
+
+	fz_try(ctx)
+		fz_run_display_list_parallel(ctx, list, ctm, pix, 0, threads, NULL);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+
+	return pix;
+}
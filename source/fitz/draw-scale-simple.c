@@ -12,6 +12,7 @@ intermediate results rather than ints.
 
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
+#include "draw-simd.h"
 
 /* Do we special case handling of single pixel high/wide images? The
  * 'purest' handling is given by not special casing them, but certain
@@ -21,6 +22,12 @@ intermediate results rather than ints.
  */
 #define SINGLE_PIXEL_SPECIALS
 
+/* Use the vector versions of the row scalers where we have them (the
+ * ARM build has hand written ones of its own). */
+#if defined(FZ_SIMD) && !defined(ARCH_ARM)
+#define SIMD_SCALER
+#endif
+
 /*
 Consider a row of source samples, src, of width src_w, positioned at x,
 scaled to width dst_w.
@@ -1000,6 +1007,242 @@ scale_row_from_temp_alpha(unsigned char * restrict dst, const unsigned char * re
 	);
 }
 #else
+#ifdef SIMD_SCALER
+/*
+ * Vector versions of the plain C row scalers below. Both the samples
+ * and the weights (which stay close to the 0..256 range) fit in signed
+ * 16 bit lanes, and each multiply-add sums a pair of products into a
+ * 32 bit lane. The sums are exactly those of the C code, just added up
+ * in a different order, so the results are identical.
+ */
+static void
+scale_row_to_temp1(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int len, i, step = 1;
+	const unsigned char *min;
+
+	assert(weights->n == 1);
+	if (weights->flip)
+	{
+		dst += weights->count-1;
+		step = -1;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		int val = 128;
+		min = &src[*contrib++];
+		len = *contrib++;
+		if (len >= 8)
+		{
+			v32 acc = v32_splat(0);
+			int t[4];
+			do
+			{
+				acc = v32_madd(acc, v16_load(min), v16_load_i32(contrib));
+				min += 8;
+				contrib += 8;
+				len -= 8;
+			}
+			while (len >= 8);
+			v32_store(t, acc);
+			val += t[0] + t[1] + t[2] + t[3];
+		}
+		while (len-- > 0)
+		{
+			val += *min++ * *contrib++;
+		}
+		*dst = (unsigned char)(val>>8);
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp2(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int len, i, step = 2;
+	const unsigned char *min;
+
+	assert(weights->n == 2);
+	if (weights->flip)
+	{
+		dst += 2*(weights->count-1);
+		step = -2;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		int c1 = 128;
+		int c2 = 128;
+		min = &src[2 * *contrib++];
+		len = *contrib++;
+		if (len >= 4)
+		{
+			v32 acc = v32_splat(0);
+			int t[4];
+			do
+			{
+				/* a0 a2 b0 b2 a1 a3 b1 b3 */
+				v16 w = v16_set(contrib[0], contrib[2], contrib[0], contrib[2], contrib[1], contrib[3], contrib[1], contrib[3]);
+				acc = v32_madd(acc, v16_zip_halves(v16_load(min)), w);
+				min += 8;
+				contrib += 4;
+				len -= 4;
+			}
+			while (len >= 4);
+			v32_store(t, acc);
+			c1 += t[0] + t[2];
+			c2 += t[1] + t[3];
+		}
+		while (len-- > 0)
+		{
+			c1 += *min++ * *contrib;
+			c2 += *min++ * *contrib++;
+		}
+		dst[0] = (unsigned char)(c1>>8);
+		dst[1] = (unsigned char)(c2>>8);
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp3(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int len, i, step = 3;
+	const unsigned char *min;
+
+	assert(weights->n == 3);
+	if (weights->flip)
+	{
+		dst += 3*(weights->count-1);
+		step = -3;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		v32 acc = v32_splat(128);
+		int t[4];
+		min = &src[3 * *contrib++];
+		len = *contrib++;
+		/* Two pixels at a time, but the load reads 8 bytes, so
+		 * keep a third pixel in hand to stay inside the row. */
+		while (len >= 3)
+		{
+			acc = v32_madd(acc, v16_zip_thirds(v16_load(min)), v16_splat2(contrib[0], contrib[1]));
+			min += 6;
+			contrib += 2;
+			len -= 2;
+		}
+		v32_store(t, acc);
+		while (len-- > 0)
+		{
+			int c = *contrib++;
+			t[0] += *min++ * c;
+			t[1] += *min++ * c;
+			t[2] += *min++ * c;
+		}
+		dst[0] = (unsigned char)(t[0]>>8);
+		dst[1] = (unsigned char)(t[1]>>8);
+		dst[2] = (unsigned char)(t[2]>>8);
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp4(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int len, i, step = 4;
+	const unsigned char *min;
+
+	assert(weights->n == 4);
+	if (weights->flip)
+	{
+		dst += 4*(weights->count-1);
+		step = -4;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		v32 acc = v32_splat(128);
+		int t[4];
+		min = &src[4 * *contrib++];
+		len = *contrib++;
+		while (len >= 2)
+		{
+			acc = v32_madd(acc, v16_zip_halves(v16_load(min)), v16_splat2(contrib[0], contrib[1]));
+			min += 8;
+			contrib += 2;
+			len -= 2;
+		}
+		v32_store(t, acc);
+		if (len > 0)
+		{
+			int c = *contrib++;
+			t[0] += min[0] * c;
+			t[1] += min[1] * c;
+			t[2] += min[2] * c;
+			t[3] += min[3] * c;
+		}
+		dst[0] = (unsigned char)(t[0]>>8);
+		dst[1] = (unsigned char)(t[1]>>8);
+		dst[2] = (unsigned char)(t[2]>>8);
+		dst[3] = (unsigned char)(t[3]>>8);
+		dst += step;
+	}
+}
+
+static void
+scale_row_from_temp(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	int len, x, i;
+	int width = w * n;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	/* Eight columns at a time, interleaving pairs of rows so that
+	 * each multiply-add takes in two rows' worth of weights. */
+	for (x=width; x >= 8; x -= 8)
+	{
+		const unsigned char *min = src;
+		v32 lo = v32_splat(128);
+		v32 hi = v32_splat(128);
+
+		for (i = 0; i+1 < len; i += 2)
+		{
+			v16 a = v16_load(min);
+			v16 b = v16_load(min + width);
+			v16 c = v16_splat2(contrib[i], contrib[i+1]);
+			lo = v32_madd(lo, v16_zip_lo(a, b), c);
+			hi = v32_madd(hi, v16_zip_hi(a, b), c);
+			min += 2*width;
+		}
+		if (i < len)
+		{
+			v16 a = v16_load(min);
+			v16 c = v16_splat2(contrib[i], 0);
+			lo = v32_madd(lo, v16_zip_lo(a, a), c);
+			hi = v32_madd(hi, v16_zip_hi(a, a), c);
+		}
+		v16_store(dst, v32_shr8_narrow(lo, hi));
+		dst += 8;
+		src += 8;
+	}
+	for (; x > 0; x--)
+	{
+		const unsigned char *min = src;
+		int val = 128;
+
+		for (i = 0; i < len; i++)
+		{
+			val += *min * contrib[i];
+			min += width;
+		}
+		*dst++ = (unsigned char)(val>>8);
+		src++;
+	}
+}
+#else
 static void
 scale_row_to_temp1(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
 {
@@ -1219,6 +1462,7 @@ scale_row_from_temp(unsigned char * restrict dst, const unsigned char * restrict
 		src++;
 	}
 }
+#endif /* SIMD_SCALER */
 
 static void
 scale_row_from_temp_alpha(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights, int w, int n, int row)
@@ -0,0 +1,339 @@
+#ifndef MUPDF_DRAW_SIMD_H
+#define MUPDF_DRAW_SIMD_H
+
+/*
+ * A minimal vector layer for the plotters and the scaler.
+ *
+ * A v16 holds eight 16 bit lanes; enough to blend eight 8 bit samples at
+ * a time using the FZ_EXPAND/FZ_COMBINE/FZ_BLEND arithmetic, with exactly
+ * the same results as the scalar code. A v32 holds four 32 bit lanes, for
+ * the weighted sums in the scaler and the fixed point colors stepped along
+ * the spans of shaded triangles. It is implemented with SSE2 on x86
+ * and NEON on ARM; both are part of the baseline for 64 bit builds, so no
+ * runtime detection is needed there. FZ_SIMD is defined when one of them
+ * is available. Define FZ_NO_SIMD to use the plain C code throughout.
+ */
+
+#ifndef FZ_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FZ_SIMD_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define FZ_SIMD_NEON
+#endif
+#endif
+
+#if defined(FZ_SIMD_SSE2) || defined(FZ_SIMD_NEON)
+#define FZ_SIMD
+
+#ifdef FZ_SIMD_SSE2
+#include <emmintrin.h>
+
+typedef __m128i v16;
+
+/* Load 8 bytes into the 8 lanes. */
+static inline v16 v16_load(const unsigned char *p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+}
+
+/* Store the 8 lanes (which must be < 256) as 8 bytes. */
+static inline void v16_store(unsigned char *p, v16 x)
+{
+	_mm_storel_epi64((__m128i *)p, _mm_packus_epi16(x, x));
+}
+
+/* Load 4 bytes, each into 2 adjacent lanes. */
+static inline v16 v16_load_x2(const unsigned char *p)
+{
+	int v;
+	__m128i x;
+	memcpy(&v, p, 4);
+	x = _mm_cvtsi32_si128(v);
+	x = _mm_unpacklo_epi8(x, x);
+	return _mm_unpacklo_epi8(x, _mm_setzero_si128());
+}
+
+/* Load 2 bytes, each into 4 adjacent lanes. */
+static inline v16 v16_load_x4(const unsigned char *p)
+{
+	__m128i x = _mm_cvtsi32_si128(p[0] | (p[1] << 8));
+	x = _mm_unpacklo_epi8(x, x);
+	x = _mm_unpacklo_epi16(x, x);
+	return _mm_unpacklo_epi8(x, _mm_setzero_si128());
+}
+
+/* Load 8 lanes from an array of 16 bit values. */
+static inline v16 v16_load_u16(const uint16_t *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline v16 v16_splat(int x) { return _mm_set1_epi16((short)x); }
+static inline v16 v16_add(v16 a, v16 b) { return _mm_add_epi16(a, b); }
+static inline v16 v16_sub(v16 a, v16 b) { return _mm_sub_epi16(a, b); }
+static inline v16 v16_mul(v16 a, v16 b) { return _mm_mullo_epi16(a, b); }
+static inline v16 v16_and(v16 a, v16 b) { return _mm_and_si128(a, b); }
+static inline v16 v16_shr7(v16 a) { return _mm_srli_epi16(a, 7); }
+static inline v16 v16_shr8(v16 a) { return _mm_srli_epi16(a, 8); }
+
+/* Copy lanes 1, 3, 5 and 7 over lanes 0, 2, 4 and 6. */
+static inline v16 v16_dup2(v16 a)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xF5), 0xF5);
+}
+
+/* Copy lane 3 over lanes 0 to 2, and lane 7 over lanes 4 to 6. */
+static inline v16 v16_dup4(v16 a)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xFF), 0xFF);
+}
+
+/* Lanes of a where c is zero, and of b elsewhere. */
+static inline v16 v16_select0(v16 c, v16 a, v16 b)
+{
+	__m128i m = _mm_cmpeq_epi16(c, _mm_setzero_si128());
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+/* Interleave the low (or high) 4 lanes of a and b. */
+static inline v16 v16_zip_lo(v16 a, v16 b) { return _mm_unpacklo_epi16(a, b); }
+static inline v16 v16_zip_hi(v16 a, v16 b) { return _mm_unpackhi_epi16(a, b); }
+
+/* Lanes 0, 4, 1, 5, 2, 6, 3, 7 of a. */
+static inline v16 v16_zip_halves(v16 a)
+{
+	return _mm_unpacklo_epi16(a, _mm_srli_si128(a, 8));
+}
+
+/* Lanes 0, 3, 1, 4, 2, 5 of a, followed by 2 lanes of junk. */
+static inline v16 v16_zip_thirds(v16 a)
+{
+	return _mm_unpacklo_epi16(a, _mm_srli_si128(a, 6));
+}
+
+/* Load 8 lanes from an array of ints, each of which must fit in 16 bits. */
+static inline v16 v16_load_i32(const int *p)
+{
+	return _mm_packs_epi32(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p + 4)));
+}
+
+static inline v16 v16_set(int a, int b, int c, int d, int e, int f, int g, int h)
+{
+	return _mm_setr_epi16((short)a, (short)b, (short)c, (short)d, (short)e, (short)f, (short)g, (short)h);
+}
+
+/* a in the even lanes and b in the odd lanes. */
+static inline v16 v16_splat2(int a, int b)
+{
+	return _mm_set1_epi32((a & 0xFFFF) | (b << 16));
+}
+
+/*
+ * A v32 holds four signed 32 bit lanes, for accumulating sums of 8 bit
+ * samples multiplied by 16 bit weights.
+ */
+typedef __m128i v32;
+
+static inline v32 v32_splat(int x) { return _mm_set1_epi32(x); }
+
+/* Add a[2i] * b[2i] + a[2i+1] * b[2i+1] to lane i of acc, treating the
+ * lanes of a and b as signed. */
+static inline v32 v32_madd(v32 acc, v16 a, v16 b)
+{
+	return _mm_add_epi32(acc, _mm_madd_epi16(a, b));
+}
+
+static inline v32 v32_load(const int *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void v32_store(int *p, v32 a)
+{
+	_mm_storeu_si128((__m128i *)p, a);
+}
+
+static inline v32 v32_add(v32 a, v32 b) { return _mm_add_epi32(a, b); }
+
+/* The low 8 bits of each lane of lo and hi shifted down by 8. */
+static inline v16 v32_shr8_narrow(v32 lo, v32 hi)
+{
+	__m128i mask = _mm_set1_epi32(255);
+	lo = _mm_and_si128(_mm_srai_epi32(lo, 8), mask);
+	hi = _mm_and_si128(_mm_srai_epi32(hi, 8), mask);
+	return _mm_packs_epi32(lo, hi);
+}
+
+/* The low 8 bits of each lane of lo and hi shifted down by 16. */
+static inline v16 v32_shr16_narrow(v32 lo, v32 hi)
+{
+	__m128i mask = _mm_set1_epi32(255);
+	lo = _mm_and_si128(_mm_srai_epi32(lo, 16), mask);
+	hi = _mm_and_si128(_mm_srai_epi32(hi, 16), mask);
+	return _mm_packs_epi32(lo, hi);
+}
+
+#else /* FZ_SIMD_NEON */
+#include <arm_neon.h>
+
+typedef uint16x8_t v16;
+
+static inline v16 v16_load(const unsigned char *p)
+{
+	return vmovl_u8(vld1_u8(p));
+}
+
+static inline void v16_store(unsigned char *p, v16 x)
+{
+	vst1_u8(p, vmovn_u16(x));
+}
+
+static inline v16 v16_load_x2(const unsigned char *p)
+{
+	uint32_t v;
+	uint8x8_t x;
+	memcpy(&v, p, 4);
+	x = vreinterpret_u8_u32(vdup_n_u32(v));
+	return vmovl_u8(vzip_u8(x, x).val[0]);
+}
+
+static inline v16 v16_load_x4(const unsigned char *p)
+{
+	uint8x8_t x = vreinterpret_u8_u16(vdup_n_u16(p[0] | (p[1] << 8)));
+	uint16x4_t y;
+	x = vzip_u8(x, x).val[0];
+	y = vreinterpret_u16_u8(x);
+	return vmovl_u8(vreinterpret_u8_u16(vzip_u16(y, y).val[0]));
+}
+
+static inline v16 v16_load_u16(const uint16_t *p)
+{
+	return vld1q_u16(p);
+}
+
+static inline v16 v16_splat(int x) { return vdupq_n_u16((uint16_t)x); }
+static inline v16 v16_add(v16 a, v16 b) { return vaddq_u16(a, b); }
+static inline v16 v16_sub(v16 a, v16 b) { return vsubq_u16(a, b); }
+static inline v16 v16_mul(v16 a, v16 b) { return vmulq_u16(a, b); }
+static inline v16 v16_and(v16 a, v16 b) { return vandq_u16(a, b); }
+static inline v16 v16_shr7(v16 a) { return vshrq_n_u16(a, 7); }
+static inline v16 v16_shr8(v16 a) { return vshrq_n_u16(a, 8); }
+
+static inline v16 v16_dup2(v16 a)
+{
+	return vtrnq_u16(a, a).val[1];
+}
+
+static inline v16 v16_dup4(v16 a)
+{
+	return vcombine_u16(vdup_lane_u16(vget_low_u16(a), 3), vdup_lane_u16(vget_high_u16(a), 3));
+}
+
+static inline v16 v16_select0(v16 c, v16 a, v16 b)
+{
+	return vbslq_u16(vceqq_u16(c, vdupq_n_u16(0)), a, b);
+}
+
+static inline v16 v16_zip_lo(v16 a, v16 b) { return vzipq_u16(a, b).val[0]; }
+static inline v16 v16_zip_hi(v16 a, v16 b) { return vzipq_u16(a, b).val[1]; }
+
+static inline v16 v16_zip_halves(v16 a)
+{
+	uint16x4x2_t z = vzip_u16(vget_low_u16(a), vget_high_u16(a));
+	return vcombine_u16(z.val[0], z.val[1]);
+}
+
+static inline v16 v16_zip_thirds(v16 a)
+{
+	uint16x4x2_t z = vzip_u16(vget_low_u16(a), vget_low_u16(vextq_u16(a, a, 3)));
+	return vcombine_u16(z.val[0], z.val[1]);
+}
+
+static inline v16 v16_load_i32(const int *p)
+{
+	return vreinterpretq_u16_s16(vcombine_s16(vmovn_s32(vld1q_s32(p)), vmovn_s32(vld1q_s32(p + 4))));
+}
+
+static inline v16 v16_set(int a, int b, int c, int d, int e, int f, int g, int h)
+{
+	uint16_t t[8];
+	t[0] = a; t[1] = b; t[2] = c; t[3] = d;
+	t[4] = e; t[5] = f; t[6] = g; t[7] = h;
+	return vld1q_u16(t);
+}
+
+static inline v16 v16_splat2(int a, int b)
+{
+	return vreinterpretq_u16_u32(vdupq_n_u32((a & 0xFFFF) | ((uint32_t)b << 16)));
+}
+
+typedef int32x4_t v32;
+
+static inline v32 v32_splat(int x) { return vdupq_n_s32(x); }
+
+static inline v32 v32_madd(v32 acc, v16 a, v16 b)
+{
+	int16x8_t sa = vreinterpretq_s16_u16(a);
+	int16x8_t sb = vreinterpretq_s16_u16(b);
+	int32x4_t lo = vmull_s16(vget_low_s16(sa), vget_low_s16(sb));
+	int32x4_t hi = vmull_s16(vget_high_s16(sa), vget_high_s16(sb));
+	return vaddq_s32(acc, vcombine_s32(
+		vpadd_s32(vget_low_s32(lo), vget_high_s32(lo)),
+		vpadd_s32(vget_low_s32(hi), vget_high_s32(hi))));
+}
+
+static inline v32 v32_load(const int *p)
+{
+	return vld1q_s32(p);
+}
+
+static inline void v32_store(int *p, v32 a)
+{
+	vst1q_s32(p, a);
+}
+
+static inline v32 v32_add(v32 a, v32 b) { return vaddq_s32(a, b); }
+
+static inline v16 v32_shr8_narrow(v32 lo, v32 hi)
+{
+	int32x4_t mask = vdupq_n_s32(255);
+	lo = vandq_s32(vshrq_n_s32(lo, 8), mask);
+	hi = vandq_s32(vshrq_n_s32(hi, 8), mask);
+	return vreinterpretq_u16_s16(vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+}
+
+static inline v16 v32_shr16_narrow(v32 lo, v32 hi)
+{
+	int32x4_t mask = vdupq_n_s32(255);
+	lo = vandq_s32(vshrq_n_s32(lo, 16), mask);
+	hi = vandq_s32(vshrq_n_s32(hi, 16), mask);
+	return vreinterpretq_u16_s16(vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+}
+
+#endif
+
+/* FZ_EXPAND on each lane. */
+static inline v16 v16_expand(v16 a)
+{
+	return v16_add(a, v16_shr7(a));
+}
+
+/* FZ_COMBINE on each lane. The product must fit in 16 bits. */
+static inline v16 v16_combine(v16 a, v16 b)
+{
+	return v16_shr8(v16_mul(a, b));
+}
+
+/*
+ * FZ_BLEND on each lane, with amounts from 0 to 256. This is computed as
+ * (src * amount + dst * (256 - amount)) >> 8, which is the same value,
+ * but never goes negative, and never exceeds 16 bits.
+ */
+static inline v16 v16_blend(v16 src, v16 dst, v16 amount)
+{
+	return v16_shr8(v16_add(v16_mul(src, amount), v16_mul(dst, v16_sub(v16_splat(256), amount))));
+}
+
+#endif /* FZ_SIMD_SSE2 || FZ_SIMD_NEON */
+
+#endif
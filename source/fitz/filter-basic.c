@@ -1,4 +1,4 @@
-#include "mupdf/fitz.h"
+#include "fitz-imp.h"
 
 /* Pretend we have a filter that just copies data forever */
 
@@ -57,9 +57,34 @@ fz_stream *
 fz_open_null(fz_context *ctx, fz_stream *chain, int len, fz_off_t offset)
 {
 	struct null_filter *state;
+	fz_stream *range;
 
 	if (len < 0)
 		len = 0;
+	/* If the data is in a mapped file anyway, just point at it. */
+	fz_try(ctx)
+		range = fz_open_memory_range(ctx, chain, offset, len);
+	fz_catch(ctx)
+	{
+		fz_drop_stream(ctx, chain);
+		fz_rethrow(ctx);
+	}
+	if (range)
+	{
+		/* Leave chain where reading all the data through a filter
+		 * would have; inline images rely on this to find their end. */
+		fz_try(ctx)
+			fz_seek(ctx, chain, offset + range->pos, 0);
+		fz_always(ctx)
+			fz_drop_stream(ctx, chain);
+		fz_catch(ctx)
+		{
+			fz_drop_stream(ctx, range);
+			fz_rethrow(ctx);
+		}
+		return range;
+	}
+
 	fz_try(ctx)
 	{
 		state = fz_malloc_struct(ctx, struct null_filter);
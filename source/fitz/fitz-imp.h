@@ -10,8 +10,44 @@ struct fz_buffer_s
 	size_t cap, len;
 	int unused_bits;
 	int shared;
+	fz_buffer *parent; /* slices keep the buffer that owns the data */
+	int mapped; /* data is a memory mapped file, cap bytes long */
 };
 
+/*
+	fz_unmap_file: Release a mapping made by
+	fz_new_buffer_from_mapped_file.
+
+	For internal use only.
+*/
+void fz_unmap_file(fz_context *ctx, unsigned char *data, size_t len);
+
+/*
+	fz_open_memory_range: If chain reads directly from a memory
+	mapped file (it was opened by fz_open_file with file mapping
+	turned on, or by this function), open a stream that reads len
+	bytes from offset without copying them. chain is kept, not
+	taken over.
+
+	Returns NULL if chain does not read from a mapped file. Other
+	memory streams are left to the null filter, whose behaviour
+	callers may rely on.
+
+	For internal use only.
+*/
+fz_stream *fz_open_memory_range(fz_context *ctx, fz_stream *chain, fz_off_t offset, size_t len);
+
+/*
+	fz_slice_memory_stream: If stm reads directly from the storage of
+	a buffer, return a slice of that buffer holding the unread data,
+	and mark the data as read.
+
+	Returns NULL if stm does not read from a buffer.
+
+	For internal use only.
+*/
+fz_buffer *fz_slice_memory_stream(fz_context *ctx, fz_stream *stm);
+
 void fz_new_colorspace_context(fz_context *ctx);
 fz_colorspace_context *fz_keep_colorspace_context(fz_context *ctx);
 void fz_drop_colorspace_context(fz_context *ctx);
@@ -66,6 +102,8 @@ struct fz_tuning_context_s
 	void *image_decode_arg;
 	fz_tune_image_scale_fn *image_scale;
 	void *image_scale_arg;
+	int map_files;
+	int lazy_loading;
 };
 
 fz_tune_image_decode_fn fz_default_image_decode;
@@ -89,5 +127,7 @@ void fz_new_output_context(fz_context *ctx);
 void fz_drop_output_context(fz_context *ctx);
 fz_output_context *fz_keep_output_context(fz_context *ctx);
 
+void fz_replay_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev);
+
 
 #endif
@@ -39,6 +39,10 @@ struct fz_font_s
 
 	/* cached encoding lookup */
 	uint16_t *encoding_cache[256];
+
+	/* md5 of the font data */
+	int has_digest;
+	unsigned char digest[16];
 };
 
 #endif
@@ -1591,3 +1591,21 @@ fz_shaper_data_t *fz_font_shaper_data(fz_context *ctx, fz_font *font)
 {
 	return font ? &font->shaper_data : NULL;
 }
+
+void fz_font_digest(fz_context *ctx, fz_font *font, unsigned char digest[16])
+{
+	if (!font->has_digest)
+	{
+		if (font->buffer)
+		{
+			fz_md5 state;
+			fz_md5_init(&state);
+			fz_md5_update(&state, font->buffer->data, font->buffer->len);
+			fz_md5_final(&state, font->digest);
+		}
+		else
+			memset(font->digest, 0, 16);
+		font->has_digest = 1;
+	}
+	memcpy(digest, font->digest, 16);
+}
@@ -30,16 +30,31 @@ fz_eval_function(fz_context *ctx, fz_function *func, const float *in, int inlen,
 	}
 }
 
+void
+fz_eval_function_n(fz_context *ctx, fz_function *func, int count, const float *in, int inlen, float *out, int outlen)
+{
+	int i;
+
+	if (func->evaluate_n && inlen == func->m && outlen == func->n)
+	{
+		func->evaluate_n(ctx, func, count, in, out);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		fz_eval_function(ctx, func, in + i * inlen, inlen, out + i * outlen, outlen);
+}
+
 fz_function *
 fz_keep_function(fz_context *ctx, fz_function *func)
 {
-	return fz_keep_storable(ctx, &func->storable);
+	return fz_keep_key_storable(ctx, &func->key_storable);
 }
 
 void
 fz_drop_function(fz_context *ctx, fz_function *func)
 {
-	fz_drop_storable(ctx, &func->storable);
+	fz_drop_key_storable(ctx, &func->key_storable);
 }
 
 size_t
@@ -47,3 +62,268 @@ fz_function_size(fz_context *ctx, fz_function *func)
 {
 	return (func ? func->size : 0);
 }
+
+/* Sampled functions */
+
+#define FZ_FUNCTION_LUT_POINTS (1 << 16)
+
+typedef struct fz_function_lut_key_s fz_function_lut_key;
+
+struct fz_function_lut_key_s
+{
+	int refs;
+	fz_function *func;
+};
+
+static int
+fz_make_hash_function_lut_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_function_lut_key *key = (fz_function_lut_key *)key_;
+	hash->u.pi.ptr = key->func;
+	hash->u.pi.i = 0;
+	return 1;
+}
+
+static void *
+fz_keep_function_lut_key(fz_context *ctx, void *key_)
+{
+	fz_function_lut_key *key = (fz_function_lut_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_function_lut_key(fz_context *ctx, void *key_)
+{
+	fz_function_lut_key *key = (fz_function_lut_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+	{
+		fz_drop_key_storable_key(ctx, &key->func->key_storable);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_function_lut_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_function_lut_key *k0 = (fz_function_lut_key *)k0_;
+	fz_function_lut_key *k1 = (fz_function_lut_key *)k1_;
+	return k0->func == k1->func;
+}
+
+static void
+fz_print_function_lut_key(fz_context *ctx, fz_output *out, void *key_)
+{
+	fz_function_lut_key *key = (fz_function_lut_key *)key_;
+	fz_printf(ctx, out, "(function lut m=%d n=%d) ", key->func->m, key->func->n);
+}
+
+static int
+fz_needs_reap_function_lut_key(fz_context *ctx, void *key_)
+{
+	fz_function_lut_key *key = (fz_function_lut_key *)key_;
+	/* Only the store's keys still hold the function. */
+	return key->func->key_storable.storable.refs == key->func->key_storable.store_key_refs;
+}
+
+static fz_store_type fz_function_lut_store_type =
+{
+	fz_make_hash_function_lut_key,
+	fz_keep_function_lut_key,
+	fz_drop_function_lut_key,
+	fz_cmp_function_lut_key,
+	fz_print_function_lut_key,
+	fz_needs_reap_function_lut_key
+};
+
+static void
+fz_drop_function_lut_imp(fz_context *ctx, fz_storable *lut_)
+{
+	fz_function_lut *lut = (fz_function_lut *)lut_;
+	fz_free(ctx, lut->samples);
+	fz_free(ctx, lut);
+}
+
+void
+fz_drop_function_lut(fz_context *ctx, fz_function_lut *lut)
+{
+	fz_drop_storable(ctx, &lut->storable);
+}
+
+/*
+	The grid spacing is 1/(size-1). We pick size so that size-1
+	divides 255: then both ends of each axis, and the 8 bit values
+	that are multiples of the spacing, hit grid points exactly.
+
+	Below 6 points per axis, interpolating a tint transform that
+	multiplies its inputs together is off by a quarter of the range,
+	so such functions are left to be evaluated exactly.
+*/
+static int
+fz_function_lut_grid_size(int m)
+{
+	static const int sizes[] = { 256, 86, 52, 18, 16, 6 };
+	int i, k, points;
+
+	for (i = 0; i < nelem(sizes); i++)
+	{
+		points = 1;
+		for (k = 0; k < m && points <= FZ_FUNCTION_LUT_POINTS; k++)
+			points *= sizes[i];
+		if (points <= FZ_FUNCTION_LUT_POINTS)
+			return sizes[i];
+	}
+	return 0;
+}
+
+static size_t
+fz_function_lut_size(fz_function_lut *lut)
+{
+	size_t points = 1;
+	int k;
+	for (k = 0; k < lut->m; k++)
+		points *= lut->size;
+	return sizeof(*lut) + points * lut->n * sizeof(float);
+}
+
+static fz_function_lut *
+fz_new_function_lut(fz_context *ctx, fz_function *func)
+{
+	fz_function_lut *lut;
+	float *in = NULL;
+	int size, points, i, k, j;
+
+	size = fz_function_lut_grid_size(func->m);
+	if (size == 0)
+		return NULL;
+	points = 1;
+	for (k = 0; k < func->m; k++)
+		points *= size;
+
+	lut = fz_malloc_struct(ctx, fz_function_lut);
+	FZ_INIT_STORABLE(lut, 1, fz_drop_function_lut_imp);
+	lut->m = func->m;
+	lut->n = func->n;
+	lut->size = size;
+
+	fz_var(in);
+
+	fz_try(ctx)
+	{
+		lut->samples = fz_malloc_array(ctx, points, func->n * sizeof(float));
+		in = fz_malloc_array(ctx, points, func->m * sizeof(float));
+		for (i = 0; i < points; i++)
+		{
+			for (j = i, k = 0; k < func->m; k++, j /= size)
+				in[i * func->m + k] = (j % size) / (float)(size - 1);
+		}
+		fz_eval_function_n(ctx, func, points, in, func->m, lut->samples, func->n);
+	}
+	fz_always(ctx)
+		fz_free(ctx, in);
+	fz_catch(ctx)
+	{
+		fz_drop_function_lut(ctx, lut);
+		fz_rethrow(ctx);
+	}
+
+	return lut;
+}
+
+fz_function_lut *
+fz_find_function_lut(fz_context *ctx, fz_function *func)
+{
+	fz_function_lut_key key, *keyp = NULL;
+	fz_function_lut *lut, *existing;
+
+	key.refs = 1;
+	key.func = func;
+	lut = fz_find_item(ctx, fz_drop_function_lut_imp, &key, &fz_function_lut_store_type);
+	if (lut)
+		return lut;
+
+	lut = fz_new_function_lut(ctx, func);
+	if (lut == NULL)
+		return NULL;
+
+	/* Any failure here will just result in us not caching. */
+	fz_var(keyp);
+	fz_try(ctx)
+	{
+		keyp = fz_malloc_struct(ctx, fz_function_lut_key);
+		keyp->refs = 1;
+		keyp->func = fz_keep_key_storable_key(ctx, &func->key_storable);
+		existing = fz_store_item(ctx, keyp, lut, fz_function_lut_size(lut), &fz_function_lut_store_type);
+		if (existing)
+		{
+			/* Built by a racing thread; use that one. */
+			fz_drop_function_lut(ctx, lut);
+			lut = existing;
+		}
+	}
+	fz_always(ctx)
+	{
+		if (keyp)
+			fz_drop_function_lut_key(ctx, keyp);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+
+	return lut;
+}
+
+void
+fz_eval_function_lut(fz_context *ctx, fz_function_lut *lut, const float *in, float *out)
+{
+	int order[FZ_FN_MAXM];
+	float frac[FZ_FN_MAXM];
+	int stride[FZ_FN_MAXM];
+	const float *v;
+	float x, w, prev;
+	int m = lut->m;
+	int n = lut->n;
+	int last = lut->size - 1;
+	int i, j, k, t, base;
+
+	/* Find the grid cell, and where in it we are along each axis. */
+	base = 0;
+	for (k = 0, t = 1; k < m; k++, t *= lut->size)
+	{
+		x = fz_clamp(in[k], 0, 1) * last;
+		i = (int)x;
+		if (i >= last)
+			i = last - 1;
+		frac[k] = x - i;
+		stride[k] = t * n;
+		base += i * t * n;
+		order[k] = k;
+	}
+
+	/* Sort the axes by decreasing fraction; we step through the cell
+	 * along them in turn, and each corner visited carries the weight
+	 * of the difference between successive fractions. */
+	for (k = 1; k < m; k++)
+	{
+		t = order[k];
+		for (j = k; j > 0 && frac[order[j - 1]] < frac[t]; j--)
+			order[j] = order[j - 1];
+		order[j] = t;
+	}
+
+	v = lut->samples + base;
+	prev = 1;
+	for (j = 0; j < n; j++)
+		out[j] = 0;
+	for (k = 0; k <= m; k++)
+	{
+		if (k > 0)
+			v += stride[order[k - 1]];
+		x = k < m ? frac[order[k]] : 0;
+		w = prev - x;
+		prev = x;
+		if (w != 0)
+			for (j = 0; j < n; j++)
+				out[j] += w * v[j];
+	}
+}
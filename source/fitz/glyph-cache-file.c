@@ -0,0 +1,532 @@
+#include "mupdf/fitz.h"
+#include "glyph-cache-imp.h"
+#include "font-imp.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+/*
+	Glyph cache files.
+
+	A glyph cache file is a fixed size file that is memory mapped
+	(shared) by every process using it. It starts with a header, then
+	a hash table of offsets, then the glyphs themselves, which are
+	appended one after another and never moved or freed:
+
+		header
+		int slots[nslots]	offset of an entry, or 0 if empty
+		entry, data, entry, data, ...
+
+	Each entry holds its key, the glyph bounds and the glyph data in
+	the form that the painters use directly, so a glyph found in the
+	file is used where it lies.
+
+	Readers take no locks. A writer locks the file (which excludes
+	other processes; threads within a process are already serialised
+	by the glyph cache lock), reserves space by bumping 'used', fills
+	in the entry, and only then publishes its offset in a free slot.
+	The slot is written with an atomic operation, which acts as a
+	barrier, and readers follow their read of a slot with a barrier,
+	so a reader that sees an offset also sees the entry behind it. A writer that dies
+	part way through leaves at worst some unused space.
+
+	Slots are only ever filled, never emptied, so a probe sequence
+	that reaches an empty slot is complete.
+*/
+
+#if !defined(_WIN32) && defined(FZ_HAVE_ATOMICS)
+#define HAVE_GLYPH_FILE
+#include <sys/mman.h>
+#endif
+
+#define GLYPH_FILE_MAGIC "MuGlyphs"
+#define GLYPH_FILE_VERSION 1
+#define GLYPH_FILE_BYTE_ORDER 0x01020304
+#define GLYPH_FILE_DEFAULT_SIZE (64 << 20)
+#define GLYPH_FILE_MIN_SIZE (1 << 20)
+#define GLYPH_FILE_TABLE 64 /* offset of the slot table */
+#define GLYPH_FILE_BYTES_PER_SLOT 512
+#define GLYPH_FILE_MAX_PROBE 32
+#define GLYPH_FILE_MAX_GLYPH 256 /* as the glyph cache's MAX_GLYPH_SIZE */
+
+#define GLYPH_FILE_RLE 0
+#define GLYPH_FILE_PIXMAP 1
+
+typedef struct glyph_file_header_s glyph_file_header;
+typedef struct glyph_file_key_s glyph_file_key;
+typedef struct glyph_file_entry_s glyph_file_entry;
+
+struct glyph_file_header_s
+{
+	char magic[8];
+	int version;
+	int byte_order;
+	int key_size;
+	int size;
+	int nslots;
+	int used;
+};
+
+/* Everything that affects the rendered glyph, in a form that means the
+ * same thing in every process. All ints, so there is no padding. */
+struct glyph_file_key_s
+{
+	unsigned char digest[16];
+	int index;
+	int flags;
+	int width;
+	int a, b, c, d;
+	int gid;
+	int e, f;
+	int aa;
+};
+
+struct glyph_file_entry_s
+{
+	glyph_file_key key;
+	int x, y, w, h;
+	int kind;
+	int size;
+	int pad;
+	/* data follows */
+};
+
+struct fz_glyph_file_s
+{
+	int fd;
+	int writable;
+	unsigned char *base;
+	int size;
+	int nslots;
+	glyph_file_header *header;
+	int *slots;
+};
+
+#ifdef HAVE_GLYPH_FILE
+
+static int
+lock_file(int fd, int type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof fl);
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 1;
+	while (fcntl(fd, F_SETLKW, &fl) < 0)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+unlock_file(int fd)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof fl);
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 1;
+	(void)fcntl(fd, F_SETLK, &fl);
+}
+
+static void
+init_header(glyph_file_header *header, int size)
+{
+	header->version = GLYPH_FILE_VERSION;
+	header->byte_order = GLYPH_FILE_BYTE_ORDER;
+	header->key_size = sizeof(glyph_file_key);
+	header->size = size;
+	header->nslots = size / GLYPH_FILE_BYTES_PER_SLOT;
+	/* Entries are kept 8 byte aligned; entry_at rejects any others. */
+	header->used = (GLYPH_FILE_TABLE + header->nslots * sizeof(int) + 7) & ~7;
+	/* The magic goes in last, so a half initialised file is rejected. */
+	memcpy(header->magic, GLYPH_FILE_MAGIC, 8);
+}
+
+static int
+check_header(const glyph_file_header *header, int size)
+{
+	if (memcmp(header->magic, GLYPH_FILE_MAGIC, 8) ||
+		header->version != GLYPH_FILE_VERSION ||
+		header->byte_order != GLYPH_FILE_BYTE_ORDER ||
+		header->key_size != (int)sizeof(glyph_file_key) ||
+		header->size != size ||
+		header->nslots <= 0 ||
+		header->nslots > (size - GLYPH_FILE_TABLE) / (int)sizeof(int))
+		return 0;
+	return 1;
+}
+
+fz_glyph_file *
+fz_open_glyph_file(fz_context *ctx, const char *filename, size_t size)
+{
+	fz_glyph_file *file;
+	struct stat info;
+	int fd, writable, locked, ok;
+	void *base;
+
+	if (size == 0)
+		size = GLYPH_FILE_DEFAULT_SIZE;
+	if (size < GLYPH_FILE_MIN_SIZE)
+		size = GLYPH_FILE_MIN_SIZE;
+	if (size > INT_MAX)
+		size = INT_MAX;
+	size &= ~(size_t)7;
+
+	writable = 1;
+	fd = open(filename, O_RDWR | O_CREAT | O_BINARY, 0666);
+	if (fd < 0 && (errno == EACCES || errno == EROFS))
+	{
+		writable = 0;
+		fd = open(filename, O_RDONLY | O_BINARY);
+	}
+	if (fd < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open glyph cache file '%s': %s", filename, strerror(errno));
+
+	/* Hold the lock while we look at the header, so that we never see
+	 * one that is still being created by another process. */
+	locked = (lock_file(fd, writable ? F_WRLCK : F_RDLCK) == 0);
+	if (!locked)
+	{
+		close(fd);
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot lock glyph cache file '%s': %s", filename, strerror(errno));
+	}
+
+	base = MAP_FAILED;
+	ok = 0;
+	if (fstat(fd, &info) == 0)
+	{
+		if (info.st_size == 0 && writable)
+		{
+			if (ftruncate(fd, (off_t)size) == 0)
+			{
+				base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (base != MAP_FAILED)
+				{
+					init_header(base, (int)size);
+					ok = 1;
+				}
+			}
+		}
+		else if (info.st_size >= GLYPH_FILE_MIN_SIZE && info.st_size <= INT_MAX)
+		{
+			size = (size_t)info.st_size;
+			base = mmap(NULL, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+			if (base != MAP_FAILED)
+				ok = check_header(base, (int)size);
+		}
+	}
+	unlock_file(fd);
+
+	if (!ok)
+	{
+		if (base != MAP_FAILED)
+			munmap(base, size);
+		close(fd);
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot use '%s' as a glyph cache file", filename);
+	}
+
+	fz_try(ctx)
+		file = fz_malloc_struct(ctx, fz_glyph_file);
+	fz_catch(ctx)
+	{
+		munmap(base, size);
+		close(fd);
+		fz_rethrow(ctx);
+	}
+
+	file->fd = fd;
+	file->writable = writable;
+	file->base = base;
+	file->size = (int)size;
+	file->header = base;
+	file->nslots = file->header->nslots;
+	file->slots = (int *)(file->base + GLYPH_FILE_TABLE);
+
+	return file;
+}
+
+void
+fz_drop_glyph_file(fz_context *ctx, fz_glyph_file *file)
+{
+	if (!file)
+		return;
+	munmap(file->base, file->size);
+	close(file->fd);
+	fz_free(ctx, file);
+}
+
+/* Fonts are known across processes by the digest of their data, so a
+ * font that was not loaded from a buffer cannot be named in the file.
+ * Returns 0 for such fonts. */
+static int
+make_key(fz_context *ctx, glyph_file_key *fkey, const fz_glyph_key *key)
+{
+	fz_font *font = key->font;
+	FT_Face face = font->ft_face;
+
+	if (!font->buffer)
+		return 0;
+
+	memset(fkey, 0, sizeof *fkey);
+	fz_font_digest(ctx, font, fkey->digest);
+	fkey->index = face->face_index;
+	fkey->flags =
+		(font->flags.fake_bold << 0) |
+		(font->flags.fake_italic << 1) |
+		(font->flags.force_hinting << 2) |
+		(font->flags.ft_stretch << 3);
+	/* Substitute fonts are stretched to the widths of the font they
+	 * stand in for. */
+	if (font->flags.ft_stretch && font->width_table)
+		fkey->width = key->gid < font->width_count ? font->width_table[key->gid] : font->width_default;
+	fkey->a = key->a;
+	fkey->b = key->b;
+	fkey->c = key->c;
+	fkey->d = key->d;
+	fkey->gid = key->gid;
+	fkey->e = key->e;
+	fkey->f = key->f;
+	fkey->aa = key->aa;
+	return 1;
+}
+
+static unsigned
+hash_key(const glyph_file_key *key)
+{
+	const unsigned char *s = (const unsigned char *)key;
+	unsigned h = 2166136261u;
+	size_t i;
+	for (i = 0; i < sizeof *key; i++)
+		h = (h ^ s[i]) * 16777619u;
+	return h;
+}
+
+/* Read a slot, with a barrier so that the entry it points to is seen
+ * complete. This must not write, as the file may be mapped read only;
+ * FZ_HAVE_ATOMICS on anything but Windows means gcc builtins. */
+static inline int
+read_slot(fz_glyph_file *file, int i)
+{
+	int offset = ((volatile int *)file->slots)[i];
+	__sync_synchronize();
+	return offset;
+}
+
+static const glyph_file_entry *
+entry_at(fz_glyph_file *file, int offset)
+{
+	const glyph_file_entry *entry;
+
+	/* Don't trust the file any further than we have to. */
+	if (offset < GLYPH_FILE_TABLE || offset > file->size - (int)sizeof(glyph_file_entry) || (offset & 7))
+		return NULL;
+	entry = (const glyph_file_entry *)(file->base + offset);
+	if (entry->size < 0 || entry->size > file->size - offset - (int)sizeof(glyph_file_entry))
+		return NULL;
+	return entry;
+}
+
+/* The painters follow the row offsets and runs of an RLE glyph
+ * without checking them, so check them here: each row offset must be
+ * -1 for a blank row, or point into the run data that follows the
+ * offsets, and the runs of a row (with the pixels of intermediate
+ * runs) must cover the width of the glyph, or end the row, before
+ * they run off the end of the entry. w and h are already bounded. */
+static int
+check_rle_rows(const glyph_file_entry *entry)
+{
+	const unsigned char *data = (const unsigned char *)(entry + 1);
+	const int *rows = (const int *)data;
+	int x, y, v, len, extend, eol, offset;
+
+	if (entry->size < entry->h * (int)sizeof(int))
+		return 0;
+	for (y = 0; y < entry->h; y++)
+	{
+		offset = rows[y];
+		if (offset == -1)
+			continue;
+		if (offset < entry->h * (int)sizeof(int) || offset >= entry->size)
+			return 0;
+		x = 0;
+		extend = 0;
+		eol = 0;
+		while (x < entry->w && !eol)
+		{
+			if (offset >= entry->size)
+				return 0;
+			v = data[offset++];
+			switch (v & 3)
+			{
+			case 0: /* Extend */
+				extend = v >> 2;
+				len = 0;
+				break;
+			case 1: /* Transparent */
+				len = (v >> 2) + 1 + (extend << 6);
+				extend = 0;
+				break;
+			case 2: /* Solid */
+				eol = v & 4;
+				len = (v >> 3) + 1 + (extend << 5);
+				extend = 0;
+				break;
+			default: /* Intermediate */
+				eol = v & 4;
+				len = (v >> 3) + 1 + (extend << 5);
+				extend = 0;
+				if (len > entry->size - offset)
+					return 0;
+				offset += len;
+				break;
+			}
+			x += len;
+		}
+	}
+	return 1;
+}
+
+fz_glyph *
+fz_lookup_glyph_file(fz_context *ctx, fz_glyph_file *file, const fz_glyph_key *key)
+{
+	glyph_file_key fkey;
+	unsigned h;
+	int i;
+
+	if (!make_key(ctx, &fkey, key))
+		return NULL;
+	h = hash_key(&fkey);
+
+	for (i = 0; i < GLYPH_FILE_MAX_PROBE; i++)
+	{
+		int offset = read_slot(file, (h + i) % file->nslots);
+		const glyph_file_entry *entry;
+
+		if (offset == 0)
+			break;
+		entry = entry_at(file, offset);
+		if (entry && !memcmp(&entry->key, &fkey, sizeof fkey))
+		{
+			const unsigned char *data = (const unsigned char *)(entry + 1);
+			if (entry->w < 0 || entry->h < 0 || entry->w > GLYPH_FILE_MAX_GLYPH || entry->h > GLYPH_FILE_MAX_GLYPH)
+				break;
+			if (entry->kind == GLYPH_FILE_PIXMAP ? (size_t)entry->size != (size_t)entry->w * entry->h : entry->kind != GLYPH_FILE_RLE || !check_rle_rows(entry))
+				break;
+			return fz_new_glyph_from_mapped_data(ctx, entry->x, entry->y, entry->w, entry->h,
+				data, entry->size, entry->kind == GLYPH_FILE_RLE);
+		}
+	}
+
+	return NULL;
+}
+
+void
+fz_insert_glyph_file(fz_context *ctx, fz_glyph_file *file, const fz_glyph_key *key, fz_glyph *glyph)
+{
+	glyph_file_key fkey;
+	glyph_file_entry *entry;
+	const unsigned char *data;
+	int kind, size, len, used, slot, i;
+	unsigned h;
+
+	if (!file->writable)
+		return;
+	if (glyph->w < 0 || glyph->h < 0 || glyph->w > GLYPH_FILE_MAX_GLYPH || glyph->h > GLYPH_FILE_MAX_GLYPH)
+		return;
+
+	if (glyph->pixmap)
+	{
+		fz_pixmap *pix = glyph->pixmap;
+		if (pix->n != 1 || pix->stride != pix->w)
+			return;
+		kind = GLYPH_FILE_PIXMAP;
+		data = pix->samples;
+		size = pix->w * pix->h;
+	}
+	else
+	{
+		kind = GLYPH_FILE_RLE;
+		data = fz_glyph_data(glyph);
+		size = (int)glyph->size;
+	}
+	len = (sizeof(glyph_file_entry) + size + 7) & ~7;
+
+	if (!make_key(ctx, &fkey, key))
+		return;
+	h = hash_key(&fkey);
+
+	if (lock_file(file->fd, F_WRLCK) < 0)
+		return;
+
+	/* Find a free slot, unless someone has beaten us to it. */
+	slot = -1;
+	for (i = 0; i < GLYPH_FILE_MAX_PROBE; i++)
+	{
+		int s = (h + i) % file->nslots;
+		int offset = file->slots[s];
+		const glyph_file_entry *other;
+
+		if (offset == 0)
+		{
+			slot = s;
+			break;
+		}
+		other = entry_at(file, offset);
+		if (other && !memcmp(&other->key, &fkey, sizeof fkey))
+			break;
+	}
+
+	used = file->header->used;
+	if (slot >= 0 && used >= GLYPH_FILE_TABLE && (used & 7) == 0 && used <= file->size - len)
+	{
+		file->header->used = used + len;
+
+		entry = (glyph_file_entry *)(file->base + used);
+		entry->key = fkey;
+		entry->x = glyph->x;
+		entry->y = glyph->y;
+		entry->w = glyph->w;
+		entry->h = glyph->h;
+		entry->kind = kind;
+		entry->size = size;
+		entry->pad = 0;
+		memcpy(entry + 1, data, size);
+
+		(void)fz_atomic_add(&file->slots[slot], used);
+	}
+
+	unlock_file(file->fd);
+}
+
+#else
+
+fz_glyph_file *
+fz_open_glyph_file(fz_context *ctx, const char *filename, size_t size)
+{
+	fz_throw(ctx, FZ_ERROR_GENERIC, "glyph cache files are not supported on this platform");
+}
+
+void
+fz_drop_glyph_file(fz_context *ctx, fz_glyph_file *file)
+{
+}
+
+fz_glyph *
+fz_lookup_glyph_file(fz_context *ctx, fz_glyph_file *file, const fz_glyph_key *key)
+{
+	return NULL;
+}
+
+void
+fz_insert_glyph_file(fz_context *ctx, fz_glyph_file *file, const fz_glyph_key *key, fz_glyph *glyph)
+{
+}
+
+#endif
@@ -10,6 +10,30 @@
 #include "mupdf/fitz/device.h"
 #include "mupdf/fitz/glyph-cache.h"
 
+typedef struct fz_glyph_key_s fz_glyph_key;
+typedef struct fz_glyph_file_s fz_glyph_file;
+
+struct fz_glyph_key_s
+{
+	fz_font *font;
+	int a, b, c, d;
+	unsigned short gid;
+	unsigned char e, f;
+	int aa;
+};
+
+/*
+	Glyph cache files; see fz_attach_glyph_cache_file. Lookups return
+	NULL on a miss, and inserts silently do nothing if the file is
+	read only or full. Both are called with the glyph cache lock held,
+	which serialises the threads of one process; the file itself is
+	locked to serialise writes from several processes.
+*/
+fz_glyph_file *fz_open_glyph_file(fz_context *ctx, const char *filename, size_t size);
+void fz_drop_glyph_file(fz_context *ctx, fz_glyph_file *file);
+fz_glyph *fz_lookup_glyph_file(fz_context *ctx, fz_glyph_file *file, const fz_glyph_key *key);
+void fz_insert_glyph_file(fz_context *ctx, fz_glyph_file *file, const fz_glyph_key *key, fz_glyph *glyph);
+
 fz_path *fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm);
 fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm);
 fz_glyph *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, const fz_matrix *trm, int aa);
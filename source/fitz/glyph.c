@@ -69,7 +69,8 @@ fz_dump_glyph(fz_glyph *glyph)
 
 	for (y = 0; y < glyph->h; y++)
 	{
-		int offset = ((int *)(glyph->data))[y];
+		const unsigned char *data = fz_glyph_data(glyph);
+		int offset = ((const int *)data)[y];
 		if (offset >= 0)
 		{
 			int extend = 0;
@@ -77,7 +78,7 @@ fz_dump_glyph(fz_glyph *glyph)
 			x = glyph->w;
 			do
 			{
-				int v = glyph->data[offset++];
+				int v = data[offset++];
 				int len;
 				char c;
 				switch(v&3)
@@ -156,6 +157,40 @@ fz_new_glyph_from_pixmap(fz_context *ctx, fz_pixmap *pix)
 	return glyph;
 }
 
+fz_glyph *
+fz_new_glyph_from_mapped_data(fz_context *ctx, int x, int y, int w, int h, const unsigned char *data, size_t size, int rle)
+{
+	fz_glyph *glyph = fz_malloc_struct(ctx, fz_glyph);
+	FZ_INIT_STORABLE(glyph, 1, fz_drop_glyph_imp);
+	glyph->x = x;
+	glyph->y = y;
+	glyph->w = w;
+	glyph->h = h;
+
+	if (rle)
+	{
+		glyph->size = size;
+		glyph->mapped = data;
+		return glyph;
+	}
+
+	fz_try(ctx)
+	{
+		/* The pixmap never writes to, or frees, the samples. */
+		glyph->pixmap = fz_new_pixmap_with_data(ctx, NULL, w, h, 1, w, (unsigned char *)data);
+		glyph->pixmap->x = x;
+		glyph->pixmap->y = y;
+		glyph->size = fz_pixmap_size(ctx, glyph->pixmap);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, glyph);
+		fz_rethrow(ctx);
+	}
+
+	return glyph;
+}
+
 fz_glyph *
 fz_new_glyph_from_8bpp_data(fz_context *ctx, int x, int y, int w, int h, unsigned char *sp, int span)
 {
@@ -184,6 +219,7 @@ fz_new_glyph_from_8bpp_data(fz_context *ctx, int x, int y, int w, int h, unsigne
 		glyph->w = w;
 		glyph->h = h;
 		glyph->pixmap = NULL;
+		glyph->mapped = NULL;
 		if (w == 0 || h == 0)
 		{
 			glyph->size = 0;
@@ -293,6 +329,7 @@ try_pixmap:
 		glyph->h = pix->h;
 		glyph->size = fz_pixmap_size(ctx, pix);
 		glyph->pixmap = pix;
+		glyph->mapped = NULL;
 	}
 	fz_catch(ctx)
 	{
@@ -332,6 +369,7 @@ fz_new_glyph_from_1bpp_data(fz_context *ctx, int x, int y, int w, int h, unsigne
 		glyph->w = w;
 		glyph->h = h;
 		glyph->pixmap = NULL;
+		glyph->mapped = NULL;
 		if (w == 0 || h == 0)
 		{
 			glyph->size = 0;
@@ -425,6 +463,7 @@ try_pixmap:
 		glyph->h = pix->h;
 		glyph->size = fz_pixmap_size(ctx, pix);
 		glyph->pixmap = pix;
+		glyph->mapped = NULL;
 	}
 	fz_catch(ctx)
 	{
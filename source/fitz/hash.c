@@ -144,8 +144,17 @@ do_hash_insert(fz_context *ctx, fz_hash_table *table, const void *key, void *val
 	}
 }
 
+/* Locks at or below the alloc lock in the ordering (the alloc lock itself,
+ * and the store shard locks) cannot be held while we allocate or free. */
+static int
+lock_dropped_for_alloc(int lock)
+{
+	return lock >= 0 && lock <= FZ_LOCK_ALLOC;
+}
+
 /* Entered with the lock taken, held throughout and at exit, UNLESS the lock
- * is the alloc lock in which case it may be momentarily dropped. */
+ * is one that must be dropped around allocations (see above), in which case
+ * it may be momentarily dropped. */
 static void
 fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 {
@@ -161,20 +170,20 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		return;
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (lock_dropped_for_alloc(table->lock))
 		fz_unlock(ctx, table->lock);
 	newents = fz_malloc_array_no_throw(ctx, newsize, sizeof(fz_hash_entry));
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (lock_dropped_for_alloc(table->lock))
 		fz_lock(ctx, table->lock);
 	if (table->lock >= 0)
 	{
 		if (table->size >= newsize)
 		{
 			/* Someone else fixed it before we could lock! */
-			if (table->lock == FZ_LOCK_ALLOC)
+			if (lock_dropped_for_alloc(table->lock))
 				fz_unlock(ctx, table->lock);
 			fz_free(ctx, newents);
-			if (table->lock == FZ_LOCK_ALLOC)
+			if (lock_dropped_for_alloc(table->lock))
 				fz_lock(ctx, table->lock);
 			return;
 		}
@@ -194,10 +203,10 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		}
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (lock_dropped_for_alloc(table->lock))
 		fz_unlock(ctx, table->lock);
 	fz_free(ctx, oldents);
-	if (table->lock == FZ_LOCK_ALLOC)
+	if (lock_dropped_for_alloc(table->lock))
 		fz_lock(ctx, table->lock);
 }
 
@@ -2,6 +2,7 @@
 
 typedef struct fz_display_node_s fz_display_node;
 typedef struct fz_list_device_s fz_list_device;
+typedef struct fz_list_index_s fz_list_index;
 
 #define STACK_SIZE 96
 
@@ -116,6 +117,8 @@ struct fz_display_list_s
 	fz_rect mediabox;
 	int max;
 	int len;
+	int want_index;
+	fz_list_index *index;
 };
 
 struct fz_list_device_s
@@ -142,6 +145,8 @@ struct fz_list_device_s
 
 enum { ISOLATED = 1, KNOCKOUT = 2 };
 
+static void fz_drop_list_index(fz_context *ctx, fz_list_index *idx);
+
 #define SIZE_IN_NODES(t) \
 	((t + sizeof(fz_display_node) - 1) / sizeof(fz_display_node))
 
@@ -1194,6 +1199,15 @@ fz_list_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
 		0); /* private_data_len */
 }
 
+static void
+fz_list_close_device(fz_context *ctx, fz_device *dev)
+{
+	fz_list_device *writer = (fz_list_device *)dev;
+
+	if (writer->list->want_index)
+		fz_index_display_list(ctx, writer->list);
+}
+
 static void
 fz_list_drop_device(fz_context *ctx, fz_device *dev)
 {
@@ -1239,6 +1253,7 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 
 	dev->super.render_flags = fz_list_render_flags;
 
+	dev->super.close_device = fz_list_close_device;
 	dev->super.drop_device = fz_list_drop_device;
 
 	dev->list = list;
@@ -1343,6 +1358,7 @@ fz_drop_display_list_imp(fz_context *ctx, fz_storable *list_)
 
 		node = next;
 	}
+	fz_drop_list_index(ctx, list->index);
 	fz_free(ctx, list->list);
 	fz_free(ctx, list);
 }
@@ -1356,6 +1372,8 @@ fz_new_display_list(fz_context *ctx, const fz_rect *mediabox)
 	list->mediabox = mediabox ? *mediabox : fz_empty_rect;
 	list->max = 0;
 	list->len = 0;
+	list->want_index = 0;
+	list->index = NULL;
 	return list;
 }
 
@@ -1385,329 +1403,1159 @@ int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list)
 	return !list || list->len == 0;
 }
 
-void
-fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
+/* Spatial index.
+ *
+ * Running a list over a small area still has to unpack every node in
+ * order to cull it. For large lists rendered as many small tiles, the
+ * index lets us skip straight to the nodes that can be visible.
+ *
+ * The list is split into containers: the list as a whole, and the body
+ * of each clip, group and mask. A container has an entry for each item
+ * at its top level; either a single node, or a whole bracket from the
+ * opening node to the matching close. Each entry records the bounds of
+ * the item (those of its opening node for brackets, which the list
+ * device has already cut down to the contents), and where to find the
+ * graphics state in force before it, so that we can start running from
+ * it without unpacking everything that went before. Containers with
+ * many entries also carry a grid, mapping each cell to the entries that
+ * overlap it.
+ *
+ * When run, only the entries that may meet the scissor are visited, in
+ * list order, and brackets are descended into when their bodies are
+ * indexed in turn. Every node visited is culled exactly as a full walk
+ * would cull it, so the output is the same either way. Tiles are always
+ * run in full, as is anything in a list that does not nest properly.
+ */
+
+enum
 {
-	fz_display_node *node;
-	fz_display_node *node_end;
-	fz_display_node *next_node;
-	int clipped = 0;
-	int tiled = 0;
-	int progress = 0;
+	INDEX_MIN_ENTRIES = 32,
+	INDEX_MAX_GRID = 256
+};
 
-	/* Current graphics state as unpacked from list */
-	fz_path *path = NULL;
-	float alpha = 1.0f;
-	fz_matrix ctm = fz_identity;
-	fz_stroke_state *stroke = NULL;
-	float color[FZ_MAX_COLORS] = { 0 };
-	fz_colorspace *colorspace = fz_device_gray(ctx);
-	fz_rect rect = { 0 };
+typedef struct fz_list_keys_s fz_list_keys;
+typedef struct fz_list_entry_s fz_list_entry;
+typedef struct fz_list_container_s fz_list_container;
 
-	/* Transformed versions of graphic state entries */
-	fz_rect trans_rect;
-	fz_matrix trans_ctm;
-	int tile_skip_depth = 0;
+/* Offsets (in nodes, from the start of the list) of the data that last
+ * set each part of the graphics state, or -1 for the initial state. cs
+ * and color refer to the node itself, as the data that follows depends
+ * on the header. */
+struct fz_list_keys_s
+{
+	int rect;
+	int cs;
+	int color;
+	int ctm[3];
+	int stroke;
+	int path;
+	float alpha;
+};
 
-	fz_var(colorspace);
+struct fz_list_entry_s
+{
+	int start;
+	int body[2];
+	fz_rect bbox;
+	fz_list_keys keys;
+};
 
-	if (!scissor)
-		scissor = &fz_infinite_rect;
+/* An entry ends where the next one starts, or at the end of the
+ * container. A container with no entries is run in full. */
+struct fz_list_container_s
+{
+	int start;
+	int end;
+	int len;
+	fz_list_entry *entry;
+	fz_list_keys end_keys;
+
+	fz_rect bounds;
+	int gw, gh;
+	float sx, sy;
+	int *cell_start;
+	int *cell;
+	int always_len;
+	int *always;
+};
 
-	if (cookie)
+struct fz_list_index_s
+{
+	int list_len;
+	int root;
+	int len;
+	int max;
+	fz_list_container *container;
+};
+
+enum { FRAME_ROOT, FRAME_CLIP, FRAME_GROUP, FRAME_MASK, FRAME_MASKED };
+
+typedef struct fz_list_frame_s fz_list_frame;
+
+struct fz_list_frame_s
+{
+	int kind;
+	int start;
+	int len;
+	int max;
+	fz_list_entry *entry;
+};
+
+static void
+fz_drop_list_index(fz_context *ctx, fz_list_index *idx)
+{
+	int i;
+
+	if (!idx)
+		return;
+	for (i = 0; i < idx->len; i++)
 	{
-		cookie->progress_max = list->len;
-		cookie->progress = 0;
+		fz_list_container *con = &idx->container[i];
+		fz_free(ctx, con->entry);
+		fz_free(ctx, con->cell_start);
+		fz_free(ctx, con->cell);
+		fz_free(ctx, con->always);
 	}
+	fz_free(ctx, idx->container);
+	fz_free(ctx, idx);
+}
 
-	node = list->list;
-	node_end = &list->list[list->len];
-	for (; node != node_end ; node = next_node)
-	{
-		int empty;
-		fz_display_node n = *node;
+static int
+grid_pos(float v, int n)
+{
+	if (!(v >= 0))
+		return 0;
+	if (v >= n)
+		return n - 1;
+	return (int)v;
+}
 
-		next_node = node + n.size;
+static void
+grid_range(const fz_list_container *con, const fz_rect *r, int *x0, int *y0, int *x1, int *y1)
+{
+	*x0 = grid_pos((r->x0 - con->bounds.x0) * con->sx, con->gw);
+	*y0 = grid_pos((r->y0 - con->bounds.y0) * con->sy, con->gh);
+	*x1 = grid_pos((r->x1 - con->bounds.x0) * con->sx, con->gw);
+	*y1 = grid_pos((r->y1 - con->bounds.y0) * con->sy, con->gh);
+}
 
-		/* Check the cookie for aborting */
-		if (cookie)
+static int
+rects_disjoint(const fz_rect *a, const fz_rect *b)
+{
+	return a->x1 < b->x0 || a->x0 > b->x1 || a->y1 < b->y0 || a->y0 > b->y1;
+}
+
+static void
+build_grid(fz_context *ctx, fz_list_container *con)
+{
+	fz_rect b = fz_empty_rect;
+	int i, x, y, x0, y0, x1, y1;
+	int cells, limit, total, always;
+	int first = 1;
+	float w, h;
+
+	for (i = 0; i < con->len; i++)
+	{
+		fz_rect *r = &con->entry[i].bbox;
+		if (fz_is_infinite_rect(r))
+			continue;
+		if (first)
 		{
-			if (cookie->abort)
-				break;
-			cookie->progress = progress++;
+			b = *r;
+			first = 0;
+		}
+		else
+		{
+			b.x0 = fz_min(b.x0, r->x0);
+			b.y0 = fz_min(b.y0, r->y0);
+			b.x1 = fz_max(b.x1, r->x1);
+			b.y1 = fz_max(b.y1, r->y1);
 		}
+	}
 
-		node++;
-		if (n.rect)
+	/* Aim for a handful of entries per cell. */
+	w = b.x1 - b.x0;
+	h = b.y1 - b.y0;
+	cells = fz_clampi(con->len / 4, 1, INDEX_MAX_GRID * INDEX_MAX_GRID);
+	if (w > 0 && h > 0)
+		con->gw = fz_clampi((int)sqrtf(cells * w / h), 1, INDEX_MAX_GRID);
+	else
+		con->gw = w > 0 ? fz_mini(cells, INDEX_MAX_GRID) : 1;
+	con->gh = fz_clampi(cells / con->gw, 1, INDEX_MAX_GRID);
+	con->bounds = b;
+	con->sx = w > 0 ? con->gw / w : 0;
+	con->sy = h > 0 ? con->gh / h : 0;
+
+	/* Entries that would fill too much of the grid are always visited
+	 * instead. */
+	cells = con->gw * con->gh;
+	limit = fz_maxi(4, cells / 8);
+	con->cell_start = fz_malloc_array(ctx, cells + 1, sizeof(int));
+	memset(con->cell_start, 0, (cells + 1) * sizeof(int));
+	always = 0;
+	for (i = 0; i < con->len; i++)
+	{
+		fz_rect *r = &con->entry[i].bbox;
+		if (fz_is_infinite_rect(r))
 		{
-			rect = *(fz_rect *)node;
-			node += SIZE_IN_NODES(sizeof(fz_rect));
+			always++;
+			continue;
 		}
-		if (n.cs)
+		grid_range(con, r, &x0, &y0, &x1, &y1);
+		if ((x1 - x0 + 1) * (y1 - y0 + 1) > limit)
 		{
-			int i, en;
+			always++;
+			continue;
+		}
+		for (y = y0; y <= y1; y++)
+			for (x = x0; x <= x1; x++)
+				con->cell_start[y * con->gw + x + 1]++;
+	}
+	for (i = 0; i < cells; i++)
+		con->cell_start[i + 1] += con->cell_start[i];
+	total = con->cell_start[cells];
 
-			fz_drop_colorspace(ctx, colorspace);
-			switch (n.cs)
-			{
-			default:
-			case CS_GRAY_0:
-				colorspace = fz_device_gray(ctx);
-				color[0] = 0.0f;
-				break;
-			case CS_GRAY_1:
-				colorspace = fz_device_gray(ctx);
-				color[0] = 1.0f;
-				break;
-			case CS_RGB_0:
-				colorspace = fz_device_rgb(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				break;
-			case CS_RGB_1:
-				colorspace = fz_device_rgb(ctx);
-				color[0] = 1.0f;
-				color[1] = 1.0f;
-				color[2] = 1.0f;
-				break;
-			case CS_CMYK_0:
-				colorspace = fz_device_cmyk(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 0.0f;
-				break;
-			case CS_CMYK_1:
-				colorspace = fz_device_cmyk(ctx);
-				color[0] = 0.0f;
-				color[1] = 0.0f;
-				color[2] = 0.0f;
-				color[3] = 1.0f;
-				break;
-			case CS_OTHER_0:
-				colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
-				node += SIZE_IN_NODES(sizeof(fz_colorspace *));
-				en = fz_colorspace_n(ctx, colorspace);
-				for (i = 0; i < en; i++)
-					color[i] = 0.0f;
-				break;
-			}
+	con->cell = fz_malloc_array(ctx, fz_maxi(total, 1), sizeof(int));
+	con->always = fz_malloc_array(ctx, fz_maxi(always, 1), sizeof(int));
+	for (i = 0; i < con->len; i++)
+	{
+		fz_rect *r = &con->entry[i].bbox;
+		if (fz_is_infinite_rect(r))
+		{
+			con->always[con->always_len++] = i;
+			continue;
 		}
-		if (n.color)
+		grid_range(con, r, &x0, &y0, &x1, &y1);
+		if ((x1 - x0 + 1) * (y1 - y0 + 1) > limit)
 		{
-			int nc = fz_colorspace_n(ctx, colorspace);
-			memcpy(color, (float *)node, nc * sizeof(float));
-			node += SIZE_IN_NODES(nc * sizeof(float));
+			con->always[con->always_len++] = i;
+			continue;
 		}
-		if (n.alpha)
+		for (y = y0; y <= y1; y++)
+			for (x = x0; x <= x1; x++)
+				con->cell[con->cell_start[y * con->gw + x]++] = i;
+	}
+	/* Filling advanced each start to the next; shift them back. */
+	for (i = cells; i > 0; i--)
+		con->cell_start[i] = con->cell_start[i - 1];
+	con->cell_start[0] = 0;
+}
+
+static void
+add_entry(fz_context *ctx, fz_list_frame *f, int start, const fz_rect *bbox, const fz_list_keys *keys)
+{
+	fz_list_entry *e;
+
+	if (f->len == f->max)
+	{
+		int max = f->max ? f->max * 2 : 16;
+		f->entry = fz_resize_array(ctx, f->entry, max, sizeof(*f->entry));
+		f->max = max;
+	}
+	e = &f->entry[f->len++];
+	e->start = start;
+	e->body[0] = -1;
+	e->body[1] = -1;
+	e->bbox = *bbox;
+	e->keys = *keys;
+}
+
+/* Turn a frame into a container. Containers that are small, and have
+ * nothing indexed beneath them, are left to be run in full. */
+static int
+close_frame(fz_context *ctx, fz_list_index *idx, fz_list_frame *f, int end, const fz_list_keys *keys)
+{
+	fz_list_container *con;
+	int i, nested = 0;
+
+	for (i = 0; i < f->len; i++)
+		if (f->entry[i].body[0] >= 0)
+			nested = 1;
+
+	if (idx->len == idx->max)
+	{
+		int max = idx->max ? idx->max * 2 : 16;
+		idx->container = fz_resize_array(ctx, idx->container, max, sizeof(*idx->container));
+		idx->max = max;
+	}
+	con = &idx->container[idx->len++];
+	memset(con, 0, sizeof(*con));
+	con->start = f->start;
+	con->end = end;
+	con->end_keys = *keys;
+	if (nested || f->len >= INDEX_MIN_ENTRIES)
+	{
+		con->len = f->len;
+		con->entry = f->entry;
+		f->entry = NULL;
+	}
+	fz_free(ctx, f->entry);
+	f->entry = NULL;
+	f->len = f->max = 0;
+
+	if (con->len >= INDEX_MIN_ENTRIES)
+		build_grid(ctx, con);
+
+	return idx->len - 1;
+}
+
+static fz_list_index *
+build_list_index(fz_context *ctx, fz_display_list *list)
+{
+	fz_display_node *base = list->list;
+	fz_list_index *idx;
+	fz_list_frame *stack = NULL;
+	fz_list_keys cur, before;
+	fz_rect rect = { 0 };
+	int top = 0, max = 0;
+	int tile_depth = 0;
+	int pos = 0;
+	int nc = 1;
+	int i, id;
+
+	idx = fz_malloc_struct(ctx, fz_list_index);
+	idx->list_len = list->len;
+	idx->root = -1;
+
+	cur.rect = cur.cs = cur.color = -1;
+	cur.ctm[0] = cur.ctm[1] = cur.ctm[2] = -1;
+	cur.stroke = cur.path = -1;
+	cur.alpha = 1;
+
+	fz_var(idx);
+	fz_var(stack);
+	fz_var(top);
+
+	fz_try(ctx)
+	{
+		max = 16;
+		stack = fz_malloc_array(ctx, max, sizeof(*stack));
+		memset(&stack[0], 0, sizeof(*stack));
+		stack[0].kind = FRAME_ROOT;
+		top = 1;
+
+		while (pos < list->len)
 		{
-			switch(n.alpha)
+			fz_display_node n = base[pos];
+			fz_list_frame *f, *parent;
+			int p = pos + 1;
+
+			if (n.size == 0)
+				goto unbalanced;
+
+			/* Follow the state just as fz_run_display_list unpacks it. */
+			before = cur;
+			if (n.rect)
 			{
-			default:
-			case ALPHA_0:
-				alpha = 0.0f;
-				break;
-			case ALPHA_1:
-				alpha = 1.0f;
-				break;
-			case ALPHA_PRESENT:
-				alpha = *(float *)node;
-				node += SIZE_IN_NODES(sizeof(float));
-				break;
+				cur.rect = p;
+				rect = *(fz_rect *)&base[p];
+				p += SIZE_IN_NODES(sizeof(fz_rect));
 			}
-		}
-		if (n.ctm != 0)
-		{
-			float *packed_ctm = (float *)node;
-			if (n.ctm & CTM_CHANGE_AD)
+			if (n.cs)
 			{
-				ctm.a = *packed_ctm++;
-				ctm.d = *packed_ctm++;
-				node += SIZE_IN_NODES(2*sizeof(float));
+				cur.cs = cur.color = pos;
+				switch (n.cs)
+				{
+				default:
+					nc = 1;
+					break;
+				case CS_RGB_0:
+				case CS_RGB_1:
+					nc = 3;
+					break;
+				case CS_CMYK_0:
+				case CS_CMYK_1:
+					nc = 4;
+					break;
+				case CS_OTHER_0:
+					nc = fz_colorspace_n(ctx, *(fz_colorspace **)&base[p]);
+					p += SIZE_IN_NODES(sizeof(fz_colorspace *));
+					break;
+				}
 			}
-			if (n.ctm & CTM_CHANGE_BC)
+			if (n.color)
 			{
-				ctm.b = *packed_ctm++;
-				ctm.c = *packed_ctm++;
-				node += SIZE_IN_NODES(2*sizeof(float));
+				cur.color = pos;
+				p += SIZE_IN_NODES(nc * sizeof(float));
 			}
-			if (n.ctm & CTM_CHANGE_EF)
+			if (n.alpha)
 			{
-				ctm.e = *packed_ctm++;
-				ctm.f = *packed_ctm;
-				node += SIZE_IN_NODES(2*sizeof(float));
+				switch (n.alpha)
+				{
+				default:
+				case ALPHA_0:
+					cur.alpha = 0;
+					break;
+				case ALPHA_1:
+					cur.alpha = 1;
+					break;
+				case ALPHA_PRESENT:
+					cur.alpha = *(float *)&base[p];
+					p += SIZE_IN_NODES(sizeof(float));
+					break;
+				}
 			}
-		}
-		if (n.stroke)
-		{
-			fz_drop_stroke_state(ctx, stroke);
-			stroke = fz_keep_stroke_state(ctx, *(fz_stroke_state **)node);
-			node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
-		}
-		if (n.path)
-		{
-			fz_drop_path(ctx, path);
-			path = fz_keep_path(ctx, (fz_path *)node);
-			node += SIZE_IN_NODES(fz_packed_path_size(path));
-		}
-
-		if (tile_skip_depth > 0)
-		{
-			if (n.cmd == FZ_CMD_BEGIN_TILE)
-				tile_skip_depth++;
-			else if (n.cmd == FZ_CMD_END_TILE)
-				tile_skip_depth--;
-			if (tile_skip_depth > 0)
-				continue;
-		}
-
-		trans_rect = rect;
-		fz_transform_rect(&trans_rect, top_ctm);
-
-		/* cull objects to draw using a quick visibility test */
-
-		if (tiled ||
-			n.cmd == FZ_CMD_BEGIN_TILE || n.cmd == FZ_CMD_END_TILE ||
-			n.cmd == FZ_CMD_RENDER_FLAGS)
-		{
-			empty = 0;
-		}
-		else
-		{
-			fz_rect irect = trans_rect;
-			fz_intersect_rect(&irect, scissor);
-			empty = fz_is_empty_rect(&irect);
-		}
+			for (i = 0; i < 3; i++)
+			{
+				if (n.ctm & (1<<i))
+				{
+					cur.ctm[i] = p;
+					p += SIZE_IN_NODES(2*sizeof(float));
+				}
+			}
+			if (n.stroke)
+			{
+				cur.stroke = p;
+				p += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+			}
+			if (n.path)
+				cur.path = p;
 
-		if (clipped || empty)
-		{
-			switch (n.cmd)
+			if (tile_depth > 0)
 			{
-			case FZ_CMD_CLIP_PATH:
-			case FZ_CMD_CLIP_STROKE_PATH:
-			case FZ_CMD_CLIP_TEXT:
-			case FZ_CMD_CLIP_STROKE_TEXT:
-			case FZ_CMD_CLIP_IMAGE_MASK:
-			case FZ_CMD_BEGIN_MASK:
-			case FZ_CMD_BEGIN_GROUP:
-				clipped++;
-				continue;
-			case FZ_CMD_POP_CLIP:
-			case FZ_CMD_END_GROUP:
-				if (!clipped)
-					goto visible;
-				clipped--;
-				continue;
-			case FZ_CMD_END_MASK:
-				if (!clipped)
-					goto visible;
-				continue;
-			default:
+				if (n.cmd == FZ_CMD_BEGIN_TILE)
+					tile_depth++;
+				else if (n.cmd == FZ_CMD_END_TILE)
+					tile_depth--;
+				pos += n.size;
 				continue;
 			}
-		}
-
-visible:
-		fz_concat(&trans_ctm, &ctm, top_ctm);
 
-		fz_try(ctx)
-		{
+			f = &stack[top-1];
+			parent = top > 1 ? &stack[top-2] : NULL;
 			switch (n.cmd)
 			{
-			case FZ_CMD_FILL_PATH:
-				fz_fill_path(ctx, dev, path, n.flags, &trans_ctm, colorspace, color, alpha);
-				break;
-			case FZ_CMD_STROKE_PATH:
-				fz_stroke_path(ctx, dev, path, stroke, &trans_ctm, colorspace, color, alpha);
-				break;
 			case FZ_CMD_CLIP_PATH:
-				fz_clip_path(ctx, dev, path, n.flags, &trans_ctm, &trans_rect);
-				break;
 			case FZ_CMD_CLIP_STROKE_PATH:
-				fz_clip_stroke_path(ctx, dev, path, stroke, &trans_ctm, &trans_rect);
-				break;
-			case FZ_CMD_FILL_TEXT:
-				fz_fill_text(ctx, dev, *(fz_text **)node, &trans_ctm, colorspace, color, alpha);
-				break;
-			case FZ_CMD_STROKE_TEXT:
-				fz_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm, colorspace, color, alpha);
-				break;
 			case FZ_CMD_CLIP_TEXT:
-				fz_clip_text(ctx, dev, *(fz_text **)node, &trans_ctm, &trans_rect);
-				break;
 			case FZ_CMD_CLIP_STROKE_TEXT:
-				fz_clip_stroke_text(ctx, dev, *(fz_text **)node, stroke, &trans_ctm, &trans_rect);
-				break;
-			case FZ_CMD_IGNORE_TEXT:
-				fz_ignore_text(ctx, dev, *(fz_text **)node, &trans_ctm);
-				break;
-			case FZ_CMD_FILL_SHADE:
-				if ((dev->hints & FZ_IGNORE_SHADE) == 0)
-					fz_fill_shade(ctx, dev, *(fz_shade **)node, &trans_ctm, alpha);
-				break;
-			case FZ_CMD_FILL_IMAGE:
-				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_fill_image(ctx, dev, *(fz_image **)node, &trans_ctm, alpha);
-				break;
-			case FZ_CMD_FILL_IMAGE_MASK:
-				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_fill_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, colorspace, color, alpha);
-				break;
 			case FZ_CMD_CLIP_IMAGE_MASK:
-				if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
-					fz_clip_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, &trans_rect);
-				break;
-			case FZ_CMD_POP_CLIP:
-				fz_pop_clip(ctx, dev);
-				break;
+			case FZ_CMD_BEGIN_GROUP:
 			case FZ_CMD_BEGIN_MASK:
-				fz_begin_mask(ctx, dev, &trans_rect, n.flags, colorspace, color);
+				add_entry(ctx, f, pos, &rect, &before);
+				if (top == max)
+				{
+					stack = fz_resize_array(ctx, stack, max * 2, sizeof(*stack));
+					max *= 2;
+				}
+				f = &stack[top++];
+				memset(f, 0, sizeof(*f));
+				f->kind = n.cmd == FZ_CMD_BEGIN_GROUP ? FRAME_GROUP : n.cmd == FZ_CMD_BEGIN_MASK ? FRAME_MASK : FRAME_CLIP;
+				f->start = pos + n.size;
 				break;
 			case FZ_CMD_END_MASK:
-				fz_end_mask(ctx, dev);
-				break;
-			case FZ_CMD_BEGIN_GROUP:
-				fz_begin_group(ctx, dev, &trans_rect, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), alpha);
+				if (f->kind != FRAME_MASK)
+					goto unbalanced;
+				parent->entry[parent->len-1].body[0] = close_frame(ctx, idx, f, pos, &before);
+				f->kind = FRAME_MASKED;
+				f->start = pos + n.size;
 				break;
+			case FZ_CMD_POP_CLIP:
 			case FZ_CMD_END_GROUP:
-				fz_end_group(ctx, dev);
+				if (n.cmd == FZ_CMD_END_GROUP ? f->kind != FRAME_GROUP : f->kind != FRAME_CLIP && f->kind != FRAME_MASKED)
+					goto unbalanced;
+				id = close_frame(ctx, idx, f, pos, &before);
+				top--;
+				if (f->kind == FRAME_MASKED)
+				{
+					int *body = parent->entry[parent->len-1].body;
+					if (idx->container[body[0]].len == 0 && idx->container[id].len == 0)
+					{
+						/* Neither part is indexed; we know they
+						 * are the last two containers. */
+						idx->len -= 2;
+						body[0] = -1;
+					}
+					else
+						body[1] = id;
+				}
+				else if (idx->container[id].len == 0)
+					idx->len--;
+				else
+					parent->entry[parent->len-1].body[0] = id;
 				break;
 			case FZ_CMD_BEGIN_TILE:
-			{
-				int cached;
-				fz_list_tile_data *data = (fz_list_tile_data *)node;
-				fz_rect tile_rect;
-				tiled++;
-				tile_rect = data->view;
-				cached = fz_begin_tile_id(ctx, dev, &rect, &tile_rect, data->xstep, data->ystep, &trans_ctm, n.flags);
-				if (cached)
-					tile_skip_depth = 1;
+				add_entry(ctx, f, pos, &fz_infinite_rect, &before);
+				tile_depth = 1;
 				break;
-			}
 			case FZ_CMD_END_TILE:
-				tiled--;
-				fz_end_tile(ctx, dev);
-				break;
+				goto unbalanced;
 			case FZ_CMD_RENDER_FLAGS:
-				if (n.flags == 0)
-					fz_render_flags(ctx, dev, 0, FZ_DEVFLAG_GRIDFIT_AS_TILED);
-				else if (n.flags == 1)
-					fz_render_flags(ctx, dev, FZ_DEVFLAG_GRIDFIT_AS_TILED, 0);
+				add_entry(ctx, f, pos, &fz_infinite_rect, &before);
+				break;
+			default:
+				add_entry(ctx, f, pos, &rect, &before);
 				break;
 			}
+			pos += n.size;
 		}
-		fz_catch(ctx)
+
+		if (top != 1 || tile_depth != 0 || pos != list->len)
 		{
-			/* Swallow the error */
-			if (cookie)
-				cookie->errors++;
-			if (fz_caught(ctx) == FZ_ERROR_ABORT)
-				break;
-			fz_warn(ctx, "Ignoring error during interpretation");
+unbalanced:
+			fz_drop_list_index(ctx, idx);
+			idx = NULL;
+		}
+		else
+		{
+			id = close_frame(ctx, idx, &stack[0], list->len, &cur);
+			top = 0;
+			if (idx->container[id].len == 0)
+			{
+				/* Too small to be worth indexing. */
+				fz_drop_list_index(ctx, idx);
+				idx = NULL;
+			}
+			else
+				idx->root = id;
+		}
+	}
+	fz_always(ctx)
+	{
+		while (top > 0)
+			fz_free(ctx, stack[--top].entry);
+		fz_free(ctx, stack);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_list_index(ctx, idx);
+		fz_rethrow(ctx);
+	}
+
+	return idx;
+}
+
+void
+fz_index_display_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_list_index *idx;
+
+	list->want_index = 1;
+	if (list->len == 0 || (list->index && list->index->list_len == list->len))
+		return;
+
+	fz_try(ctx)
+		idx = build_list_index(ctx, list);
+	fz_catch(ctx)
+	{
+		fz_rethrow_if(ctx, FZ_ERROR_ABORT);
+		fz_warn(ctx, "cannot index display list");
+		return;
+	}
+	fz_drop_list_index(ctx, list->index);
+	list->index = idx;
+}
+
+typedef struct fz_list_runner_s fz_list_runner;
+
+struct fz_list_runner_s
+{
+	fz_device *dev;
+	const fz_matrix *top_ctm;
+	const fz_rect *scissor;
+	fz_cookie *cookie;
+	int strict;
+	int clipped;
+	int tiled;
+	int tile_skip_depth;
+	int progress;
+
+	/* Area of the list to visit when using the index. */
+	fz_rect area;
+
+	/* Node at which the state below is correct. */
+	int pos;
+
+	/* Current graphics state as unpacked from list */
+	fz_path *path;
+	float alpha;
+	fz_matrix ctm;
+	fz_stroke_state *stroke;
+	float color[FZ_MAX_COLORS];
+	fz_colorspace *colorspace;
+	fz_rect rect;
+};
+
+static void
+unpack_colorspace(fz_context *ctx, fz_list_runner *r, int cs, fz_display_node *node)
+{
+	float *color = r->color;
+	int i, en;
+
+	fz_drop_colorspace(ctx, r->colorspace);
+	switch (cs)
+	{
+	default:
+	case CS_GRAY_0:
+		r->colorspace = fz_device_gray(ctx);
+		color[0] = 0.0f;
+		break;
+	case CS_GRAY_1:
+		r->colorspace = fz_device_gray(ctx);
+		color[0] = 1.0f;
+		break;
+	case CS_RGB_0:
+		r->colorspace = fz_device_rgb(ctx);
+		color[0] = 0.0f;
+		color[1] = 0.0f;
+		color[2] = 0.0f;
+		break;
+	case CS_RGB_1:
+		r->colorspace = fz_device_rgb(ctx);
+		color[0] = 1.0f;
+		color[1] = 1.0f;
+		color[2] = 1.0f;
+		break;
+	case CS_CMYK_0:
+		r->colorspace = fz_device_cmyk(ctx);
+		color[0] = 0.0f;
+		color[1] = 0.0f;
+		color[2] = 0.0f;
+		color[3] = 0.0f;
+		break;
+	case CS_CMYK_1:
+		r->colorspace = fz_device_cmyk(ctx);
+		color[0] = 0.0f;
+		color[1] = 0.0f;
+		color[2] = 0.0f;
+		color[3] = 1.0f;
+		break;
+	case CS_OTHER_0:
+		r->colorspace = fz_keep_colorspace(ctx, *(fz_colorspace **)(node));
+		en = fz_colorspace_n(ctx, r->colorspace);
+		for (i = 0; i < en; i++)
+			color[i] = 0.0f;
+		break;
+	}
+}
+
+/* Set the graphics state to that in force at an entry, without
+ * unpacking the nodes in between. */
+static void
+restore_state(fz_context *ctx, fz_display_list *list, fz_list_runner *r, const fz_list_keys *k)
+{
+	fz_display_node *base = list->list;
+	fz_display_node n;
+	int p;
+
+	r->rect = k->rect < 0 ? fz_empty_rect : *(fz_rect *)&base[k->rect];
+
+	if (k->cs < 0)
+	{
+		fz_drop_colorspace(ctx, r->colorspace);
+		r->colorspace = fz_device_gray(ctx);
+		memset(r->color, 0, sizeof(r->color));
+	}
+	else
+	{
+		n = base[k->cs];
+		p = k->cs + 1 + (n.rect ? SIZE_IN_NODES(sizeof(fz_rect)) : 0);
+		unpack_colorspace(ctx, r, n.cs, &base[p]);
+	}
+	if (k->color >= 0)
+	{
+		n = base[k->color];
+		if (n.color)
+		{
+			p = k->color + 1 + (n.rect ? SIZE_IN_NODES(sizeof(fz_rect)) : 0);
+			if (n.cs == CS_OTHER_0)
+				p += SIZE_IN_NODES(sizeof(fz_colorspace *));
+			memcpy(r->color, &base[p], fz_colorspace_n(ctx, r->colorspace) * sizeof(float));
+		}
+	}
+
+	r->alpha = k->alpha;
+
+	r->ctm = fz_identity;
+	if (k->ctm[0] >= 0)
+	{
+		r->ctm.a = ((float *)&base[k->ctm[0]])[0];
+		r->ctm.d = ((float *)&base[k->ctm[0]])[1];
+	}
+	if (k->ctm[1] >= 0)
+	{
+		r->ctm.b = ((float *)&base[k->ctm[1]])[0];
+		r->ctm.c = ((float *)&base[k->ctm[1]])[1];
+	}
+	if (k->ctm[2] >= 0)
+	{
+		r->ctm.e = ((float *)&base[k->ctm[2]])[0];
+		r->ctm.f = ((float *)&base[k->ctm[2]])[1];
+	}
+
+	fz_drop_stroke_state(ctx, r->stroke);
+	r->stroke = k->stroke < 0 ? NULL : fz_keep_stroke_state(ctx, *(fz_stroke_state **)&base[k->stroke]);
+
+	fz_drop_path(ctx, r->path);
+	r->path = k->path < 0 ? NULL : fz_keep_path(ctx, (fz_path *)&base[k->path]);
+}
+
+/* Unpack and run a single node. Returns non-zero if the run should
+ * stop. */
+static int
+run_node(fz_context *ctx, fz_display_list *list, fz_list_runner *r, int pos)
+{
+	fz_display_node *node = &list->list[pos];
+	fz_device *dev = r->dev;
+	fz_display_node n = *node;
+	fz_rect trans_rect;
+	fz_matrix trans_ctm;
+	int empty;
+
+	r->pos = pos + n.size;
+
+	/* Check the cookie for aborting */
+	if (r->cookie)
+	{
+		if (r->cookie->abort)
+			return 1;
+		r->cookie->progress = r->progress++;
+	}
+
+	node++;
+	if (n.rect)
+	{
+		r->rect = *(fz_rect *)node;
+		node += SIZE_IN_NODES(sizeof(fz_rect));
+	}
+	if (n.cs)
+	{
+		unpack_colorspace(ctx, r, n.cs, node);
+		if (n.cs == CS_OTHER_0)
+			node += SIZE_IN_NODES(sizeof(fz_colorspace *));
+	}
+	if (n.color)
+	{
+		int nc = fz_colorspace_n(ctx, r->colorspace);
+		memcpy(r->color, (float *)node, nc * sizeof(float));
+		node += SIZE_IN_NODES(nc * sizeof(float));
+	}
+	if (n.alpha)
+	{
+		switch(n.alpha)
+		{
+		default:
+		case ALPHA_0:
+			r->alpha = 0.0f;
+			break;
+		case ALPHA_1:
+			r->alpha = 1.0f;
+			break;
+		case ALPHA_PRESENT:
+			r->alpha = *(float *)node;
+			node += SIZE_IN_NODES(sizeof(float));
+			break;
+		}
+	}
+	if (n.ctm != 0)
+	{
+		float *packed_ctm = (float *)node;
+		if (n.ctm & CTM_CHANGE_AD)
+		{
+			r->ctm.a = *packed_ctm++;
+			r->ctm.d = *packed_ctm++;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (n.ctm & CTM_CHANGE_BC)
+		{
+			r->ctm.b = *packed_ctm++;
+			r->ctm.c = *packed_ctm++;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+		if (n.ctm & CTM_CHANGE_EF)
+		{
+			r->ctm.e = *packed_ctm++;
+			r->ctm.f = *packed_ctm;
+			node += SIZE_IN_NODES(2*sizeof(float));
+		}
+	}
+	if (n.stroke)
+	{
+		fz_drop_stroke_state(ctx, r->stroke);
+		r->stroke = fz_keep_stroke_state(ctx, *(fz_stroke_state **)node);
+		node += SIZE_IN_NODES(sizeof(fz_stroke_state *));
+	}
+	if (n.path)
+	{
+		fz_drop_path(ctx, r->path);
+		r->path = fz_keep_path(ctx, (fz_path *)node);
+		node += SIZE_IN_NODES(fz_packed_path_size(r->path));
+	}
+
+	if (r->tile_skip_depth > 0)
+	{
+		if (n.cmd == FZ_CMD_BEGIN_TILE)
+			r->tile_skip_depth++;
+		else if (n.cmd == FZ_CMD_END_TILE)
+			r->tile_skip_depth--;
+		if (r->tile_skip_depth > 0)
+			return 0;
+	}
+
+	trans_rect = r->rect;
+	fz_transform_rect(&trans_rect, r->top_ctm);
+
+	/* cull objects to draw using a quick visibility test */
+
+	if (r->tiled || r->strict ||
+		n.cmd == FZ_CMD_BEGIN_TILE || n.cmd == FZ_CMD_END_TILE ||
+		n.cmd == FZ_CMD_RENDER_FLAGS)
+	{
+		empty = 0;
+	}
+	else
+	{
+		fz_rect irect = trans_rect;
+		fz_intersect_rect(&irect, r->scissor);
+		empty = fz_is_empty_rect(&irect);
+	}
+
+	if (r->clipped || empty)
+	{
+		switch (n.cmd)
+		{
+		case FZ_CMD_CLIP_PATH:
+		case FZ_CMD_CLIP_STROKE_PATH:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_CLIP_IMAGE_MASK:
+		case FZ_CMD_BEGIN_MASK:
+		case FZ_CMD_BEGIN_GROUP:
+			r->clipped++;
+			return 0;
+		case FZ_CMD_POP_CLIP:
+		case FZ_CMD_END_GROUP:
+			if (!r->clipped)
+				goto visible;
+			r->clipped--;
+			return 0;
+		case FZ_CMD_END_MASK:
+			if (!r->clipped)
+				goto visible;
+			return 0;
+		default:
+			return 0;
+		}
+	}
+
+visible:
+	fz_concat(&trans_ctm, &r->ctm, r->top_ctm);
+
+	fz_try(ctx)
+	{
+		switch (n.cmd)
+		{
+		case FZ_CMD_FILL_PATH:
+			fz_fill_path(ctx, dev, r->path, n.flags, &trans_ctm, r->colorspace, r->color, r->alpha);
+			break;
+		case FZ_CMD_STROKE_PATH:
+			fz_stroke_path(ctx, dev, r->path, r->stroke, &trans_ctm, r->colorspace, r->color, r->alpha);
+			break;
+		case FZ_CMD_CLIP_PATH:
+			fz_clip_path(ctx, dev, r->path, n.flags, &trans_ctm, &trans_rect);
+			break;
+		case FZ_CMD_CLIP_STROKE_PATH:
+			fz_clip_stroke_path(ctx, dev, r->path, r->stroke, &trans_ctm, &trans_rect);
+			break;
+		case FZ_CMD_FILL_TEXT:
+			fz_fill_text(ctx, dev, *(fz_text **)node, &trans_ctm, r->colorspace, r->color, r->alpha);
+			break;
+		case FZ_CMD_STROKE_TEXT:
+			fz_stroke_text(ctx, dev, *(fz_text **)node, r->stroke, &trans_ctm, r->colorspace, r->color, r->alpha);
+			break;
+		case FZ_CMD_CLIP_TEXT:
+			fz_clip_text(ctx, dev, *(fz_text **)node, &trans_ctm, &trans_rect);
+			break;
+		case FZ_CMD_CLIP_STROKE_TEXT:
+			fz_clip_stroke_text(ctx, dev, *(fz_text **)node, r->stroke, &trans_ctm, &trans_rect);
+			break;
+		case FZ_CMD_IGNORE_TEXT:
+			fz_ignore_text(ctx, dev, *(fz_text **)node, &trans_ctm);
+			break;
+		case FZ_CMD_FILL_SHADE:
+			if ((dev->hints & FZ_IGNORE_SHADE) == 0)
+				fz_fill_shade(ctx, dev, *(fz_shade **)node, &trans_ctm, r->alpha);
+			break;
+		case FZ_CMD_FILL_IMAGE:
+			if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
+				fz_fill_image(ctx, dev, *(fz_image **)node, &trans_ctm, r->alpha);
+			break;
+		case FZ_CMD_FILL_IMAGE_MASK:
+			if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
+				fz_fill_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, r->colorspace, r->color, r->alpha);
+			break;
+		case FZ_CMD_CLIP_IMAGE_MASK:
+			if ((dev->hints & FZ_IGNORE_IMAGE) == 0)
+				fz_clip_image_mask(ctx, dev, *(fz_image **)node, &trans_ctm, &trans_rect);
+			break;
+		case FZ_CMD_POP_CLIP:
+			fz_pop_clip(ctx, dev);
+			break;
+		case FZ_CMD_BEGIN_MASK:
+			fz_begin_mask(ctx, dev, &trans_rect, n.flags, r->colorspace, r->color);
+			break;
+		case FZ_CMD_END_MASK:
+			fz_end_mask(ctx, dev);
+			break;
+		case FZ_CMD_BEGIN_GROUP:
+			fz_begin_group(ctx, dev, &trans_rect, (n.flags & ISOLATED) != 0, (n.flags & KNOCKOUT) != 0, (n.flags>>2), r->alpha);
+			break;
+		case FZ_CMD_END_GROUP:
+			fz_end_group(ctx, dev);
+			break;
+		case FZ_CMD_BEGIN_TILE:
+		{
+			int cached;
+			fz_list_tile_data *data = (fz_list_tile_data *)node;
+			fz_rect tile_rect;
+			r->tiled++;
+			tile_rect = data->view;
+			cached = fz_begin_tile_id(ctx, dev, &r->rect, &tile_rect, data->xstep, data->ystep, &trans_ctm, n.flags);
+			if (cached)
+				r->tile_skip_depth = 1;
+			break;
 		}
+		case FZ_CMD_END_TILE:
+			r->tiled--;
+			fz_end_tile(ctx, dev);
+			break;
+		case FZ_CMD_RENDER_FLAGS:
+			if (n.flags == 0)
+				fz_render_flags(ctx, dev, 0, FZ_DEVFLAG_GRIDFIT_AS_TILED);
+			else if (n.flags == 1)
+				fz_render_flags(ctx, dev, FZ_DEVFLAG_GRIDFIT_AS_TILED, 0);
+			break;
+		}
+	}
+	fz_catch(ctx)
+	{
+		if (r->strict)
+			fz_rethrow(ctx);
+		/* Swallow the error */
+		if (r->cookie)
+			r->cookie->errors++;
+		if (fz_caught(ctx) == FZ_ERROR_ABORT)
+			return 1;
+		fz_warn(ctx, "Ignoring error during interpretation");
+	}
+	return 0;
+}
+
+static int
+run_nodes(fz_context *ctx, fz_display_list *list, fz_list_runner *r, int pos, int end)
+{
+	while (pos < end)
+	{
+		int size = list->list[pos].size;
+		if (run_node(ctx, list, r, pos))
+			return 1;
+		pos += size;
 	}
-	fz_drop_colorspace(ctx, colorspace);
-	fz_drop_stroke_state(ctx, stroke);
-	fz_drop_path(ctx, path);
+	return 0;
+}
+
+static int cmp_int(const void *a_, const void *b_)
+{
+	return *(const int *)a_ - *(const int *)b_;
+}
+
+/* Find the entries of a container that may meet the area being run, in
+ * list order. Returns -1 if so much of the container is covered that
+ * visiting every entry is cheaper. */
+static int
+query_grid(fz_context *ctx, const fz_list_container *con, const fz_rect *area, int **hitsp)
+{
+	int y, x0, y0, x1, y1, i, j, n;
+	int *hits;
+
+	if (con->gw == 0)
+		return -1;
+
+	n = con->always_len;
+	if (!rects_disjoint(&con->bounds, area))
+	{
+		grid_range(con, area, &x0, &y0, &x1, &y1);
+		if ((x1 - x0 + 1) * (y1 - y0 + 1) * 2 > con->gw * con->gh)
+			return -1;
+		for (y = y0; y <= y1; y++)
+			n += con->cell_start[y * con->gw + x1 + 1] - con->cell_start[y * con->gw + x0];
+	}
+	else
+		x0 = y0 = 0, x1 = y1 = -1;
+
+	hits = *hitsp = fz_malloc_array(ctx, fz_maxi(n, 1), sizeof(int));
+	memcpy(hits, con->always, con->always_len * sizeof(int));
+	n = con->always_len;
+	for (y = y0; y <= y1; y++)
+	{
+		int *cell = &con->cell[con->cell_start[y * con->gw + x0]];
+		int *cell_end = &con->cell[con->cell_start[y * con->gw + x1 + 1]];
+		for (; cell < cell_end; cell++)
+			if (!rects_disjoint(&con->entry[*cell].bbox, area))
+				hits[n++] = *cell;
+	}
+
+	/* Entries spanning several cells are found more than once. */
+	qsort(hits, n, sizeof(int), cmp_int);
+	for (i = j = 0; i < n; i++)
+		if (j == 0 || hits[j-1] != hits[i])
+			hits[j++] = hits[i];
+	return j;
+}
+
+static int run_container(fz_context *ctx, fz_display_list *list, fz_list_runner *r, int c);
+
+static int
+run_entry(fz_context *ctx, fz_display_list *list, fz_list_runner *r, const fz_list_container *con, int i)
+{
+	const fz_list_entry *e = &con->entry[i];
+	int end = i + 1 < con->len ? con->entry[i+1].start : con->end;
+	int clipped = r->clipped;
+	int k;
+
+	if (e->body[0] < 0)
+		return run_nodes(ctx, list, r, e->start, end);
+
+	/* If the opening node is culled, so is everything up to the
+	 * matching close. */
+	if (run_node(ctx, list, r, e->start))
+		return 1;
+	if (r->clipped != clipped)
+	{
+		r->clipped = clipped;
+		return 0;
+	}
+
+	/* Masks have two bodies, separated by the end of the mask. */
+	for (k = 0; k < 2 && e->body[k] >= 0; k++)
+	{
+		if (run_container(ctx, list, r, e->body[k]))
+			return 1;
+		if (run_node(ctx, list, r, list->index->container[e->body[k]].end))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+run_container(fz_context *ctx, fz_display_list *list, fz_list_runner *r, int c)
+{
+	const fz_list_container *con = &list->index->container[c];
+	int *hits = NULL;
+	int i, n, stop = 0;
+
+	if (con->len == 0)
+		return run_nodes(ctx, list, r, con->start, con->end);
+
+	n = query_grid(ctx, con, &r->area, &hits);
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < (n < 0 ? con->len : n) && !stop; i++)
+		{
+			int k = n < 0 ? i : hits[i];
+			if (r->pos != con->entry[k].start)
+				restore_state(ctx, list, r, &con->entry[k].keys);
+			stop = run_entry(ctx, list, r, con, k);
+		}
+		if (!stop && r->pos != con->end)
+			restore_state(ctx, list, r, &con->end_keys);
+	}
+	fz_always(ctx)
+		fz_free(ctx, hits);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return stop;
+}
+
+/* The index can only be used when the scissor maps back to a rectangle
+ * in the list's own space. */
+static int
+index_area(fz_display_list *list, const fz_matrix *ctm, const fz_rect *scissor, fz_rect *area)
+{
+	fz_matrix inv;
+	float ex, ey;
+
+	if (!list->index || list->index->list_len != list->len)
+		return 0;
+	if (fz_is_infinite_rect(scissor))
+		return 0;
+	if (!(fabsf(ctm->b) < FLT_EPSILON && fabsf(ctm->c) < FLT_EPSILON) &&
+		!(fabsf(ctm->a) < FLT_EPSILON && fabsf(ctm->d) < FLT_EPSILON))
+		return 0;
+	if (fz_try_invert_matrix(&inv, ctm))
+		return 0;
+
+	/* Be generous; every node visited is culled exactly anyway. */
+	*area = *scissor;
+	area->x0 -= 1;
+	area->y0 -= 1;
+	area->x1 += 1;
+	area->y1 += 1;
+	fz_transform_rect(area, &inv);
+	ex = (fabsf(area->x0) + fabsf(area->x1)) * 1e-5f;
+	ey = (fabsf(area->y0) + fabsf(area->y1)) * 1e-5f;
+	area->x0 -= ex;
+	area->y0 -= ey;
+	area->x1 += ex;
+	area->y1 += ey;
+	return 1;
+}
+
+static void
+fz_run_display_list_imp(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie, int strict)
+{
+	fz_list_runner r = { 0 };
+	int use_index;
+
+	if (!scissor)
+		scissor = &fz_infinite_rect;
+
+	r.dev = dev;
+	r.top_ctm = top_ctm;
+	r.scissor = scissor;
+	r.cookie = cookie;
+	r.strict = strict;
+	r.alpha = 1.0f;
+	r.ctm = fz_identity;
+	r.colorspace = fz_device_gray(ctx);
+
+	use_index = !strict && index_area(list, top_ctm, scissor, &r.area);
+
+	if (cookie)
+	{
+		cookie->progress_max = list->len;
+		cookie->progress = 0;
+	}
+
+	fz_try(ctx)
+	{
+		if (use_index)
+			run_container(ctx, list, &r, list->index->root);
+		else
+			run_nodes(ctx, list, &r, 0, list->len);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_colorspace(ctx, r.colorspace);
+		fz_drop_stroke_state(ctx, r.stroke);
+		fz_drop_path(ctx, r.path);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+void
+fz_run_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
+{
+	fz_run_display_list_imp(ctx, list, dev, top_ctm, scissor, cookie, 0);
+}
+
+/* Run every node in the list through the device, without culling, and
+ * without swallowing errors. Used when copying a list elsewhere. */
+void
+fz_replay_display_list(fz_context *ctx, fz_display_list *list, fz_device *dev)
+{
+	fz_run_display_list_imp(ctx, list, dev, &fz_identity, NULL, NULL, 1);
 }
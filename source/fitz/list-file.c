@@ -0,0 +1,2423 @@
+#include "fitz-imp.h"
+#include "colorspace-imp.h"
+#include "font-imp.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <zlib.h>
+
+/*
+	Display list files.
+
+	A saved display list is the sequence of device calls that running
+	the list produces, written as a stream of records:
+
+		"MUDL" version
+		mediabox record* END
+
+	Each record starts with an opcode byte. Resource definitions
+	(colorspaces, fonts, images, shades, stroke states and texts) are
+	written once, immediately before the first record that uses them,
+	and are referred to afterwards by their index in the table of
+	resources of that type. Drawing records carry a byte of flags
+	saying which parts of the graphics state (ctm, colorspace, color,
+	alpha, stroke state, scissor and path) follow, and the rest of the
+	state is carried over from the previous record.
+
+	Numbers are written as LEB128 varints (zigzag encoded when signed)
+	and floats as little endian IEEE singles.
+
+	Images are written as self contained blobs that are identified by
+	the MD5 digest of their contents. A blob can either be embedded in
+	the file, or kept elsewhere (shared between many files) by the
+	caller, in which case only the digest is written.
+
+	Type 3 fonts are written with the display lists of their glyphs.
+	Colorspaces other than the device, Lab and Indexed ones carry
+	callbacks into the interpreter (e.g. Separation tint transforms),
+	so they are sampled into a grid of RGB values and approximated
+	by interpolation when loaded. The grid has at most MAX_SAMPLES
+	points, which gives 256 per axis for one or two components, 40
+	for three and 16 for four. Smooth tint transforms come back to
+	within a level or so; sharp bends in them can be off by a few.
+*/
+
+enum
+{
+	DL_END = 0,
+
+	DL_DEF_COLORSPACE,
+	DL_DEF_FONT,
+	DL_DEF_IMAGE,
+	DL_DEF_SHADE,
+	DL_DEF_STROKE,
+	DL_DEF_TEXT,
+
+	DL_FILL_PATH,
+	DL_STROKE_PATH,
+	DL_CLIP_PATH,
+	DL_CLIP_STROKE_PATH,
+	DL_FILL_TEXT,
+	DL_STROKE_TEXT,
+	DL_CLIP_TEXT,
+	DL_CLIP_STROKE_TEXT,
+	DL_IGNORE_TEXT,
+	DL_FILL_SHADE,
+	DL_FILL_IMAGE,
+	DL_FILL_IMAGE_MASK,
+	DL_CLIP_IMAGE_MASK,
+	DL_POP_CLIP,
+	DL_BEGIN_MASK,
+	DL_END_MASK,
+	DL_BEGIN_GROUP,
+	DL_END_GROUP,
+	DL_BEGIN_TILE,
+	DL_END_TILE,
+	DL_RENDER_FLAGS,
+
+	/* Only found in image blobs */
+	DL_IMAGE
+};
+
+enum
+{
+	CHANGE_CTM = 1,
+	CHANGE_COLORSPACE = 2,
+	CHANGE_COLOR = 4,
+	CHANGE_ALPHA = 8,
+	CHANGE_STROKE = 16,
+	CHANGE_PATH = 32,
+	HAS_SCISSOR = 64
+};
+
+enum
+{
+	PATH_END = 0,
+	PATH_MOVETO,
+	PATH_LINETO,
+	PATH_CURVETO,
+	PATH_QUADTO,
+	PATH_RECTTO,
+	PATH_CLOSE
+};
+
+enum
+{
+	RES_COLORSPACE,
+	RES_FONT,
+	RES_IMAGE,
+	RES_SHADE,
+	RES_STROKE,
+	RES_TEXT,
+	RES_MAX
+};
+
+enum
+{
+	CS_GRAY,
+	CS_RGB,
+	CS_BGR,
+	CS_CMYK,
+	CS_LAB,
+	CS_INDEXED,
+	CS_SAMPLED
+};
+
+enum
+{
+	FONT_FREETYPE,
+	FONT_TYPE3
+};
+
+enum
+{
+	IMAGE_COMPRESSED,
+	IMAGE_PIXMAP
+};
+
+enum
+{
+	DL_VERSION = 1,
+	MAX_NESTING = 32,
+	MAX_SAMPLED_N = 8,
+	MAX_SAMPLES = 65536
+};
+
+static const char dl_magic[4] = { 'M', 'U', 'D', 'L' };
+
+/*
+ * Writing
+ */
+
+typedef struct fz_list_writer_s fz_list_writer;
+typedef struct fz_list_writer_device_s fz_list_writer_device;
+
+struct fz_list_writer_s
+{
+	fz_output *out;
+	fz_hash_table *resources; /* pointer -> index + 1 */
+	fz_hash_table *digests; /* image digest -> index + 1 */
+	int count[RES_MAX];
+	fz_display_list_put_image_fn *put_image;
+	void *arg;
+	int depth;
+	fz_font *fonts[MAX_NESTING]; /* type 3 fonts being written */
+};
+
+struct fz_list_writer_device_s
+{
+	fz_device super;
+	fz_list_writer *wri;
+	fz_matrix ctm;
+	fz_colorspace *colorspace;
+	float color[FZ_MAX_COLORS];
+	float alpha;
+	const fz_stroke_state *stroke;
+	const fz_path *path;
+};
+
+static void
+write_uint(fz_context *ctx, fz_output *out, unsigned int x)
+{
+	while (x >= 0x80)
+	{
+		fz_write_byte(ctx, out, (x & 0x7f) | 0x80);
+		x >>= 7;
+	}
+	fz_write_byte(ctx, out, x);
+}
+
+static void
+write_int(fz_context *ctx, fz_output *out, int x)
+{
+	write_uint(ctx, out, ((unsigned int)x << 1) ^ (unsigned int)(x >> 31));
+}
+
+static void
+write_float(fz_context *ctx, fz_output *out, float f)
+{
+	union { float f; int i; } u;
+	u.f = f;
+	fz_write_int32_le(ctx, out, u.i);
+}
+
+static void
+write_floats(fz_context *ctx, fz_output *out, const float *f, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		write_float(ctx, out, f[i]);
+}
+
+static void
+write_rect(fz_context *ctx, fz_output *out, const fz_rect *r)
+{
+	write_float(ctx, out, r->x0);
+	write_float(ctx, out, r->y0);
+	write_float(ctx, out, r->x1);
+	write_float(ctx, out, r->y1);
+}
+
+static void
+write_matrix(fz_context *ctx, fz_output *out, const fz_matrix *m)
+{
+	write_float(ctx, out, m->a);
+	write_float(ctx, out, m->b);
+	write_float(ctx, out, m->c);
+	write_float(ctx, out, m->d);
+	write_float(ctx, out, m->e);
+	write_float(ctx, out, m->f);
+}
+
+static void
+write_data(fz_context *ctx, fz_output *out, const unsigned char *data, size_t len)
+{
+	if (len > INT_MAX)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save display list with %zu byte resource", len);
+	write_uint(ctx, out, (unsigned int)len);
+	fz_write(ctx, out, data, len);
+}
+
+static void
+write_string(fz_context *ctx, fz_output *out, const char *s)
+{
+	write_data(ctx, out, (const unsigned char *)s, strlen(s));
+}
+
+static int
+find_resource(fz_context *ctx, fz_list_writer *wri, const void *res)
+{
+	return (int)(intptr_t)fz_hash_find(ctx, wri->resources, &res) - 1;
+}
+
+static int
+add_resource(fz_context *ctx, fz_list_writer *wri, const void *res, int type)
+{
+	int idx = wri->count[type]++;
+	fz_hash_insert(ctx, wri->resources, &res, (void *)(intptr_t)(idx + 1));
+	return idx;
+}
+
+static void save_list(fz_context *ctx, fz_list_writer *wri, fz_display_list *list);
+static int use_image(fz_context *ctx, fz_list_writer *wri, fz_image *image);
+
+static void
+write_compressed_buffer(fz_context *ctx, fz_output *out, fz_compressed_buffer *cbuf)
+{
+	fz_compression_params *p = &cbuf->params;
+
+	write_uint(ctx, out, p->type);
+	switch (p->type)
+	{
+	case FZ_IMAGE_JPEG:
+		write_int(ctx, out, p->u.jpeg.color_transform);
+		break;
+	case FZ_IMAGE_JPX:
+		write_int(ctx, out, p->u.jpx.smask_in_data);
+		break;
+	case FZ_IMAGE_FAX:
+		write_int(ctx, out, p->u.fax.columns);
+		write_int(ctx, out, p->u.fax.rows);
+		write_int(ctx, out, p->u.fax.k);
+		write_int(ctx, out, p->u.fax.end_of_line);
+		write_int(ctx, out, p->u.fax.encoded_byte_align);
+		write_int(ctx, out, p->u.fax.end_of_block);
+		write_int(ctx, out, p->u.fax.black_is_1);
+		write_int(ctx, out, p->u.fax.damaged_rows_before_error);
+		break;
+	case FZ_IMAGE_FLATE:
+		write_int(ctx, out, p->u.flate.columns);
+		write_int(ctx, out, p->u.flate.colors);
+		write_int(ctx, out, p->u.flate.predictor);
+		write_int(ctx, out, p->u.flate.bpc);
+		break;
+	case FZ_IMAGE_LZW:
+		write_int(ctx, out, p->u.lzw.columns);
+		write_int(ctx, out, p->u.lzw.colors);
+		write_int(ctx, out, p->u.lzw.predictor);
+		write_int(ctx, out, p->u.lzw.bpc);
+		write_int(ctx, out, p->u.lzw.early_change);
+		break;
+	}
+	write_data(ctx, out, cbuf->buffer->data, cbuf->buffer->len);
+}
+
+/* Colorspaces */
+
+static void
+sample_colorspace(fz_context *ctx, fz_colorspace *cs, int grid, unsigned short *samples)
+{
+	int pos[MAX_SAMPLED_N] = { 0 };
+	float color[MAX_SAMPLED_N];
+	float rgb[3];
+	int i, k, total = 1;
+
+	for (i = 0; i < cs->n; i++)
+		total *= grid;
+
+	for (i = 0; i < total; i++)
+	{
+		for (k = 0; k < cs->n; k++)
+			color[k] = (float)pos[k] / (grid - 1);
+		cs->to_rgb(ctx, cs, color, rgb);
+		for (k = 0; k < 3; k++)
+			*samples++ = fz_clamp(rgb[k], 0, 1) * 65535 + 0.5f;
+
+		/* The first component varies fastest. */
+		for (k = 0; k < cs->n && ++pos[k] == grid; k++)
+			pos[k] = 0;
+	}
+}
+
+static int
+sampled_grid_size(int n)
+{
+	int grid = 256;
+	int i, total;
+
+	for (;;)
+	{
+		total = 1;
+		for (i = 0; i < n && total <= MAX_SAMPLES; i++)
+			total *= grid;
+		if (total <= MAX_SAMPLES || grid == 2)
+			return grid;
+		grid--;
+	}
+}
+
+static int
+use_colorspace(fz_context *ctx, fz_list_writer *wri, fz_colorspace *cs)
+{
+	fz_output *out = wri->out;
+	unsigned short *samples;
+	unsigned char *lookup;
+	fz_colorspace *base;
+	int idx, high, base_idx, grid, i, total;
+
+	idx = find_resource(ctx, wri, cs);
+	if (idx >= 0)
+		return idx;
+
+	if (cs == fz_device_gray(ctx))
+	{
+		fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+		fz_write_byte(ctx, out, CS_GRAY);
+	}
+	else if (cs == fz_device_rgb(ctx))
+	{
+		fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+		fz_write_byte(ctx, out, CS_RGB);
+	}
+	else if (cs == fz_device_bgr(ctx))
+	{
+		fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+		fz_write_byte(ctx, out, CS_BGR);
+	}
+	else if (cs == fz_device_cmyk(ctx))
+	{
+		fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+		fz_write_byte(ctx, out, CS_CMYK);
+	}
+	else if (cs == fz_device_lab(ctx))
+	{
+		fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+		fz_write_byte(ctx, out, CS_LAB);
+	}
+	else if ((base = fz_indexed_colorspace_base(ctx, cs, &high, &lookup)) != NULL)
+	{
+		base_idx = use_colorspace(ctx, wri, base);
+		fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+		fz_write_byte(ctx, out, CS_INDEXED);
+		write_uint(ctx, out, base_idx);
+		write_uint(ctx, out, high);
+		fz_write(ctx, out, lookup, (high + 1) * base->n);
+	}
+	else
+	{
+		if (cs->n < 1 || cs->n > MAX_SAMPLED_N)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save %d component colorspace '%s'", cs->n, cs->name);
+		grid = sampled_grid_size(cs->n);
+		total = 1;
+		for (i = 0; i < cs->n; i++)
+			total *= grid;
+		samples = fz_malloc_array(ctx, total * 3, sizeof(*samples));
+		fz_try(ctx)
+		{
+			sample_colorspace(ctx, cs, grid, samples);
+			fz_write_byte(ctx, out, DL_DEF_COLORSPACE);
+			fz_write_byte(ctx, out, CS_SAMPLED);
+			write_string(ctx, out, cs->name);
+			write_uint(ctx, out, cs->n);
+			write_uint(ctx, out, grid);
+			for (i = 0; i < total * 3; i++)
+				fz_write_int16_le(ctx, out, samples[i]);
+		}
+		fz_always(ctx)
+			fz_free(ctx, samples);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+
+	return add_resource(ctx, wri, cs, RES_COLORSPACE);
+}
+
+/* Fonts */
+
+static unsigned int
+pack_font_flags(fz_font_flags_t *flags)
+{
+	return flags->is_mono |
+		flags->is_serif << 1 |
+		flags->is_bold << 2 |
+		flags->is_italic << 3 |
+		flags->ft_substitute << 4 |
+		flags->ft_stretch << 5 |
+		flags->fake_bold << 6 |
+		flags->fake_italic << 7 |
+		flags->force_hinting << 8 |
+		flags->has_opentype << 9 |
+		flags->invalid_bbox << 10 |
+		flags->use_glyph_bbox << 11;
+}
+
+static void
+unpack_font_flags(fz_font_flags_t *flags, unsigned int x)
+{
+	flags->is_mono = x & 1;
+	flags->is_serif = (x >> 1) & 1;
+	flags->is_bold = (x >> 2) & 1;
+	flags->is_italic = (x >> 3) & 1;
+	flags->ft_substitute = (x >> 4) & 1;
+	flags->ft_stretch = (x >> 5) & 1;
+	flags->fake_bold = (x >> 6) & 1;
+	flags->fake_italic = (x >> 7) & 1;
+	flags->force_hinting = (x >> 8) & 1;
+	flags->has_opentype = (x >> 9) & 1;
+	flags->invalid_bbox = (x >> 10) & 1;
+	flags->use_glyph_bbox = (x >> 11) & 1;
+}
+
+static int
+use_font(fz_context *ctx, fz_list_writer *wri, fz_font *font)
+{
+	fz_output *out = wri->out;
+	int idx, i;
+
+	idx = find_resource(ctx, wri, font);
+	if (idx >= 0)
+		return idx;
+
+	if (font->ft_face)
+	{
+		if (!font->buffer)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save font '%s' without data", font->name);
+		fz_write_byte(ctx, out, DL_DEF_FONT);
+		fz_write_byte(ctx, out, FONT_FREETYPE);
+		write_string(ctx, out, font->name);
+		write_uint(ctx, out, pack_font_flags(&font->flags));
+		write_rect(ctx, out, &font->bbox);
+		write_uint(ctx, out, ((FT_Face)font->ft_face)->face_index);
+		write_data(ctx, out, font->buffer->data, font->buffer->len);
+		write_uint(ctx, out, font->width_count);
+		write_int(ctx, out, font->width_default);
+		for (i = 0; i < font->width_count; i++)
+			write_int(ctx, out, font->width_table[i]);
+	}
+	else if (font->t3lists)
+	{
+		for (i = 0; i < wri->depth; i++)
+			if (wri->fonts[i] == font)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save recursive type3 font '%s'", font->name);
+		if (wri->depth == MAX_NESTING)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "type3 fonts nested too deeply");
+
+		fz_write_byte(ctx, out, DL_DEF_FONT);
+		fz_write_byte(ctx, out, FONT_TYPE3);
+		write_string(ctx, out, font->name);
+		write_uint(ctx, out, pack_font_flags(&font->flags));
+		write_rect(ctx, out, &font->bbox);
+		write_matrix(ctx, out, &font->t3matrix);
+
+		wri->fonts[wri->depth++] = font;
+		fz_try(ctx)
+		{
+			for (i = 0; i < 256; i++)
+			{
+				fz_write_byte(ctx, out, font->t3lists[i] != NULL);
+				write_float(ctx, out, font->t3widths[i]);
+				write_uint(ctx, out, font->t3flags[i]);
+				write_rect(ctx, out, font->bbox_table ? &font->bbox_table[i] : &fz_infinite_rect);
+				if (font->t3lists[i])
+					save_list(ctx, wri, font->t3lists[i]);
+			}
+		}
+		fz_always(ctx)
+			wri->depth--;
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save font '%s'", font->name);
+
+	return add_resource(ctx, wri, font, RES_FONT);
+}
+
+/* Texts, stroke states and shades */
+
+static int
+use_text(fz_context *ctx, fz_list_writer *wri, const fz_text *text)
+{
+	fz_output *out = wri->out;
+	fz_text_span *span;
+	int idx, n, i;
+
+	idx = find_resource(ctx, wri, text);
+	if (idx >= 0)
+		return idx;
+
+	n = 0;
+	for (span = text->head; span; span = span->next)
+	{
+		use_font(ctx, wri, span->font);
+		n++;
+	}
+
+	fz_write_byte(ctx, out, DL_DEF_TEXT);
+	write_uint(ctx, out, n);
+	for (span = text->head; span; span = span->next)
+	{
+		write_uint(ctx, out, find_resource(ctx, wri, span->font));
+		write_float(ctx, out, span->trm.a);
+		write_float(ctx, out, span->trm.b);
+		write_float(ctx, out, span->trm.c);
+		write_float(ctx, out, span->trm.d);
+		write_uint(ctx, out, span->wmode);
+		write_uint(ctx, out, span->bidi_level);
+		write_uint(ctx, out, span->markup_dir);
+		write_uint(ctx, out, span->language);
+		write_uint(ctx, out, span->len);
+		for (i = 0; i < span->len; i++)
+		{
+			write_int(ctx, out, span->items[i].gid);
+			write_int(ctx, out, span->items[i].ucs);
+			write_float(ctx, out, span->items[i].x);
+			write_float(ctx, out, span->items[i].y);
+		}
+	}
+
+	return add_resource(ctx, wri, text, RES_TEXT);
+}
+
+static int
+use_stroke(fz_context *ctx, fz_list_writer *wri, const fz_stroke_state *stroke)
+{
+	fz_output *out = wri->out;
+	int idx;
+
+	idx = find_resource(ctx, wri, stroke);
+	if (idx >= 0)
+		return idx;
+
+	fz_write_byte(ctx, out, DL_DEF_STROKE);
+	write_uint(ctx, out, stroke->start_cap);
+	write_uint(ctx, out, stroke->dash_cap);
+	write_uint(ctx, out, stroke->end_cap);
+	write_uint(ctx, out, stroke->linejoin);
+	write_float(ctx, out, stroke->linewidth);
+	write_float(ctx, out, stroke->miterlimit);
+	write_float(ctx, out, stroke->dash_phase);
+	write_uint(ctx, out, stroke->dash_len);
+	write_floats(ctx, out, stroke->dash_list, stroke->dash_len);
+
+	return add_resource(ctx, wri, stroke, RES_STROKE);
+}
+
+static int
+use_shade(fz_context *ctx, fz_list_writer *wri, fz_shade *shade)
+{
+	fz_output *out = wri->out;
+	int idx, cs_idx, n, i, ncomp;
+
+	idx = find_resource(ctx, wri, shade);
+	if (idx >= 0)
+		return idx;
+
+	cs_idx = use_colorspace(ctx, wri, shade->colorspace);
+	n = shade->colorspace->n;
+
+	fz_write_byte(ctx, out, DL_DEF_SHADE);
+	write_uint(ctx, out, shade->type);
+	write_uint(ctx, out, cs_idx);
+	write_rect(ctx, out, &shade->bbox);
+	write_matrix(ctx, out, &shade->matrix);
+	write_uint(ctx, out, shade->use_background);
+	if (shade->use_background)
+		write_floats(ctx, out, shade->background, n);
+	write_uint(ctx, out, shade->use_function);
+	if (shade->use_function)
+		for (i = 0; i < 256; i++)
+			write_floats(ctx, out, shade->function[i], n + 1);
+
+	switch (shade->type)
+	{
+	case FZ_FUNCTION_BASED:
+		write_matrix(ctx, out, &shade->u.f.matrix);
+		write_uint(ctx, out, shade->u.f.xdivs);
+		write_uint(ctx, out, shade->u.f.ydivs);
+		write_floats(ctx, out, &shade->u.f.domain[0][0], 4);
+		write_floats(ctx, out, shade->u.f.fn_vals, (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n);
+		break;
+	case FZ_LINEAR:
+	case FZ_RADIAL:
+		write_uint(ctx, out, shade->u.l_or_r.extend[0]);
+		write_uint(ctx, out, shade->u.l_or_r.extend[1]);
+		write_floats(ctx, out, &shade->u.l_or_r.coords[0][0], 6);
+		break;
+	default:
+		ncomp = shade->use_function ? 1 : n;
+		write_int(ctx, out, shade->u.m.vprow);
+		write_int(ctx, out, shade->u.m.bpflag);
+		write_int(ctx, out, shade->u.m.bpcoord);
+		write_int(ctx, out, shade->u.m.bpcomp);
+		write_float(ctx, out, shade->u.m.x0);
+		write_float(ctx, out, shade->u.m.x1);
+		write_float(ctx, out, shade->u.m.y0);
+		write_float(ctx, out, shade->u.m.y1);
+		write_floats(ctx, out, shade->u.m.c0, ncomp);
+		write_floats(ctx, out, shade->u.m.c1, ncomp);
+		break;
+	}
+
+	fz_write_byte(ctx, out, shade->buffer != NULL);
+	if (shade->buffer)
+		write_compressed_buffer(ctx, out, shade->buffer);
+
+	return add_resource(ctx, wri, shade, RES_SHADE);
+}
+
+/* Images */
+
+static void
+write_pixmap_samples(fz_context *ctx, fz_output *out, fz_pixmap *pix)
+{
+	size_t w = (size_t)pix->w * pix->n;
+	size_t len = w * pix->h;
+	uLongf clen = compressBound(len);
+	unsigned char *data, *cdata;
+	int y;
+
+	data = fz_malloc(ctx, len);
+	cdata = NULL;
+	fz_var(cdata);
+	fz_try(ctx)
+	{
+		for (y = 0; y < pix->h; y++)
+			memcpy(data + y * w, pix->samples + y * pix->stride, w);
+		cdata = fz_malloc(ctx, clen);
+		if (compress(cdata, &clen, data, len) != Z_OK)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot compress image samples");
+		write_data(ctx, out, cdata, clen);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, data);
+		fz_free(ctx, cdata);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Write the body of an image blob. */
+static void
+write_image(fz_context *ctx, fz_list_writer *wri, fz_image *image)
+{
+	fz_output *out = wri->out;
+	fz_compressed_buffer *cbuf = fz_compressed_image_buffer(ctx, image);
+	fz_pixmap *pix = NULL;
+	int cs_idx = -1;
+	int mask_idx = -1;
+
+	fz_var(pix);
+
+	if (image->mask)
+		mask_idx = use_image(ctx, wri, image->mask);
+
+	if (cbuf)
+	{
+		if (image->colorspace)
+			cs_idx = use_colorspace(ctx, wri, image->colorspace);
+
+		fz_write_byte(ctx, out, DL_IMAGE);
+		fz_write_byte(ctx, out, IMAGE_COMPRESSED);
+		write_uint(ctx, out, image->w);
+		write_uint(ctx, out, image->h);
+		write_uint(ctx, out, image->bpc);
+		write_int(ctx, out, cs_idx);
+		write_int(ctx, out, image->xres);
+		write_int(ctx, out, image->yres);
+		write_uint(ctx, out, image->interpolate | image->imagemask << 1 | image->invert_cmyk_jpeg << 2 | image->use_colorkey << 3);
+		write_int(ctx, out, mask_idx);
+		write_floats(ctx, out, image->decode, image->n * 2);
+		if (image->use_colorkey)
+		{
+			int i;
+			for (i = 0; i < image->n * 2; i++)
+				write_int(ctx, out, image->colorkey[i]);
+		}
+		write_compressed_buffer(ctx, out, cbuf);
+		return;
+	}
+
+	/* Anything else (images made from pixmaps, or from display lists)
+	 * is saved as its decoded samples. */
+	pix = fz_pixmap_image_tile(ctx, (fz_pixmap_image *)image);
+	if (pix)
+		fz_keep_pixmap(ctx, pix);
+	else
+		pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+
+	fz_try(ctx)
+	{
+		if (pix->colorspace)
+			cs_idx = use_colorspace(ctx, wri, pix->colorspace);
+
+		fz_write_byte(ctx, out, DL_IMAGE);
+		fz_write_byte(ctx, out, IMAGE_PIXMAP);
+		write_uint(ctx, out, pix->w);
+		write_uint(ctx, out, pix->h);
+		write_uint(ctx, out, pix->n);
+		write_uint(ctx, out, pix->alpha);
+		write_int(ctx, out, cs_idx);
+		write_int(ctx, out, image->xres);
+		write_int(ctx, out, image->yres);
+		write_uint(ctx, out, image->interpolate | image->imagemask << 1);
+		write_int(ctx, out, mask_idx);
+		write_pixmap_samples(ctx, out, pix);
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void
+init_writer(fz_context *ctx, fz_list_writer *wri, fz_output *out, fz_display_list_put_image_fn *put_image, void *arg)
+{
+	memset(wri, 0, sizeof *wri);
+	wri->out = out;
+	wri->put_image = put_image;
+	wri->arg = arg;
+	wri->resources = fz_new_hash_table(ctx, 256, sizeof(void *), -1);
+	fz_try(ctx)
+		wri->digests = fz_new_hash_table(ctx, 64, 16, -1);
+	fz_catch(ctx)
+	{
+		fz_drop_hash(ctx, wri->resources);
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+fini_writer(fz_context *ctx, fz_list_writer *wri)
+{
+	fz_drop_hash(ctx, wri->resources);
+	fz_drop_hash(ctx, wri->digests);
+}
+
+/* Make the self contained blob for an image, with its own tables of
+ * resources, so that its digest does not depend on where it is used. */
+static fz_buffer *
+new_image_blob(fz_context *ctx, fz_list_writer *parent, fz_image *image)
+{
+	fz_list_writer wri;
+	fz_buffer *buf;
+	fz_output *out = NULL;
+
+	fz_var(out);
+
+	buf = fz_new_buffer(ctx, 1024);
+	init_writer(ctx, &wri, NULL, parent->put_image, parent->arg);
+	fz_try(ctx)
+	{
+		out = fz_new_output_with_buffer(ctx, buf);
+		wri.out = out;
+		write_image(ctx, &wri, image);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fini_writer(ctx, &wri);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+static int
+use_image(fz_context *ctx, fz_list_writer *wri, fz_image *image)
+{
+	fz_output *out = wri->out;
+	unsigned char digest[16];
+	fz_buffer *blob;
+	fz_md5 md5;
+	int idx, external;
+
+	idx = find_resource(ctx, wri, image);
+	if (idx >= 0)
+		return idx;
+
+	blob = new_image_blob(ctx, wri, image);
+	fz_try(ctx)
+	{
+		fz_md5_init(&md5);
+		fz_md5_update(&md5, blob->data, blob->len);
+		fz_md5_final(&md5, digest);
+
+		/* The same image may be reachable through several fz_images. */
+		idx = (int)(intptr_t)fz_hash_find(ctx, wri->digests, digest) - 1;
+		if (idx < 0)
+		{
+			external = wri->put_image && wri->put_image(ctx, wri->arg, digest, blob);
+			fz_write_byte(ctx, out, DL_DEF_IMAGE);
+			fz_write(ctx, out, digest, 16);
+			fz_write_byte(ctx, out, !external);
+			if (!external)
+				write_data(ctx, out, blob->data, blob->len);
+			idx = add_resource(ctx, wri, image, RES_IMAGE);
+			fz_hash_insert(ctx, wri->digests, digest, (void *)(intptr_t)(idx + 1));
+		}
+		else
+			fz_hash_insert(ctx, wri->resources, &image, (void *)(intptr_t)(idx + 1));
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, blob);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return idx;
+}
+
+/* Paths */
+
+static void
+path_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, PATH_MOVETO);
+	write_float(ctx, out, x);
+	write_float(ctx, out, y);
+}
+
+static void
+path_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, PATH_LINETO);
+	write_float(ctx, out, x);
+	write_float(ctx, out, y);
+}
+
+static void
+path_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, PATH_CURVETO);
+	write_float(ctx, out, x1);
+	write_float(ctx, out, y1);
+	write_float(ctx, out, x2);
+	write_float(ctx, out, y2);
+	write_float(ctx, out, x3);
+	write_float(ctx, out, y3);
+}
+
+static void
+path_quadto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, PATH_QUADTO);
+	write_float(ctx, out, x1);
+	write_float(ctx, out, y1);
+	write_float(ctx, out, x2);
+	write_float(ctx, out, y2);
+}
+
+static void
+path_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, PATH_RECTTO);
+	write_float(ctx, out, x1);
+	write_float(ctx, out, y1);
+	write_float(ctx, out, x2);
+	write_float(ctx, out, y2);
+}
+
+static void
+path_closepath(fz_context *ctx, void *arg)
+{
+	fz_output *out = arg;
+	fz_write_byte(ctx, out, PATH_CLOSE);
+}
+
+static const fz_path_walker path_writer =
+{
+	path_moveto,
+	path_lineto,
+	path_curveto,
+	path_closepath,
+	path_quadto,
+	NULL,
+	NULL,
+	path_rectto
+};
+
+/* The writer device */
+
+static void
+write_state(fz_context *ctx, fz_list_writer_device *wdev, int op,
+	const fz_matrix *ctm, fz_colorspace *colorspace, const float *color, const float *alpha,
+	const fz_stroke_state *stroke, const fz_path *path, const fz_rect *scissor)
+{
+	fz_output *out = wdev->wri->out;
+	int changes = 0;
+	int cs_idx = 0;
+	int stroke_idx = 0;
+	int i, n = 0;
+
+	if (colorspace && color)
+	{
+		n = colorspace->n;
+		if (colorspace != wdev->colorspace)
+		{
+			cs_idx = use_colorspace(ctx, wdev->wri, colorspace);
+			changes |= CHANGE_COLORSPACE | CHANGE_COLOR;
+		}
+		else
+		{
+			for (i = 0; i < n; i++)
+				if (color[i] != wdev->color[i])
+					changes |= CHANGE_COLOR;
+		}
+	}
+	if (stroke && stroke != wdev->stroke)
+	{
+		stroke_idx = use_stroke(ctx, wdev->wri, stroke);
+		changes |= CHANGE_STROKE;
+	}
+	if (ctm && memcmp(ctm, &wdev->ctm, sizeof *ctm))
+		changes |= CHANGE_CTM;
+	if (alpha && *alpha != wdev->alpha)
+		changes |= CHANGE_ALPHA;
+	if (path && path != wdev->path)
+		changes |= CHANGE_PATH;
+	if (scissor)
+		changes |= HAS_SCISSOR;
+
+	fz_write_byte(ctx, out, op);
+	fz_write_byte(ctx, out, changes);
+	if (changes & CHANGE_CTM)
+	{
+		write_matrix(ctx, out, ctm);
+		wdev->ctm = *ctm;
+	}
+	if (changes & CHANGE_COLORSPACE)
+	{
+		write_uint(ctx, out, cs_idx);
+		wdev->colorspace = colorspace;
+	}
+	if (changes & CHANGE_COLOR)
+	{
+		write_floats(ctx, out, color, n);
+		memcpy(wdev->color, color, n * sizeof(float));
+	}
+	if (changes & CHANGE_ALPHA)
+	{
+		write_float(ctx, out, *alpha);
+		wdev->alpha = *alpha;
+	}
+	if (changes & CHANGE_STROKE)
+	{
+		write_uint(ctx, out, stroke_idx);
+		wdev->stroke = stroke;
+	}
+	if (changes & HAS_SCISSOR)
+		write_rect(ctx, out, scissor);
+	if (changes & CHANGE_PATH)
+	{
+		fz_walk_path(ctx, path, &path_writer, out);
+		fz_write_byte(ctx, out, PATH_END);
+		wdev->path = path;
+	}
+}
+
+static void
+fz_list_writer_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_FILL_PATH, ctm, colorspace, color, &alpha, NULL, path, NULL);
+	fz_write_byte(ctx, wdev->wri->out, even_odd);
+}
+
+static void
+fz_list_writer_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke,
+	const fz_matrix *ctm, fz_colorspace *colorspace, const float *color, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_STROKE_PATH, ctm, colorspace, color, &alpha, stroke, path, NULL);
+}
+
+static void
+fz_list_writer_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_CLIP_PATH, ctm, NULL, NULL, NULL, NULL, path, scissor);
+	fz_write_byte(ctx, wdev->wri->out, even_odd);
+}
+
+static void
+fz_list_writer_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_CLIP_STROKE_PATH, ctm, NULL, NULL, NULL, stroke, path, scissor);
+}
+
+static void
+fz_list_writer_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_text(ctx, wdev->wri, text);
+	write_state(ctx, wdev, DL_FILL_TEXT, ctm, colorspace, color, &alpha, NULL, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_text(ctx, wdev->wri, text);
+	write_state(ctx, wdev, DL_STROKE_TEXT, ctm, colorspace, color, &alpha, stroke, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_text(ctx, wdev->wri, text);
+	write_state(ctx, wdev, DL_CLIP_TEXT, ctm, NULL, NULL, NULL, NULL, NULL, scissor);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_text(ctx, wdev->wri, text);
+	write_state(ctx, wdev, DL_CLIP_STROKE_TEXT, ctm, NULL, NULL, NULL, stroke, NULL, scissor);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_matrix *ctm)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_text(ctx, wdev->wri, text);
+	write_state(ctx, wdev, DL_IGNORE_TEXT, ctm, NULL, NULL, NULL, NULL, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, const fz_matrix *ctm, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_shade(ctx, wdev->wri, shade);
+	write_state(ctx, wdev, DL_FILL_SHADE, ctm, NULL, NULL, &alpha, NULL, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_image(ctx, wdev->wri, image);
+	write_state(ctx, wdev, DL_FILL_IMAGE, ctm, NULL, NULL, &alpha, NULL, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_image(ctx, wdev->wri, image);
+	write_state(ctx, wdev, DL_FILL_IMAGE_MASK, ctm, colorspace, color, &alpha, NULL, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	int idx = use_image(ctx, wdev->wri, image);
+	write_state(ctx, wdev, DL_CLIP_IMAGE_MASK, ctm, NULL, NULL, NULL, NULL, NULL, scissor);
+	write_uint(ctx, wdev->wri->out, idx);
+}
+
+static void
+fz_list_writer_pop_clip(fz_context *ctx, fz_device *dev)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_POP_CLIP, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static void
+fz_list_writer_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, const float *color)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_BEGIN_MASK, NULL, colorspace, color, NULL, NULL, NULL, rect);
+	fz_write_byte(ctx, wdev->wri->out, luminosity);
+}
+
+static void
+fz_list_writer_end_mask(fz_context *ctx, fz_device *dev)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_END_MASK, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static void
+fz_list_writer_begin_group(fz_context *ctx, fz_device *dev, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_BEGIN_GROUP, NULL, NULL, NULL, &alpha, NULL, NULL, rect);
+	fz_write_byte(ctx, wdev->wri->out, (isolated != 0) | (knockout != 0) << 1);
+	write_uint(ctx, wdev->wri->out, blendmode);
+}
+
+static void
+fz_list_writer_end_group(fz_context *ctx, fz_device *dev)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_END_GROUP, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static int
+fz_list_writer_begin_tile(fz_context *ctx, fz_device *dev, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm, int id)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	fz_output *out = wdev->wri->out;
+	write_state(ctx, wdev, DL_BEGIN_TILE, ctm, NULL, NULL, NULL, NULL, NULL, area);
+	write_rect(ctx, out, view);
+	write_float(ctx, out, xstep);
+	write_float(ctx, out, ystep);
+	write_int(ctx, out, id);
+	return 0;
+}
+
+static void
+fz_list_writer_end_tile(fz_context *ctx, fz_device *dev)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_END_TILE, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+static void
+fz_list_writer_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+	fz_list_writer_device *wdev = (fz_list_writer_device *)dev;
+	write_state(ctx, wdev, DL_RENDER_FLAGS, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+	write_uint(ctx, wdev->wri->out, set);
+	write_uint(ctx, wdev->wri->out, clear);
+}
+
+static fz_device *
+new_list_writer_device(fz_context *ctx, fz_list_writer *wri)
+{
+	fz_list_writer_device *dev = fz_new_device(ctx, sizeof *dev);
+
+	dev->super.fill_path = fz_list_writer_fill_path;
+	dev->super.stroke_path = fz_list_writer_stroke_path;
+	dev->super.clip_path = fz_list_writer_clip_path;
+	dev->super.clip_stroke_path = fz_list_writer_clip_stroke_path;
+
+	dev->super.fill_text = fz_list_writer_fill_text;
+	dev->super.stroke_text = fz_list_writer_stroke_text;
+	dev->super.clip_text = fz_list_writer_clip_text;
+	dev->super.clip_stroke_text = fz_list_writer_clip_stroke_text;
+	dev->super.ignore_text = fz_list_writer_ignore_text;
+
+	dev->super.fill_shade = fz_list_writer_fill_shade;
+	dev->super.fill_image = fz_list_writer_fill_image;
+	dev->super.fill_image_mask = fz_list_writer_fill_image_mask;
+	dev->super.clip_image_mask = fz_list_writer_clip_image_mask;
+
+	dev->super.pop_clip = fz_list_writer_pop_clip;
+
+	dev->super.begin_mask = fz_list_writer_begin_mask;
+	dev->super.end_mask = fz_list_writer_end_mask;
+	dev->super.begin_group = fz_list_writer_begin_group;
+	dev->super.end_group = fz_list_writer_end_group;
+
+	dev->super.begin_tile = fz_list_writer_begin_tile;
+	dev->super.end_tile = fz_list_writer_end_tile;
+
+	dev->super.render_flags = fz_list_writer_render_flags;
+
+	dev->wri = wri;
+	dev->ctm = fz_identity;
+	dev->alpha = 1;
+
+	return &dev->super;
+}
+
+static void
+save_list(fz_context *ctx, fz_list_writer *wri, fz_display_list *list)
+{
+	fz_device *dev;
+	fz_rect mediabox;
+
+	write_rect(ctx, wri->out, fz_bound_display_list(ctx, list, &mediabox));
+
+	dev = new_list_writer_device(ctx, wri);
+	fz_try(ctx)
+	{
+		fz_replay_display_list(ctx, list, dev);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	fz_write_byte(ctx, wri->out, DL_END);
+}
+
+void
+fz_save_display_list(fz_context *ctx, fz_display_list *list, fz_output *out, fz_display_list_put_image_fn *put_image, void *arg)
+{
+	fz_list_writer wri;
+
+	init_writer(ctx, &wri, out, put_image, arg);
+	fz_try(ctx)
+	{
+		fz_write(ctx, out, dl_magic, 4);
+		fz_write_byte(ctx, out, DL_VERSION);
+		save_list(ctx, &wri, list);
+	}
+	fz_always(ctx)
+		fini_writer(ctx, &wri);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/*
+ * Reading
+ */
+
+typedef struct fz_list_reader_s fz_list_reader;
+
+struct fz_list_reader_s
+{
+	fz_stream *stm;
+	int len[RES_MAX];
+	int cap[RES_MAX];
+	void **res[RES_MAX];
+	fz_display_list_get_image_fn *get_image;
+	void *arg;
+	int depth;
+};
+
+static void
+corrupt(fz_context *ctx)
+{
+	fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+}
+
+static int
+read_byte(fz_context *ctx, fz_stream *stm)
+{
+	int c = fz_read_byte(ctx, stm);
+	if (c == EOF)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+	return c;
+}
+
+static unsigned int
+read_uint(fz_context *ctx, fz_stream *stm)
+{
+	unsigned int x = 0;
+	int shift = 0;
+	int c;
+
+	do
+	{
+		c = read_byte(ctx, stm);
+		if (shift > 28)
+			corrupt(ctx);
+		x |= (unsigned int)(c & 0x7f) << shift;
+		shift += 7;
+	}
+	while (c & 0x80);
+
+	return x;
+}
+
+static int
+read_int(fz_context *ctx, fz_stream *stm)
+{
+	unsigned int x = read_uint(ctx, stm);
+	return (int)(x >> 1) ^ -(int)(x & 1);
+}
+
+/* An unsigned value that must be less than max. */
+static int
+read_count(fz_context *ctx, fz_stream *stm, unsigned int max)
+{
+	unsigned int x = read_uint(ctx, stm);
+	if (x >= max)
+		corrupt(ctx);
+	return (int)x;
+}
+
+static float
+read_float(fz_context *ctx, fz_stream *stm)
+{
+	union { float f; int i; } u;
+	u.i = fz_read_int32_le(ctx, stm);
+	return u.f;
+}
+
+static void
+read_floats(fz_context *ctx, fz_stream *stm, float *f, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		f[i] = read_float(ctx, stm);
+}
+
+static void
+read_rect(fz_context *ctx, fz_stream *stm, fz_rect *r)
+{
+	r->x0 = read_float(ctx, stm);
+	r->y0 = read_float(ctx, stm);
+	r->x1 = read_float(ctx, stm);
+	r->y1 = read_float(ctx, stm);
+}
+
+static void
+read_matrix(fz_context *ctx, fz_stream *stm, fz_matrix *m)
+{
+	m->a = read_float(ctx, stm);
+	m->b = read_float(ctx, stm);
+	m->c = read_float(ctx, stm);
+	m->d = read_float(ctx, stm);
+	m->e = read_float(ctx, stm);
+	m->f = read_float(ctx, stm);
+}
+
+static void
+read_exactly(fz_context *ctx, fz_stream *stm, unsigned char *data, size_t len)
+{
+	if (fz_read(ctx, stm, data, len) != len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+}
+
+/* The length is only trusted as far as the data is actually there: the
+ * buffer grows as it is read, so it never gets much larger than the
+ * rest of the stream. */
+static fz_buffer *
+read_data(fz_context *ctx, fz_stream *stm)
+{
+	size_t len = read_uint(ctx, stm);
+	fz_buffer *buf = fz_new_buffer(ctx, len < 4096 ? (len ? len : 1) : 4096);
+	size_t n;
+	fz_try(ctx)
+	{
+		while (buf->len < len)
+		{
+			if (buf->len == buf->cap)
+				fz_resize_buffer(ctx, buf, len - buf->cap < buf->cap ? len : buf->cap * 2);
+			n = fz_read(ctx, stm, buf->data + buf->len, buf->cap - buf->len);
+			if (n == 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "premature end of display list");
+			buf->len += n;
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+static void
+read_string(fz_context *ctx, fz_stream *stm, char *s, int size)
+{
+	int len = read_count(ctx, stm, size);
+	read_exactly(ctx, stm, (unsigned char *)s, len);
+	s[len] = 0;
+}
+
+/* Returns a borrowed reference. */
+static void *
+read_resource(fz_context *ctx, fz_list_reader *rd, int type)
+{
+	return rd->res[type][read_count(ctx, rd->stm, rd->len[type])];
+}
+
+static fz_compressed_buffer *
+read_compressed_buffer(fz_context *ctx, fz_stream *stm)
+{
+	fz_compressed_buffer *cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+	fz_compression_params *p = &cbuf->params;
+
+	fz_try(ctx)
+	{
+		p->type = read_count(ctx, stm, FZ_IMAGE_TIFF + 1);
+		switch (p->type)
+		{
+		case FZ_IMAGE_JPEG:
+			p->u.jpeg.color_transform = read_int(ctx, stm);
+			break;
+		case FZ_IMAGE_JPX:
+			p->u.jpx.smask_in_data = read_int(ctx, stm);
+			break;
+		case FZ_IMAGE_FAX:
+			p->u.fax.columns = read_int(ctx, stm);
+			p->u.fax.rows = read_int(ctx, stm);
+			p->u.fax.k = read_int(ctx, stm);
+			p->u.fax.end_of_line = read_int(ctx, stm);
+			p->u.fax.encoded_byte_align = read_int(ctx, stm);
+			p->u.fax.end_of_block = read_int(ctx, stm);
+			p->u.fax.black_is_1 = read_int(ctx, stm);
+			p->u.fax.damaged_rows_before_error = read_int(ctx, stm);
+			break;
+		case FZ_IMAGE_FLATE:
+			p->u.flate.columns = read_int(ctx, stm);
+			p->u.flate.colors = read_int(ctx, stm);
+			p->u.flate.predictor = read_int(ctx, stm);
+			p->u.flate.bpc = read_int(ctx, stm);
+			break;
+		case FZ_IMAGE_LZW:
+			p->u.lzw.columns = read_int(ctx, stm);
+			p->u.lzw.colors = read_int(ctx, stm);
+			p->u.lzw.predictor = read_int(ctx, stm);
+			p->u.lzw.bpc = read_int(ctx, stm);
+			p->u.lzw.early_change = read_int(ctx, stm);
+			break;
+		}
+		cbuf->buffer = read_data(ctx, stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, cbuf);
+		fz_rethrow(ctx);
+	}
+	return cbuf;
+}
+
+static fz_display_list *load_list(fz_context *ctx, fz_list_reader *rd);
+
+/* Sampled colorspaces */
+
+typedef struct
+{
+	int grid;
+	unsigned short *samples;
+} sampled_colorspace;
+
+static void
+sampled_to_rgb(fz_context *ctx, fz_colorspace *cs, const float *color, float *rgb)
+{
+	sampled_colorspace *sc = cs->data;
+	int n = cs->n;
+	int grid = sc->grid;
+	int base[MAX_SAMPLED_N];
+	float frac[MAX_SAMPLED_N];
+	float acc[3] = { 0, 0, 0 };
+	int i, k, corner;
+
+	for (i = 0; i < n; i++)
+	{
+		float v = fz_clamp(color[i], 0, 1) * (grid - 1);
+		base[i] = (int)v;
+		if (base[i] >= grid - 1)
+			base[i] = grid - 2;
+		frac[i] = v - base[i];
+	}
+
+	/* Multilinear interpolation between the 2^n surrounding samples. */
+	for (corner = 0; corner < (1 << n); corner++)
+	{
+		float w = 1;
+		int ofs = 0;
+		int stride = 1;
+		for (i = 0; i < n; i++)
+		{
+			int bit = (corner >> i) & 1;
+			w *= bit ? frac[i] : 1 - frac[i];
+			ofs += (base[i] + bit) * stride;
+			stride *= grid;
+		}
+		if (w == 0)
+			continue;
+		for (k = 0; k < 3; k++)
+			acc[k] += w * sc->samples[ofs * 3 + k];
+	}
+
+	for (k = 0; k < 3; k++)
+		rgb[k] = acc[k] / 65535;
+}
+
+static void
+free_sampled(fz_context *ctx, fz_colorspace *cs)
+{
+	sampled_colorspace *sc = cs->data;
+	fz_free(ctx, sc->samples);
+	fz_free(ctx, sc);
+}
+
+static fz_colorspace *
+read_sampled_colorspace(fz_context *ctx, fz_stream *stm)
+{
+	char name[16];
+	sampled_colorspace *sc;
+	fz_colorspace *cs = NULL;
+	int n, grid, total, i;
+
+	read_string(ctx, stm, name, sizeof name);
+	n = read_count(ctx, stm, MAX_SAMPLED_N + 1);
+	grid = read_count(ctx, stm, 257);
+	if (n < 1 || grid < 2)
+		corrupt(ctx);
+	total = 1;
+	for (i = 0; i < n; i++)
+	{
+		total *= grid;
+		if (total > MAX_SAMPLES)
+			corrupt(ctx);
+	}
+
+	sc = fz_malloc_struct(ctx, sampled_colorspace);
+	fz_try(ctx)
+	{
+		sc->grid = grid;
+		sc->samples = fz_malloc_array(ctx, total * 3, sizeof(unsigned short));
+		for (i = 0; i < total * 3; i++)
+		{
+			sc->samples[i] = read_byte(ctx, stm);
+			sc->samples[i] |= read_byte(ctx, stm) << 8;
+		}
+		cs = fz_new_colorspace(ctx, name, n, sampled_to_rgb, NULL, free_sampled, sc, sizeof(*sc) + total * 3 * sizeof(unsigned short));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, sc->samples);
+		fz_free(ctx, sc);
+		fz_rethrow(ctx);
+	}
+	return cs;
+}
+
+static fz_colorspace *
+read_colorspace(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_colorspace *base, *cs;
+	unsigned char *lookup;
+	int high;
+
+	switch (read_byte(ctx, stm))
+	{
+	case CS_GRAY:
+		return fz_keep_colorspace(ctx, fz_device_gray(ctx));
+	case CS_RGB:
+		return fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+	case CS_BGR:
+		return fz_keep_colorspace(ctx, fz_device_bgr(ctx));
+	case CS_CMYK:
+		return fz_keep_colorspace(ctx, fz_device_cmyk(ctx));
+	case CS_LAB:
+		return fz_keep_colorspace(ctx, fz_device_lab(ctx));
+	case CS_INDEXED:
+		base = read_resource(ctx, rd, RES_COLORSPACE);
+		high = read_count(ctx, stm, 256);
+		/* The reader's resource table owns base; take our own
+		 * reference for the indexed colorspace to hold. */
+		fz_keep_colorspace(ctx, base);
+		lookup = NULL;
+		fz_var(lookup);
+		fz_try(ctx)
+		{
+			lookup = fz_malloc(ctx, (high + 1) * base->n);
+			read_exactly(ctx, stm, lookup, (high + 1) * base->n);
+			cs = fz_new_indexed_colorspace(ctx, base, high, lookup);
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_colorspace(ctx, base);
+			fz_free(ctx, lookup);
+			fz_rethrow(ctx);
+		}
+		return cs;
+	case CS_SAMPLED:
+		return read_sampled_colorspace(ctx, stm);
+	}
+	corrupt(ctx);
+	return NULL;
+}
+
+/* Fonts */
+
+static fz_font *
+read_font(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_buffer *buf = NULL;
+	fz_font *font = NULL;
+	char name[32];
+	unsigned int flags;
+	fz_rect bbox;
+	fz_matrix matrix;
+	int kind, index, i;
+
+	fz_var(buf);
+	fz_var(font);
+
+	kind = read_byte(ctx, stm);
+	read_string(ctx, stm, name, sizeof name);
+	flags = read_uint(ctx, stm);
+	read_rect(ctx, stm, &bbox);
+
+	fz_try(ctx)
+	{
+		if (kind == FONT_FREETYPE)
+		{
+			index = read_uint(ctx, stm);
+			buf = read_data(ctx, stm);
+			font = fz_new_font_from_buffer(ctx, name, buf, index, (flags >> 11) & 1);
+			unpack_font_flags(&font->flags, flags);
+			font->bbox = bbox;
+			font->width_count = read_count(ctx, stm, 65536);
+			font->width_default = read_int(ctx, stm);
+			if (font->width_count > 0)
+			{
+				font->width_table = fz_malloc_array(ctx, font->width_count, sizeof(short));
+				for (i = 0; i < font->width_count; i++)
+					font->width_table[i] = read_int(ctx, stm);
+			}
+		}
+		else if (kind == FONT_TYPE3)
+		{
+			if (rd->depth == MAX_NESTING)
+				corrupt(ctx);
+			read_matrix(ctx, stm, &matrix);
+			font = fz_new_type3_font(ctx, name, &matrix);
+			unpack_font_flags(&font->flags, flags);
+			font->bbox = bbox;
+			rd->depth++;
+			fz_try(ctx)
+			{
+				for (i = 0; i < 256; i++)
+				{
+					int has_list = read_byte(ctx, stm);
+					fz_rect gbox;
+					font->t3widths[i] = read_float(ctx, stm);
+					font->t3flags[i] = read_uint(ctx, stm);
+					read_rect(ctx, stm, &gbox);
+					if (font->bbox_table)
+						font->bbox_table[i] = gbox;
+					if (has_list)
+						font->t3lists[i] = load_list(ctx, rd);
+				}
+			}
+			fz_always(ctx)
+				rd->depth--;
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+		}
+		else
+			corrupt(ctx);
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+	{
+		fz_drop_font(ctx, font);
+		fz_rethrow(ctx);
+	}
+	return font;
+}
+
+/* Texts, stroke states and shades */
+
+static fz_text *
+read_text(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_text *text = fz_new_text(ctx);
+	int nspans, i, k, len;
+
+	fz_try(ctx)
+	{
+		nspans = read_uint(ctx, stm);
+		for (i = 0; i < nspans; i++)
+		{
+			fz_font *font = read_resource(ctx, rd, RES_FONT);
+			fz_matrix trm;
+			int wmode, bidi_level, markup_dir, language;
+
+			trm.a = read_float(ctx, stm);
+			trm.b = read_float(ctx, stm);
+			trm.c = read_float(ctx, stm);
+			trm.d = read_float(ctx, stm);
+			wmode = read_count(ctx, stm, 2);
+			bidi_level = read_count(ctx, stm, 128);
+			markup_dir = read_count(ctx, stm, 4);
+			language = read_count(ctx, stm, 1 << 15);
+			len = read_uint(ctx, stm);
+			for (k = 0; k < len; k++)
+			{
+				int gid = read_int(ctx, stm);
+				int ucs = read_int(ctx, stm);
+				trm.e = read_float(ctx, stm);
+				trm.f = read_float(ctx, stm);
+				fz_show_glyph(ctx, text, font, &trm, gid, ucs, wmode, bidi_level, markup_dir, language);
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+static fz_stroke_state *
+read_stroke(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_linecap start_cap, dash_cap, end_cap;
+	fz_linejoin linejoin;
+	float linewidth, miterlimit, dash_phase;
+	fz_stroke_state *stroke;
+	int dash_len;
+
+	start_cap = read_count(ctx, stm, 4);
+	dash_cap = read_count(ctx, stm, 4);
+	end_cap = read_count(ctx, stm, 4);
+	linejoin = read_count(ctx, stm, 4);
+	linewidth = read_float(ctx, stm);
+	miterlimit = read_float(ctx, stm);
+	dash_phase = read_float(ctx, stm);
+	dash_len = read_count(ctx, stm, 65536);
+
+	stroke = fz_new_stroke_state_with_dash_len(ctx, dash_len);
+	stroke->start_cap = start_cap;
+	stroke->dash_cap = dash_cap;
+	stroke->end_cap = end_cap;
+	stroke->linejoin = linejoin;
+	stroke->linewidth = linewidth;
+	stroke->miterlimit = miterlimit;
+	stroke->dash_phase = dash_phase;
+	stroke->dash_len = dash_len;
+	fz_try(ctx)
+		read_floats(ctx, stm, stroke->dash_list, dash_len);
+	fz_catch(ctx)
+	{
+		fz_drop_stroke_state(ctx, stroke);
+		fz_rethrow(ctx);
+	}
+	return stroke;
+}
+
+static const int flag_bits[] = { 2, 4, 8, 0 };
+static const int coord_bits[] = { 1, 2, 4, 8, 12, 16, 24, 32, 0 };
+static const int comp_bits[] = { 1, 2, 4, 8, 12, 16, 0 };
+static const int image_bits[] = { 1, 2, 4, 8, 16, 0 };
+
+static int
+valid_bits(int bits, const int *allowed)
+{
+	for (; *allowed; allowed++)
+		if (bits == *allowed)
+			return 1;
+	return 0;
+}
+
+static fz_shade *
+read_shade(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_shade *shade;
+	int n, i, ncomp, count;
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	fz_try(ctx)
+	{
+		shade->type = read_count(ctx, stm, FZ_MESH_TYPE7 + 1);
+		if (shade->type < FZ_FUNCTION_BASED)
+			corrupt(ctx);
+		shade->colorspace = fz_keep_colorspace(ctx, read_resource(ctx, rd, RES_COLORSPACE));
+		n = shade->colorspace->n;
+		read_rect(ctx, stm, &shade->bbox);
+		read_matrix(ctx, stm, &shade->matrix);
+		shade->use_background = read_uint(ctx, stm);
+		if (shade->use_background)
+			read_floats(ctx, stm, shade->background, n);
+		shade->use_function = read_uint(ctx, stm);
+		if (shade->use_function)
+			for (i = 0; i < 256; i++)
+				read_floats(ctx, stm, shade->function[i], n + 1);
+
+		switch (shade->type)
+		{
+		case FZ_FUNCTION_BASED:
+			read_matrix(ctx, stm, &shade->u.f.matrix);
+			shade->u.f.xdivs = read_count(ctx, stm, 65536);
+			shade->u.f.ydivs = read_count(ctx, stm, 65536);
+			read_floats(ctx, stm, &shade->u.f.domain[0][0], 4);
+			count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1);
+			if (count > (1 << 24))
+				corrupt(ctx);
+			shade->u.f.fn_vals = fz_malloc_array(ctx, count * n, sizeof(float));
+			read_floats(ctx, stm, shade->u.f.fn_vals, count * n);
+			break;
+		case FZ_LINEAR:
+		case FZ_RADIAL:
+			shade->u.l_or_r.extend[0] = read_uint(ctx, stm);
+			shade->u.l_or_r.extend[1] = read_uint(ctx, stm);
+			read_floats(ctx, stm, &shade->u.l_or_r.coords[0][0], 6);
+			break;
+		default:
+			ncomp = shade->use_function ? 1 : n;
+			shade->u.m.vprow = read_int(ctx, stm);
+			shade->u.m.bpflag = read_int(ctx, stm);
+			shade->u.m.bpcoord = read_int(ctx, stm);
+			shade->u.m.bpcomp = read_int(ctx, stm);
+			/* The same limits as pdf_load_shading puts on the mesh. */
+			if (shade->type == FZ_MESH_TYPE5 && shade->u.m.vprow < 2)
+				corrupt(ctx);
+			if (shade->type != FZ_MESH_TYPE5 && !valid_bits(shade->u.m.bpflag, flag_bits))
+				corrupt(ctx);
+			if (!valid_bits(shade->u.m.bpcoord, coord_bits) || !valid_bits(shade->u.m.bpcomp, comp_bits))
+				corrupt(ctx);
+			shade->u.m.x0 = read_float(ctx, stm);
+			shade->u.m.x1 = read_float(ctx, stm);
+			shade->u.m.y0 = read_float(ctx, stm);
+			shade->u.m.y1 = read_float(ctx, stm);
+			read_floats(ctx, stm, shade->u.m.c0, ncomp);
+			read_floats(ctx, stm, shade->u.m.c1, ncomp);
+			break;
+		}
+
+		if (read_byte(ctx, stm))
+			shade->buffer = read_compressed_buffer(ctx, stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+	return shade;
+}
+
+/* Images */
+
+static fz_colorspace *
+read_optional_colorspace(fz_context *ctx, fz_list_reader *rd)
+{
+	int idx = read_int(ctx, rd->stm);
+	if (idx < 0)
+		return NULL;
+	if (idx >= rd->len[RES_COLORSPACE])
+		corrupt(ctx);
+	return rd->res[RES_COLORSPACE][idx];
+}
+
+static fz_image *
+read_optional_image(fz_context *ctx, fz_list_reader *rd)
+{
+	int idx = read_int(ctx, rd->stm);
+	if (idx < 0)
+		return NULL;
+	if (idx >= rd->len[RES_IMAGE])
+		corrupt(ctx);
+	return rd->res[RES_IMAGE][idx];
+}
+
+static fz_image *
+read_image_pixmap(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_colorspace *cs;
+	fz_image *mask;
+	fz_pixmap *pix = NULL;
+	fz_stream *in = NULL;
+	fz_buffer *buf = NULL;
+	fz_image *image = NULL;
+	int w, h, n, alpha, xres, yres, flags, y;
+
+	fz_var(pix);
+	fz_var(in);
+	fz_var(buf);
+
+	w = read_count(ctx, stm, 1 << 20);
+	h = read_count(ctx, stm, 1 << 20);
+	n = read_count(ctx, stm, FZ_MAX_COLORS + 2);
+	alpha = read_count(ctx, stm, 2);
+	cs = read_optional_colorspace(ctx, rd);
+	xres = read_int(ctx, stm);
+	yres = read_int(ctx, stm);
+	flags = read_uint(ctx, stm);
+	mask = read_optional_image(ctx, rd);
+	if (n != (cs ? cs->n : 0) + alpha || (mask && mask->mask))
+		corrupt(ctx);
+
+	fz_try(ctx)
+	{
+		pix = fz_new_pixmap(ctx, cs, w, h, alpha);
+		pix->xres = xres;
+		pix->yres = yres;
+		buf = read_data(ctx, stm);
+		in = fz_open_buffer(ctx, buf);
+		in = fz_open_flated(ctx, in, 15);
+		for (y = 0; y < h; y++)
+			read_exactly(ctx, in, pix->samples + y * pix->stride, (size_t)w * n);
+		image = fz_new_image_from_pixmap(ctx, pix, fz_keep_image(ctx, mask));
+		image->interpolate = flags & 1;
+		image->imagemask = (flags >> 1) & 1;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, in);
+		fz_drop_buffer(ctx, buf);
+		fz_drop_pixmap(ctx, pix);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return image;
+}
+
+static fz_image *
+read_image_compressed(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	fz_colorspace *cs;
+	fz_compressed_buffer *cbuf;
+	fz_image *image, *mask;
+	float decode[FZ_MAX_COLORS * 2];
+	int colorkey[FZ_MAX_COLORS * 2];
+	int w, h, bpc, xres, yres, flags, n, i;
+
+	w = read_count(ctx, stm, 1 << 20);
+	h = read_count(ctx, stm, 1 << 20);
+	bpc = read_count(ctx, stm, 33);
+	if (!valid_bits(bpc, image_bits))
+		corrupt(ctx);
+	cs = read_optional_colorspace(ctx, rd);
+	xres = read_int(ctx, stm);
+	yres = read_int(ctx, stm);
+	flags = read_uint(ctx, stm);
+	mask = read_optional_image(ctx, rd);
+	if (mask && mask->mask)
+		corrupt(ctx);
+	n = cs ? cs->n : 1;
+	read_floats(ctx, stm, decode, n * 2);
+	if (flags & 8)
+		for (i = 0; i < n * 2; i++)
+			colorkey[i] = read_int(ctx, stm);
+
+	cbuf = read_compressed_buffer(ctx, stm);
+	image = fz_new_image_from_compressed_buffer(ctx, w, h, bpc, cs, xres, yres,
+		flags & 1, (flags >> 1) & 1, decode, (flags & 8) ? colorkey : NULL, cbuf, fz_keep_image(ctx, mask));
+	image->invert_cmyk_jpeg = (flags >> 2) & 1;
+	return image;
+}
+
+static void read_definition(fz_context *ctx, fz_list_reader *rd, int op);
+static void fini_reader(fz_context *ctx, fz_list_reader *rd);
+
+/* Read an image blob. */
+static fz_image *
+read_image_blob(fz_context *ctx, fz_list_reader *parent, fz_buffer *blob)
+{
+	fz_list_reader rd = { 0 };
+	fz_image *image = NULL;
+	int op, kind;
+
+	rd.get_image = parent->get_image;
+	rd.arg = parent->arg;
+	rd.depth = parent->depth + 1;
+	if (rd.depth > MAX_NESTING)
+		corrupt(ctx);
+
+	fz_try(ctx)
+	{
+		rd.stm = fz_open_buffer(ctx, blob);
+		while ((op = read_byte(ctx, rd.stm)) != DL_IMAGE)
+		{
+			if (op != DL_DEF_COLORSPACE && op != DL_DEF_IMAGE)
+				corrupt(ctx);
+			read_definition(ctx, &rd, op);
+		}
+		kind = read_byte(ctx, rd.stm);
+		if (kind == IMAGE_COMPRESSED)
+			image = read_image_compressed(ctx, &rd);
+		else if (kind == IMAGE_PIXMAP)
+			image = read_image_pixmap(ctx, &rd);
+		else
+			corrupt(ctx);
+	}
+	fz_always(ctx)
+		fini_reader(ctx, &rd);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return image;
+}
+
+static fz_image *
+read_image(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_stream *stm = rd->stm;
+	unsigned char digest[16], check[16];
+	fz_buffer *blob = NULL;
+	fz_image *image = NULL;
+	fz_md5 md5;
+
+	fz_var(blob);
+
+	read_exactly(ctx, stm, digest, 16);
+	fz_try(ctx)
+	{
+		if (read_byte(ctx, stm))
+			blob = read_data(ctx, stm);
+		else if (rd->get_image)
+			blob = rd->get_image(ctx, rd->arg, digest);
+		if (!blob)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find image for display list");
+
+		fz_md5_init(&md5);
+		fz_md5_update(&md5, blob->data, blob->len);
+		fz_md5_final(&md5, check);
+		if (memcmp(digest, check, 16))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "image does not match its digest");
+
+		image = read_image_blob(ctx, rd, blob);
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, blob);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return image;
+}
+
+/* Resource tables */
+
+static void
+drop_resource(fz_context *ctx, int type, void *res)
+{
+	switch (type)
+	{
+	case RES_COLORSPACE: fz_drop_colorspace(ctx, res); break;
+	case RES_FONT: fz_drop_font(ctx, res); break;
+	case RES_IMAGE: fz_drop_image(ctx, res); break;
+	case RES_SHADE: fz_drop_shade(ctx, res); break;
+	case RES_STROKE: fz_drop_stroke_state(ctx, res); break;
+	case RES_TEXT: fz_drop_text(ctx, res); break;
+	}
+}
+
+static void
+read_definition(fz_context *ctx, fz_list_reader *rd, int op)
+{
+	int type = op - DL_DEF_COLORSPACE;
+	void *res = NULL;
+
+	switch (op)
+	{
+	case DL_DEF_COLORSPACE: res = read_colorspace(ctx, rd); break;
+	case DL_DEF_FONT: res = read_font(ctx, rd); break;
+	case DL_DEF_IMAGE: res = read_image(ctx, rd); break;
+	case DL_DEF_SHADE: res = read_shade(ctx, rd); break;
+	case DL_DEF_STROKE: res = read_stroke(ctx, rd); break;
+	case DL_DEF_TEXT: res = read_text(ctx, rd); break;
+	}
+
+	/* A Type3 font's glyph lists may define further resources in the
+	 * same tables while it is read, so only make room once it is done. */
+	if (rd->len[type] == rd->cap[type])
+	{
+		fz_try(ctx)
+		{
+			int newcap = rd->cap[type] ? rd->cap[type] * 2 : 16;
+			rd->res[type] = fz_resize_array(ctx, rd->res[type], newcap, sizeof(void *));
+			rd->cap[type] = newcap;
+		}
+		fz_catch(ctx)
+		{
+			drop_resource(ctx, type, res);
+			fz_rethrow(ctx);
+		}
+	}
+
+	rd->res[type][rd->len[type]++] = res;
+}
+
+static void
+fini_reader(fz_context *ctx, fz_list_reader *rd)
+{
+	int type, i;
+
+	for (type = 0; type < RES_MAX; type++)
+	{
+		for (i = 0; i < rd->len[type]; i++)
+			drop_resource(ctx, type, rd->res[type][i]);
+		fz_free(ctx, rd->res[type]);
+	}
+	fz_drop_stream(ctx, rd->stm);
+}
+
+/* Paths */
+
+static fz_path *
+read_path(fz_context *ctx, fz_stream *stm)
+{
+	fz_path *path = fz_new_path(ctx);
+	float v[6];
+	int op;
+
+	fz_try(ctx)
+	{
+		while ((op = read_byte(ctx, stm)) != PATH_END)
+		{
+			switch (op)
+			{
+			case PATH_MOVETO:
+				read_floats(ctx, stm, v, 2);
+				fz_moveto(ctx, path, v[0], v[1]);
+				break;
+			case PATH_LINETO:
+				read_floats(ctx, stm, v, 2);
+				fz_lineto(ctx, path, v[0], v[1]);
+				break;
+			case PATH_CURVETO:
+				read_floats(ctx, stm, v, 6);
+				fz_curveto(ctx, path, v[0], v[1], v[2], v[3], v[4], v[5]);
+				break;
+			case PATH_QUADTO:
+				read_floats(ctx, stm, v, 4);
+				fz_quadto(ctx, path, v[0], v[1], v[2], v[3]);
+				break;
+			case PATH_RECTTO:
+				read_floats(ctx, stm, v, 4);
+				fz_rectto(ctx, path, v[0], v[1], v[2], v[3]);
+				break;
+			case PATH_CLOSE:
+				fz_closepath(ctx, path);
+				break;
+			default:
+				corrupt(ctx);
+			}
+		}
+		fz_trim_path(ctx, path);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_rethrow(ctx);
+	}
+	return path;
+}
+
+/* Lists */
+
+typedef struct
+{
+	fz_matrix ctm;
+	fz_colorspace *colorspace;
+	float color[FZ_MAX_COLORS];
+	float alpha;
+	fz_stroke_state *stroke;
+	fz_path *path;
+	fz_rect scissor;
+} fz_list_reader_state;
+
+static int
+read_state(fz_context *ctx, fz_list_reader *rd, fz_list_reader_state *st)
+{
+	fz_stream *stm = rd->stm;
+	int changes = read_byte(ctx, stm);
+
+	if (changes & CHANGE_CTM)
+		read_matrix(ctx, stm, &st->ctm);
+	if (changes & CHANGE_COLORSPACE)
+		st->colorspace = read_resource(ctx, rd, RES_COLORSPACE);
+	if (changes & CHANGE_COLOR)
+	{
+		if (!st->colorspace)
+			corrupt(ctx);
+		read_floats(ctx, stm, st->color, st->colorspace->n);
+	}
+	if (changes & CHANGE_ALPHA)
+		st->alpha = read_float(ctx, stm);
+	if (changes & CHANGE_STROKE)
+		st->stroke = read_resource(ctx, rd, RES_STROKE);
+	if (changes & HAS_SCISSOR)
+		read_rect(ctx, stm, &st->scissor);
+	if (changes & CHANGE_PATH)
+	{
+		fz_path *path = read_path(ctx, stm);
+		fz_drop_path(ctx, st->path);
+		st->path = path;
+	}
+	return changes;
+}
+
+static void
+run_op(fz_context *ctx, fz_list_reader *rd, fz_list_reader_state *st, fz_device *dev, int op)
+{
+	fz_stream *stm = rd->stm;
+	int changes = read_state(ctx, rd, st);
+	const fz_rect *scissor = (changes & HAS_SCISSOR) ? &st->scissor : NULL;
+	int needs_path = 0, needs_stroke = 0, needs_color = 0, needs_rect = 0;
+	int even_odd, flags;
+	fz_rect view;
+	float xstep, ystep;
+	int id, set, clear;
+
+	switch (op)
+	{
+	case DL_FILL_PATH: needs_path = needs_color = 1; break;
+	case DL_STROKE_PATH: needs_path = needs_stroke = needs_color = 1; break;
+	case DL_CLIP_PATH: needs_path = 1; break;
+	case DL_CLIP_STROKE_PATH: needs_path = needs_stroke = 1; break;
+	case DL_FILL_TEXT: needs_color = 1; break;
+	case DL_STROKE_TEXT: needs_stroke = needs_color = 1; break;
+	case DL_CLIP_STROKE_TEXT: needs_stroke = 1; break;
+	case DL_FILL_IMAGE_MASK: needs_color = 1; break;
+	case DL_BEGIN_GROUP: needs_rect = 1; break;
+	case DL_BEGIN_MASK: needs_rect = 1; break;
+	case DL_BEGIN_TILE: needs_rect = 1; break;
+	}
+	if ((needs_path && !st->path) || (needs_stroke && !st->stroke) || (needs_color && !st->colorspace) || (needs_rect && !scissor))
+		corrupt(ctx);
+
+	switch (op)
+	{
+	case DL_FILL_PATH:
+		even_odd = read_byte(ctx, stm);
+		fz_fill_path(ctx, dev, st->path, even_odd, &st->ctm, st->colorspace, st->color, st->alpha);
+		break;
+	case DL_STROKE_PATH:
+		fz_stroke_path(ctx, dev, st->path, st->stroke, &st->ctm, st->colorspace, st->color, st->alpha);
+		break;
+	case DL_CLIP_PATH:
+		even_odd = read_byte(ctx, stm);
+		fz_clip_path(ctx, dev, st->path, even_odd, &st->ctm, scissor);
+		break;
+	case DL_CLIP_STROKE_PATH:
+		fz_clip_stroke_path(ctx, dev, st->path, st->stroke, &st->ctm, scissor);
+		break;
+	case DL_FILL_TEXT:
+		fz_fill_text(ctx, dev, read_resource(ctx, rd, RES_TEXT), &st->ctm, st->colorspace, st->color, st->alpha);
+		break;
+	case DL_STROKE_TEXT:
+		fz_stroke_text(ctx, dev, read_resource(ctx, rd, RES_TEXT), st->stroke, &st->ctm, st->colorspace, st->color, st->alpha);
+		break;
+	case DL_CLIP_TEXT:
+		fz_clip_text(ctx, dev, read_resource(ctx, rd, RES_TEXT), &st->ctm, scissor);
+		break;
+	case DL_CLIP_STROKE_TEXT:
+		fz_clip_stroke_text(ctx, dev, read_resource(ctx, rd, RES_TEXT), st->stroke, &st->ctm, scissor);
+		break;
+	case DL_IGNORE_TEXT:
+		fz_ignore_text(ctx, dev, read_resource(ctx, rd, RES_TEXT), &st->ctm);
+		break;
+	case DL_FILL_SHADE:
+		fz_fill_shade(ctx, dev, read_resource(ctx, rd, RES_SHADE), &st->ctm, st->alpha);
+		break;
+	case DL_FILL_IMAGE:
+		fz_fill_image(ctx, dev, read_resource(ctx, rd, RES_IMAGE), &st->ctm, st->alpha);
+		break;
+	case DL_FILL_IMAGE_MASK:
+		fz_fill_image_mask(ctx, dev, read_resource(ctx, rd, RES_IMAGE), &st->ctm, st->colorspace, st->color, st->alpha);
+		break;
+	case DL_CLIP_IMAGE_MASK:
+		fz_clip_image_mask(ctx, dev, read_resource(ctx, rd, RES_IMAGE), &st->ctm, scissor);
+		break;
+	case DL_POP_CLIP:
+		fz_pop_clip(ctx, dev);
+		break;
+	case DL_BEGIN_MASK:
+		flags = read_byte(ctx, stm);
+		fz_begin_mask(ctx, dev, scissor, flags, st->colorspace, st->colorspace ? st->color : NULL);
+		break;
+	case DL_END_MASK:
+		fz_end_mask(ctx, dev);
+		break;
+	case DL_BEGIN_GROUP:
+		flags = read_byte(ctx, stm);
+		fz_begin_group(ctx, dev, scissor, flags & 1, (flags >> 1) & 1, read_uint(ctx, stm), st->alpha);
+		break;
+	case DL_END_GROUP:
+		fz_end_group(ctx, dev);
+		break;
+	case DL_BEGIN_TILE:
+		read_rect(ctx, stm, &view);
+		xstep = read_float(ctx, stm);
+		ystep = read_float(ctx, stm);
+		id = read_int(ctx, stm);
+		fz_begin_tile_id(ctx, dev, scissor, &view, xstep, ystep, &st->ctm, id);
+		break;
+	case DL_END_TILE:
+		fz_end_tile(ctx, dev);
+		break;
+	case DL_RENDER_FLAGS:
+		set = read_uint(ctx, stm);
+		clear = read_uint(ctx, stm);
+		fz_render_flags(ctx, dev, set, clear);
+		break;
+	default:
+		corrupt(ctx);
+	}
+}
+
+static fz_display_list *
+load_list(fz_context *ctx, fz_list_reader *rd)
+{
+	fz_list_reader_state st = { { 0 } };
+	fz_display_list *list;
+	fz_device *dev = NULL;
+	fz_rect mediabox;
+	int op;
+
+	fz_var(dev);
+
+	read_rect(ctx, rd->stm, &mediabox);
+	st.ctm = fz_identity;
+	st.alpha = 1;
+
+	list = fz_new_display_list(ctx, &mediabox);
+	fz_try(ctx)
+	{
+		dev = fz_new_list_device(ctx, list);
+		while ((op = read_byte(ctx, rd->stm)) != DL_END)
+		{
+			if (op >= DL_DEF_COLORSPACE && op <= DL_DEF_TEXT)
+				read_definition(ctx, rd, op);
+			else
+				run_op(ctx, rd, &st, dev, op);
+		}
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_path(ctx, st.path);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	return list;
+}
+
+fz_display_list *
+fz_load_display_list(fz_context *ctx, fz_stream *stm, fz_display_list_get_image_fn *get_image, void *arg)
+{
+	fz_list_reader rd = { 0 };
+	fz_display_list *list = NULL;
+	unsigned char magic[4];
+
+	rd.get_image = get_image;
+	rd.arg = arg;
+
+	fz_try(ctx)
+	{
+		read_exactly(ctx, stm, magic, 4);
+		if (memcmp(magic, dl_magic, 4))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "not a display list file");
+		if (read_byte(ctx, stm) != DL_VERSION)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unsupported display list version");
+		rd.stm = fz_keep_stream(ctx, stm);
+		list = load_list(ctx, &rd);
+	}
+	fz_always(ctx)
+		fini_reader(ctx, &rd);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return list;
+}
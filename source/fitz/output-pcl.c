@@ -689,7 +689,7 @@ fz_write_pixmap_as_pcl(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap,
 	fz_try(ctx)
 	{
 		fz_write_header(ctx, writer, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, pixmap->xres, pixmap->yres, 1);
-		fz_write_band(ctx, writer, pixmap->stride, 0, 0, pixmap->samples);
+		fz_write_band(ctx, writer, pixmap->stride, 0, pixmap->h, pixmap->samples);
 		fz_write_trailer(ctx, writer);
 	}
 	fz_always(ctx)
@@ -698,6 +698,12 @@ fz_write_pixmap_as_pcl(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap,
 		fz_rethrow(ctx);
 }
 
+typedef struct color_pcl_row_s
+{
+	int blank;
+	int delta_len;
+} color_pcl_row;
+
 typedef struct color_pcl_band_writer_s
 {
 	fz_band_writer super;
@@ -708,8 +714,94 @@ typedef struct color_pcl_band_writer_s
 	unsigned char *curr;
 	int fill;
 	int seed_valid;
+	int band_rows;
+	color_pcl_row *rows;
+	unsigned char *rows_rgb;
+	unsigned char *rows_delta;
 } color_pcl_band_writer;
 
+/* With a thread pool, every row of a band is copied and delta compressed
+ * against the row above it by jobs before any of them are written. The
+ * seed row used when writing the rows in order is always the row above
+ * (or a copy of it), so the band writer only has to check whether each
+ * delta fits in the block it is filling, and the output is the same. */
+typedef struct color_pcl_job_s
+{
+	color_pcl_band_writer *writer;
+	const unsigned char *sp;
+	int stride;
+	int y0;
+	int y1;
+	int copied;
+} color_pcl_job;
+
+static void
+color_pcl_compress_rows(fz_context *ctx, void *arg)
+{
+	color_pcl_job *job = (color_pcl_job *)arg;
+	color_pcl_band_writer *writer = job->writer;
+	int w = writer->super.w;
+	int ds = w * 3;
+	const unsigned char *sp = job->sp + job->y0 * job->stride;
+	int y;
+
+	/* Copy every row first, as each row's delta needs the row above. */
+	for (y = job->y0; y < job->y1 - job->copied; y++, sp += job->stride)
+		writer->rows[y].blank = line_is_blank(writer->rows_rgb + y * ds, sp, w);
+
+	for (y = job->y0; y < job->y1; y++)
+	{
+		unsigned char *curr = writer->rows_rgb + y * ds;
+		unsigned char *prev = (y > 0 ? curr - ds : writer->prev);
+		writer->rows[y].delta_len = delta_compression(curr, prev, writer->rows_delta + y * ds, ds, ds);
+	}
+}
+
+static void
+color_pcl_compress_band(fz_context *ctx, color_pcl_band_writer *writer, int stride, int band_height, const unsigned char *sp)
+{
+	fz_thread_pool *pool = writer->super.pool;
+	int ds = writer->super.w * 3;
+	color_pcl_job *jobs;
+	int njobs, i;
+
+	if (writer->band_rows < band_height)
+	{
+		writer->rows = fz_resize_array(ctx, writer->rows, band_height, sizeof(*writer->rows));
+		writer->rows_rgb = fz_resize_array(ctx, writer->rows_rgb, band_height, ds);
+		writer->rows_delta = fz_resize_array(ctx, writer->rows_delta, band_height, ds);
+		writer->band_rows = band_height;
+	}
+
+	/* The first row of each job is compressed against the last row of
+	 * the job before, so copy those in advance. */
+	njobs = fz_mini(band_height, 4 * (fz_thread_pool_size(ctx, pool) + 1));
+	for (i = 1; i < njobs; i++)
+	{
+		int y = band_height * i / njobs - 1;
+		writer->rows[y].blank = line_is_blank(writer->rows_rgb + y * ds, sp + y * stride, writer->super.w);
+	}
+
+	jobs = fz_malloc_array(ctx, njobs, sizeof(*jobs));
+	fz_try(ctx)
+	{
+		for (i = 0; i < njobs; i++)
+		{
+			jobs[i].writer = writer;
+			jobs[i].sp = sp;
+			jobs[i].stride = stride;
+			jobs[i].y0 = band_height * i / njobs;
+			jobs[i].y1 = band_height * (i + 1) / njobs;
+			jobs[i].copied = (i < njobs - 1);
+			fz_thread_pool_submit(ctx, pool, color_pcl_compress_rows, &jobs[i]);
+		}
+		fz_thread_pool_wait(ctx, pool);
+	}
+	fz_always(ctx)
+		fz_free(ctx, jobs);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
 static void
 color_pcl_write_header(fz_context *ctx, fz_band_writer *writer_)
 {
@@ -781,6 +873,7 @@ color_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int b
 	unsigned char *prev;
 	unsigned char *curr;
 	unsigned char *comp;
+	color_pcl_row *rows = NULL;
 
 	ds = w * 3;
 	ss = w * 4;
@@ -794,6 +887,12 @@ color_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int b
 	if (band_start+band_height >= h)
 		band_height = h - band_start;
 
+	if (writer->super.pool && band_height > 0)
+	{
+		color_pcl_compress_band(ctx, writer, stride, band_height, sp);
+		rows = writer->rows;
+	}
+
 	y = 0;
 	while (y < band_height)
 	{
@@ -804,9 +903,17 @@ color_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int b
 			blanks = 0;
 			while (blanks < 32767 && y < band_height)
 			{
-				if (!line_is_blank(curr, sp, w))
+				if (rows)
+				{
+					curr = writer->rows_rgb + y * ds;
+					if (!rows[y].blank)
+						break;
+				}
+				else if (!line_is_blank(curr, sp, w))
 					break;
 				blanks++;
+				sp += stride;
+				y++;
 			}
 
 			if (blanks)
@@ -830,12 +937,14 @@ color_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int b
 			break;
 
 		/* So, at least 1 more line to copy, and it's in curr */
+		if (rows)
+			prev = (y > 0 ? curr - ds : writer->prev);
 		if (seed_valid && fill + 5 <= 32767 && memcmp(curr, prev, ds) == 0)
 		{
 			int count = 1;
 			sp += stride;
 			y++;
-			while (count < 32767 && y < h)
+			while (count < 32767 && y < band_height)
 			{
 				if (memcmp(sp-stride, sp, ss) != 0)
 					break;
@@ -853,7 +962,19 @@ color_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int b
 			int len = 0;
 
 			if (seed_valid)
-				len = delta_compression(curr, prev, &comp[fill+3], ds, fz_mini(ds, 32767 - fill - len - 3));
+			{
+				if (rows)
+				{
+					/* Use the delta only if it would have fitted. */
+					len = rows[y].delta_len;
+					if (len > 32767 - fill - 3)
+						len = 0;
+					if (len)
+						memcpy(&comp[fill+3], writer->rows_delta + y * ds, len);
+				}
+				else
+					len = delta_compression(curr, prev, &comp[fill+3], ds, fz_mini(ds, 32767 - fill - len - 3));
+			}
 
 			if (fill + len + 3 > 32767)
 			{
@@ -893,14 +1014,24 @@ color_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int b
 			}
 
 			/* curr becomes prev */
-			tmp = prev; prev = curr; curr = tmp;
+			if (!rows)
+			{
+				tmp = prev; prev = curr; curr = tmp;
+			}
 			sp += stride;
 			y++;
 		}
 	}
 
-	writer->prev = prev;
-	writer->curr = curr;
+	/* The rows were compressed in place, so copy the last of them to
+	 * where the next band will look for its seed row. */
+	if (rows)
+		memcpy(writer->prev, writer->rows_rgb + (band_height - 1) * ds, ds);
+	else
+	{
+		writer->prev = prev;
+		writer->curr = curr;
+	}
 	writer->fill = fill;
 	writer->compbuf = comp;
 	writer->seed_valid = seed_valid;
@@ -929,6 +1060,9 @@ color_pcl_drop_band_writer(fz_context *ctx, fz_band_writer *writer_)
 
 	fz_free(ctx, writer->compbuf);
 	fz_free(ctx, writer->linebuf);
+	fz_free(ctx, writer->rows);
+	fz_free(ctx, writer->rows_rgb);
+	fz_free(ctx, writer->rows_delta);
 }
 
 fz_band_writer *fz_new_color_pcl_band_writer(fz_context *ctx, fz_output *out, const fz_pcl_options *options)
@@ -1086,6 +1220,13 @@ fz_write_bitmap_as_pcl(fz_context *ctx, fz_output *out, const fz_bitmap *bitmap,
 		fz_rethrow(ctx);
 }
 
+typedef struct mono_pcl_row_s
+{
+	int blank;
+	int count2;
+	int count3;
+} mono_pcl_row;
+
 typedef struct mono_pcl_band_writer_s
 {
 	fz_band_writer super;
@@ -1095,8 +1236,138 @@ typedef struct mono_pcl_band_writer_s
 	unsigned char *mode3buf;
 	int top_of_page;
 	int num_blank_lines;
+	int max_mode_2_size;
+	int max_mode_3_size;
+	int band_rows;
+	mono_pcl_row *rows;
+	unsigned char *rows_mode2buf;
+	unsigned char *rows_mode3buf;
 } mono_pcl_band_writer;
 
+/* With a thread pool, the rows of a band are compressed by jobs before
+ * any of them are written. Each row is compressed against the row
+ * above it, or against a cleared seed row if the row above is blank,
+ * which is exactly the seed row that writing the rows one after
+ * another would have left. So the band writer only has to choose
+ * between the results, and the output is the same. */
+typedef struct mono_pcl_job_s
+{
+	mono_pcl_band_writer *writer;
+	const unsigned char *data;
+	const unsigned char *prev;
+	int ss;
+	int y0;
+	int y1;
+} mono_pcl_job;
+
+/* Mask of the bits of the last byte of a line that hold pixels. */
+static int
+mono_pcl_rmask(int w)
+{
+	return (int)(~0u << (-w & 7));
+}
+
+static int
+mono_pcl_line_is_blank(const unsigned char *data, int line_size, int rmask)
+{
+	const unsigned char *end_data = data + line_size;
+
+	if ((end_data[-1] & rmask) == 0)
+	{
+		end_data--;
+		while (end_data > data && end_data[-1] == 0)
+			end_data--;
+	}
+	return end_data == data;
+}
+
+static void
+mono_pcl_compress_rows(fz_context *ctx, void *arg)
+{
+	mono_pcl_job *job = (mono_pcl_job *)arg;
+	mono_pcl_band_writer *writer = job->writer;
+	int w = writer->super.w;
+	int features = writer->options.features;
+	int line_size = (w + 7)/8;
+	int rmask = mono_pcl_rmask(w);
+	const unsigned char *data = job->data + job->y0 * job->ss;
+	const unsigned char *prev = job->prev;
+	unsigned char *seed;
+	int y;
+
+	seed = fz_malloc(ctx, line_size);
+	for (y = job->y0; y < job->y1; y++, data += job->ss)
+	{
+		mono_pcl_row *row = &writer->rows[y];
+
+		row->blank = mono_pcl_line_is_blank(data, line_size, rmask);
+		if (row->blank)
+		{
+			prev = NULL;
+			continue;
+		}
+
+		row->count2 = mode2compress(writer->rows_mode2buf + y * writer->max_mode_2_size, data, line_size);
+		if (features & PCL_MODE_3_COMPRESSION)
+		{
+			if (prev)
+				memcpy(seed, prev, line_size);
+			else
+				memset(seed, 0, line_size);
+			row->count3 = mode3compress(writer->rows_mode3buf + y * writer->max_mode_3_size, data, seed, line_size);
+		}
+		prev = data;
+	}
+	fz_free(ctx, seed);
+}
+
+static void
+mono_pcl_compress_band(fz_context *ctx, mono_pcl_band_writer *writer, int ss, int band_height, const unsigned char *data)
+{
+	fz_thread_pool *pool = writer->super.pool;
+	int w = writer->super.w;
+	int line_size = (w + 7)/8;
+	int rmask = mono_pcl_rmask(w);
+	mono_pcl_job *jobs;
+	int njobs, i;
+
+	if (writer->band_rows < band_height)
+	{
+		writer->rows = fz_resize_array(ctx, writer->rows, band_height, sizeof(*writer->rows));
+		writer->rows_mode2buf = fz_resize_array(ctx, writer->rows_mode2buf, band_height, writer->max_mode_2_size);
+		if (writer->options.features & PCL_MODE_3_COMPRESSION)
+			writer->rows_mode3buf = fz_resize_array(ctx, writer->rows_mode3buf, band_height, writer->max_mode_3_size);
+		writer->band_rows = band_height;
+	}
+
+	njobs = fz_mini(band_height, 4 * (fz_thread_pool_size(ctx, pool) + 1));
+	jobs = fz_malloc_array(ctx, njobs, sizeof(*jobs));
+	fz_try(ctx)
+	{
+		for (i = 0; i < njobs; i++)
+		{
+			jobs[i].writer = writer;
+			jobs[i].data = data;
+			jobs[i].ss = ss;
+			jobs[i].y0 = band_height * i / njobs;
+			jobs[i].y1 = band_height * (i + 1) / njobs;
+			if (jobs[i].y0 > 0)
+			{
+				const unsigned char *above = data + (jobs[i].y0 - 1) * ss;
+				jobs[i].prev = mono_pcl_line_is_blank(above, line_size, rmask) ? NULL : above;
+			}
+			else
+				jobs[i].prev = writer->num_blank_lines > 0 ? NULL : writer->prev;
+			fz_thread_pool_submit(ctx, pool, mono_pcl_compress_rows, &jobs[i]);
+		}
+		fz_thread_pool_wait(ctx, pool);
+	}
+	fz_always(ctx)
+		fz_free(ctx, jobs);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 static void
 mono_pcl_write_header(fz_context *ctx, fz_band_writer *writer_)
 {
@@ -1117,6 +1388,8 @@ mono_pcl_write_header(fz_context *ctx, fz_band_writer *writer_)
 	writer->prev = fz_calloc(ctx, line_size, sizeof(unsigned char));
 	writer->mode2buf = fz_calloc(ctx, max_mode_2_size, sizeof(unsigned char));
 	writer->mode3buf = fz_calloc(ctx, max_mode_3_size, sizeof(unsigned char));
+	writer->max_mode_2_size = max_mode_2_size;
+	writer->max_mode_3_size = max_mode_3_size;
 	writer->num_blank_lines = 0;
 	writer->top_of_page = 1;
 
@@ -1140,6 +1413,7 @@ mono_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int ss, int band_s
 	int h = writer->super.h;
 	int yres = writer->super.yres;
 	const unsigned char *out_data;
+	const unsigned char *last_data = NULL;
 	int y, rmask, line_size;
 	int num_blank_lines;
 	int compression = -1;
@@ -1148,27 +1422,40 @@ mono_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int ss, int band_s
 	unsigned char *mode3buf = NULL;
 	int out_count;
 	const fz_pcl_options *pcl;
+	mono_pcl_row *rows = NULL;
 
 	num_blank_lines = writer->num_blank_lines;
-	rmask = ~0 << (-w & 7);
+	rmask = mono_pcl_rmask(w);
 	line_size = (w + 7)/8;
 	prev = writer->prev;
 	mode2buf = writer->mode2buf;
 	mode3buf = writer->mode3buf;
 	pcl = &writer->options;
 
+	if (band_start+band_height >= h)
+		band_height = h - band_start;
+
+	if (writer->super.pool && (pcl->features & (PCL_MODE_2_COMPRESSION | PCL_MODE_3_COMPRESSION)))
+	{
+		mono_pcl_compress_band(ctx, writer, ss, band_height, data);
+		rows = writer->rows;
+	}
+
 	/* Transfer raster graphics. */
-	for (y = 0; y < h; y++, data += ss)
+	for (y = 0; y < band_height; y++, data += ss)
 	{
-		const unsigned char *end_data = data + line_size;
+		int blank;
 
-		if ((end_data[-1] & rmask) == 0)
+		if (rows)
 		{
-			end_data--;
-			while (end_data > data && end_data[-1] == 0)
-				end_data--;
+			blank = rows[y].blank;
+			mode2buf = writer->rows_mode2buf + y * writer->max_mode_2_size;
+			if (writer->rows_mode3buf)
+				mode3buf = writer->rows_mode3buf + y * writer->max_mode_3_size;
 		}
-		if (end_data == data)
+		else
+			blank = mono_pcl_line_is_blank(data, line_size, rmask);
+		if (blank)
 		{
 			/* Blank line */
 			num_blank_lines++;
@@ -1257,8 +1544,8 @@ mono_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int ss, int band_s
 			/* Compression modes 2 and 3 are both available. Try
 			 * both and see which produces the least output data.
 			 */
-			int count3 = mode3compress(mode3buf, data, prev, line_size);
-			int count2 = mode2compress(mode2buf, data, line_size);
+			int count3 = rows ? rows[y].count3 : mode3compress(mode3buf, data, prev, line_size);
+			int count2 = rows ? rows[y].count2 : mode2compress(mode2buf, data, line_size);
 			int penalty3 = (compression == 3 ? 0 : penalty_from2to3);
 			int penalty2 = (compression == 2 ? 0 : penalty_from3to2);
 
@@ -1282,7 +1569,7 @@ mono_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int ss, int band_s
 		else if (pcl->features & PCL_MODE_2_COMPRESSION)
 		{
 			out_data = mode2buf;
-			out_count = mode2compress(mode2buf, data, line_size);
+			out_count = rows ? rows[y].count2 : mode2compress(mode2buf, data, line_size);
 		}
 		else
 		{
@@ -1293,8 +1580,14 @@ mono_pcl_write_band(fz_context *ctx, fz_band_writer *writer_, int ss, int band_s
 		/* Transfer the data */
 		fz_printf(ctx, out, "\033*b%dW", out_count);
 		fz_write(ctx, out, out_data, out_count);
+		last_data = data;
 	}
 
+	/* The rows were compressed against copies of the seed row, so
+	 * bring the real one up to date. */
+	if (rows && last_data && (pcl->features & PCL_MODE_3_COMPRESSION))
+		memcpy(prev, last_data, line_size);
+
 	writer->num_blank_lines = num_blank_lines;
 }
 
@@ -1322,6 +1615,9 @@ mono_pcl_drop_band_writer(fz_context *ctx, fz_band_writer *writer_)
 	fz_free(ctx, writer->prev);
 	fz_free(ctx, writer->mode2buf);
 	fz_free(ctx, writer->mode3buf);
+	fz_free(ctx, writer->rows);
+	fz_free(ctx, writer->rows_mode2buf);
+	fz_free(ctx, writer->rows_mode3buf);
 }
 
 fz_band_writer *fz_new_mono_pcl_band_writer(fz_context *ctx, fz_output *out, const fz_pcl_options *options)
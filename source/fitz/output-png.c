@@ -85,8 +85,194 @@ typedef struct png_band_writer_s
 	unsigned char *cdata;
 	uLong usize, csize;
 	z_stream stream;
+	int started;
+	uLong adler;
+	int history;
+	int pending;
 } png_band_writer;
 
+/* When a band writer has a thread pool, the filtered rows are cut into
+ * pieces of about this many bytes, which are deflated as separate raw
+ * deflate streams. Each piece is primed with the 32K of
+ * data before it, and ends with a sync flush (or with the end of the
+ * stream for the last piece of the image), so that the pieces join up
+ * into a single zlib stream. The zlib header and checksum are written
+ * by the band writer itself. */
+#define PNG_PIECE_SIZE (256 << 10)
+#define PNG_WINDOW_SIZE 32768
+
+typedef struct png_piece_s
+{
+	const unsigned char *dict;
+	const unsigned char *in;
+	unsigned char *out;
+	int dict_len;
+	int in_len;
+	int out_len;
+	int last;
+	uLong adler;
+} png_piece;
+
+static void
+png_deflate_piece(fz_context *ctx, void *arg)
+{
+	png_piece *piece = (png_piece *)arg;
+	z_stream stream;
+	uLong cap;
+	int err;
+
+	memset(&stream, 0, sizeof stream);
+	err = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (err != Z_OK)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+
+	fz_try(ctx)
+	{
+		if (piece->dict_len > 0)
+		{
+			err = deflateSetDictionary(&stream, piece->dict, piece->dict_len);
+			if (err != Z_OK)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+		}
+
+		/* The bound allows for a single deflate call finishing the
+		 * stream; leave some room for the sync flush marker. */
+		cap = deflateBound(&stream, piece->in_len) + 16;
+		piece->out = fz_malloc(ctx, cap);
+		stream.next_in = (Bytef *)piece->in;
+		stream.avail_in = (uInt)piece->in_len;
+		stream.next_out = piece->out;
+		stream.avail_out = (uInt)cap;
+		while (1)
+		{
+			err = deflate(&stream, piece->last ? Z_FINISH : Z_SYNC_FLUSH);
+			if (err == Z_STREAM_END)
+				break;
+			if (err != Z_OK && err != Z_BUF_ERROR)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+			if (stream.avail_out != 0 && !piece->last)
+				break;
+			piece->out = fz_resize_array(ctx, piece->out, cap * 2, 1);
+			stream.next_out = piece->out + cap;
+			stream.avail_out = (uInt)cap;
+			cap *= 2;
+		}
+		piece->out_len = (int)(stream.next_out - piece->out);
+		piece->adler = adler32(adler32(0, NULL, 0), piece->in, piece->in_len);
+	}
+	fz_always(ctx)
+		deflateEnd(&stream);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static unsigned char *
+png_filter_rows(unsigned char *dp, const unsigned char *sp, int stride, int w, int n, int band_height)
+{
+	int y, x, k;
+
+	stride -= w*n;
+	for (y = 0; y < band_height; y++)
+	{
+		*dp++ = 1; /* sub prediction filter */
+		for (x = 0; x < w; x++)
+		{
+			for (k = 0; k < n; k++)
+			{
+				if (x == 0)
+					dp[k] = sp[k];
+				else
+					dp[k] = sp[k] - sp[k-n];
+			}
+			sp += n;
+			dp += n;
+		}
+		sp += stride;
+	}
+	return dp;
+}
+
+static void
+png_write_band_pieces(fz_context *ctx, png_band_writer *writer, int stride, int band_height, const unsigned char *sp, int finalband)
+{
+	fz_output *out = writer->super.out;
+	fz_thread_pool *pool = writer->super.pool;
+	int row_len = writer->super.w * writer->super.n + 1;
+	int piece_len = fz_maxi(1, PNG_PIECE_SIZE / row_len) * row_len;
+	png_piece *pieces;
+	unsigned char *data;
+	int npieces, i, len, pos;
+	unsigned char block[4];
+
+	/* Rows are gathered until there are enough for a piece, so that the
+	 * pieces (and so the output) are the same however the image is cut
+	 * into bands. The end of the data already compressed is kept in
+	 * front of the rest, to prime the first of the next pieces. */
+	len = writer->pending + row_len * band_height;
+	if (PNG_WINDOW_SIZE + (uLong)len > writer->usize)
+	{
+		writer->udata = fz_resize_array(ctx, writer->udata, PNG_WINDOW_SIZE + len, 1);
+		writer->usize = PNG_WINDOW_SIZE + len;
+	}
+	data = writer->udata + PNG_WINDOW_SIZE;
+	png_filter_rows(data + writer->pending, sp, stride, writer->super.w, writer->super.n, band_height);
+
+	if (finalband)
+		npieces = fz_maxi(1, (len + piece_len - 1) / piece_len);
+	else
+		npieces = len / piece_len;
+
+	pieces = fz_calloc(ctx, npieces, sizeof(*pieces));
+	fz_try(ctx)
+	{
+		pos = 0;
+		for (i = 0; i < npieces; i++)
+		{
+			int dict_len = fz_mini(pos + writer->history, PNG_WINDOW_SIZE);
+			pieces[i].dict = data + pos - dict_len;
+			pieces[i].dict_len = dict_len;
+			pieces[i].in = data + pos;
+			pieces[i].in_len = fz_mini(piece_len, len - pos);
+			pieces[i].last = finalband && i == npieces-1;
+			pos += pieces[i].in_len;
+			fz_thread_pool_submit(ctx, pool, png_deflate_piece, &pieces[i]);
+		}
+		fz_thread_pool_wait(ctx, pool);
+
+		if (!writer->started && npieces > 0)
+		{
+			/* zlib header: deflate, 32K window, default compression */
+			block[0] = 0x78;
+			block[1] = 0x9c;
+			putchunk(ctx, out, "IDAT", block, 2);
+			writer->adler = adler32(0, NULL, 0);
+			writer->started = 1;
+		}
+		for (i = 0; i < npieces; i++)
+		{
+			putchunk(ctx, out, "IDAT", pieces[i].out, pieces[i].out_len);
+			writer->adler = adler32_combine(writer->adler, pieces[i].adler, pieces[i].in_len);
+		}
+		if (finalband)
+		{
+			big32(block, (unsigned int)writer->adler);
+			putchunk(ctx, out, "IDAT", block, 4);
+		}
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < npieces; i++)
+			fz_free(ctx, pieces[i].out);
+		fz_free(ctx, pieces);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	writer->history = fz_mini(writer->history + pos, PNG_WINDOW_SIZE);
+	writer->pending = len - pos;
+	memmove(data - writer->history, data + pos - writer->history, writer->history + writer->pending);
+}
+
 static void
 png_write_header(fz_context *ctx, fz_band_writer *writer_)
 {
@@ -120,6 +306,10 @@ png_write_header(fz_context *ctx, fz_band_writer *writer_)
 	head[11] = 0; /* filter */
 	head[12] = 0; /* interlace */
 
+	writer->started = 0;
+	writer->history = 0;
+	writer->pending = 0;
+
 	fz_write(ctx, out, pngsig, 8);
 	putchunk(ctx, out, "IHDR", head, 13);
 }
@@ -130,7 +320,7 @@ png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_st
 	png_band_writer *writer = (png_band_writer *)(void *)writer_;
 	fz_output *out = writer->super.out;
 	unsigned char *dp;
-	int y, x, k, err, finalband;
+	int err, finalband;
 	int w, h, n;
 
 	w = writer->super.w;
@@ -141,6 +331,12 @@ png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_st
 	if (finalband)
 		band_height = h - band_start;
 
+	if (writer->super.pool)
+	{
+		png_write_band_pieces(ctx, writer, stride, band_height, sp, finalband);
+		return;
+	}
+
 	if (writer->udata == NULL)
 	{
 		writer->usize = (w * n + 1) * band_height;
@@ -157,25 +353,7 @@ png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_st
 			fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
 	}
 
-	dp = writer->udata;
-	stride -= w*n;
-	for (y = 0; y < band_height; y++)
-	{
-		*dp++ = 1; /* sub prediction filter */
-		for (x = 0; x < w; x++)
-		{
-			for (k = 0; k < n; k++)
-			{
-				if (x == 0)
-					dp[k] = sp[k];
-				else
-					dp[k] = sp[k] - sp[k-n];
-			}
-			sp += n;
-			dp += n;
-		}
-		sp += stride;
-	}
+	dp = png_filter_rows(writer->udata, sp, stride, w, n, band_height);
 
 	writer->stream.next_in = (Bytef*)writer->udata;
 	writer->stream.avail_in = (uInt)(dp - writer->udata);
@@ -192,8 +370,10 @@ png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_st
 		}
 		else
 		{
+			/* Everything held back by earlier bands comes out
+			 * now, so it may take more than one buffer full. */
 			err = deflate(&writer->stream, Z_FINISH);
-			if (err != Z_STREAM_END)
+			if (err != Z_STREAM_END && (err != Z_OK || writer->stream.avail_out != 0))
 				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
 		}
 
@@ -211,9 +391,12 @@ png_write_trailer(fz_context *ctx, fz_band_writer *writer_)
 	unsigned char block[1];
 	int err;
 
-	err = deflateEnd(&writer->stream);
-	if (err != Z_OK)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+	if (!writer->super.pool)
+	{
+		err = deflateEnd(&writer->stream);
+		if (err != Z_OK)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+	}
 
 	putchunk(ctx, out, "IEND", block, 0);
 }
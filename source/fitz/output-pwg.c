@@ -87,169 +87,363 @@ fz_write_pwg_page_header(fz_context *ctx, fz_output *out, const fz_pwg_options *
 	fz_write(ctx, out, pwg ? pwg->page_size_name : zero, 64);
 }
 
-void
-fz_write_pixmap_as_pwg_page(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap, const fz_pwg_options *pwg)
+/* Encode a line of pixels, using a packbits like compression. Returns the
+ * number of bytes written, which is at most w * (n + 1). */
+static int
+pwg_encode_line(unsigned char *dp, const unsigned char *sp, int w, int n)
 {
-	unsigned char *sp;
-	int y, x, sn, dn, ss, ss2;
+	unsigned char *dp0 = dp;
+	int x = 0;
 
-	if (!out || !pixmap)
-		return;
+	while (x < w)
+	{
+		int d;
 
-	if (pixmap->alpha != 0)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write pwg with alpha");
-	sn = pixmap->n;
-	if (sn != 1 && sn != 3 && sn != 4)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale, rgb or cmyk to write as pwg");
+		/* How far do we have to look to find a repeated value? */
+		for (d = 1; d < 128 && x+d < w; d++)
+		{
+			if (memcmp(sp + (d-1)*n, sp + d*n, n) == 0)
+				break;
+		}
+		if (d == 1)
+		{
+			int xrep;
+
+			/* We immediately have a repeat (or we've hit
+			 * the end of the line). Count the number of
+			 * times this value is repeated. */
+			for (xrep = 1; xrep < 128 && x+xrep < w; xrep++)
+			{
+				if (memcmp(sp, sp + xrep*n, n) != 0)
+					break;
+			}
+			*dp++ = xrep-1;
+			memcpy(dp, sp, n);
+			dp += n;
+			sp += n*xrep;
+			x += xrep;
+		}
+		else
+		{
+			*dp++ = 257-d;
+			memcpy(dp, sp, d*n);
+			dp += d*n;
+			sp += d*n;
+			x += d;
+		}
+	}
 
-	dn = pixmap->n;
+	return dp - dp0;
+}
 
-	fz_write_pwg_page_header(ctx, out, pwg, pixmap->xres, pixmap->yres, pixmap->w, pixmap->h, dn*8);
+/* As pwg_encode_line, but for a line of bits, encoded as bytes. Returns
+ * the number of bytes written, which is at most byte_width * 2. */
+static int
+pwg_encode_mono_line(unsigned char *dp, const unsigned char *sp, int byte_width)
+{
+	unsigned char *dp0 = dp;
+	int x = 0;
 
-	/* Now output the actual bitmap, using a packbits like compression */
-	sp = pixmap->samples;
-	ss = pixmap->w * sn;
-	ss2 = pixmap->stride;
-	y = 0;
-	while (y < pixmap->h)
+	while (x < byte_width)
 	{
-		int yrep;
-
-		assert(sp == pixmap->samples + y * ss2);
+		int d;
 
-		/* Count the number of times this line is repeated */
-		for (yrep = 1; yrep < 256 && y+yrep < pixmap->h; yrep++)
+		/* How far do we have to look to find a repeated value? */
+		for (d = 1; d < 128 && x+d < byte_width; d++)
 		{
-			if (memcmp(sp, sp + yrep * ss2, ss) != 0)
+			if (sp[d-1] == sp[d])
 				break;
 		}
-		fz_write_byte(ctx, out, yrep-1);
-
-		/* Encode the line */
-		x = 0;
-		while (x < pixmap->w)
+		if (d == 1)
 		{
-			int d;
-
-			assert(sp == pixmap->samples + y * ss2 + x * sn);
+			int xrep;
 
-			/* How far do we have to look to find a repeated value? */
-			for (d = 1; d < 128 && x+d < pixmap->w; d++)
+			/* We immediately have a repeat (or we've hit
+			 * the end of the line). Count the number of
+			 * times this value is repeated. */
+			for (xrep = 1; xrep < 128 && x+xrep < byte_width; xrep++)
 			{
-				if (memcmp(sp + (d-1)*sn, sp + d*sn, sn) == 0)
+				if (sp[0] != sp[xrep])
 					break;
 			}
-			if (d == 1)
-			{
-				int xrep;
-
-				/* We immediately have a repeat (or we've hit
-				 * the end of the line). Count the number of
-				 * times this value is repeated. */
-				for (xrep = 1; xrep < 128 && x+xrep < pixmap->w; xrep++)
-				{
-					if (memcmp(sp, sp + xrep*sn, sn) != 0)
-						break;
-				}
-				fz_write_byte(ctx, out, xrep-1);
-				fz_write(ctx, out, sp, dn);
-				sp += sn*xrep;
-				x += xrep;
-			}
-			else
-			{
-				fz_write_byte(ctx, out, 257-d);
-				x += d;
-				while (d > 0)
-				{
-					fz_write(ctx, out, sp, dn);
-					sp += sn;
-					d--;
-				}
-			}
+			*dp++ = xrep-1;
+			*dp++ = sp[0];
+			sp += xrep;
+			x += xrep;
+		}
+		else
+		{
+			*dp++ = 257-d;
+			memcpy(dp, sp, d);
+			dp += d;
+			sp += d;
+			x += d;
 		}
-
-		/* Move to the next line */
-		sp += ss2*(yrep-1);
-		y += yrep;
 	}
+
+	return dp - dp0;
 }
 
-void
-fz_write_bitmap_as_pwg_page(fz_context *ctx, fz_output *out, const fz_bitmap *bitmap, const fz_pwg_options *pwg)
+/* Each line is written as a count of how many times it is repeated (up
+ * to 256), followed by the encoded line. A run of repeated lines may
+ * carry on into the next band, so the last line of a band is kept back
+ * until the band after it shows where its run ends. */
+typedef struct pwg_run_s
 {
-	unsigned char *sp;
-	int y, x, ss;
-	int byte_width;
+	const unsigned char *line;
+	int yrep;
+} pwg_run;
 
-	if (!out || !bitmap)
+typedef struct pwg_band_writer_s
+{
+	fz_band_writer super;
+	fz_pwg_options pwg;
+	int mono;
+	int line_len;
+	int max_len;
+	unsigned char *line;
+	int yrep;
+	unsigned char *buf;
+	int max_runs;
+	pwg_run *runs;
+} pwg_band_writer;
+
+/* With a thread pool, the runs of lines found in a band are shared out
+ * between jobs, each of which encodes its runs into a buffer of its
+ * own. The buffers are then written in order. */
+typedef struct pwg_job_s
+{
+	pwg_band_writer *writer;
+	pwg_run *runs;
+	int nruns;
+	unsigned char *buf;
+	int len;
+} pwg_job;
+
+static int
+pwg_encode_run(pwg_band_writer *writer, unsigned char *dp, const pwg_run *run)
+{
+	dp[0] = run->yrep-1;
+	if (writer->mono)
+		return 1 + pwg_encode_mono_line(dp+1, run->line, writer->line_len);
+	return 1 + pwg_encode_line(dp+1, run->line, writer->super.w, writer->super.n);
+}
+
+static void
+pwg_encode_runs(fz_context *ctx, void *arg)
+{
+	pwg_job *job = (pwg_job *)arg;
+	int i;
+
+	job->len = 0;
+	for (i = 0; i < job->nruns; i++)
+		job->len += pwg_encode_run(job->writer, job->buf + job->len, &job->runs[i]);
+}
+
+static void
+pwg_write_runs(fz_context *ctx, pwg_band_writer *writer, int nruns)
+{
+	fz_output *out = writer->super.out;
+	fz_thread_pool *pool = writer->super.pool;
+	pwg_job *jobs;
+	int njobs, i;
+
+	if (!pool || nruns < 2)
+	{
+		for (i = 0; i < nruns; i++)
+			fz_write(ctx, out, writer->buf, pwg_encode_run(writer, writer->buf, &writer->runs[i]));
 		return;
+	}
+
+	njobs = fz_mini(nruns, 4 * (fz_thread_pool_size(ctx, pool) + 1));
+	jobs = fz_calloc(ctx, njobs, sizeof(*jobs));
+	fz_try(ctx)
+	{
+		for (i = 0; i < njobs; i++)
+		{
+			int r0 = nruns * i / njobs;
+			int r1 = nruns * (i + 1) / njobs;
+			jobs[i].writer = writer;
+			jobs[i].runs = writer->runs + r0;
+			jobs[i].nruns = r1 - r0;
+			jobs[i].buf = fz_malloc_array(ctx, r1 - r0, writer->max_len + 1);
+		}
+		for (i = 0; i < njobs; i++)
+			fz_thread_pool_submit(ctx, pool, pwg_encode_runs, &jobs[i]);
+		fz_thread_pool_wait(ctx, pool);
+		for (i = 0; i < njobs; i++)
+			fz_write(ctx, out, jobs[i].buf, jobs[i].len);
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < njobs; i++)
+			fz_free(ctx, jobs[i].buf);
+		fz_free(ctx, jobs);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
 
-	fz_write_pwg_page_header(ctx, out, pwg, bitmap->xres, bitmap->yres, bitmap->w, bitmap->h, 1);
+static void
+pwg_write_header(fz_context *ctx, fz_band_writer *writer_)
+{
+	pwg_band_writer *writer = (pwg_band_writer *)writer_;
+	int w = writer->super.w;
+	int n = writer->super.n;
 
-	/* Now output the actual bitmap, using a packbits like compression */
-	sp = bitmap->samples;
-	ss = bitmap->stride;
-	byte_width = (bitmap->w+7)/8;
-	y = 0;
-	while (y < bitmap->h)
+	if (writer->mono)
+	{
+		writer->line_len = (w + 7)/8;
+		writer->max_len = writer->line_len * 2;
+	}
+	else
 	{
-		int yrep;
+		if (writer->super.alpha != 0)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write pwg with alpha");
+		if (n != 1 && n != 3 && n != 4)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap must be grayscale, rgb or cmyk to write as pwg");
+		writer->line_len = w * n;
+		writer->max_len = w * (n + 1);
+	}
 
-		assert(sp == bitmap->samples + y * ss);
+	fz_write_pwg_page_header(ctx, writer->super.out, &writer->pwg,
+			writer->super.xres, writer->super.yres, w, writer->super.h, writer->mono ? 1 : n*8);
+
+	writer->line = fz_malloc(ctx, writer->line_len);
+	writer->buf = fz_malloc(ctx, writer->max_len + 1);
+	writer->yrep = 0;
+}
 
-		/* Count the number of times this line is repeated */
-		for (yrep = 1; yrep < 256 && y+yrep < bitmap->h; yrep++)
+static void
+pwg_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_start, int band_height, const unsigned char *sp)
+{
+	pwg_band_writer *writer = (pwg_band_writer *)writer_;
+	int h = writer->super.h;
+	int line_len = writer->line_len;
+	const unsigned char *line;
+	int y, yrep, nruns, finalband;
+
+	finalband = (band_start+band_height >= h);
+	if (finalband)
+		band_height = h - band_start;
+
+	if (writer->max_runs < band_height + 1)
+	{
+		writer->runs = fz_resize_array(ctx, writer->runs, band_height + 1, sizeof(*writer->runs));
+		writer->max_runs = band_height + 1;
+	}
+
+	/* Count the number of times each line is repeated */
+	nruns = 0;
+	line = writer->line;
+	yrep = writer->yrep;
+	for (y = 0; y < band_height; y++, sp += stride)
+	{
+		if (yrep > 0 && yrep < 256 && memcmp(line, sp, line_len) == 0)
 		{
-			if (memcmp(sp, sp + yrep * ss, byte_width) != 0)
-				break;
+			yrep++;
+			continue;
 		}
-		fz_write_byte(ctx, out, yrep-1);
-
-		/* Encode the line */
-		x = 0;
-		while (x < byte_width)
+		if (yrep > 0)
 		{
-			int d;
+			writer->runs[nruns].line = line;
+			writer->runs[nruns].yrep = yrep;
+			nruns++;
+		}
+		line = sp;
+		yrep = 1;
+	}
+	if (finalband && yrep > 0)
+	{
+		writer->runs[nruns].line = line;
+		writer->runs[nruns].yrep = yrep;
+		nruns++;
+		yrep = 0;
+	}
 
-			assert(sp == bitmap->samples + y * ss + x);
+	pwg_write_runs(ctx, writer, nruns);
 
-			/* How far do we have to look to find a repeated value? */
-			for (d = 1; d < 128 && x+d < byte_width; d++)
-			{
-				if (sp[d-1] == sp[d])
-					break;
-			}
-			if (d == 1)
-			{
-				int xrep;
-
-				/* We immediately have a repeat (or we've hit
-				 * the end of the line). Count the number of
-				 * times this value is repeated. */
-				for (xrep = 1; xrep < 128 && x+xrep < byte_width; xrep++)
-				{
-					if (sp[0] != sp[xrep])
-						break;
-				}
-				fz_write_byte(ctx, out, xrep-1);
-				fz_write(ctx, out, sp, 1);
-				sp += xrep;
-				x += xrep;
-			}
-			else
-			{
-				fz_write_byte(ctx, out, 257-d);
-				fz_write(ctx, out, sp, d);
-				sp += d;
-				x += d;
-			}
-		}
+	if (yrep > 0 && line != writer->line)
+		memcpy(writer->line, line, line_len);
+	writer->yrep = yrep;
+}
+
+static void
+pwg_drop_band_writer(fz_context *ctx, fz_band_writer *writer_)
+{
+	pwg_band_writer *writer = (pwg_band_writer *)writer_;
+
+	fz_free(ctx, writer->line);
+	fz_free(ctx, writer->buf);
+	fz_free(ctx, writer->runs);
+}
+
+static fz_band_writer *
+new_pwg_band_writer(fz_context *ctx, fz_output *out, const fz_pwg_options *pwg, int mono)
+{
+	pwg_band_writer *writer = fz_new_band_writer(ctx, pwg_band_writer, out);
+
+	writer->super.header = pwg_write_header;
+	writer->super.band = pwg_write_band;
+	writer->super.drop = pwg_drop_band_writer;
+
+	if (pwg)
+		writer->pwg = *pwg;
+	writer->mono = mono;
+
+	return &writer->super;
+}
 
-		/* Move to the next line */
-		sp += ss*yrep - byte_width;
-		y += yrep;
+fz_band_writer *fz_new_pwg_band_writer(fz_context *ctx, fz_output *out, const fz_pwg_options *pwg)
+{
+	return new_pwg_band_writer(ctx, out, pwg, 0);
+}
+
+fz_band_writer *fz_new_mono_pwg_band_writer(fz_context *ctx, fz_output *out, const fz_pwg_options *pwg)
+{
+	return new_pwg_band_writer(ctx, out, pwg, 1);
+}
+
+void
+fz_write_pixmap_as_pwg_page(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap, const fz_pwg_options *pwg)
+{
+	fz_band_writer *writer;
+
+	if (!out || !pixmap)
+		return;
+
+	writer = fz_new_pwg_band_writer(ctx, out, pwg);
+	fz_try(ctx)
+	{
+		fz_write_header(ctx, writer, pixmap->w, pixmap->h, pixmap->n, pixmap->alpha, pixmap->xres, pixmap->yres, 0);
+		fz_write_band(ctx, writer, pixmap->stride, 0, pixmap->h, pixmap->samples);
+		fz_write_trailer(ctx, writer);
 	}
+	fz_always(ctx)
+		fz_drop_band_writer(ctx, writer);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+void
+fz_write_bitmap_as_pwg_page(fz_context *ctx, fz_output *out, const fz_bitmap *bitmap, const fz_pwg_options *pwg)
+{
+	fz_band_writer *writer;
+
+	if (!out || !bitmap)
+		return;
+
+	writer = fz_new_mono_pwg_band_writer(ctx, out, pwg);
+	fz_try(ctx)
+	{
+		fz_write_header(ctx, writer, bitmap->w, bitmap->h, 1, 0, bitmap->xres, bitmap->yres, 0);
+		fz_write_band(ctx, writer, bitmap->stride, 0, bitmap->h, bitmap->samples);
+		fz_write_trailer(ctx, writer);
+	}
+	fz_always(ctx)
+		fz_drop_band_writer(ctx, writer);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 }
 
 void
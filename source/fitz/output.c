@@ -332,6 +332,13 @@ void fz_write_trailer(fz_context *ctx, fz_band_writer *writer)
 	writer->trailer(ctx, writer);
 }
 
+void fz_set_band_writer_thread_pool(fz_context *ctx, fz_band_writer *writer, fz_thread_pool *pool)
+{
+	if (writer == NULL)
+		return;
+	writer->pool = pool;
+}
+
 void fz_drop_band_writer(fz_context *ctx, fz_band_writer *writer)
 {
 	if (writer == NULL)
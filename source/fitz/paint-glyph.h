@@ -44,17 +44,18 @@ FUNCTION_NAME(NAME,N,NAME2)(const unsigned char * restrict colorbv,
 	const uint32_t color = *(const uint32_t *)colorbv;
 #endif
 #endif
+	const unsigned char *data = fz_glyph_data(glyph);
 	TRACK_FN();
 	while (h--)
 	{
 		int skip_xx, ww, len, extend;
 		const unsigned char *runp;
 		unsigned char *ddp = dp;
-		int offset = ((int *)(glyph->data))[skip_y++];
+		int offset = ((const int *)data)[skip_y++];
 		if (offset >= 0)
 		{
 			int eol = 0;
-			runp = &glyph->data[offset];
+			runp = &data[offset];
 			extend = 0;
 			ww = w;
 			skip_xx = skip_x;
@@ -440,7 +440,7 @@ fz_process_shade_type5(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 	}
 }
 
-/* Subdivide and tessellate tensor-patches */
+/* Tessellate tensor-patches */
 
 typedef struct tensor_patch_s tensor_patch;
 
@@ -450,159 +450,259 @@ struct tensor_patch_s
 	float color[4][FZ_MAX_COLORS];
 };
 
-static void
-triangulate_patch(fz_context *ctx, fz_mesh_processor *painter, tensor_patch p)
+/*
+	Each patch is cut into a grid of quads, with as many rows and
+	columns as the size and curvature of the patch on the device and
+	the range of colors across it call for.
+
+	Neighbouring patches may be cut differently, so to avoid cracks
+	the outer ring of the grid is left out, and each edge of the patch
+	is cut into a number of segments that depends only on that edge
+	(its control points and end colors, whichever way round it is
+	walked). The gap between each edge and the side of the grid next
+	to it is then stitched up with triangles. All the weights used
+	along an edge are symmetric under reversal, so both patches that
+	share an edge put exactly the same vertices along it.
+*/
+
+#define MAX_PATCH_LEVEL 6 /* at most 64 rows or columns per patch */
+#define MAX_PATCH_SEGS (1 << MAX_PATCH_LEVEL)
+#define PATCH_SCRATCH (6 * (MAX_PATCH_SEGS + 1)) /* vertices used by draw_patch */
+
+static int
+patch_level(float segs)
 {
-	fz_vertex v0, v1, v2, v3;
+	int k = 0;
+	while (k < MAX_PATCH_LEVEL && (1 << k) < segs)
+		k++;
+	return k;
+}
 
-	v0.p = p.pole[0][0];
-	v1.p = p.pole[0][3];
-	v2.p = p.pole[3][3];
-	v3.p = p.pole[3][0];
+static inline float
+point_dist(fz_point a, fz_point b)
+{
+	float dx = b.x - a.x;
+	float dy = b.y - a.y;
+	return sqrtf(dx * dx + dy * dy);
+}
 
-	fz_prepare_color(ctx, painter, &v0, p.color[0]);
-	fz_prepare_color(ctx, painter, &v1, p.color[1]);
-	fz_prepare_color(ctx, painter, &v2, p.color[2]);
-	fz_prepare_color(ctx, painter, &v3, p.color[3]);
+/* Number of chords needed to follow a bezier curve to within a quarter
+ * of a pixel. A chord strays from the curve by no more than 3/4 of the
+ * largest second difference of the control points over n^2. */
+static float
+curve_segs(fz_point p0, fz_point p1, fz_point p2, fz_point p3)
+{
+	float ax = p0.x - 2 * p1.x + p2.x;
+	float ay = p0.y - 2 * p1.y + p2.y;
+	float bx = p1.x - 2 * p2.x + p3.x;
+	float by = p1.y - 2 * p2.y + p3.y;
+	float d = fz_max(ax * ax + ay * ay, bx * bx + by * by);
+	return sqrtf(3 * sqrtf(d));
+}
 
-	paint_quad(ctx, painter, &v0, &v1, &v2, &v3);
+static inline float
+curve_length(fz_point p0, fz_point p1, fz_point p2, fz_point p3)
+{
+	return (point_dist(p0, p1) + point_dist(p2, p3)) + point_dist(p1, p2);
 }
 
-static inline void midcolor(float *c, float *c1, float *c2, int n)
+/* Largest change in any color component between two colors, as a
+ * fraction of the range of that component. */
+static float
+color_delta(fz_mesh_processor *painter, const float *ca, const float *cb)
 {
-	int i;
-	for (i = 0; i < n; i++)
-		c[i] = (c1[i] + c2[i]) * 0.5f;
+	const float *c0 = painter->shade->u.m.c0;
+	const float *c1 = painter->shade->u.m.c1;
+	float d = 0;
+	int k;
+
+	for (k = 0; k < painter->ncomp; k++)
+	{
+		float range = fabsf(c1[k] - c0[k]);
+		if (range > 0)
+			d = fz_max(d, fabsf(cb[k] - ca[k]) / range);
+	}
+	return d;
 }
 
-static void
-split_curve(fz_point *pole, fz_point *q0, fz_point *q1, int polestep)
+/* Level of an edge of a patch. Aim for segments that change color by
+ * no more than 1/16 of the range, but are no shorter than 4 pixels
+ * unless the curvature needs them to be. */
+static int
+edge_level(fz_mesh_processor *painter, fz_point p0, fz_point p1, fz_point p2, fz_point p3, const float *ca, const float *cb)
 {
-	/*
-	split bezier curve given by control points pole[0]..pole[3]
-	using de casteljau algo at midpoint and build two new
-	bezier curves q0[0]..q0[3] and q1[0]..q1[3]. all indices
-	should be multiplies by polestep == 1 for vertical bezier
-	curves in patch and == 4 for horizontal bezier curves due
-	to C's multi-dimensional matrix memory layout.
-	*/
-
-	float x12 = (pole[1 * polestep].x + pole[2 * polestep].x) * 0.5f;
-	float y12 = (pole[1 * polestep].y + pole[2 * polestep].y) * 0.5f;
-
-	q0[1 * polestep].x = (pole[0 * polestep].x + pole[1 * polestep].x) * 0.5f;
-	q0[1 * polestep].y = (pole[0 * polestep].y + pole[1 * polestep].y) * 0.5f;
-	q1[2 * polestep].x = (pole[2 * polestep].x + pole[3 * polestep].x) * 0.5f;
-	q1[2 * polestep].y = (pole[2 * polestep].y + pole[3 * polestep].y) * 0.5f;
-
-	q0[2 * polestep].x = (q0[1 * polestep].x + x12) * 0.5f;
-	q0[2 * polestep].y = (q0[1 * polestep].y + y12) * 0.5f;
-	q1[1 * polestep].x = (x12 + q1[2 * polestep].x) * 0.5f;
-	q1[1 * polestep].y = (y12 + q1[2 * polestep].y) * 0.5f;
-
-	q0[3 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
-	q0[3 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
-	q1[0 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
-	q1[0 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
-
-	q0[0 * polestep].x = pole[0 * polestep].x;
-	q0[0 * polestep].y = pole[0 * polestep].y;
-	q1[3 * polestep].x = pole[3 * polestep].x;
-	q1[3 * polestep].y = pole[3 * polestep].y;
+	float flat = curve_segs(p0, p1, p2, p3);
+	float color = fz_min(color_delta(painter, ca, cb) * 16, curve_length(p0, p1, p2, p3) / 4);
+	return patch_level(fz_max(flat, color));
 }
 
-static void
-split_stripe(tensor_patch *p, tensor_patch *s0, tensor_patch *s1, int n)
+/* Evaluate the bezier curve p[0], p[step], p[2*step], p[3*step] at j/n. */
+static inline fz_point
+eval_curve(const fz_point *p, int step, int j, int n)
 {
-	/*
-	split all horizontal bezier curves in patch,
-	creating two new patches with half the width.
-	*/
-	split_curve(&p->pole[0][0], &s0->pole[0][0], &s1->pole[0][0], 4);
-	split_curve(&p->pole[0][1], &s0->pole[0][1], &s1->pole[0][1], 4);
-	split_curve(&p->pole[0][2], &s0->pole[0][2], &s1->pole[0][2], 4);
-	split_curve(&p->pole[0][3], &s0->pole[0][3], &s1->pole[0][3], 4);
-
-	/* interpolate the colors for the two new patches. */
-	memcpy(s0->color[0], p->color[0], n * sizeof(s0->color[0][0]));
-	memcpy(s0->color[1], p->color[1], n * sizeof(s0->color[1][0]));
-	midcolor(s0->color[2], p->color[1], p->color[2], n);
-	midcolor(s0->color[3], p->color[0], p->color[3], n);
-
-	memcpy(s1->color[0], s0->color[3], n * sizeof(s1->color[0][0]));
-	memcpy(s1->color[1], s0->color[2], n * sizeof(s1->color[1][0]));
-	memcpy(s1->color[2], p->color[2], n * sizeof(s1->color[2][0]));
-	memcpy(s1->color[3], p->color[3], n * sizeof(s1->color[3][0]));
+	float t = (float)j / n;
+	float s = (float)(n - j) / n;
+	float st = s * t;
+	float w0 = s * s * s;
+	float w1 = 3 * (st * s);
+	float w2 = 3 * (st * t);
+	float w3 = t * t * t;
+	fz_point pt;
+
+	pt.x = (w0 * p[0].x + w3 * p[3 * step].x) + (w1 * p[step].x + w2 * p[2 * step].x);
+	pt.y = (w0 * p[0].y + w3 * p[3 * step].y) + (w1 * p[step].y + w2 * p[2 * step].y);
+	return pt;
 }
 
+/* Put the vertices k/m of the way along an edge, for k = 0 to m. */
 static void
-draw_stripe(fz_context *ctx, fz_mesh_processor *painter, tensor_patch *p, int depth)
+make_edge(fz_context *ctx, fz_mesh_processor *painter, fz_vertex *v, const fz_point *p, int step, int m, const float *ca, const float *cb)
 {
-	tensor_patch s0, s1;
-
-	/* split patch into two half-height patches */
-	split_stripe(p, &s0, &s1, painter->ncomp);
+	float color[FZ_MAX_COLORS];
+	int k, i;
 
-	depth--;
-	if (depth == 0)
+	for (k = 0; k <= m; k++)
 	{
-		/* if no more subdividing, draw two new patches... */
-		triangulate_patch(ctx, painter, s1);
-		triangulate_patch(ctx, painter, s0);
-	}
-	else
-	{
-		/* ...otherwise, continue subdividing. */
-		draw_stripe(ctx, painter, &s1, depth);
-		draw_stripe(ctx, painter, &s0, depth);
+		float t = (float)k / m;
+		float s = (float)(m - k) / m;
+
+		v[k].p = eval_curve(p, step, k, m);
+		for (i = 0; i < painter->ncomp; i++)
+			color[i] = s * ca[i] + t * cb[i];
+		fz_prepare_color(ctx, painter, &v[k], color);
 	}
 }
 
+/* Stitch up the gap between an edge, with m+1 vertices k/m of the way
+ * along it, and the side of the grid next to it, with n-1 vertices
+ * (k+1)/n of the way along, walking along both in step. */
 static void
-split_patch(tensor_patch *p, tensor_patch *s0, tensor_patch *s1, int n)
+stitch_edge(fz_context *ctx, fz_mesh_processor *painter, fz_vertex *edge, int m, fz_vertex *side, int n)
 {
-	/*
-	split all vertical bezier curves in patch,
-	creating two new patches with half the height.
-	*/
-	split_curve(p->pole[0], s0->pole[0], s1->pole[0], 1);
-	split_curve(p->pole[1], s0->pole[1], s1->pole[1], 1);
-	split_curve(p->pole[2], s0->pole[2], s1->pole[2], 1);
-	split_curve(p->pole[3], s0->pole[3], s1->pole[3], 1);
-
-	/* interpolate the colors for the two new patches. */
-	memcpy(s0->color[0], p->color[0], n * sizeof(s0->color[0][0]));
-	midcolor(s0->color[1], p->color[0], p->color[1], n);
-	midcolor(s0->color[2], p->color[2], p->color[3], n);
-	memcpy(s0->color[3], p->color[3], n * sizeof(s0->color[3][0]));
-
-	memcpy(s1->color[0], s0->color[1], n * sizeof(s1->color[0][0]));
-	memcpy(s1->color[1], p->color[1], n * sizeof(s1->color[1][0]));
-	memcpy(s1->color[2], p->color[2], n * sizeof(s1->color[2][0]));
-	memcpy(s1->color[3], s0->color[2], n * sizeof(s1->color[3][0]));
+	int a = 0;
+	int b = 0;
+
+	while (a < m || b < n - 2)
+	{
+		if (b == n - 2 || (a < m && (a + 1) * n <= (b + 2) * m))
+		{
+			paint_tri(ctx, painter, &edge[a], &edge[a+1], &side[b]);
+			a++;
+		}
+		else
+		{
+			paint_tri(ctx, painter, &edge[a], &side[b], &side[b+1]);
+			b++;
+		}
+	}
 }
 
 static void
-draw_patch(fz_context *ctx, fz_mesh_processor *painter, tensor_patch *p, int depth, int origdepth)
+draw_patch(fz_context *ctx, fz_mesh_processor *painter, tensor_patch *p, fz_vertex *scratch)
 {
-	tensor_patch s0, s1;
-
-	/* split patch into two half-width patches */
-	split_patch(p, &s0, &s1, painter->ncomp);
-
-	depth--;
-	if (depth == 0)
+	fz_point curve[4][MAX_PATCH_SEGS + 1];
+	fz_point column[4];
+	float color[FZ_MAX_COLORS];
+	fz_vertex *prev = scratch;
+	fz_vertex *cur = prev + MAX_PATCH_SEGS + 1;
+	fz_vertex *top = cur + MAX_PATCH_SEGS + 1;
+	fz_vertex *left = top + MAX_PATCH_SEGS + 1;
+	fz_vertex *right = left + MAX_PATCH_SEGS + 1;
+	fz_vertex *edge = right + MAX_PATCH_SEGS + 1;
+	fz_vertex *t;
+	int ncomp = painter->ncomp;
+	int ma0, ma1, mb0, mb1, na, nb;
+	float twist, len_a, len_b;
+	int i, j, k;
+
+	/* Edges along the rows of poles (a) and the columns (b). */
+	ma0 = edge_level(painter, p->pole[0][0], p->pole[0][1], p->pole[0][2], p->pole[0][3], p->color[0], p->color[1]);
+	ma1 = edge_level(painter, p->pole[3][0], p->pole[3][1], p->pole[3][2], p->pole[3][3], p->color[3], p->color[2]);
+	mb0 = edge_level(painter, p->pole[0][0], p->pole[1][0], p->pole[2][0], p->pole[3][0], p->color[0], p->color[3]);
+	mb1 = edge_level(painter, p->pole[0][3], p->pole[1][3], p->pole[2][3], p->pole[3][3], p->color[1], p->color[2]);
+
+	/* The interior must follow the inner rows and columns of poles,
+	 * and cope with colors that do not vary linearly across the
+	 * patch: splitting a quad into two triangles misses the color
+	 * in its middle by a quarter of the twist, so aim for 1/64 of
+	 * the range there. The grid always has at least one vertex
+	 * inside the outer ring. */
+	twist = 0;
+	for (k = 0; k < ncomp; k++)
 	{
-		/* if no more subdividing, draw two new patches... */
-		draw_stripe(ctx, painter, &s0, origdepth);
-		draw_stripe(ctx, painter, &s1, origdepth);
+		float range = fabsf(painter->shade->u.m.c1[k] - painter->shade->u.m.c0[k]);
+		if (range > 0)
+			twist = fz_max(twist, fabsf(p->color[0][k] - p->color[1][k] + p->color[2][k] - p->color[3][k]) / range);
 	}
-	else
+	twist = 4 * sqrtf(twist);
+	len_a = fz_max(curve_length(p->pole[0][0], p->pole[0][1], p->pole[0][2], p->pole[0][3]),
+			curve_length(p->pole[3][0], p->pole[3][1], p->pole[3][2], p->pole[3][3]));
+	len_b = fz_max(curve_length(p->pole[0][0], p->pole[1][0], p->pole[2][0], p->pole[3][0]),
+			curve_length(p->pole[0][3], p->pole[1][3], p->pole[2][3], p->pole[3][3]));
+
+	na = fz_maxi(fz_maxi(ma0, ma1), patch_level(fz_max(fz_min(twist, len_a / 4),
+			fz_max(curve_segs(p->pole[1][0], p->pole[1][1], p->pole[1][2], p->pole[1][3]),
+				curve_segs(p->pole[2][0], p->pole[2][1], p->pole[2][2], p->pole[2][3])))));
+	nb = fz_maxi(fz_maxi(mb0, mb1), patch_level(fz_max(fz_min(twist, len_b / 4),
+			fz_max(curve_segs(p->pole[0][1], p->pole[1][1], p->pole[2][1], p->pole[3][1]),
+				curve_segs(p->pole[0][2], p->pole[1][2], p->pole[2][2], p->pole[3][2])))));
+
+	ma0 = 1 << ma0;
+	ma1 = 1 << ma1;
+	mb0 = 1 << mb0;
+	mb1 = 1 << mb1;
+	na = 1 << fz_maxi(na, 1);
+	nb = 1 << fz_maxi(nb, 1);
+
+	/* Evaluate each row of poles at every inner column of the grid. */
+	for (k = 0; k < 4; k++)
+		for (j = 1; j < na; j++)
+			curve[k][j] = eval_curve(p->pole[k], 1, j, na);
+
+	/* Paint the inside of the grid, a row at a time, keeping its
+	 * outermost rows and columns for stitching. */
+	for (i = 1; i < nb; i++)
 	{
-		/* ...otherwise, continue subdividing. */
-		draw_patch(ctx, painter, &s0, depth, origdepth);
-		draw_patch(ctx, painter, &s1, depth, origdepth);
+		float tv = (float)i / nb;
+		float sv = (float)(nb - i) / nb;
+
+		for (j = 1; j < na; j++)
+		{
+			float tu = (float)j / na;
+			float su = (float)(na - j) / na;
+			fz_vertex *v = &cur[j];
+
+			for (k = 0; k < 4; k++)
+				column[k] = curve[k][j];
+			v->p = eval_curve(column, 1, i, nb);
+
+			for (k = 0; k < ncomp; k++)
+				color[k] = sv * (su * p->color[0][k] + tu * p->color[1][k]) + tv * (su * p->color[3][k] + tu * p->color[2][k]);
+			fz_prepare_color(ctx, painter, v, color);
+		}
+
+		if (i == 1)
+			memcpy(&top[1], &cur[1], (na - 1) * sizeof(fz_vertex));
+		else
+			for (j = 1; j < na - 1; j++)
+				paint_quad(ctx, painter, &prev[j], &prev[j+1], &cur[j+1], &cur[j]);
+		left[i] = cur[1];
+		right[i] = cur[na-1];
+
+		t = prev;
+		prev = cur;
+		cur = t;
 	}
+
+	/* prev now holds the bottom row of the grid. */
+	make_edge(ctx, painter, edge, &p->pole[0][0], 1, ma0, p->color[0], p->color[1]);
+	stitch_edge(ctx, painter, edge, ma0, &top[1], na);
+	make_edge(ctx, painter, edge, &p->pole[3][0], 1, ma1, p->color[3], p->color[2]);
+	stitch_edge(ctx, painter, edge, ma1, &prev[1], na);
+	make_edge(ctx, painter, edge, &p->pole[0][0], 4, mb0, p->color[0], p->color[3]);
+	stitch_edge(ctx, painter, edge, mb0, &left[1], nb);
+	make_edge(ctx, painter, edge, &p->pole[0][3], 4, mb1, p->color[1], p->color[2]);
+	stitch_edge(ctx, painter, edge, mb1, &right[1], nb);
 }
 
 static fz_point
@@ -692,9 +792,6 @@ make_tensor_patch(tensor_patch *p, int type, fz_point *pt)
 	}
 }
 
-/* FIXME: Nasty */
-#define SUBDIV 3 /* how many levels to subdivide patches */
-
 static void
 fz_process_shade_type6(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_mesh_processor *painter)
 {
@@ -713,11 +810,15 @@ fz_process_shade_type6(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 	float y1 = shade->u.m.y1;
 	const float *c0 = shade->u.m.c0;
 	const float *c1 = shade->u.m.c1;
+	fz_vertex *scratch = NULL;
+
+	fz_var(scratch);
 
 	fz_try(ctx)
 	{
 		float (*prevc)[FZ_MAX_COLORS] = NULL;
 		fz_point *prevp = NULL;
+		scratch = fz_malloc_array(ctx, PATCH_SCRATCH, sizeof(fz_vertex));
 		while (!fz_is_eof_bits(ctx, stream))
 		{
 			float (*c)[FZ_MAX_COLORS] = color_storage[store];
@@ -791,7 +892,7 @@ fz_process_shade_type6(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 			for (i = 0; i < 4; i++)
 				memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-			draw_patch(ctx, painter, &patch, SUBDIV, SUBDIV);
+			draw_patch(ctx, painter, &patch, scratch);
 
 			prevp = v;
 			prevc = c;
@@ -800,6 +901,7 @@ fz_process_shade_type6(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 	}
 	fz_always(ctx)
 	{
+		fz_free(ctx, scratch);
 		fz_drop_stream(ctx, stream);
 	}
 	fz_catch(ctx)
@@ -828,9 +930,13 @@ fz_process_shade_type7(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 	int i, k;
 	float (*prevc)[FZ_MAX_COLORS] = NULL;
 	fz_point (*prevp) = NULL;
+	fz_vertex *scratch = NULL;
+
+	fz_var(scratch);
 
 	fz_try(ctx)
 	{
+		scratch = fz_malloc_array(ctx, PATCH_SCRATCH, sizeof(fz_vertex));
 		while (!fz_is_eof_bits(ctx, stream))
 		{
 			float (*c)[FZ_MAX_COLORS] = color_storage[store];
@@ -904,7 +1010,7 @@ fz_process_shade_type7(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 			for (i = 0; i < 4; i++)
 				memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-			draw_patch(ctx, painter, &patch, SUBDIV, SUBDIV);
+			draw_patch(ctx, painter, &patch, scratch);
 
 			prevp = v;
 			prevc = c;
@@ -913,6 +1019,7 @@ fz_process_shade_type7(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, f
 	}
 	fz_always(ctx)
 	{
+		fz_free(ctx, scratch);
 		fz_drop_stream(ctx, stream);
 	}
 	fz_catch(ctx)
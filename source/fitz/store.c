@@ -1,6 +1,7 @@
 #include "mupdf/fitz.h"
 
 typedef struct fz_item_s fz_item;
+typedef struct fz_store_shard_s fz_store_shard;
 
 struct fz_item_s
 {
@@ -13,11 +14,25 @@ struct fz_item_s
 	fz_store_type *type;
 };
 
-struct fz_store_s
+/*
+	The store is split into a number of shards, chosen by hashing the
+	key. Each shard has its own lock, LRU list and hash table, so that
+	lookups of different keys can proceed in parallel.
+
+	Shard locks sit below FZ_LOCK_ALLOC in the lock ordering, so we
+	never allocate or free (or take FZ_LOCK_ALLOC for any other reason)
+	while holding one. This allows the scavenging allocator to evict
+	from the store while it holds FZ_LOCK_ALLOC.
+
+	Reference counts of storables are updated atomically where
+	possible (see refs_add), so neither the store nor
+	fz_keep_storable/fz_drop_storable need FZ_LOCK_ALLOC either.
+*/
+struct fz_store_shard_s
 {
-	int refs;
+	int lock;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
+	/* Every item in the shard is kept in a doubly linked list, ordered
 	 * by usage (so LRU entries are at the end). */
 	fz_item *head;
 	fz_item *tail;
@@ -26,39 +41,164 @@ struct fz_store_s
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
 
-	/* We keep track of the size of the store, and keep it below max. */
-	size_t max;
+	/* The size of the items in this shard. */
 	size_t size;
+};
+
+struct fz_store_s
+{
+	int refs;
+
+	fz_store_shard shard[FZ_STORE_SHARDS];
+
+	/* We keep track of the total size of the store (the sum of the
+	 * shard sizes), and keep it below max. */
+	size_t max;
 
 	/* Protected by the reap lock */
 	int defer_reap_count;
 	int needs_reaping;
 };
 
+/*
+	Adjust the reference count of a storable by delta, returning the
+	new value. Without atomics we protect the count with the reap lock,
+	which is never held while any other lock is taken.
+*/
+static int
+refs_add(fz_context *ctx, fz_storable *s, int delta)
+{
+#ifdef FZ_HAVE_ATOMICS
+	return fz_atomic_add(&s->refs, delta);
+#else
+	int refs;
+	fz_lock(ctx, FZ_LOCK_REAP);
+	refs = (s->refs += delta);
+	fz_unlock(ctx, FZ_LOCK_REAP);
+	return refs;
+#endif
+}
+
+/* Storables with a reference count of 0 or less are static, and are never
+ * counted (or freed). */
+static void
+keep_refs(fz_context *ctx, fz_storable *s)
+{
+	if (s->refs > 0)
+		refs_add(ctx, s, 1);
+}
+
+static int
+drop_refs(fz_context *ctx, fz_storable *s)
+{
+	return s->refs > 0 && refs_add(ctx, s, -1) == 0;
+}
+
 void
 fz_new_store_context(fz_context *ctx, size_t max)
 {
 	fz_store *store;
+	int i;
+
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+		{
+			store->shard[i].lock = FZ_LOCK_STORE + i;
+			store->shard[i].hash = fz_new_hash_table(ctx, 4096 / FZ_STORE_SHARDS + 256, sizeof(fz_store_hash), FZ_LOCK_STORE + i);
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_drop_hash(ctx, store->shard[i].hash);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
-	store->size = 0;
 	store->max = max;
 	store->defer_reap_count = 0;
 	store->needs_reaping = 0;
 	ctx->store = store;
 }
 
+/*
+	Choose the shard for a key. Hashable keys are distributed by their
+	hash key; all other items of a given type must live in the same
+	shard, as we find them by a linear search, so we use the drop
+	function.
+
+	We deliberately use a different hash function (FNV-1a) from the one
+	the hash tables use; otherwise every key in a shard would fall into
+	the same residue class within that shard's hash table.
+*/
+static fz_store_shard *
+find_shard(fz_store *store, fz_store_drop_fn *drop, const fz_store_hash *hash, int use_hash)
+{
+	const unsigned char *s;
+	unsigned int h = 2166136261u;
+	size_t i, n;
+
+	if (use_hash)
+	{
+		s = (const unsigned char *)hash;
+		n = sizeof(*hash);
+	}
+	else
+	{
+		s = (const unsigned char *)&drop;
+		n = sizeof(drop);
+	}
+	for (i = 0; i < n; i++)
+	{
+		h ^= s[i];
+		h *= 16777619u;
+	}
+	return &store->shard[h % FZ_STORE_SHARDS];
+}
+
+/*
+	The total size of the store. We read the shard sizes without taking
+	their locks, so this is only a snapshot; that is good enough to
+	decide whether to evict.
+*/
+static size_t
+store_size(fz_store *store)
+{
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+		size += store->shard[i].size;
+	return size;
+}
+
+static void
+unlink_item(fz_store_shard *shard, fz_item *item)
+{
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		shard->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		shard->head = item->next;
+}
+
+static void
+unhash_item(fz_context *ctx, fz_store_shard *shard, fz_item *item)
+{
+	if (item->type->make_hash_key)
+	{
+		fz_store_hash hash = { NULL };
+		hash.drop = item->val->drop;
+		if (item->type->make_hash_key(ctx, &hash, item->key))
+			fz_hash_remove(ctx, shard->hash, &hash);
+	}
+}
+
 void *
 fz_keep_storable(fz_context *ctx, const fz_storable *sc)
 {
@@ -66,7 +206,15 @@ fz_keep_storable(fz_context *ctx, const fz_storable *sc)
 	 * sanely throughout the code. */
 	fz_storable *s = (fz_storable *)sc;
 
-	return fz_keep_imp(ctx, s, &s->refs);
+	if (s == NULL)
+		return NULL;
+
+	if (s->refs > 0)
+	{
+		(void)Memento_takeRef(s);
+		refs_add(ctx, s, 1);
+	}
+	return s;
 }
 
 void
@@ -76,6 +224,9 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 	 * sanely throughout the code. */
 	fz_storable *s = (fz_storable *)sc;
 
+	if (s == NULL)
+		return;
+
 	/*
 		If we are dropping the last reference to an object, then
 		it cannot possibly be in the store (as the store always
@@ -83,7 +234,9 @@ fz_drop_storable(fz_context *ctx, const fz_storable *sc)
 		this method. So we can simply drop the storable object
 		itself without any operations on the fz_store.
 	 */
-	if (fz_drop_imp(ctx, s, &s->refs))
+	if (s->refs > 0)
+		(void)Memento_dropRef(s);
+	if (drop_refs(ctx, s))
 		s->drop(ctx, s);
 }
 
@@ -93,65 +246,51 @@ void *fz_keep_key_storable(fz_context *ctx, const fz_key_storable *sc)
 }
 
 /*
-	Entered with FZ_LOCK_ALLOC and FZ_LOCK_REAP held.
-	Drops FZ_LOCK_ALLOC.
+	Entered with no locks held. Runs over every shard, removing the
+	items that the key types tell us need reaping.
 */
 static void
 do_reap(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
 	fz_item *item, *prev, *remove;
+	int i;
 
 	if (store == NULL)
-	{
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		return;
-	}
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
-	fz_assert_lock_held(ctx, FZ_LOCK_REAP);
-
-	ctx->store->needs_reaping = 0;
+	fz_lock(ctx, FZ_LOCK_REAP);
+	store->needs_reaping = 0;
+	fz_unlock(ctx, FZ_LOCK_REAP);
 
 	/* Reap the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		prev = item->prev;
-
-		if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
-			continue;
+		fz_store_shard *shard = &store->shard[i];
 
-		/* We have to drop it */
-		store->size -= item->size;
+		fz_lock(ctx, shard->lock);
+		for (item = shard->tail; item; item = prev)
+		{
+			prev = item->prev;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+			if (item->type->needs_reap == NULL || item->type->needs_reap(ctx, item->key) == 0)
+				continue;
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			/* We have to drop it */
+			shard->size -= item->size;
+			unlink_item(shard, item);
+			unhash_item(ctx, shard, item);
 
-		/* Store whether to drop this value or not in 'prev' */
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+			/* Store whether to drop this value or not in 'prev' */
+			item->prev = drop_refs(ctx, item->val) ? item : NULL;
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
+		}
+		fz_unlock(ctx, shard->lock);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	/* Now drop the remove chain */
 	for (item = remove; item != NULL; item = remove)
@@ -166,7 +305,6 @@ do_reap(fz_context *ctx)
 		item->type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
-
 }
 
 void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
@@ -174,35 +312,31 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_key_storable *s = (fz_key_storable *)sc;
-	int drop;
-	int unlock = 1;
+	int refs;
+	int reap = 0;
 
 	if (s == NULL)
 		return;
 
-	if (s->storable.refs > 0)
-		(void)Memento_dropRef(s);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (s->storable.refs > 0)
+	if (s->storable.refs <= 0)
+		return;
+
+	(void)Memento_dropRef(s);
+	refs = refs_add(ctx, &s->storable, -1);
+	if (refs > 0)
 	{
-		drop = --s->storable.refs == 0;
-		if (!drop && s->storable.refs == s->store_key_refs)
+		fz_lock(ctx, FZ_LOCK_REAP);
+		if (refs == s->store_key_refs)
 		{
-			fz_lock(ctx, FZ_LOCK_REAP);
 			if (ctx->store->defer_reap_count > 0)
 				ctx->store->needs_reaping = 1;
 			else
-			{
-				do_reap(ctx);
-				unlock = 0;
-			}
-			fz_unlock(ctx, FZ_LOCK_REAP);
+				reap = 1;
 		}
+		fz_unlock(ctx, FZ_LOCK_REAP);
+		if (reap)
+			do_reap(ctx);
 	}
-	else
-		drop = 0;
-	if (unlock)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
 	/*
 		If we are dropping the last reference to an object, then
 		it cannot possibly be in the store (as the store always
@@ -210,7 +344,7 @@ void fz_drop_key_storable(fz_context *ctx, const fz_key_storable *sc)
 		this method. So we can simply drop the storable object
 		itself without any operations on the fz_store.
 	 */
-	if (drop)
+	else if (refs == 0)
 		s->storable.drop(ctx, &s->storable);
 }
 
@@ -223,15 +357,16 @@ void *fz_keep_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 	if (s == NULL)
 		return NULL;
 
-	if (s->storable.refs > 0)
-		(void)Memento_takeRef(s);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	if (s->storable.refs > 0)
 	{
-		++s->storable.refs;
+		(void)Memento_takeRef(s);
+		/* Count the reference before the key reference, so that
+		 * refs == store_key_refs never appears true in between. */
+		refs_add(ctx, &s->storable, 1);
+		fz_lock(ctx, FZ_LOCK_REAP);
 		++s->store_key_refs;
+		fz_unlock(ctx, FZ_LOCK_REAP);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	return s;
 }
 
@@ -240,18 +375,18 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 	/* Explicitly drop const to allow us to use const
 	 * sanely throughout the code. */
 	fz_key_storable *s = (fz_key_storable *)sc;
-	int drop;
 
 	if (s == NULL)
 		return;
 
-	if (s->storable.refs > 0)
-		(void)Memento_dropRef(s);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (s->storable.refs <= 0)
+		return;
+
+	(void)Memento_dropRef(s);
+	fz_lock(ctx, FZ_LOCK_REAP);
 	assert(s->store_key_refs > 0 && s->storable.refs >= s->store_key_refs);
-	drop = --s->storable.refs == 0;
 	--s->store_key_refs;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, FZ_LOCK_REAP);
 	/*
 		If we are dropping the last reference to an object, then
 		it cannot possibly be in the store (as the store always
@@ -259,132 +394,136 @@ void fz_drop_key_storable_key(fz_context *ctx, const fz_key_storable *sc)
 		this method. So we can simply drop the storable object
 		itself without any operations on the fz_store.
 	 */
-	if (drop)
+	if (drop_refs(ctx, &s->storable))
 		s->storable.drop(ctx, &s->storable);
 }
 
+/*
+	Entered with the shard lock held; exits with it released. If
+	alloc_held, FZ_LOCK_ALLOC is held on entry and exit, but is dropped
+	while we free the item.
+*/
 static void
-evict(fz_context *ctx, fz_item *item)
+evict(fz_context *ctx, fz_store_shard *shard, fz_item *item, int alloc_held)
 {
-	fz_store *store = ctx->store;
 	int drop;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
+	shard->size -= item->size;
+	unlink_item(shard, item);
+	unhash_item(ctx, shard, item);
 
 	/* Drop a reference to the value (freeing if required) */
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
+	drop = drop_refs(ctx, item->val);
+	fz_unlock(ctx, shard->lock);
 
-	/* Remove from the hash table */
-	if (item->type->make_hash_key)
-	{
-		fz_store_hash hash = { NULL };
-		hash.drop = item->val->drop;
-		if (item->type->make_hash_key(ctx, &hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
-	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (alloc_held)
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (drop)
 		item->val->drop(ctx, item->val);
 
 	/* Always drops the key and drop the item */
 	item->type->drop_key(ctx, item->key);
 	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (alloc_held)
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 }
 
+/*
+	Evict items that only the store holds a reference to, until we have
+	freed at least tofree bytes or run out of candidates. To keep the
+	store approximately LRU as a whole, we take the least recently used
+	candidate from each shard in turn.
+*/
 static size_t
-ensure_space(fz_context *ctx, size_t tofree)
+evict_lru(fz_context *ctx, size_t tofree, int alloc_held)
 {
-	fz_item *item, *prev;
-	size_t count;
 	fz_store *store = ctx->store;
+	int exhausted[FZ_STORE_SHARDS] = { 0 };
+	int remaining = FZ_STORE_SHARDS;
+	size_t count = 0;
+	int i;
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
-
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+	while (count < tofree && remaining > 0)
 	{
-		if (item->val->refs == 1)
+		for (i = 0; i < FZ_STORE_SHARDS && count < tofree; i++)
 		{
+			fz_store_shard *shard = &store->shard[i];
+			fz_item *item;
+
+			if (exhausted[i])
+				continue;
+
+			fz_lock(ctx, shard->lock);
+			for (item = shard->tail; item; item = item->prev)
+				if (item->val->refs == 1)
+					break;
+			if (item == NULL)
+			{
+				fz_unlock(ctx, shard->lock);
+				exhausted[i] = 1;
+				remaining--;
+				continue;
+			}
 			count += item->size;
-			if (count >= tofree)
-				break;
+			evict(ctx, shard, item, alloc_held); /* Drops the shard lock */
 		}
 	}
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
-	{
-		return 0;
-	}
+	return count;
+}
 
-	/* Actually free the items */
+static size_t
+ensure_space(fz_context *ctx, size_t tofree)
+{
+	fz_store *store = ctx->store;
+	fz_item *item;
+	size_t count;
+	int i;
+
+	/* First check that we *can* free tofree; if not, we'd rather not
+	 * cache this. */
 	count = 0;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < FZ_STORE_SHARDS && count < tofree; i++)
 	{
-		prev = item->prev;
-		if (item->val->refs == 1)
+		fz_store_shard *shard = &store->shard[i];
+
+		fz_lock(ctx, shard->lock);
+		for (item = shard->tail; item; item = item->prev)
 		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-				prev->val->refs++;
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-				--prev->val->refs;
-
-			if (count >= tofree)
-				return count;
+			if (item->val->refs == 1)
+			{
+				count += item->size;
+				if (count >= tofree)
+					break;
+			}
 		}
+		fz_unlock(ctx, shard->lock);
 	}
 
-	return count;
+	/* If we ran out of items to search, then we can never free enough */
+	if (count < tofree)
+		return 0;
+
+	/* Actually free the items */
+	return evict_lru(ctx, tofree, 0);
 }
 
+/* Entered with the shard lock held. */
 static void
-touch(fz_store *store, fz_item *item)
+touch(fz_store_shard *shard, fz_item *item)
 {
 	if (item->next != item)
 	{
 		/* Already in the list - unlink it */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		unlink_item(shard, item);
 	}
 	/* Now relink it at the start of the LRU chain */
-	item->next = store->head;
+	item->next = shard->head;
 	if (item->next)
 		item->next->prev = item;
 	else
-		store->tail = item;
-	store->head = item;
+		shard->tail = item;
+	shard->head = item;
 	item->prev = NULL;
 }
 
@@ -395,6 +534,7 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, fz_store_
 	size_t size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
 	unsigned pos;
@@ -421,9 +561,10 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, fz_store_
 		hash.drop = val->drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, val->drop, &hash, use_hash);
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 
 	/* Fill out the item. To start with, we always set item->next == item
 	 * and item->prev == item. This is so that we can spot items that have
@@ -445,13 +586,13 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, fz_store_
 		fz_try(ctx)
 		{
 			/* May drop and retake the lock */
-			existing = fz_hash_insert_with_pos(ctx, store->hash, &hash, item, &pos);
+			existing = fz_hash_insert_with_pos(ctx, shard->hash, &hash, item, &pos);
 		}
 		fz_catch(ctx)
 		{
 			/* Any error here means that item never made it into the
 			 * hash - so no one else can have a reference. */
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return NULL;
@@ -460,65 +601,55 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, fz_store_
 		{
 			/* There was one there already! Take a new reference
 			 * to the existing one, and drop our current one. */
-			touch(store, existing);
-			if (existing->val->refs > 0)
-				existing->val->refs++;
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			touch(shard, existing);
+			keep_refs(ctx, existing->val);
+			fz_unlock(ctx, shard->lock);
 			fz_free(ctx, item);
 			type->drop_key(ctx, key);
 			return existing->val;
 		}
 	}
 	/* Now bump the ref */
-	if (val->refs > 0)
-		val->refs++;
-	/* If we haven't got an infinite store, check for space within it */
+	keep_refs(ctx, val);
+
+	/* Regardless of whether it's indexed, it goes into the linked list */
+	shard->size += itemsize;
+	touch(shard, item);
+	fz_unlock(ctx, shard->lock);
+
+	/* If we haven't got an infinite store, check for space within it.
+	 * Our new item is referenced by the caller, so it cannot be evicted
+	 * by this. */
 	if (store->max != FZ_STORE_UNLIMITED)
 	{
-		size = store->size + itemsize;
-		while (size > store->max)
+		size = store_size(store);
+		if (size > store->max)
 		{
-			size_t saved;
-			int relock = 0;
+			int reap;
 
 			/* First, do any outstanding reaping, even if defer_reap_count > 0 */
 			fz_lock(ctx, FZ_LOCK_REAP);
-			if (store->needs_reaping)
-			{
-				do_reap(ctx); /* Drops alloc lock */
-				relock = 1;
-			}
+			reap = store->needs_reaping;
 			fz_unlock(ctx, FZ_LOCK_REAP);
-			if (relock)
-				fz_lock(ctx, FZ_LOCK_ALLOC);
-			size = store->size + itemsize;
-			if (size <= store->max)
-				break;
-
-			/* ensure_space may drop, then retake the lock */
-			saved = ensure_space(ctx, size - store->max);
-			size -= saved;
-			if (saved == 0)
+			if (reap)
 			{
-				/* Failed to free any space. */
-				/* We used to 'unstore' it here, but that's wrong.
-				 * If we've already spent the memory to malloc it
-				 * then not putting it in the store just means that
-				 * a resource used multiple times will just be malloced
-				 * again. Better to put it in the store, have the
-				 * store account for it, and for it to potentially be reused.
-				 * When the caller drops the reference to it, it can then
-				 * be dropped from the store on the next attempt to store
-				 * anything else. */
-				break;
+				do_reap(ctx);
+				size = store_size(store);
 			}
+
+			/* If we fail to free enough space, we still keep the item.
+			 * We used to 'unstore' it here, but that's wrong. If we've
+			 * already spent the memory to malloc it then not putting it
+			 * in the store just means that a resource used multiple
+			 * times will just be malloced again. Better to put it in the
+			 * store, have the store account for it, and for it to
+			 * potentially be reused. When the caller drops the reference
+			 * to it, it can then be dropped from the store on the next
+			 * attempt to store anything else. */
+			if (size > store->max)
+				ensure_space(ctx, size - store->max);
 		}
 	}
-	store->size += itemsize;
-
-	/* Regardless of whether it's indexed, it goes into the linked list */
-	touch(store, item);
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
 }
@@ -528,6 +659,7 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
 
@@ -542,17 +674,18 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, drop, &hash, use_hash);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 		{
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
@@ -564,14 +697,13 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type *
 		 * picked up from the hash before it has made it into the
 		 * linked list does not get whipped out again due to the
 		 * store being full. */
-		touch(store, item);
+		touch(shard, item);
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-			item->val->refs++;
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		keep_refs(ctx, item->val);
+		fz_unlock(ctx, shard->lock);
 		return (void *)item->val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, shard->lock);
 
 	return NULL;
 }
@@ -581,6 +713,7 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_shard *shard;
 	int dodrop;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
@@ -590,19 +723,20 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 		hash.drop = drop;
 		use_hash = type->make_hash_key(ctx, &hash, key);
 	}
+	shard = find_shard(store, drop, &hash, use_hash);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, shard->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, shard->hash, &hash);
 		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, shard->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = shard->head; item; item = item->next)
 			if (item->val->drop == drop && !type->cmp_key(ctx, item->key, key))
 				break;
 	}
@@ -613,41 +747,42 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, fz_store_type
 		 * such items by setting item->next == item. */
 		if (item->next != item)
 		{
-			if (item->next)
-				item->next->prev = item->prev;
-			else
-				store->tail = item->prev;
-			if (item->prev)
-				item->prev->next = item->next;
-			else
-				store->head = item->next;
+			unlink_item(shard, item);
+			shard->size -= item->size;
 		}
-		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		dodrop = drop_refs(ctx, item->val);
+		fz_unlock(ctx, shard->lock);
 		if (dodrop)
 			item->val->drop(ctx, item->val);
 		type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
 	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, shard->lock);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	int i;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Run through all the items in the store */
-	while (store->head)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		evict(ctx, store->head); /* Drops then retakes lock */
+		fz_store_shard *shard = &store->shard[i];
+
+		fz_lock(ctx, shard->lock);
+		while (shard->head)
+		{
+			evict(ctx, shard, shard->head, 0); /* Drops the lock */
+			fz_lock(ctx, shard->lock);
+		}
+		fz_unlock(ctx, shard->lock);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 fz_store *
@@ -661,12 +796,15 @@ fz_keep_store_context(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
+	int i;
+
 	if (!ctx)
 		return;
 	if (fz_drop_imp(ctx, ctx->store, &ctx->store->refs))
 	{
 		fz_empty_store(ctx);
-		fz_drop_hash(ctx, ctx->store->hash);
+		for (i = 0; i < FZ_STORE_SHARDS; i++)
+			fz_drop_hash(ctx, ctx->store->shard[i].hash);
 		fz_free(ctx, ctx->store);
 		ctx->store = NULL;
 	}
@@ -684,24 +822,43 @@ fz_print_store_locked(fz_context *ctx, fz_output *out)
 {
 	fz_item *item, *next;
 	fz_store *store = ctx->store;
+	int i;
 
 	fz_printf(ctx, out, "-- resource store contents --\n");
 
-	for (item = store->head; item; item = next)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		next = item->next;
-		if (next)
-			next->val->refs++;
-		fz_printf(ctx, out, "store[*][refs=%d][size=%d] ", item->val->refs, item->size);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		item->type->print(ctx, out, item->key);
-		fz_printf(ctx, out, " = %p\n", item->val);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (next)
-			next->val->refs--;
+		fz_store_shard *shard = &store->shard[i];
+
+		fz_lock(ctx, shard->lock);
+		for (item = shard->head; item; item = next)
+		{
+			int refs = item->val->refs;
+			size_t size = item->size;
+
+			/* Pin the next item while we drop the locks to print. */
+			next = item->next;
+			if (next)
+				keep_refs(ctx, next->val);
+			fz_unlock(ctx, shard->lock);
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_printf(ctx, out, "store[%d][refs=%d][size=" FMT_zu "] ", i, refs, size);
+			item->type->print(ctx, out, item->key);
+			fz_printf(ctx, out, " = %p\n", item->val);
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			fz_lock(ctx, shard->lock);
+			if (next && next->val->refs > 0)
+				refs_add(ctx, next->val, -1);
+		}
+		fz_unlock(ctx, shard->lock);
 	}
 	fz_printf(ctx, out, "-- resource store hash contents --\n");
-	fz_print_hash_details(ctx, out, store->hash, print_item, 1);
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
+	{
+		fz_lock(ctx, store->shard[i].lock);
+		fz_print_hash_details(ctx, out, store->shard[i].hash, print_item, 1);
+		fz_unlock(ctx, store->shard[i].lock);
+	}
 	fz_printf(ctx, out, "-- end --\n");
 }
 
@@ -713,35 +870,11 @@ fz_print_store(fz_context *ctx, fz_output *out)
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
+/* Success is managing to evict any blocks */
 static int
-scavenge(fz_context *ctx, size_t tofree)
+scavenge(fz_context *ctx, size_t tofree, int alloc_held)
 {
-	fz_store *store = ctx->store;
-	size_t count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
-
-			if (count >= tofree)
-				break;
-
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
-	}
-	/* Success is managing to evict any blocks */
-	return count != 0;
+	return evict_lru(ctx, tofree, alloc_held) != 0;
 }
 
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
@@ -754,13 +887,14 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 		return 0;
 
 #ifdef DEBUG_SCAVENGING
-	printf("Scavenging: store=" FMT_zu " size=" FMT_zu " phase=%d\n", store->size, size, *phase);
+	printf("Scavenging: store=" FMT_zu " size=" FMT_zu " phase=%d\n", store_size(store), size, *phase);
 	fz_print_store_locked(ctx, stderr);
 	Memento_stats();
 #endif
 	do
 	{
 		size_t tofree;
+		size_t store_sz = store_size(store);
 
 		/* Calculate 'max' as the maximum size of the store for this phase */
 		if (*phase >= 16)
@@ -768,21 +902,22 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
 		else if (store->max != FZ_STORE_UNLIMITED)
 			max = store->max / 16 * (16 - *phase);
 		else
-			max = store->size / (16 - *phase) * (15 - *phase);
+			max = store_sz / (16 - *phase) * (15 - *phase);
 		(*phase)++;
 
 		/* Slightly baroque calculations to avoid overflow */
-		if (size > SIZE_MAX - store->size)
+		if (size > SIZE_MAX - store_sz)
 			tofree = SIZE_MAX - max;
-		else if (size + store->size > max)
+		else if (size + store_sz > max)
 			continue;
 		else
-			tofree = size + store->size - max;
+			tofree = size + store_sz - max;
 
-		if (scavenge(ctx, tofree))
+		/* We are called from the allocator with FZ_LOCK_ALLOC held */
+		if (scavenge(ctx, tofree, 1))
 		{
 #ifdef DEBUG_SCAVENGING
-			printf("scavenged: store=" FMT_zu "\n", store->size);
+			printf("scavenged: store=" FMT_zu "\n", store_size(store));
 			fz_print_store(ctx, stderr);
 			Memento_stats();
 #endif
@@ -804,7 +939,7 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 {
 	int success;
 	fz_store *store;
-	size_t new_size;
+	size_t size, new_size;
 
 	if (percent >= 100)
 		return 1;
@@ -813,19 +948,19 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	if (store == NULL)
 		return 0;
 
+	size = store_size(store);
 #ifdef DEBUG_SCAVENGING
-	fprintf(stderr, "fz_shrink_store: " FMT_zu "\n", store->size/(1024*1024));
+	fprintf(stderr, "fz_shrink_store: " FMT_zu "\n", size/(1024*1024));
 #endif
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 
-	new_size = (size_t)(((uint64_t)store->size * percent) / 100);
-	if (store->size > new_size)
-		scavenge(ctx, store->size - new_size);
+	new_size = (size_t)(((uint64_t)size * percent) / 100);
+	if (size > new_size)
+		scavenge(ctx, size - new_size, 0);
 
-	success = (store->size <= new_size) ? 1 : 0;
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	size = store_size(store);
+	success = (size <= new_size) ? 1 : 0;
 #ifdef DEBUG_SCAVENGING
-	fprintf(stderr, "fz_shrink_store after: " FMT_zu "\n", store->size/(1024*1024));
+	fprintf(stderr, "fz_shrink_store after: " FMT_zu "\n", size/(1024*1024));
 #endif
 
 	return success;
@@ -835,54 +970,42 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, fz_stor
 {
 	fz_store *store;
 	fz_item *item, *prev, *remove;
+	int i;
 
 	store = ctx->store;
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-
 	/* Filter the items */
 	remove = NULL;
-	for (item = store->tail; item; item = prev)
+	for (i = 0; i < FZ_STORE_SHARDS; i++)
 	{
-		prev = item->prev;
-		if (item->type != type)
-			continue;
-
-		if (fn(ctx, arg, item->key) == 0)
-			continue;
+		fz_store_shard *shard = &store->shard[i];
 
-		/* We have to drop it */
-		store->size -= item->size;
+		fz_lock(ctx, shard->lock);
+		for (item = shard->tail; item; item = prev)
+		{
+			prev = item->prev;
+			if (item->type != type)
+				continue;
 
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+			if (fn(ctx, arg, item->key) == 0)
+				continue;
 
-		/* Remove from the hash table */
-		if (item->type->make_hash_key)
-		{
-			fz_store_hash hash = { NULL };
-			hash.drop = item->val->drop;
-			if (item->type->make_hash_key(ctx, &hash, item->key))
-				fz_hash_remove(ctx, store->hash, &hash);
-		}
+			/* We have to drop it */
+			shard->size -= item->size;
+			unlink_item(shard, item);
+			unhash_item(ctx, shard, item);
 
-		/* Store whether to drop this value or not in 'prev' */
-		item->prev = (item->val->refs > 0 && --item->val->refs == 0) ? item : NULL;
+			/* Store whether to drop this value or not in 'prev' */
+			item->prev = drop_refs(ctx, item->val) ? item : NULL;
 
-		/* Store it in our removal chain - just singly linked */
-		item->next = remove;
-		remove = item;
+			/* Store it in our removal chain - just singly linked */
+			item->next = remove;
+			remove = item;
+		}
+		fz_unlock(ctx, shard->lock);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	/* Now drop the remove chain */
 	for (item = remove; item != NULL; item = remove)
@@ -916,13 +1039,10 @@ void fz_defer_reap_end(fz_context *ctx)
 	if (ctx->store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	fz_lock(ctx, FZ_LOCK_REAP);
 	--ctx->store->defer_reap_count;
 	reap = ctx->store->defer_reap_count == 0 && ctx->store->needs_reaping;
-	if (reap)
-		do_reap(ctx); /* Drops FZ_LOCK_ALLOC */
 	fz_unlock(ctx, FZ_LOCK_REAP);
-	if (!reap)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (reap)
+		do_reap(ctx);
 }
@@ -1,5 +1,11 @@
 #include "fitz-imp.h"
 
+#if !defined(_WIN32) && !defined(FZ_NO_MMAP)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 int
 fz_file_exists(fz_context *ctx, const char *path)
 {
@@ -126,10 +132,112 @@ fz_open_file_ptr(fz_context *ctx, FILE *file)
 	return stm;
 }
 
+/* Mapped files */
+
+#ifdef HAVE_MMAP
+static unsigned char *
+map_file(const char *name, size_t *lenp)
+{
+	struct stat info;
+	void *data;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return NULL;
+	/* Streams keep their position in an fz_off_t, so leave any file
+	 * too big for one to the ordinary file stream. */
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 ||
+		(uint64_t)info.st_size > SIZE_MAX || (uint64_t)info.st_size > (uint64_t)FZ_OFF_MAX)
+	{
+		close(fd);
+		return NULL;
+	}
+	/* Private and writable, so that anyone scribbling on the data
+	 * gets a copy of the page rather than changing the file. */
+	data = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	*lenp = (size_t)info.st_size;
+	return data;
+}
+
+void
+fz_unmap_file(fz_context *ctx, unsigned char *data, size_t len)
+{
+	munmap(data, len);
+}
+
+static fz_buffer *
+new_mapped_buffer(fz_context *ctx, unsigned char *data, size_t len)
+{
+	fz_buffer *buf;
+
+	fz_try(ctx)
+		buf = fz_new_buffer_from_shared_data(ctx, (const char *)data, len);
+	fz_catch(ctx)
+	{
+		munmap(data, len);
+		fz_rethrow(ctx);
+	}
+	buf->mapped = 1;
+
+	return buf;
+}
+
+fz_buffer *
+fz_new_buffer_from_mapped_file(fz_context *ctx, const char *filename)
+{
+	unsigned char *data;
+	size_t len;
+
+	data = map_file(filename, &len);
+	if (!data)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map %s", filename);
+	return new_mapped_buffer(ctx, data, len);
+}
+#else
+void
+fz_unmap_file(fz_context *ctx, unsigned char *data, size_t len)
+{
+}
+
+fz_buffer *
+fz_new_buffer_from_mapped_file(fz_context *ctx, const char *filename)
+{
+	return fz_read_file(ctx, filename);
+}
+#endif
+
 fz_stream *
 fz_open_file(fz_context *ctx, const char *name)
 {
 	FILE *f;
+
+#ifdef HAVE_MMAP
+	if (ctx->tuning->map_files)
+	{
+		size_t len;
+		unsigned char *data = map_file(name, &len);
+
+		/* If the file cannot be mapped, quietly read it instead. */
+		if (data)
+		{
+			fz_buffer *buf = new_mapped_buffer(ctx, data, len);
+			fz_stream *stm;
+
+			fz_try(ctx)
+				stm = fz_open_buffer(ctx, buf);
+			fz_always(ctx)
+				fz_drop_buffer(ctx, buf);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+			return stm;
+		}
+	}
+#endif
+
 #if defined(_WIN32) || defined(_WIN64)
 	char *s = (char*)name;
 	wchar_t *wname, *d;
@@ -185,7 +293,7 @@ static void seek_buffer(fz_context *ctx, fz_stream *stm, fz_off_t offset, int wh
 		offset = 0;
 	if (offset > stm->pos)
 		offset = stm->pos;
-	stm->rp += (int)(offset - pos);
+	stm->rp += (ptrdiff_t)(offset - pos);
 }
 
 static void close_buffer(fz_context *ctx, void *state_)
@@ -211,6 +319,74 @@ fz_open_buffer(fz_context *ctx, fz_buffer *buf)
 	return stm;
 }
 
+static void close_range(fz_context *ctx, void *state_)
+{
+	fz_drop_stream(ctx, (fz_stream *)state_);
+}
+
+/* The buffer that a memory stream (or a range of one) reads from, or NULL
+ * for fz_open_memory. */
+static fz_buffer *
+memory_stream_buffer(fz_stream *stm)
+{
+	while (stm->close == close_range)
+		stm = stm->state;
+	if (stm->close != close_buffer)
+		return NULL;
+	return stm->state;
+}
+
+fz_stream *
+fz_open_memory_range(fz_context *ctx, fz_stream *chain, fz_off_t offset, size_t len)
+{
+	fz_stream *stm;
+	fz_buffer *buf;
+	unsigned char *base;
+
+	if (chain->next != next_buffer)
+		return NULL;
+	buf = memory_stream_buffer(chain);
+	if (!buf || !buf->mapped)
+		return NULL;
+
+	/* A memory stream holds all of its data at once, with pos at the
+	 * end of it. */
+	base = chain->wp - chain->pos;
+	if (offset < 0)
+		offset = 0;
+	if (offset > chain->pos)
+		offset = chain->pos;
+	if (len > (size_t)(chain->pos - offset))
+		len = (size_t)(chain->pos - offset);
+
+	stm = fz_new_stream(ctx, fz_keep_stream(ctx, chain), next_buffer, close_range);
+	stm->seek = seek_buffer;
+
+	stm->rp = base + offset;
+	stm->wp = stm->rp + len;
+
+	stm->pos = (fz_off_t)len;
+
+	return stm;
+}
+
+fz_buffer *
+fz_slice_memory_stream(fz_context *ctx, fz_stream *stm)
+{
+	fz_buffer *buf, *slice;
+
+	if (stm->next != next_buffer)
+		return NULL;
+
+	buf = memory_stream_buffer(stm);
+	if (!buf)
+		return NULL; /* fz_open_memory; we cannot keep the data alive */
+
+	slice = fz_new_buffer_slice(ctx, buf, stm->rp - buf->data, stm->wp - stm->rp);
+	stm->rp = stm->wp;
+	return slice;
+}
+
 fz_stream *
 fz_open_memory(fz_context *ctx, unsigned char *data, size_t len)
 {
@@ -53,6 +53,19 @@ fz_read_all(fz_context *ctx, fz_stream *stm, size_t initial)
 	return fz_read_best(ctx, stm, initial, NULL);
 }
 
+fz_buffer *
+fz_read_shared(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated)
+{
+	fz_buffer *buf = fz_slice_memory_stream(ctx, stm);
+	if (buf)
+	{
+		if (truncated)
+			*truncated = 0;
+		return buf;
+	}
+	return fz_read_best(ctx, stm, initial, truncated);
+}
+
 fz_buffer *
 fz_read_best(fz_context *ctx, fz_stream *stm, size_t initial, int *truncated)
 {
@@ -0,0 +1,461 @@
+#include "mupdf/fitz.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define POOL_THREADS
+typedef CRITICAL_SECTION pool_mutex;
+typedef CONDITION_VARIABLE pool_cond;
+typedef HANDLE pool_thread;
+#define MUTEX_INIT(A) InitializeCriticalSection(&A)
+#define MUTEX_FIN(A) DeleteCriticalSection(&A)
+#define MUTEX_LOCK(A) EnterCriticalSection(&A)
+#define MUTEX_UNLOCK(A) LeaveCriticalSection(&A)
+#define COND_INIT(A) InitializeConditionVariable(&A)
+#define COND_FIN(A) do { } while (0)
+#define COND_WAIT(A,M) (void)SleepConditionVariableCS(&A, &M, INFINITE)
+#define COND_BROADCAST(A) WakeAllConditionVariable(&A)
+#elif defined(HAVE_PTHREADS)
+#include <pthread.h>
+#define POOL_THREADS
+typedef pthread_mutex_t pool_mutex;
+typedef pthread_cond_t pool_cond;
+typedef pthread_t pool_thread;
+#define MUTEX_INIT(A) (void)pthread_mutex_init(&A, NULL)
+#define MUTEX_FIN(A) (void)pthread_mutex_destroy(&A)
+#define MUTEX_LOCK(A) (void)pthread_mutex_lock(&A)
+#define MUTEX_UNLOCK(A) (void)pthread_mutex_unlock(&A)
+#define COND_INIT(A) (void)pthread_cond_init(&A, NULL)
+#define COND_FIN(A) (void)pthread_cond_destroy(&A)
+#define COND_WAIT(A,M) (void)pthread_cond_wait(&A, &M)
+#define COND_BROADCAST(A) (void)pthread_cond_broadcast(&A)
+#else
+typedef int pool_mutex;
+typedef int pool_cond;
+#define MUTEX_INIT(A) do { } while (0)
+#define MUTEX_FIN(A) do { } while (0)
+#define MUTEX_LOCK(A) do { } while (0)
+#define MUTEX_UNLOCK(A) do { } while (0)
+#define COND_INIT(A) do { } while (0)
+#define COND_FIN(A) do { } while (0)
+#define COND_WAIT(A,M) do { } while (0)
+#define COND_BROADCAST(A) do { } while (0)
+#endif
+
+/*
+	The pool has a queue for each worker thread, and one more for the
+	threads that are not workers (those that submit jobs from outside
+	the pool, and the one running fz_thread_pool_wait).
+
+	Each queue is a doubly linked list of jobs with a lock of its own.
+	The owner pushes and pops at the tail; thieves take from the head,
+	so that they get the oldest (and typically largest) work.
+
+	The pool lock protects the counts, the error state and the
+	shutdown flag, and is taken with no queue lock held. None of
+	these locks are fz locks. Nothing that can throw or take an fz
+	lock is called while any of them are held; the only fz functions
+	called are fz_caught, fz_caught_message and fz_strlcpy, which
+	copy the error message into and out of the pool under the pool
+	lock.
+*/
+
+typedef struct pool_job_s pool_job;
+typedef struct pool_queue_s pool_queue;
+typedef struct pool_worker_s pool_worker;
+
+struct pool_job_s
+{
+	fz_thread_job_fn *fn;
+	void *arg;
+	pool_job *prev;
+	pool_job *next;
+};
+
+struct pool_queue_s
+{
+	pool_mutex lock;
+	pool_job *head;
+	pool_job *tail;
+};
+
+struct pool_worker_s
+{
+	fz_thread_pool *pool;
+	fz_context *ctx;
+	int index;
+#ifdef POOL_THREADS
+	pool_thread thread;
+#endif
+};
+
+struct fz_thread_pool_s
+{
+	int nthreads;
+	pool_worker *workers;
+	pool_queue *queues; /* nthreads + 1 of them */
+
+	pool_mutex lock;
+	pool_cond cond;
+	int queued; /* Jobs sitting in a queue */
+	int pending; /* Jobs queued or running */
+	int next_queue;
+	int shutdown;
+	int failed;
+	int code;
+	char message[256];
+};
+
+static void
+push_job(pool_queue *q, pool_job *job)
+{
+	MUTEX_LOCK(q->lock);
+	job->next = NULL;
+	job->prev = q->tail;
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+	MUTEX_UNLOCK(q->lock);
+}
+
+static pool_job *
+pop_job(pool_queue *q)
+{
+	pool_job *job;
+
+	MUTEX_LOCK(q->lock);
+	job = q->tail;
+	if (job)
+	{
+		q->tail = job->prev;
+		if (q->tail)
+			q->tail->next = NULL;
+		else
+			q->head = NULL;
+	}
+	MUTEX_UNLOCK(q->lock);
+	return job;
+}
+
+static pool_job *
+steal_job(pool_queue *q)
+{
+	pool_job *job;
+
+	MUTEX_LOCK(q->lock);
+	job = q->head;
+	if (job)
+	{
+		q->head = job->next;
+		if (q->head)
+			q->head->prev = NULL;
+		else
+			q->tail = NULL;
+	}
+	MUTEX_UNLOCK(q->lock);
+	return job;
+}
+
+/* Take a job from queue 'self', or failing that steal one from another
+ * queue. Only called once a job has been reserved by decrementing
+ * pool->queued, so one will turn up, but it may have been pushed to a
+ * queue we have already looked at, so keep going round until it does. */
+static pool_job *
+take_job(fz_thread_pool *pool, int self)
+{
+	int nqueues = pool->nthreads + 1;
+	pool_job *job;
+	int i;
+
+	job = pop_job(&pool->queues[self]);
+	while (job == NULL)
+	{
+		for (i = 1; i <= nqueues && job == NULL; i++)
+			job = steal_job(&pool->queues[(self + i) % nqueues]);
+	}
+	return job;
+}
+
+/* Errors are kept for fz_thread_pool_wait to throw. */
+static void
+call_job(fz_context *ctx, fz_thread_pool *pool, fz_thread_job_fn *fn, void *arg)
+{
+	fz_try(ctx)
+		fn(ctx, arg);
+	fz_catch(ctx)
+	{
+		MUTEX_LOCK(pool->lock);
+		if (!pool->failed)
+		{
+			pool->failed = 1;
+			pool->code = fz_caught(ctx);
+			fz_strlcpy(pool->message, fz_caught_message(ctx), sizeof pool->message);
+		}
+		MUTEX_UNLOCK(pool->lock);
+	}
+}
+
+static void
+run_job(fz_context *ctx, fz_thread_pool *pool, pool_job *job)
+{
+	call_job(ctx, pool, job->fn, job->arg);
+	fz_free(ctx, job);
+
+	MUTEX_LOCK(pool->lock);
+	if (--pool->pending == 0)
+		COND_BROADCAST(pool->cond);
+	MUTEX_UNLOCK(pool->lock);
+}
+
+/* Returns the queue that jobs submitted with ctx should go on. */
+static int
+queue_for_context(fz_thread_pool *pool, fz_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < pool->nthreads; i++)
+		if (pool->workers[i].ctx == ctx)
+			return i;
+	return pool->nthreads;
+}
+
+#ifdef POOL_THREADS
+static void
+worker_loop(pool_worker *w)
+{
+	fz_thread_pool *pool = w->pool;
+
+	while (1)
+	{
+		MUTEX_LOCK(pool->lock);
+		while (pool->queued == 0 && !pool->shutdown)
+			COND_WAIT(pool->cond, pool->lock);
+		if (pool->queued == 0)
+		{
+			MUTEX_UNLOCK(pool->lock);
+			break;
+		}
+		pool->queued--;
+		MUTEX_UNLOCK(pool->lock);
+
+		run_job(w->ctx, pool, take_job(pool, w->index));
+	}
+}
+
+#ifdef _MSC_VER
+static DWORD WINAPI
+worker_thread(LPVOID arg)
+{
+	worker_loop((pool_worker *)arg);
+	return 0;
+}
+
+static int
+start_worker(pool_worker *w)
+{
+	w->thread = CreateThread(NULL, 0, worker_thread, w, 0, NULL);
+	return w->thread != NULL;
+}
+
+static void
+join_worker(pool_worker *w)
+{
+	(void)WaitForSingleObject(w->thread, INFINITE);
+	CloseHandle(w->thread);
+}
+#else
+static void *
+worker_thread(void *arg)
+{
+	worker_loop((pool_worker *)arg);
+	return NULL;
+}
+
+static int
+start_worker(pool_worker *w)
+{
+	return pthread_create(&w->thread, NULL, worker_thread, w) == 0;
+}
+
+static void
+join_worker(pool_worker *w)
+{
+	(void)pthread_join(w->thread, NULL);
+}
+#endif
+#endif
+
+fz_thread_pool *
+fz_new_thread_pool(fz_context *ctx, int threads)
+{
+	fz_thread_pool *pool;
+	int i;
+
+#ifndef POOL_THREADS
+	threads = 0;
+#endif
+	if (threads < 0)
+		threads = 0;
+
+	pool = fz_malloc_struct(ctx, fz_thread_pool);
+	fz_try(ctx)
+	{
+		pool->workers = fz_calloc(ctx, threads + 1, sizeof(*pool->workers));
+		pool->queues = fz_calloc(ctx, threads + 1, sizeof(*pool->queues));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, pool->workers);
+		fz_free(ctx, pool);
+		fz_rethrow(ctx);
+	}
+
+	MUTEX_INIT(pool->lock);
+	COND_INIT(pool->cond);
+	for (i = 0; i <= threads; i++)
+		MUTEX_INIT(pool->queues[i].lock);
+
+#ifdef POOL_THREADS
+	/* Workers only look at nthreads once they have been given a job,
+	 * which cannot happen until we return, so it is safe to bump it as
+	 * each one starts. If we get fewer threads than we asked for, the
+	 * queue after the last worker becomes the callers queue, and any
+	 * beyond that are unused. */
+	for (i = 0; i < threads; i++)
+	{
+		pool_worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i;
+		w->ctx = fz_clone_context(ctx);
+		if (w->ctx == NULL)
+			break;
+		if (!start_worker(w))
+		{
+			fz_drop_context(w->ctx);
+			w->ctx = NULL;
+			break;
+		}
+		pool->nthreads++;
+	}
+	for (i = pool->nthreads + 1; i <= threads; i++)
+		MUTEX_FIN(pool->queues[i].lock);
+#endif
+
+	return pool;
+}
+
+void
+fz_drop_thread_pool(fz_context *ctx, fz_thread_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	fz_try(ctx)
+		fz_thread_pool_wait(ctx, pool);
+	fz_catch(ctx)
+	{
+		/* Swallow the error */
+	}
+
+#ifdef POOL_THREADS
+	MUTEX_LOCK(pool->lock);
+	pool->shutdown = 1;
+	COND_BROADCAST(pool->cond);
+	MUTEX_UNLOCK(pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+	{
+		join_worker(&pool->workers[i]);
+		fz_drop_context(pool->workers[i].ctx);
+	}
+#endif
+
+	for (i = 0; i <= pool->nthreads; i++)
+		MUTEX_FIN(pool->queues[i].lock);
+	COND_FIN(pool->cond);
+	MUTEX_FIN(pool->lock);
+	fz_free(ctx, pool->queues);
+	fz_free(ctx, pool->workers);
+	fz_free(ctx, pool);
+}
+
+int
+fz_thread_pool_size(fz_context *ctx, fz_thread_pool *pool)
+{
+	return pool ? pool->nthreads : 0;
+}
+
+void
+fz_thread_pool_submit(fz_context *ctx, fz_thread_pool *pool, fz_thread_job_fn *fn, void *arg)
+{
+	pool_job *job;
+	int q;
+
+	/* Callers submit in a loop and free the jobs' data if anything
+	 * throws, so we must not throw once earlier jobs are queued. If
+	 * there is no memory for the job, run it here instead. */
+	job = fz_calloc_no_throw(ctx, 1, sizeof *job);
+	if (job == NULL)
+	{
+		call_job(ctx, pool, fn, arg);
+		return;
+	}
+	job->fn = fn;
+	job->arg = arg;
+
+	/* Jobs from outside the pool are spread across all the queues, so
+	 * that idle workers pick them up without having to steal. */
+	q = queue_for_context(pool, ctx);
+	MUTEX_LOCK(pool->lock);
+	if (q == pool->nthreads)
+	{
+		q = pool->next_queue;
+		pool->next_queue = (q + 1) % (pool->nthreads + 1);
+	}
+	pool->pending++;
+	MUTEX_UNLOCK(pool->lock);
+
+	push_job(&pool->queues[q], job);
+
+	MUTEX_LOCK(pool->lock);
+	pool->queued++;
+	COND_BROADCAST(pool->cond);
+	MUTEX_UNLOCK(pool->lock);
+}
+
+void
+fz_thread_pool_wait(fz_context *ctx, fz_thread_pool *pool)
+{
+	int failed = 0;
+	int code = 0;
+	char message[256];
+
+	while (1)
+	{
+		MUTEX_LOCK(pool->lock);
+		while (pool->queued == 0 && pool->pending > 0)
+			COND_WAIT(pool->cond, pool->lock);
+		if (pool->queued == 0)
+		{
+			if (pool->failed)
+			{
+				failed = 1;
+				code = pool->code;
+				fz_strlcpy(message, pool->message, sizeof message);
+				pool->failed = 0;
+			}
+			MUTEX_UNLOCK(pool->lock);
+			break;
+		}
+		pool->queued--;
+		MUTEX_UNLOCK(pool->lock);
+
+		run_job(ctx, pool, take_job(pool, pool->nthreads));
+	}
+
+	if (failed)
+		fz_throw(ctx, code, "%s", message);
+}
@@ -110,6 +110,8 @@ load_separation(fz_context *ctx, pdf_document *doc, pdf_obj *array)
 
 		cs = fz_new_colorspace(ctx, n == 1 ? "Separation" : "DeviceN", n, separation_to_rgb, NULL, free_separation, sep,
 			sizeof(struct separation) + (base ? base->size : 0) + fz_function_size(ctx, tint));
+		cs->tint_base = base;
+		cs->tint = tint;
 	}
 	fz_catch(ctx)
 	{
@@ -1,6 +1,8 @@
 #include "mupdf/pdf.h"
 
 typedef struct psobj_s psobj;
+typedef union psreg_u psreg;
+typedef struct psinsn_s psinsn;
 
 enum
 {
@@ -46,6 +48,12 @@ struct pdf_function_s
 		struct {
 			psobj *code;
 			int cap;
+			psinsn *prog;		/* compiled code, or NULL to interpret */
+			int len, prog_cap;
+			psinsn *konst;		/* constant loads, run once per batch */
+			int klen, kcap;
+			int nregs;
+			int out[FZ_FN_MAXN];	/* register holding each output */
 		} p;
 	} u;
 };
@@ -468,7 +476,9 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_IDIV:
 				i2 = ps_pop_int(st);
 				i1 = ps_pop_int(st);
-				if (i2 != 0)
+				if (i2 == -1)
+					ps_push_int(st, (int)(0u - (unsigned int)i1));
+				else if (i2 != 0)
 					ps_push_int(st, i1 / i2);
 				else
 					ps_push_int(st, DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX));
@@ -519,7 +529,9 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_MOD:
 				i2 = ps_pop_int(st);
 				i1 = ps_pop_int(st);
-				if (i2 != 0)
+				if (i2 == -1)
+					ps_push_int(st, 0);
+				else if (i2 != 0)
 					ps_push_int(st, i1 % i2);
 				else
 					ps_push_int(st, DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX));
@@ -832,6 +844,1044 @@ parse_code(fz_context *ctx, pdf_function *func, fz_stream *stream, int *codeptr,
 	}
 }
 
+/*
+ * PostScript calculator compiler
+ *
+ * The code is run once at load time over a stack of abstract values whose
+ * types and depths are known, so that each operator can be resolved to a
+ * single typed instruction on virtual registers. Values computed only from
+ * constants are folded, and stack shuffling operators just rename
+ * registers. If the shape of the stack cannot be determined (operands
+ * of copy, index or roll that are not constant, or type errors that the
+ * interpreter would quietly step around), or the program grows too big,
+ * we keep using ps_run.
+ */
+
+#define PS_MAX_REGS 1024
+#define PS_MAX_INSNS 4096
+
+enum
+{
+	PSI_MOV, PSI_LOADK, PSI_JMP, PSI_JZ,
+	PSI_CVI, PSI_CVR,
+	PSI_ABS_I, PSI_ABS_R, PSI_NEG_I, PSI_NEG_R, PSI_NOT_I, PSI_NOT_B,
+	PSI_ADD_I, PSI_ADD_R, PSI_SUB_I, PSI_SUB_R, PSI_MUL_I, PSI_MUL_R,
+	PSI_DIV, PSI_IDIV, PSI_MOD, PSI_BITSHIFT,
+	PSI_AND, PSI_OR, PSI_XOR,
+	PSI_EQ_I, PSI_EQ_R, PSI_NE_I, PSI_NE_R, PSI_GE_I, PSI_GE_R,
+	PSI_GT_I, PSI_GT_R, PSI_LE_I, PSI_LE_R, PSI_LT_I, PSI_LT_R,
+	PSI_ATAN, PSI_CEILING, PSI_FLOOR, PSI_COS, PSI_SIN, PSI_EXP,
+	PSI_LN, PSI_LOG, PSI_SQRT, PSI_ROUND, PSI_TRUNCATE
+};
+
+union psreg_u
+{
+	int i;		/* integer or boolean */
+	float f;
+};
+
+struct psinsn_s
+{
+	unsigned short op;
+	unsigned short dst;	/* or condition for PSI_JZ */
+	union
+	{
+		struct { unsigned short a, b; } r;
+		psreg k;	/* PSI_LOADK */
+		int target;	/* PSI_JMP, PSI_JZ */
+	} u;
+};
+
+/* Same sanitising as ps_push_real. */
+static inline float ps_real(float n)
+{
+	if (isnan(n))
+		n = 1.0;
+	return fz_clamp(n, -FLT_MAX, FLT_MAX);
+}
+
+static void
+ps_exec(const psinsn *prog, int len, psreg *r)
+{
+	const psinsn *p;
+	int pc = 0;
+	int i1, i2;
+	float r1, r2;
+
+	/* Each case mirrors the expression used by ps_run, so that results
+	 * are identical bit for bit. */
+	while (pc < len)
+	{
+		p = &prog[pc++];
+		switch (p->op)
+		{
+		case PSI_MOV: r[p->dst] = r[p->u.r.a]; break;
+		case PSI_LOADK: r[p->dst] = p->u.k; break;
+		case PSI_JMP: pc = p->u.target; break;
+		case PSI_JZ: if (!r[p->dst].i) pc = p->u.target; break;
+
+		case PSI_CVI: r[p->dst].i = r[p->u.r.a].f; break;
+		case PSI_CVR: r[p->dst].f = ps_real(r[p->u.r.a].i); break;
+
+		case PSI_ABS_I: r[p->dst].i = abs(r[p->u.r.a].i); break;
+		case PSI_ABS_R: r[p->dst].f = ps_real(fabsf(r[p->u.r.a].f)); break;
+		case PSI_NEG_I: r[p->dst].i = -r[p->u.r.a].i; break;
+		case PSI_NEG_R: r[p->dst].f = ps_real(-r[p->u.r.a].f); break;
+		case PSI_NOT_I: r[p->dst].i = ~r[p->u.r.a].i; break;
+		case PSI_NOT_B: r[p->dst].i = !r[p->u.r.a].i; break;
+
+		case PSI_ADD_I: r[p->dst].i = r[p->u.r.a].i + r[p->u.r.b].i; break;
+		case PSI_ADD_R: r[p->dst].f = ps_real(r[p->u.r.a].f + r[p->u.r.b].f); break;
+		case PSI_SUB_I: r[p->dst].i = r[p->u.r.a].i - r[p->u.r.b].i; break;
+		case PSI_SUB_R: r[p->dst].f = ps_real(r[p->u.r.a].f - r[p->u.r.b].f); break;
+		case PSI_MUL_I: r[p->dst].i = r[p->u.r.a].i * r[p->u.r.b].i; break;
+		case PSI_MUL_R: r[p->dst].f = ps_real(r[p->u.r.a].f * r[p->u.r.b].f); break;
+
+		case PSI_DIV:
+			r1 = r[p->u.r.a].f;
+			r2 = r[p->u.r.b].f;
+			if (fabsf(r2) >= FLT_EPSILON)
+				r[p->dst].f = ps_real(r1 / r2);
+			else
+				r[p->dst].f = ps_real(DIV_BY_ZERO(r1, r2, -FLT_MAX, FLT_MAX));
+			break;
+		case PSI_IDIV:
+			i1 = r[p->u.r.a].i;
+			i2 = r[p->u.r.b].i;
+			if (i2 == -1)
+				r[p->dst].i = (int)(0u - (unsigned int)i1);
+			else if (i2 != 0)
+				r[p->dst].i = i1 / i2;
+			else
+				r[p->dst].i = DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX);
+			break;
+		case PSI_MOD:
+			i1 = r[p->u.r.a].i;
+			i2 = r[p->u.r.b].i;
+			if (i2 == -1)
+				r[p->dst].i = 0;
+			else if (i2 != 0)
+				r[p->dst].i = i1 % i2;
+			else
+				r[p->dst].i = DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX);
+			break;
+		case PSI_BITSHIFT:
+			i1 = r[p->u.r.a].i;
+			i2 = r[p->u.r.b].i;
+			if (i2 > 0 && i2 < 8 * sizeof (i2))
+				r[p->dst].i = i1 << i2;
+			else if (i2 < 0 && i2 > -8 * (int)sizeof (i2))
+				r[p->dst].i = (int)((unsigned int)i1 >> -i2);
+			else
+				r[p->dst].i = i1;
+			break;
+
+		/* Booleans are always 0 or 1, so these serve for both types. */
+		case PSI_AND: r[p->dst].i = r[p->u.r.a].i & r[p->u.r.b].i; break;
+		case PSI_OR: r[p->dst].i = r[p->u.r.a].i | r[p->u.r.b].i; break;
+		case PSI_XOR: r[p->dst].i = r[p->u.r.a].i ^ r[p->u.r.b].i; break;
+
+		case PSI_EQ_I: r[p->dst].i = r[p->u.r.a].i == r[p->u.r.b].i; break;
+		case PSI_EQ_R: r[p->dst].i = r[p->u.r.a].f == r[p->u.r.b].f; break;
+		case PSI_NE_I: r[p->dst].i = r[p->u.r.a].i != r[p->u.r.b].i; break;
+		case PSI_NE_R: r[p->dst].i = r[p->u.r.a].f != r[p->u.r.b].f; break;
+		case PSI_GE_I: r[p->dst].i = r[p->u.r.a].i >= r[p->u.r.b].i; break;
+		case PSI_GE_R: r[p->dst].i = r[p->u.r.a].f >= r[p->u.r.b].f; break;
+		case PSI_GT_I: r[p->dst].i = r[p->u.r.a].i > r[p->u.r.b].i; break;
+		case PSI_GT_R: r[p->dst].i = r[p->u.r.a].f > r[p->u.r.b].f; break;
+		case PSI_LE_I: r[p->dst].i = r[p->u.r.a].i <= r[p->u.r.b].i; break;
+		case PSI_LE_R: r[p->dst].i = r[p->u.r.a].f <= r[p->u.r.b].f; break;
+		case PSI_LT_I: r[p->dst].i = r[p->u.r.a].i < r[p->u.r.b].i; break;
+		case PSI_LT_R: r[p->dst].i = r[p->u.r.a].f < r[p->u.r.b].f; break;
+
+		case PSI_ATAN:
+			r1 = atan2f(r[p->u.r.a].f, r[p->u.r.b].f) * RADIAN;
+			if (r1 < 0)
+				r1 += 360;
+			r[p->dst].f = ps_real(r1);
+			break;
+		case PSI_CEILING: r[p->dst].f = ps_real(ceilf(r[p->u.r.a].f)); break;
+		case PSI_FLOOR: r[p->dst].f = ps_real(floorf(r[p->u.r.a].f)); break;
+		case PSI_COS: r[p->dst].f = ps_real(cosf(r[p->u.r.a].f/RADIAN)); break;
+		case PSI_SIN: r[p->dst].f = ps_real(sinf(r[p->u.r.a].f/RADIAN)); break;
+		case PSI_EXP: r[p->dst].f = ps_real(powf(r[p->u.r.a].f, r[p->u.r.b].f)); break;
+		case PSI_LN:
+			/* Bug 692941 - logf as separate statement */
+			r2 = logf(r[p->u.r.a].f);
+			r[p->dst].f = ps_real(r2);
+			break;
+		case PSI_LOG: r[p->dst].f = ps_real(log10f(r[p->u.r.a].f)); break;
+		case PSI_SQRT: r[p->dst].f = ps_real(sqrtf(r[p->u.r.a].f)); break;
+		case PSI_ROUND:
+			r1 = r[p->u.r.a].f;
+			r[p->dst].f = ps_real((r1 >= 0) ? floorf(r1 + 0.5f) : ceilf(r1 - 0.5f));
+			break;
+		case PSI_TRUNCATE:
+			r1 = r[p->u.r.a].f;
+			r[p->dst].f = ps_real((r1 >= 0) ? floorf(r1) : ceilf(r1));
+			break;
+		}
+	}
+}
+
+/* A value on the abstract stack: a register, or a constant if reg < 0. */
+typedef struct
+{
+	int type;
+	int reg;
+	psreg k;
+} psval;
+
+typedef struct
+{
+	psval stack[100];
+	int sp;
+	int cont[100];	/* where to carry on after each enclosing block */
+	int ncont;
+} psvstack;
+
+typedef struct
+{
+	pdf_function *func;
+	int ends;	/* number of paths that reach the end of the program */
+} pscompiler;
+
+enum { PS_FAIL = -1, PS_FALL, PS_DONE, PS_SPLIT };
+
+static int
+ps_new_reg(pdf_function *func)
+{
+	if (func->u.p.nregs >= PS_MAX_REGS)
+		return -1;
+	return func->u.p.nregs++;
+}
+
+static int
+ps_emit(fz_context *ctx, pdf_function *func, int op, int dst, int a, int b)
+{
+	psinsn *p;
+
+	if (func->u.p.len == func->u.p.prog_cap)
+	{
+		int new_cap = func->u.p.prog_cap + 64;
+		func->u.p.prog = fz_resize_array(ctx, func->u.p.prog, new_cap, sizeof(psinsn));
+		func->u.p.prog_cap = new_cap;
+	}
+	p = &func->u.p.prog[func->u.p.len];
+	p->op = op;
+	p->dst = dst;
+	p->u.r.a = a;
+	p->u.r.b = b;
+	return func->u.p.len++;
+}
+
+/* Load a constant into a register, once per batch of evaluations. */
+static void
+ps_emit_konst(fz_context *ctx, pdf_function *func, int dst, psreg k)
+{
+	psinsn *p;
+
+	if (func->u.p.klen == func->u.p.kcap)
+	{
+		int new_cap = func->u.p.kcap + 16;
+		func->u.p.konst = fz_resize_array(ctx, func->u.p.konst, new_cap, sizeof(psinsn));
+		func->u.p.kcap = new_cap;
+	}
+	p = &func->u.p.konst[func->u.p.klen++];
+	p->op = PSI_LOADK;
+	p->dst = dst;
+	p->u.k = k;
+}
+
+/* Emit a copy of v into register dst. */
+static void
+ps_emit_move(fz_context *ctx, pdf_function *func, int dst, psval *v)
+{
+	int pc;
+
+	if (v->reg >= 0)
+		ps_emit(ctx, func, PSI_MOV, dst, v->reg, 0);
+	else
+	{
+		pc = ps_emit(ctx, func, PSI_LOADK, dst, 0, 0);
+		func->u.p.prog[pc].u.k = v->k;
+	}
+}
+
+/* Return a register holding v, loading constants as needed. */
+static int
+ps_reg_of(fz_context *ctx, pdf_function *func, psval *v)
+{
+	int reg;
+
+	if (v->reg >= 0)
+		return v->reg;
+	/* Nothing else writes to the new register. */
+	reg = ps_new_reg(func);
+	if (reg >= 0)
+		ps_emit_konst(ctx, func, reg, v->k);
+	return reg;
+}
+
+/* Compute op applied to a (and b, if not NULL) into *res, folding constants. */
+static int
+ps_apply(fz_context *ctx, pdf_function *func, int op, int type, psval *a, psval *b, psval *res)
+{
+	int ra, rb, dst;
+
+	if (a->reg < 0 && (!b || b->reg < 0))
+	{
+		psinsn insn;
+		psreg tmp[3];
+
+		insn.op = op;
+		insn.dst = 0;
+		insn.u.r.a = 1;
+		insn.u.r.b = 2;
+		tmp[1] = a->k;
+		tmp[2] = b ? b->k : a->k;
+		ps_exec(&insn, 1, tmp);
+		res->type = type;
+		res->reg = -1;
+		res->k = tmp[0];
+		return 0;
+	}
+
+	ra = ps_reg_of(ctx, func, a);
+	rb = b ? ps_reg_of(ctx, func, b) : 0;
+	dst = ps_new_reg(func);
+	if (ra < 0 || rb < 0 || dst < 0)
+		return -1;
+	ps_emit(ctx, func, op, dst, ra, rb);
+	res->type = type;
+	res->reg = dst;
+	return 0;
+}
+
+static int ps_is_num(psval *v)
+{
+	return v->type == PS_INT || v->type == PS_REAL;
+}
+
+/* The conversions done by ps_pop_real and ps_pop_int. */
+static int
+ps_to_real(fz_context *ctx, pdf_function *func, psval *v, psval *res)
+{
+	if (v->type == PS_REAL)
+	{
+		*res = *v;
+		return 0;
+	}
+	return ps_apply(ctx, func, PSI_CVR, PS_REAL, v, NULL, res);
+}
+
+static int
+ps_to_int(fz_context *ctx, pdf_function *func, psval *v, psval *res)
+{
+	if (v->type == PS_INT)
+	{
+		*res = *v;
+		return 0;
+	}
+	return ps_apply(ctx, func, PSI_CVI, PS_INT, v, NULL, res);
+}
+
+/* Pop a constant count operand, for copy, index and roll. */
+static int
+ps_pop_const_int(fz_context *ctx, pdf_function *func, psvstack *st, int *n)
+{
+	psval v;
+
+	if (st->sp < 1 || !ps_is_num(&st->stack[st->sp - 1]) || st->stack[st->sp - 1].reg >= 0)
+		return -1;
+	if (ps_to_int(ctx, func, &st->stack[--st->sp], &v))
+		return -1;
+	*n = v.k.i;
+	return 0;
+}
+
+static int ps_same_val(psval *a, psval *b)
+{
+	if (a->type != b->type)
+		return 0;
+	if (a->reg >= 0 || b->reg >= 0)
+		return a->reg == b->reg;
+	return a->k.i == b->k.i;
+}
+
+static int ps_compile_block(fz_context *ctx, pscompiler *c, int pc, psvstack *st, int stop);
+
+static int
+ps_push_cont(psvstack *st, int pc)
+{
+	if (st->ncont == nelem(st->cont))
+		return -1;
+	st->cont[st->ncont++] = pc;
+	return 0;
+}
+
+/* Both paths of a conditional run on to the end of the program. */
+static int
+ps_compile_split(fz_context *ctx, pscompiler *c, psval *cond, int then_pc, int else_pc, int end_pc, psvstack *st, psvstack *t)
+{
+	pdf_function *func = c->func;
+	int jz, code;
+
+	jz = ps_emit(ctx, func, PSI_JZ, cond->reg, 0, 0);
+
+	*t = *st;
+	if (ps_push_cont(t, end_pc))
+		return PS_FAIL;
+	code = ps_compile_block(ctx, c, then_pc, t, 0);
+	if (code != PS_DONE)
+		return PS_FAIL;
+
+	func->u.p.prog[jz].u.target = func->u.p.len;
+	if (else_pc >= 0)
+	{
+		if (ps_push_cont(st, end_pc))
+			return PS_FAIL;
+		code = ps_compile_block(ctx, c, else_pc, st, 0);
+	}
+	else
+		code = ps_compile_block(ctx, c, end_pc, st, 0);
+	return code == PS_DONE ? PS_DONE : PS_FAIL;
+}
+
+/*
+	A jump over the 'then' block to the 'else' block (which may be
+	empty), after which both paths must have left stacks of the same
+	depth and types. Slots that differ are merged into one register
+	written on each path.
+*/
+static int
+ps_compile_merge(fz_context *ctx, pscompiler *c, psval *cond, int then_pc, int else_pc, int end_pc, psvstack *st, psvstack *t)
+{
+	pdf_function *func = c->func;
+	int claimed[nelem(st->stack)];
+	int then_move[nelem(st->stack)];
+	int then_regs, then_end, jz, jmp, else_start;
+	int i, k, n, reg, then_code, else_code;
+	psinsn *p;
+
+	jz = ps_emit(ctx, func, PSI_JZ, cond->reg, 0, 0);
+
+	then_regs = func->u.p.nregs;
+	*t = *st;
+	if (ps_push_cont(t, end_pc))
+		return PS_FAIL;
+	then_code = ps_compile_block(ctx, c, then_pc, t, t->ncont);
+	if (then_code == PS_FAIL || then_code == PS_SPLIT)
+		return then_code;
+	t->ncont--;
+	then_end = func->u.p.len;
+	jmp = then_code == PS_FALL ? ps_emit(ctx, func, PSI_JMP, 0, 0, 0) : -1;
+
+	else_start = func->u.p.len;
+	else_code = PS_FALL;
+	if (else_pc >= 0)
+	{
+		if (ps_push_cont(st, end_pc))
+			return PS_FAIL;
+		else_code = ps_compile_block(ctx, c, else_pc, st, st->ncont);
+		if (else_code == PS_FAIL || else_code == PS_SPLIT)
+			return else_code;
+		st->ncont--;
+	}
+
+	/* A path that ended the program needs no merging. */
+	p = func->u.p.prog;
+	if (then_code == PS_DONE)
+	{
+		p[jz].u.target = else_start;
+		return else_code;
+	}
+	if (else_code == PS_DONE)
+	{
+		p[jz].u.target = else_start;
+		p[jmp].u.target = func->u.p.len;
+		*st = *t;
+		return PS_FALL;
+	}
+
+	if (t->sp != st->sp)
+		return PS_SPLIT;
+	for (i = 0; i < st->sp; i++)
+		if (t->stack[i].type != st->stack[i].type)
+			return PS_SPLIT;
+
+	n = 0;
+	for (i = 0; i < st->sp; i++)
+	{
+		psval *tv = &t->stack[i];
+		psval *ev = &st->stack[i];
+
+		then_move[i] = -1;
+		if (ps_same_val(tv, ev))
+			continue;
+
+		/* A register first written in the 'then' block is not live on
+		 * the 'else' path, so it can take the merged value directly. */
+		reg = -1;
+		if (tv->reg >= then_regs)
+		{
+			reg = tv->reg;
+			for (k = 0; k < n; k++)
+				if (claimed[k] == reg)
+					reg = -1;
+		}
+		if (reg < 0)
+		{
+			reg = ps_new_reg(func);
+			if (reg < 0)
+				return PS_FAIL;
+			then_move[i] = reg;
+		}
+		claimed[n++] = reg;
+		ps_emit_move(ctx, func, reg, ev);
+		ev->reg = reg;
+	}
+
+	/* Insert the moves for the 'then' path in front of its jump. */
+	n = 0;
+	for (i = 0; i < st->sp; i++)
+		if (then_move[i] >= 0)
+			n++;
+	if (n > 0)
+	{
+		for (i = 0; i < n; i++)
+			ps_emit(ctx, func, PSI_MOV, 0, 0, 0);
+		p = func->u.p.prog;
+		memmove(p + then_end + n, p + then_end, (func->u.p.len - n - then_end) * sizeof(psinsn));
+		for (i = 0; i < func->u.p.len; i++)
+			if ((i < then_end || i >= then_end + n) && (p[i].op == PSI_JMP || p[i].op == PSI_JZ) && p[i].u.target > then_end)
+				p[i].u.target += n;
+		k = then_end;
+		for (i = 0; i < st->sp; i++)
+		{
+			if (then_move[i] >= 0)
+			{
+				p[k].op = PSI_MOV;
+				p[k].dst = then_move[i];
+				if (t->stack[i].reg >= 0)
+					p[k].u.r.a = t->stack[i].reg;
+				else
+				{
+					p[k].op = PSI_LOADK;
+					p[k].u.k = t->stack[i].k;
+				}
+				k++;
+			}
+		}
+		jmp += n;
+		else_start += n;
+	}
+
+	p = func->u.p.prog;
+	if (func->u.p.len == else_start)
+	{
+		/* Nothing to do on the 'else' path. */
+		memmove(p + jmp, p + jmp + 1, (func->u.p.len - jmp - 1) * sizeof(psinsn));
+		func->u.p.len--;
+		for (i = 0; i < func->u.p.len; i++)
+			if ((p[i].op == PSI_JMP || p[i].op == PSI_JZ) && p[i].u.target > jmp)
+				p[i].u.target--;
+		p[jz].u.target = func->u.p.len;
+	}
+	else
+	{
+		p[jz].u.target = else_start;
+		p[jmp].u.target = func->u.p.len;
+	}
+	return PS_FALL;
+}
+
+/*
+	Compile a conditional on a value only known at run time. We try
+	to merge the two paths, and failing that (when one path leaves an
+	integer where the other leaves a real, say) compile the rest of
+	the program separately for each path.
+*/
+static int
+ps_compile_cond(fz_context *ctx, pscompiler *c, psval *cond, int then_pc, int else_pc, int end_pc, psvstack *st)
+{
+	pdf_function *func = c->func;
+	psvstack *tmp = fz_malloc_array(ctx, 2, sizeof(psvstack));
+	int len = func->u.p.len;
+	int nregs = func->u.p.nregs;
+	int klen = func->u.p.klen;
+	int ends = c->ends;
+	int code;
+
+	fz_try(ctx)
+	{
+		tmp[1] = *st;
+		code = ps_compile_merge(ctx, c, cond, then_pc, else_pc, end_pc, st, &tmp[0]);
+		if (code == PS_SPLIT)
+		{
+			func->u.p.len = len;
+			func->u.p.nregs = nregs;
+			func->u.p.klen = klen;
+			c->ends = ends;
+			*st = tmp[1];
+			code = ps_compile_split(ctx, c, cond, then_pc, else_pc, end_pc, st, &tmp[0]);
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, tmp);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return code;
+}
+
+/* Pop the outputs as eval_postscript_func does, into their registers. */
+static int
+ps_compile_end(fz_context *ctx, pscompiler *c, psvstack *st)
+{
+	pdf_function *func = c->func;
+	psval x[FZ_FN_MAXN];
+	int i;
+
+	for (i = func->base.n - 1; i >= 0; i--)
+	{
+		/* As ps_pop_real: zero if nothing suitable is left. */
+		if (st->sp > 0 && ps_is_num(&st->stack[st->sp - 1]))
+		{
+			if (ps_to_real(ctx, func, &st->stack[--st->sp], &x[i]))
+				return PS_FAIL;
+		}
+		else
+		{
+			x[i].type = PS_REAL;
+			x[i].reg = -1;
+			x[i].k.f = 0;
+		}
+	}
+	for (i = 0; i < func->base.n; i++)
+		ps_emit_move(ctx, func, func->u.p.out[i], &x[i]);
+	ps_emit(ctx, func, PSI_JMP, 0, 0, 0);
+	func->u.p.prog[func->u.p.len - 1].u.target = -1;
+	c->ends++;
+	return PS_DONE;
+}
+
+/*
+	Compile from pc until the end of the program, or until the end of
+	a block when only the stop innermost blocks are left open.
+*/
+static int
+ps_compile_block(fz_context *ctx, pscompiler *c, int pc, psvstack *st, int stop)
+{
+	pdf_function *func = c->func;
+	psobj *code = func->u.p.code;
+	psval *a, *b, x, y, tmp;
+	int op, type, n, j, i;
+
+#define PS_PUSH(V) do { if (st->sp + 1 < nelem(st->stack)) st->stack[st->sp++] = (V); } while (0)
+#define PS_NEED(N) do { if (st->sp < (N)) return PS_FAIL; a = &st->stack[st->sp - (N)]; b = a + 1; } while (0)
+
+	while (1)
+	{
+		if (func->u.p.len > PS_MAX_INSNS)
+			return PS_FAIL;
+
+		switch (code[pc].type)
+		{
+		case PS_INT:
+			x.type = PS_INT;
+			x.reg = -1;
+			x.k.i = code[pc++].u.i;
+			PS_PUSH(x);
+			break;
+
+		case PS_REAL:
+			x.type = PS_REAL;
+			x.reg = -1;
+			x.k.f = ps_real(code[pc++].u.f);
+			PS_PUSH(x);
+			break;
+
+		case PS_OPERATOR:
+			switch (op = code[pc++].u.op)
+			{
+			/* Unary numeric operators. */
+			case PS_OP_ABS:
+			case PS_OP_NEG:
+				PS_NEED(1);
+				if (a->type == PS_INT)
+				{
+					if (ps_apply(ctx, func, op == PS_OP_ABS ? PSI_ABS_I : PSI_NEG_I, PS_INT, a, NULL, &x))
+						return PS_FAIL;
+				}
+				else if (a->type == PS_REAL)
+				{
+					if (ps_apply(ctx, func, op == PS_OP_ABS ? PSI_ABS_R : PSI_NEG_R, PS_REAL, a, NULL, &x))
+						return PS_FAIL;
+				}
+				else
+					return PS_FAIL;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_ROUND:
+			case PS_OP_TRUNCATE:
+				PS_NEED(1);
+				if (a->type == PS_INT)
+					break;
+				if (a->type != PS_REAL)
+					return PS_FAIL;
+				if (ps_apply(ctx, func, op == PS_OP_ROUND ? PSI_ROUND : PSI_TRUNCATE, PS_REAL, a, NULL, &x))
+					return PS_FAIL;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_CEILING:
+			case PS_OP_FLOOR:
+			case PS_OP_COS:
+			case PS_OP_SIN:
+			case PS_OP_LN:
+			case PS_OP_LOG:
+			case PS_OP_SQRT:
+			case PS_OP_CVR:
+				PS_NEED(1);
+				if (!ps_is_num(a) || ps_to_real(ctx, func, a, &y))
+					return PS_FAIL;
+				switch (op)
+				{
+				default:
+				case PS_OP_CEILING: i = PSI_CEILING; break;
+				case PS_OP_FLOOR: i = PSI_FLOOR; break;
+				case PS_OP_COS: i = PSI_COS; break;
+				case PS_OP_SIN: i = PSI_SIN; break;
+				case PS_OP_LN: i = PSI_LN; break;
+				case PS_OP_LOG: i = PSI_LOG; break;
+				case PS_OP_SQRT: i = PSI_SQRT; break;
+				case PS_OP_CVR: i = -1; break;
+				}
+				if (i < 0)
+					x = y;
+				else if (ps_apply(ctx, func, i, PS_REAL, &y, NULL, &x))
+					return PS_FAIL;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_CVI:
+				PS_NEED(1);
+				if (!ps_is_num(a) || ps_to_int(ctx, func, a, &x))
+					return PS_FAIL;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_NOT:
+				PS_NEED(1);
+				if (a->type == PS_BOOL)
+				{
+					if (ps_apply(ctx, func, PSI_NOT_B, PS_BOOL, a, NULL, &x))
+						return PS_FAIL;
+				}
+				else if (ps_to_int(ctx, func, a, &y) || ps_apply(ctx, func, PSI_NOT_I, PS_INT, &y, NULL, &x))
+					return PS_FAIL;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			/* Binary operators on integers or reals. */
+			case PS_OP_ADD:
+			case PS_OP_SUB:
+			case PS_OP_MUL:
+			case PS_OP_EQ:
+			case PS_OP_NE:
+			case PS_OP_GE:
+			case PS_OP_GT:
+			case PS_OP_LE:
+			case PS_OP_LT:
+				PS_NEED(2);
+				switch (op)
+				{
+				default:
+				case PS_OP_ADD: i = PSI_ADD_I; type = PS_INT; break;
+				case PS_OP_SUB: i = PSI_SUB_I; type = PS_INT; break;
+				case PS_OP_MUL: i = PSI_MUL_I; type = PS_INT; break;
+				case PS_OP_EQ: i = PSI_EQ_I; type = PS_BOOL; break;
+				case PS_OP_NE: i = PSI_NE_I; type = PS_BOOL; break;
+				case PS_OP_GE: i = PSI_GE_I; type = PS_BOOL; break;
+				case PS_OP_GT: i = PSI_GT_I; type = PS_BOOL; break;
+				case PS_OP_LE: i = PSI_LE_I; type = PS_BOOL; break;
+				case PS_OP_LT: i = PSI_LT_I; type = PS_BOOL; break;
+				}
+				if ((a->type == PS_INT && b->type == PS_INT) ||
+					((op == PS_OP_EQ || op == PS_OP_NE) && a->type == PS_BOOL && b->type == PS_BOOL))
+				{
+					if (ps_apply(ctx, func, i, type, a, b, &x))
+						return PS_FAIL;
+				}
+				else
+				{
+					/* The _R variant follows each _I one. */
+					if (!ps_is_num(a) || !ps_is_num(b))
+						return PS_FAIL;
+					if (ps_to_real(ctx, func, a, &y) || ps_to_real(ctx, func, b, &tmp))
+						return PS_FAIL;
+					if (ps_apply(ctx, func, i + 1, type == PS_INT ? PS_REAL : type, &y, &tmp, &x))
+						return PS_FAIL;
+				}
+				st->sp--;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_DIV:
+			case PS_OP_ATAN:
+			case PS_OP_EXP:
+				PS_NEED(2);
+				if (!ps_is_num(a) || !ps_is_num(b))
+					return PS_FAIL;
+				if (ps_to_real(ctx, func, a, &y) || ps_to_real(ctx, func, b, &tmp))
+					return PS_FAIL;
+				i = op == PS_OP_DIV ? PSI_DIV : op == PS_OP_ATAN ? PSI_ATAN : PSI_EXP;
+				if (ps_apply(ctx, func, i, PS_REAL, &y, &tmp, &x))
+					return PS_FAIL;
+				st->sp--;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_IDIV:
+			case PS_OP_MOD:
+			case PS_OP_BITSHIFT:
+				PS_NEED(2);
+				if (!ps_is_num(a) || !ps_is_num(b))
+					return PS_FAIL;
+				if (ps_to_int(ctx, func, a, &y) || ps_to_int(ctx, func, b, &tmp))
+					return PS_FAIL;
+				i = op == PS_OP_IDIV ? PSI_IDIV : op == PS_OP_MOD ? PSI_MOD : PSI_BITSHIFT;
+				if (ps_apply(ctx, func, i, PS_INT, &y, &tmp, &x))
+					return PS_FAIL;
+				st->sp--;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			/* Logical operators on booleans or integers. */
+			case PS_OP_AND:
+			case PS_OP_OR:
+			case PS_OP_XOR:
+				PS_NEED(2);
+				i = op == PS_OP_AND ? PSI_AND : op == PS_OP_OR ? PSI_OR : PSI_XOR;
+				if ((a->type == PS_BOOL && b->type == PS_BOOL) || (a->type == PS_INT && b->type == PS_INT))
+				{
+					if (ps_apply(ctx, func, i, a->type, a, b, &x))
+						return PS_FAIL;
+				}
+				else
+				{
+					/* and only takes two integers; or and xor convert reals */
+					if (op == PS_OP_AND || !ps_is_num(a) || !ps_is_num(b))
+						return PS_FAIL;
+					if (ps_to_int(ctx, func, a, &y) || ps_to_int(ctx, func, b, &tmp))
+						return PS_FAIL;
+					if (ps_apply(ctx, func, i, PS_INT, &y, &tmp, &x))
+						return PS_FAIL;
+				}
+				st->sp--;
+				st->stack[st->sp - 1] = x;
+				break;
+
+			case PS_OP_TRUE:
+			case PS_OP_FALSE:
+				x.type = PS_BOOL;
+				x.reg = -1;
+				x.k.i = op == PS_OP_TRUE;
+				PS_PUSH(x);
+				break;
+
+			/* Stack operators only rename values. */
+			case PS_OP_POP:
+				if (st->sp > 0)
+					st->sp--;
+				break;
+
+			case PS_OP_DUP:
+			case PS_OP_COPY:
+				n = 1;
+				if (op == PS_OP_COPY && ps_pop_const_int(ctx, func, st, &n))
+					return PS_FAIL;
+				if (n >= 0 && st->sp - n >= 0 && st->sp + n < nelem(st->stack))
+				{
+					memcpy(st->stack + st->sp, st->stack + st->sp - n, n * sizeof(psval));
+					st->sp += n;
+				}
+				break;
+
+			case PS_OP_INDEX:
+				if (ps_pop_const_int(ctx, func, st, &n))
+					return PS_FAIL;
+				if (st->sp + 1 < nelem(st->stack) && n >= 0 && st->sp - n >= 0)
+				{
+					if (n == st->sp)
+						return PS_FAIL;
+					st->stack[st->sp] = st->stack[st->sp - n - 1];
+					st->sp++;
+				}
+				break;
+
+			case PS_OP_EXCH:
+			case PS_OP_ROLL:
+				n = 2;
+				j = 1;
+				if (op == PS_OP_ROLL && (ps_pop_const_int(ctx, func, st, &j) || ps_pop_const_int(ctx, func, st, &n)))
+					return PS_FAIL;
+				if (n < 0 || st->sp - n < 0 || j == 0 || n == 0)
+					break;
+				if (j == INT_MIN)
+					return PS_FAIL;
+				if (j >= 0)
+					j %= n;
+				else
+				{
+					j = -j % n;
+					if (j != 0)
+						j = n - j;
+				}
+				for (i = 0; i < j; i++)
+				{
+					tmp = st->stack[st->sp - 1];
+					memmove(st->stack + st->sp - n + 1, st->stack + st->sp - n, (n - 1) * sizeof(psval));
+					st->stack[st->sp - n] = tmp;
+				}
+				break;
+
+			case PS_OP_IF:
+			case PS_OP_IFELSE:
+				PS_NEED(1);
+				if (a->type != PS_BOOL)
+					return PS_FAIL;
+				x = *a;
+				st->sp--;
+				j = code[pc + 2].u.block;
+				i = op == PS_OP_IFELSE ? code[pc + 0].u.block : -1;
+				if (x.reg < 0)
+				{
+					/* Known condition: carry on into the branch taken. */
+					if (x.k.i)
+						i = code[pc + 1].u.block;
+					if (i < 0)
+						pc = j;
+					else
+					{
+						if (ps_push_cont(st, j))
+							return PS_FAIL;
+						pc = i;
+					}
+					break;
+				}
+				n = ps_compile_cond(ctx, c, &x, code[pc + 1].u.block, i, j, st);
+				if (n != PS_FALL)
+					return n;
+				pc = j;
+				break;
+
+			case PS_OP_RETURN:
+				if (st->ncont > stop)
+				{
+					pc = st->cont[--st->ncont];
+					break;
+				}
+				if (stop == 0)
+					return ps_compile_end(ctx, c, st);
+				return PS_FALL;
+
+			default:
+				return PS_FAIL;
+			}
+			break;
+
+		default:
+			/* ps_run gives up on the current block with a warning. */
+			return PS_FAIL;
+		}
+	}
+
+#undef PS_PUSH
+#undef PS_NEED
+}
+
+static void
+compile_postscript_func(fz_context *ctx, pdf_function *func)
+{
+	pscompiler c;
+	psvstack *st;
+	psinsn *p;
+	int i, k, n, len, ok = 0;
+
+	st = fz_malloc_struct(ctx, psvstack);
+
+	fz_var(ok);
+
+	fz_try(ctx)
+	{
+		c.func = func;
+		c.ends = 0;
+		func->u.p.nregs = func->base.m;
+		for (i = 0; i < func->base.m; i++)
+		{
+			st->stack[i].type = PS_REAL;
+			st->stack[i].reg = i;
+		}
+		st->sp = func->base.m;
+		for (i = 0; i < func->base.n; i++)
+			func->u.p.out[i] = ps_new_reg(func);
+
+		ok = ps_compile_block(ctx, &c, 0, st, 0) == PS_DONE;
+	}
+	fz_always(ctx)
+		fz_free(ctx, st);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, func->u.p.prog);
+		fz_free(ctx, func->u.p.konst);
+		func->u.p.prog = func->u.p.konst = NULL;
+		fz_rethrow(ctx);
+	}
+
+	if (!ok)
+	{
+		fz_free(ctx, func->u.p.prog);
+		fz_free(ctx, func->u.p.konst);
+		func->u.p.prog = func->u.p.konst = NULL;
+		return;
+	}
+
+	p = func->u.p.prog;
+	len = func->u.p.len;
+	n = func->base.n;
+
+	/* With a single exit, the program ends with a move to each output
+	 * register and a jump. Read the outputs from wherever they were
+	 * computed instead, and load constant ones once per batch. */
+	if (c.ends == 1)
+	{
+		for (i = len - n - 1; i < len - 1; i++)
+		{
+			for (k = 0; func->u.p.out[k] != p[i].dst; k++)
+				;
+			if (p[i].op == PSI_MOV)
+				func->u.p.out[k] = p[i].u.r.a;
+			else
+				ps_emit_konst(ctx, func, p[i].dst, p[i].u.k);
+		}
+		len -= n + 1;
+	}
+
+	/* Jumps to the end of the program. */
+	for (i = 0; i < len; i++)
+		if ((p[i].op == PSI_JMP || p[i].op == PSI_JZ) && (p[i].u.target < 0 || p[i].u.target > len))
+			p[i].u.target = len;
+	func->u.p.len = len;
+
+	/* An empty program still marks the function as compiled. */
+	func->u.p.prog = fz_resize_array(ctx, func->u.p.prog, fz_maxi(len, 1), sizeof(psinsn));
+	func->u.p.prog_cap = fz_maxi(len, 1);
+	func->base.size += (func->u.p.prog_cap + func->u.p.kcap) * sizeof(psinsn);
+}
+
 static void
 load_postscript_func(fz_context *ctx, pdf_document *doc, pdf_function *func, pdf_obj *dict)
 {
@@ -873,6 +1923,8 @@ load_postscript_func(fz_context *ctx, pdf_document *doc, pdf_function *func, pdf
 	}
 
 	func->base.size += func->u.p.cap * sizeof(psobj);
+
+	compile_postscript_func(ctx, func);
 }
 
 static void
@@ -899,6 +1951,34 @@ eval_postscript_func(fz_context *ctx, pdf_function *func, const float *in, float
 	}
 }
 
+static void
+eval_compiled_postscript_func(fz_context *ctx, pdf_function *func, int count, const float *in, float *out)
+{
+	psreg r[PS_MAX_REGS];
+	int m = func->base.m;
+	int n = func->base.n;
+	float x;
+	int i;
+
+	ps_exec(func->u.p.konst, func->u.p.klen, r);
+
+	while (count--)
+	{
+		for (i = 0; i < m; i++)
+			r[i].f = ps_real(fz_clamp(in[i], func->domain[i][0], func->domain[i][1]));
+
+		ps_exec(func->u.p.prog, func->u.p.len, r);
+
+		for (i = 0; i < n; i++)
+		{
+			x = r[func->u.p.out[i]].f;
+			out[i] = fz_clamp(x, func->range[i][0], func->range[i][1]);
+		}
+		in += m;
+		out += n;
+	}
+}
+
 /*
  * Sample function
  */
@@ -1362,6 +2442,8 @@ pdf_drop_function_imp(fz_context *ctx, fz_storable *func_)
 		break;
 	case POSTSCRIPT:
 		fz_free(ctx, func->u.p.code);
+		fz_free(ctx, func->u.p.prog);
+		fz_free(ctx, func->u.p.konst);
 		break;
 	}
 	fz_free(ctx, func);
@@ -1377,10 +2459,28 @@ pdf_eval_function(fz_context *ctx, fz_function *func_, const float *in, float *o
 	case SAMPLE: eval_sample_func(ctx, func, in, out); break;
 	case EXPONENTIAL: eval_exponential_func(ctx, func, *in, out); break;
 	case STITCHING: eval_stitching_func(ctx, func, *in, out); break;
-	case POSTSCRIPT: eval_postscript_func(ctx, func, in, out); break;
+	case POSTSCRIPT:
+		if (func->u.p.prog)
+			eval_compiled_postscript_func(ctx, func, 1, in, out);
+		else
+			eval_postscript_func(ctx, func, in, out);
+		break;
 	}
 }
 
+static void
+pdf_eval_function_n(fz_context *ctx, fz_function *func_, int count, const float *in, float *out)
+{
+	pdf_function *func = (pdf_function *)func_;
+	int i;
+
+	if (func->type == POSTSCRIPT && func->u.p.prog)
+		eval_compiled_postscript_func(ctx, func, count, in, out);
+	else
+		for (i = 0; i < count; i++)
+			pdf_eval_function(ctx, func_, in + i * func->base.m, out + i * func->base.n);
+}
+
 /*
  * Debugging prints
  */
@@ -1616,9 +2716,10 @@ pdf_load_function(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int in, int
 		return (fz_function *)func;
 
 	func = fz_malloc_struct(ctx, pdf_function);
-	FZ_INIT_STORABLE(&func->base, 1, pdf_drop_function_imp);
+	FZ_INIT_KEY_STORABLE(&func->base, 1, pdf_drop_function_imp);
 	func->base.size = sizeof(*func);
 	func->base.evaluate = pdf_eval_function;
+	func->base.evaluate_n = pdf_eval_function_n;
 	func->base.print = pdf_print_function;
 
 	obj = pdf_dict_get(ctx, dict, PDF_NAME_FunctionType);
@@ -24,6 +24,52 @@
 #define RANGE_0_7 \
 	'0':case'1':case'2':case'3':case'4':case'5':case'6':case'7'
 
+/*
+ * Character classes for the fast paths below, which scan directly over
+ * the stream's buffer (rp..wp) and only fall back to reading a byte at
+ * a time at the end of the buffer or on unusual input.
+ */
+enum
+{
+	W = 1, /* white space */
+	D = 2, /* delimiter */
+	N = 4, /* '#' escape in names */
+	S = 8, /* special in literal strings */
+	X = 16 /* hex digit */
+};
+
+static const unsigned char lex_class[256] =
+{
+	W, 0, 0, 0, 0, 0, 0, 0, 0, W, W, 0, W, W, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	W, 0, 0, N, 0, D, 0, 0, D|S, D|S, 0, 0, 0, 0, 0, D,
+	X, X, X, X, X, X, X, X, X, X, 0, 0, D, 0, D, 0,
+	0, X, X, X, X, X, X, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, D, S, D, 0, 0,
+	0, X, X, X, X, X, X, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, D, 0, D, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#undef W
+#undef D
+#undef N
+#undef S
+#undef X
+
+#define LEX_WHITE 1
+#define LEX_DELIM 2
+#define LEX_HASH 4
+#define LEX_STRING 8
+#define LEX_HEX 16
+
 static inline int iswhite(int ch)
 {
 	return
@@ -48,6 +94,12 @@ lex_white(fz_context *ctx, fz_stream *f)
 {
 	int c;
 	do {
+		unsigned char *p = f->rp;
+		while (p < f->wp && (lex_class[*p] & LEX_WHITE))
+			p++;
+		f->rp = p;
+		if (p < f->wp)
+			return;
 		c = fz_read_byte(ctx, f);
 	} while ((c <= 32) && (iswhite(c)));
 	if (c != EOF)
@@ -59,6 +111,10 @@ lex_comment(fz_context *ctx, fz_stream *f)
 {
 	int c;
 	do {
+		unsigned char *p = f->rp;
+		while (p < f->wp && *p != '\012' && *p != '\015')
+			p++;
+		f->rp = p;
 		c = fz_read_byte(ctx, f);
 	} while ((c != '\012') && (c != '\015') && (c != EOF));
 }
@@ -110,6 +166,53 @@ static float acrobat_compatible_atof(char *s)
 	}
 }
 
+/* Exactly fz_atof(s), but quicker for the plain numbers that make up
+ * most content streams: [+-]digits[.digits] with at most 9 significant
+ * digits and 13 decimals. fz_strtof rounds those correctly, and so does
+ * a single double precision division (53 >= 2*24+2 bits, so rounding
+ * first to double and then to float cannot differ). */
+static float fast_atof(char *s)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13
+	};
+	char *p = s;
+	unsigned int m = 0;
+	int digits = 0, decimals = -1, neg = 0, any = 0;
+	float v;
+
+	if (*p == '+')
+		++p;
+	else if (*p == '-')
+	{
+		neg = 1;
+		++p;
+	}
+
+	for (;; ++p)
+	{
+		if (*p >= '0' && *p <= '9')
+		{
+			if (m || *p != '0')
+				if (++digits > 9)
+					return fz_atof(s);
+			m = m * 10 + (*p - '0');
+			if (decimals >= 0 && ++decimals > 13)
+				return fz_atof(s);
+			any = 1;
+		}
+		else if (*p == '.' && decimals < 0)
+			decimals = 0;
+		else
+			break;
+	}
+	if (*p || !any)
+		return fz_atof(s);
+
+	v = (float)(m / pow10[decimals > 0 ? decimals : 0]);
+	return neg ? -v : v;
+}
+
 /* Fast but inaccurate atoi. */
 static int fast_atoi(char *s)
 {
@@ -146,6 +249,26 @@ lex_number(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf, int c)
 
 	*s++ = c;
 
+	{
+		unsigned char *p = f->rp;
+		while (s < e && p < f->wp)
+		{
+			c = *p;
+			if (lex_class[c] & (LEX_WHITE | LEX_DELIM))
+			{
+				f->rp = p;
+				goto end;
+			}
+			if (c == '-')
+				neg++;
+			else if (c == '.')
+				isreal = s;
+			*s++ = c;
+			p++;
+		}
+		f->rp = p;
+	}
+
 	while (s < e)
 	{
 		int c = fz_read_byte(ctx, f);
@@ -182,7 +305,7 @@ end:
 		if (neg > 1 || isreal - buf->scratch >= 10)
 			buf->f = acrobat_compatible_atof(buf->scratch);
 		else
-			buf->f = fz_atof(buf->scratch);
+			buf->f = fast_atof(buf->scratch);
 		return PDF_TOK_REAL;
 	}
 	else
@@ -198,6 +321,18 @@ lex_name(fz_context *ctx, fz_stream *f, pdf_lexbuf *buf)
 	char *s = buf->scratch;
 	int n = buf->size;
 
+	{
+		unsigned char *p = f->rp;
+		while (n > 1 && p < f->wp && !(lex_class[*p] & (LEX_WHITE | LEX_DELIM | LEX_HASH)))
+		{
+			*s++ = *p++;
+			n--;
+		}
+		f->rp = p;
+		if (p < f->wp && !(lex_class[*p] & LEX_HASH))
+			goto end;
+	}
+
 	while (n > 1)
 	{
 		int c = fz_read_byte(ctx, f);
@@ -276,6 +411,11 @@ lex_string(fz_context *ctx, fz_stream *f, pdf_lexbuf *lb)
 
 	while (1)
 	{
+		unsigned char *p = f->rp;
+		while (s < e && p < f->wp && !(lex_class[*p] & LEX_STRING))
+			*s++ = *p++;
+		f->rp = p;
+
 		if (s == e)
 		{
 			s += pdf_lexbuf_grow(ctx, lb);
@@ -373,6 +513,21 @@ lex_hex_string(fz_context *ctx, fz_stream *f, pdf_lexbuf *lb)
 
 	while (1)
 	{
+		unsigned char *p = f->rp;
+		while (s < e && p < f->wp && (lex_class[*p] & (LEX_WHITE | LEX_HEX)))
+		{
+			c = *p++;
+			if (lex_class[c] & LEX_HEX)
+			{
+				if (x)
+					*s++ = a * 16 + unhex(c);
+				else
+					a = unhex(c);
+				x = !x;
+			}
+		}
+		f->rp = p;
+
 		if (s == e)
 		{
 			s += pdf_lexbuf_grow(ctx, lb);
@@ -25,7 +25,9 @@ enum
 	PDF_FLAGS_SORTED = 2,
 	PDF_FLAGS_MEMO = 4,
 	PDF_FLAGS_MEMO_BOOL = 8,
-	PDF_FLAGS_DIRTY = 16
+	PDF_FLAGS_DIRTY = 16,
+	PDF_FLAGS_ARENA = 32,
+	PDF_FLAGS_ARENA_ITEMS = 64
 };
 
 struct pdf_obj_s
@@ -35,6 +37,10 @@ struct pdf_obj_s
 	unsigned char flags;
 };
 
+/* Reference counts are 16 bits. Rather than wrap, an object that reaches
+ * this many references is made permanent: it is never freed. */
+enum { PDF_OBJ_MAX_REFS = 32767 };
+
 typedef struct pdf_obj_num_s
 {
 	pdf_obj super;
@@ -55,6 +61,7 @@ typedef struct pdf_obj_string_s
 typedef struct pdf_obj_name_s
 {
 	pdf_obj super;
+	int table; /* id of the name table holding it, or 0 */
 	char n[1];
 } pdf_obj_name;
 
@@ -76,6 +83,8 @@ typedef struct pdf_obj_dict_s
 	int len;
 	int cap;
 	struct keyval *items;
+	int hash_mask; /* hash index, only for large dicts */
+	int *hash;
 } pdf_obj_dict;
 
 typedef struct pdf_obj_ref_s
@@ -93,6 +102,294 @@ typedef struct pdf_obj_ref_s
 #define ARRAY(obj) ((pdf_obj_array *)(obj))
 #define REF(obj) ((pdf_obj_ref *)(obj))
 
+/*
+ * Object arenas.
+ *
+ * Objects (and small item arrays) belonging to a document with an arena
+ * are carved out of PDF_ARENA_PAGE sized pages, each page holding blocks
+ * of a single size. Pages are aligned so that the page header, and from
+ * it the chunk and arena, can be found from any block address. Freed
+ * blocks go onto a free list per size class.
+ *
+ * Objects may outlive their document: when the arena is dropped it is
+ * only marked dead, chunks with no live blocks are freed at once and the
+ * others as soon as their last block is freed. The arena is protected by
+ * FZ_LOCK_ALLOC, like object reference counts.
+ */
+
+enum
+{
+	PDF_ARENA_PAGE = 8192,
+	PDF_ARENA_CHUNK_PAGES = 32,
+	PDF_ARENA_MAX = 256,
+	PDF_ARENA_CLASSES = PDF_ARENA_MAX / 8
+};
+
+typedef struct pdf_arena_chunk_s pdf_arena_chunk;
+
+struct pdf_arena_chunk_s
+{
+	pdf_obj_arena *arena;
+	pdf_arena_chunk *prev, *next;
+	unsigned char *mem;
+	int live;
+};
+
+typedef struct pdf_arena_page_s
+{
+	pdf_arena_chunk *chunk;
+	size_t size;
+} pdf_arena_page;
+
+struct pdf_obj_arena_s
+{
+	int dead;
+	pdf_arena_chunk *chunks;
+	pdf_arena_chunk *current;
+	unsigned char *next_page, *end_page;
+	unsigned char *bump[PDF_ARENA_CLASSES];
+	unsigned char *bump_end[PDF_ARENA_CLASSES];
+	void *free_list[PDF_ARENA_CLASSES];
+};
+
+#define ARENA_PAGE_OF(p) ((pdf_arena_page *)((uintptr_t)(p) & ~(uintptr_t)(PDF_ARENA_PAGE - 1)))
+#define ARENA_HEADER_SIZE ((sizeof(pdf_arena_page) + 7) & ~7)
+
+/* Call with FZ_LOCK_ALLOC held. Returns NULL if a new chunk is needed. */
+static void *
+arena_take(pdf_obj_arena *arena, int c)
+{
+	pdf_arena_page *page;
+	unsigned char *p;
+
+	p = arena->free_list[c];
+	if (p)
+	{
+		arena->free_list[c] = *(void **)p;
+		ARENA_PAGE_OF(p)->chunk->live++;
+		return p;
+	}
+
+	if (arena->bump_end[c] - arena->bump[c] < (c + 1) * 8)
+	{
+		if (arena->next_page == arena->end_page)
+			return NULL;
+		page = (pdf_arena_page *)arena->next_page;
+		arena->next_page += PDF_ARENA_PAGE;
+		page->chunk = arena->current;
+		page->size = (c + 1) * 8;
+		arena->bump[c] = (unsigned char *)page + ARENA_HEADER_SIZE;
+		arena->bump_end[c] = (unsigned char *)page + PDF_ARENA_PAGE;
+	}
+
+	p = arena->bump[c];
+	arena->bump[c] += (c + 1) * 8;
+	ARENA_PAGE_OF(p)->chunk->live++;
+	return p;
+}
+
+/* Returns NULL once the arena is dead. */
+static void *
+arena_alloc(fz_context *ctx, pdf_obj_arena *arena, size_t size)
+{
+	pdf_arena_chunk *chunk;
+	int c = (int)((size + 7) >> 3) - 1;
+	void *p;
+	int dead;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	p = arena->dead ? NULL : arena_take(arena, c);
+	dead = arena->dead;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (p || dead)
+		return p;
+
+	/* fz_malloc takes FZ_LOCK_ALLOC itself, so allocate unlocked. */
+	chunk = fz_malloc_struct(ctx, pdf_arena_chunk);
+	fz_try(ctx)
+		chunk->mem = Memento_label(fz_malloc(ctx, (PDF_ARENA_CHUNK_PAGES + 1) * PDF_ARENA_PAGE), "pdf_obj(arena)");
+	fz_catch(ctx)
+	{
+		fz_free(ctx, chunk);
+		fz_rethrow(ctx);
+	}
+	chunk->arena = arena;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	chunk->next = arena->chunks;
+	if (arena->chunks)
+		arena->chunks->prev = chunk;
+	arena->chunks = chunk;
+	arena->current = chunk;
+	arena->next_page = (unsigned char *)ARENA_PAGE_OF(chunk->mem + PDF_ARENA_PAGE - 1);
+	arena->end_page = arena->next_page + PDF_ARENA_CHUNK_PAGES * PDF_ARENA_PAGE;
+	p = arena_take(arena, c);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return p;
+}
+
+/* Call with FZ_LOCK_ALLOC held. Returns the chunk if it is to be freed. */
+static pdf_arena_chunk *
+arena_unlink_chunk(pdf_obj_arena *arena, pdf_arena_chunk *chunk)
+{
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		arena->chunks = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	return chunk;
+}
+
+static void
+arena_free(fz_context *ctx, void *p)
+{
+	pdf_arena_page *page = ARENA_PAGE_OF(p);
+	pdf_arena_chunk *chunk = page->chunk;
+	pdf_obj_arena *arena = chunk->arena;
+	pdf_arena_chunk *dead_chunk = NULL;
+	int c = (int)(page->size >> 3) - 1;
+	int last = 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	chunk->live--;
+	if (!arena->dead)
+	{
+		*(void **)p = arena->free_list[c];
+		arena->free_list[c] = p;
+	}
+	else if (chunk->live == 0)
+	{
+		dead_chunk = arena_unlink_chunk(arena, chunk);
+		last = (arena->chunks == NULL);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (dead_chunk)
+	{
+		fz_free(ctx, dead_chunk->mem);
+		fz_free(ctx, dead_chunk);
+		if (last)
+			fz_free(ctx, arena);
+	}
+}
+
+void
+pdf_enable_obj_arena(fz_context *ctx, pdf_document *doc)
+{
+	if (!doc || doc->obj_arena)
+		return;
+	doc->obj_arena = fz_malloc_struct(ctx, pdf_obj_arena);
+}
+
+void
+pdf_drop_obj_arena(fz_context *ctx, pdf_obj_arena *arena)
+{
+	pdf_arena_chunk *chunk, *next, *dead = NULL;
+	int last;
+
+	if (!arena)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	arena->dead = 1;
+	for (chunk = arena->chunks; chunk; chunk = next)
+	{
+		next = chunk->next;
+		if (chunk->live == 0)
+		{
+			arena_unlink_chunk(arena, chunk);
+			chunk->next = dead;
+			dead = chunk;
+		}
+	}
+	last = (arena->chunks == NULL);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	for (chunk = dead; chunk; chunk = next)
+	{
+		next = chunk->next;
+		fz_free(ctx, chunk->mem);
+		fz_free(ctx, chunk);
+	}
+	if (last)
+		fz_free(ctx, arena);
+}
+
+static pdf_obj *
+new_obj(fz_context *ctx, pdf_document *doc, size_t size, int kind, const char *label)
+{
+	pdf_obj *obj = NULL;
+	if (doc && doc->obj_arena && size <= PDF_ARENA_MAX)
+		obj = arena_alloc(ctx, doc->obj_arena, size);
+	if (obj)
+		obj->flags = PDF_FLAGS_ARENA;
+	else
+	{
+		obj = Memento_label(fz_malloc(ctx, size), label);
+		obj->flags = 0;
+	}
+	obj->refs = 1;
+	obj->kind = kind;
+	return obj;
+}
+
+static void
+free_obj(fz_context *ctx, pdf_obj *obj)
+{
+	if (obj->flags & PDF_FLAGS_ARENA)
+		arena_free(ctx, obj);
+	else
+		fz_free(ctx, obj);
+}
+
+/* Item arrays of arena objects come from the same arena while it lives. */
+static void *
+alloc_items(fz_context *ctx, pdf_obj *obj, int n, size_t size, const char *label)
+{
+	void *items = NULL;
+
+	if ((obj->flags & PDF_FLAGS_ARENA) && n <= (int)(PDF_ARENA_MAX / size))
+		items = arena_alloc(ctx, ARENA_PAGE_OF(obj)->chunk->arena, n * size);
+
+	if (items)
+		obj->flags |= PDF_FLAGS_ARENA_ITEMS;
+	else
+	{
+		items = Memento_label(fz_malloc_array(ctx, n, size), label);
+		obj->flags &= ~PDF_FLAGS_ARENA_ITEMS;
+	}
+	return items;
+}
+
+static void
+free_items(fz_context *ctx, pdf_obj *obj, void *items)
+{
+	if (obj->flags & PDF_FLAGS_ARENA_ITEMS)
+		arena_free(ctx, items);
+	else
+		fz_free(ctx, items);
+}
+
+static void *
+resize_items(fz_context *ctx, pdf_obj *obj, void *items, int old_n, int new_n, size_t size)
+{
+	int old_flags = obj->flags;
+	void *newitems;
+
+	if (!(old_flags & PDF_FLAGS_ARENA))
+		return fz_resize_array(ctx, items, new_n, size);
+
+	newitems = alloc_items(ctx, obj, new_n, size, "pdf_obj(items)");
+	memcpy(newitems, items, old_n * size);
+	if (old_flags & PDF_FLAGS_ARENA_ITEMS)
+		arena_free(ctx, items);
+	else
+		fz_free(ctx, items);
+	return newitems;
+}
+
 pdf_obj *
 pdf_new_null(fz_context *ctx, pdf_document *doc)
 {
@@ -109,10 +406,7 @@ pdf_obj *
 pdf_new_int(fz_context *ctx, pdf_document *doc, int i)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(int)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INT;
-	obj->super.flags = 0;
+	obj = (pdf_obj_num *)new_obj(ctx, doc, sizeof(pdf_obj_num), PDF_INT, "pdf_obj(int)");
 	obj->u.i = i;
 	return &obj->super;
 }
@@ -121,10 +415,7 @@ pdf_obj *
 pdf_new_int_offset(fz_context *ctx, pdf_document *doc, fz_off_t i)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(offset)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INT;
-	obj->super.flags = 0;
+	obj = (pdf_obj_num *)new_obj(ctx, doc, sizeof(pdf_obj_num), PDF_INT, "pdf_obj(offset)");
 	obj->u.i = i;
 	return &obj->super;
 }
@@ -133,10 +424,7 @@ pdf_obj *
 pdf_new_real(fz_context *ctx, pdf_document *doc, float f)
 {
 	pdf_obj_num *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_num)), "pdf_obj(real)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_REAL;
-	obj->super.flags = 0;
+	obj = (pdf_obj_num *)new_obj(ctx, doc, sizeof(pdf_obj_num), PDF_REAL, "pdf_obj(real)");
 	obj->u.f = f;
 	return &obj->super;
 }
@@ -150,10 +438,7 @@ pdf_new_string(fz_context *ctx, pdf_document *doc, const char *str, size_t len)
 	if ((size_t)l != len)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Overflow in pdf string");
 
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj_string, buf) + len + 1), "pdf_obj(string)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_STRING;
-	obj->super.flags = 0;
+	obj = (pdf_obj_string *)new_obj(ctx, doc, offsetof(pdf_obj_string, buf) + len + 1, PDF_STRING, "pdf_obj(string)");
 	obj->len = l;
 	memcpy(obj->buf, str, len);
 	obj->buf[len] = '\0';
@@ -166,6 +451,144 @@ namecmp(const void *key, const void *name)
 	return strcmp((char *)key, *(char **)name);
 }
 
+static unsigned int
+hash_name(const char *s)
+{
+	unsigned int h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/*
+ * Names made for a document are interned in its name table, so that
+ * equal names are the same object. The table holds a reference to each
+ * name until the document is dropped, and is protected by FZ_LOCK_ALLOC.
+ * Each name records the id of its table: two different names from the
+ * same table are known to differ without comparing the strings. Names
+ * made without a document are not interned. An interned name may be
+ * shared by every dictionary in a large document, so it is the object
+ * most likely to reach PDF_OBJ_MAX_REFS, at which it becomes permanent.
+ */
+
+/* Call with FZ_LOCK_ALLOC held. */
+static pdf_obj *
+name_table_find(pdf_document *doc, const char *str, unsigned int h)
+{
+	int mask = doc->name_table_size - 1;
+	pdf_obj *k;
+
+	if (!doc->name_table)
+		return NULL;
+	h &= mask;
+	while ((k = doc->name_table[h]) != NULL)
+	{
+		if (!strcmp(NAME(k)->n, str))
+			return k;
+		h = (h + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Call with FZ_LOCK_ALLOC held. */
+static void
+name_table_insert(pdf_obj **table, int size, pdf_obj *obj)
+{
+	int h = hash_name(NAME(obj)->n) & (size - 1);
+	while (table[h])
+		h = (h + 1) & (size - 1);
+	table[h] = obj;
+}
+
+/* Call with FZ_LOCK_ALLOC held. Returns a new reference, or NULL. */
+static pdf_obj *
+name_table_keep(pdf_obj *obj)
+{
+	if (obj && obj->refs > 0)
+	{
+		if (obj->refs < PDF_OBJ_MAX_REFS)
+			++obj->refs;
+		return obj;
+	}
+	return NULL;
+}
+
+/* Interns (and takes ownership of) obj, unless an equal name was added
+ * meanwhile, in which case obj is dropped and that one returned. */
+static pdf_obj *
+intern_name(fz_context *ctx, pdf_document *doc, pdf_obj *obj)
+{
+	unsigned int h = hash_name(NAME(obj)->n);
+	pdf_obj **table = NULL;
+	pdf_obj **old = NULL;
+	pdf_obj *found = NULL;
+	int size = 0;
+	int i;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (;;)
+	{
+		found = name_table_find(doc, NAME(obj)->n, h);
+		if (found || (doc->name_table_len + 1) * 2 <= doc->name_table_size)
+			break;
+		if (size > doc->name_table_size)
+		{
+			for (i = 0; i < doc->name_table_size; i++)
+				if (doc->name_table[i])
+					name_table_insert(table, size, doc->name_table[i]);
+			old = doc->name_table;
+			doc->name_table = table;
+			doc->name_table_size = size;
+			table = NULL;
+			continue;
+		}
+		size = doc->name_table_size ? doc->name_table_size * 2 : 256;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_free(ctx, table);
+		table = NULL;
+		fz_try(ctx)
+			table = fz_calloc(ctx, size, sizeof(pdf_obj *));
+		fz_catch(ctx)
+		{
+			/* Not fatal; the name just isn't interned. */
+			return obj;
+		}
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+	}
+	if (found)
+		found = name_table_keep(found);
+	else
+	{
+		name_table_insert(doc->name_table, doc->name_table_size, obj);
+		doc->name_table_len++;
+		NAME(obj)->table = doc->name_table_id;
+		++obj->refs;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	fz_free(ctx, table);
+	fz_free(ctx, old);
+	if (found)
+	{
+		pdf_drop_obj(ctx, obj);
+		return found;
+	}
+	return obj;
+}
+
+void
+pdf_drop_name_table(fz_context *ctx, pdf_document *doc)
+{
+	int i;
+
+	for (i = 0; i < doc->name_table_size; i++)
+		pdf_drop_obj(ctx, doc->name_table[i]);
+	fz_free(ctx, doc->name_table);
+	doc->name_table = NULL;
+	doc->name_table_size = 0;
+	doc->name_table_len = 0;
+}
+
 pdf_obj *
 pdf_new_name(fz_context *ctx, pdf_document *doc, const char *str)
 {
@@ -176,11 +599,22 @@ pdf_new_name(fz_context *ctx, pdf_document *doc, const char *str)
 	if (stdname != NULL)
 		return (pdf_obj *)(intptr_t)(stdname - &PDF_NAMES[0]);
 
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj_name, n) + strlen(str) + 1), "pdf_obj(name)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_NAME;
-	obj->super.flags = 0;
+	if (doc && doc->name_table_id)
+	{
+		pdf_obj *found;
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		found = name_table_keep(name_table_find(doc, str, hash_name(str)));
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (found)
+			return found;
+	}
+
+	obj = (pdf_obj_name *)new_obj(ctx, doc, offsetof(pdf_obj_name, n) + strlen(str) + 1, PDF_NAME, "pdf_obj(name)");
+	obj->table = 0;
 	strcpy(obj->n, str);
+
+	if (doc && doc->name_table_id)
+		return intern_name(ctx, doc, &obj->super);
 	return &obj->super;
 }
 
@@ -188,10 +622,7 @@ pdf_obj *
 pdf_new_indirect(fz_context *ctx, pdf_document *doc, int num, int gen)
 {
 	pdf_obj_ref *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_ref)), "pdf_obj(indirect)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_INDIRECT;
-	obj->super.flags = 0;
+	obj = (pdf_obj_ref *)new_obj(ctx, doc, sizeof(pdf_obj_ref), PDF_INDIRECT, "pdf_obj(indirect)");
 	obj->doc = doc;
 	obj->num = num;
 	obj->gen = gen;
@@ -203,7 +634,12 @@ pdf_keep_obj(fz_context *ctx, pdf_obj *obj)
 {
 	if (obj >= PDF_OBJ__LIMIT)
 	{
-		(void)fz_keep_imp16(ctx, obj, &obj->refs);
+		if (obj->refs > 0)
+			(void)Memento_takeRef(obj);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		if (obj->refs > 0 && obj->refs < PDF_OBJ_MAX_REFS)
+			++obj->refs;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
 	}
 	return obj;
 }
@@ -559,10 +995,7 @@ pdf_new_array(fz_context *ctx, pdf_document *doc, int initialcap)
 	pdf_obj_array *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_array)), "pdf_obj(array)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_ARRAY;
-	obj->super.flags = 0;
+	obj = (pdf_obj_array *)new_obj(ctx, doc, sizeof(pdf_obj_array), PDF_ARRAY, "pdf_obj(array)");
 	obj->doc = doc;
 	obj->parent_num = 0;
 
@@ -571,11 +1004,11 @@ pdf_new_array(fz_context *ctx, pdf_document *doc, int initialcap)
 
 	fz_try(ctx)
 	{
-		obj->items = Memento_label(fz_malloc_array(ctx, obj->cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
+		obj->items = alloc_items(ctx, &obj->super, obj->cap, sizeof(pdf_obj*), "pdf_obj(array items)");
 	}
 	fz_catch(ctx)
 	{
-		fz_free(ctx, obj);
+		free_obj(ctx, &obj->super);
 		fz_rethrow(ctx);
 	}
 	for (i = 0; i < obj->cap; i++)
@@ -590,7 +1023,7 @@ pdf_array_grow(fz_context *ctx, pdf_obj_array *obj)
 	int i;
 	int new_cap = (obj->cap * 3) / 2;
 
-	obj->items = fz_resize_array(ctx, obj->items, new_cap, sizeof(pdf_obj*));
+	obj->items = resize_items(ctx, &obj->super, obj->items, obj->len, new_cap, sizeof(pdf_obj*));
 	obj->cap = new_cap;
 
 	for (i = obj->len ; i < obj->cap; i++)
@@ -946,23 +1379,22 @@ pdf_new_dict(fz_context *ctx, pdf_document *doc, int initialcap)
 	pdf_obj_dict *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj_dict)), "pdf_obj(dict)");
-	obj->super.refs = 1;
-	obj->super.kind = PDF_DICT;
-	obj->super.flags = 0;
+	obj = (pdf_obj_dict *)new_obj(ctx, doc, sizeof(pdf_obj_dict), PDF_DICT, "pdf_obj(dict)");
 	obj->doc = doc;
 	obj->parent_num = 0;
 
 	obj->len = 0;
 	obj->cap = initialcap > 1 ? initialcap : 10;
+	obj->hash_mask = 0;
+	obj->hash = NULL;
 
 	fz_try(ctx)
 	{
-		DICT(obj)->items = Memento_label(fz_malloc_array(ctx, DICT(obj)->cap, sizeof(struct keyval)), "pdf_obj(dict items)");
+		DICT(obj)->items = alloc_items(ctx, &obj->super, DICT(obj)->cap, sizeof(struct keyval), "pdf_obj(dict items)");
 	}
 	fz_catch(ctx)
 	{
-		fz_free(ctx, obj);
+		free_obj(ctx, &obj->super);
 		fz_rethrow(ctx);
 	}
 	for (i = 0; i < DICT(obj)->cap; i++)
@@ -980,7 +1412,7 @@ pdf_dict_grow(fz_context *ctx, pdf_obj *obj)
 	int i;
 	int new_cap = (DICT(obj)->cap * 3) / 2;
 
-	DICT(obj)->items = fz_resize_array(ctx, DICT(obj)->items, new_cap, sizeof(struct keyval));
+	DICT(obj)->items = resize_items(ctx, obj, DICT(obj)->items, DICT(obj)->len, new_cap, sizeof(struct keyval));
 	DICT(obj)->cap = new_cap;
 
 	for (i = DICT(obj)->len; i < DICT(obj)->cap; i++)
@@ -990,6 +1422,155 @@ pdf_dict_grow(fz_context *ctx, pdf_obj *obj)
 	}
 }
 
+/*
+ * Dicts with PDF_DICT_HASH_MIN or more entries also keep an open
+ * addressing hash table (linear probing) from key name to item index + 1,
+ * so that lookups in huge resource dictionaries don't have to scan the
+ * items. The table is only ever changed by the functions that change the
+ * items, never by lookups.
+ */
+
+enum { PDF_DICT_HASH_MIN = 32 };
+
+/* True if the names a and b (b may be NULL) are known to differ without
+ * comparing strings: different static names, or different names from the
+ * same name table. */
+static inline int
+names_differ(pdf_obj *a, pdf_obj *b)
+{
+	if (!b || a == b)
+		return 0;
+	if (a < PDF_OBJ_NAME__LIMIT && b < PDF_OBJ_NAME__LIMIT)
+		return 1;
+	if (a >= PDF_OBJ__LIMIT && b >= PDF_OBJ__LIMIT && a->kind == PDF_NAME && b->kind == PDF_NAME)
+		return NAME(a)->table && NAME(a)->table == NAME(b)->table;
+	return 0;
+}
+
+static const char *
+dict_key_name(pdf_obj *k)
+{
+	if (k < PDF_OBJ_NAME__LIMIT)
+		return PDF_NAMES[(intptr_t)k];
+	if (k >= PDF_OBJ__LIMIT && k->kind == PDF_NAME)
+		return NAME(k)->n;
+	return "";
+}
+
+/* Returns the item index, or -1. key may be NULL, or the name object
+ * whose name is keys. */
+static int
+dict_hash_find(pdf_obj *obj, pdf_obj *key, const char *keys)
+{
+	int mask = DICT(obj)->hash_mask;
+	int *hash = DICT(obj)->hash;
+	int h = hash_name(keys) & mask;
+
+	while (hash[h])
+	{
+		pdf_obj *k = DICT(obj)->items[hash[h] - 1].k;
+		if (k == key)
+			return hash[h] - 1;
+		if (!names_differ(k, key) && !strcmp(dict_key_name(k), keys))
+			return hash[h] - 1;
+		h = (h + 1) & mask;
+	}
+	return -1;
+}
+
+static void
+dict_hash_insert(pdf_obj *obj, int i)
+{
+	int mask = DICT(obj)->hash_mask;
+	int *hash = DICT(obj)->hash;
+	int h = hash_name(dict_key_name(DICT(obj)->items[i].k)) & mask;
+
+	while (hash[h])
+		h = (h + 1) & mask;
+	hash[h] = i + 1;
+}
+
+/* Items from i onwards have moved up one place to make room for a new
+ * item at i; move their entries with them. No names need hashing. */
+static void
+dict_hash_shift(pdf_obj *obj, int i)
+{
+	int *hash = DICT(obj)->hash;
+	int h;
+
+	for (h = 0; h <= DICT(obj)->hash_mask; h++)
+		if (hash[h] > i)
+			hash[h]++;
+}
+
+static int
+dict_hash_slot(pdf_obj *obj, int i)
+{
+	int mask = DICT(obj)->hash_mask;
+	int *hash = DICT(obj)->hash;
+	int h = hash_name(dict_key_name(DICT(obj)->items[i].k)) & mask;
+
+	while (hash[h] != i + 1)
+		h = (h + 1) & mask;
+	return h;
+}
+
+/* Remove the entry for item i, shifting back any later entries of the
+ * probe run that could otherwise no longer be reached. */
+static void
+dict_hash_remove(pdf_obj *obj, int i)
+{
+	int mask = DICT(obj)->hash_mask;
+	int *hash = DICT(obj)->hash;
+	int hole = dict_hash_slot(obj, i);
+	int h = (hole + 1) & mask;
+
+	while (hash[h])
+	{
+		int want = hash_name(dict_key_name(DICT(obj)->items[hash[h] - 1].k)) & mask;
+		if (((h - want) & mask) >= ((h - hole) & mask))
+		{
+			hash[hole] = hash[h];
+			hole = h;
+		}
+		h = (h + 1) & mask;
+	}
+	hash[hole] = 0;
+}
+
+static void
+dict_hash_refill(pdf_obj *obj)
+{
+	int i;
+
+	if (!DICT(obj)->hash)
+		return;
+	memset(DICT(obj)->hash, 0, (DICT(obj)->hash_mask + 1) * sizeof(int));
+	for (i = 0; i < DICT(obj)->len; i++)
+		dict_hash_insert(obj, i);
+}
+
+/* Make sure the index can take n entries (building it once n is large
+ * enough). This is the only operation that can throw, so call it before
+ * changing the items. */
+static void
+dict_hash_reserve(fz_context *ctx, pdf_obj *obj, int n)
+{
+	int size;
+
+	if (n < PDF_DICT_HASH_MIN || (DICT(obj)->hash && n * 2 <= DICT(obj)->hash_mask + 1))
+		return;
+
+	size = 64;
+	while (size < n * 2)
+		size <<= 1;
+	fz_free(ctx, DICT(obj)->hash);
+	DICT(obj)->hash = NULL;
+	DICT(obj)->hash = Memento_label(fz_calloc(ctx, size, sizeof(int)), "pdf_obj(dict hash)");
+	DICT(obj)->hash_mask = size - 1;
+	dict_hash_refill(obj);
+}
+
 pdf_obj *
 pdf_copy_dict(fz_context *ctx, pdf_obj *obj)
 {
@@ -1065,11 +1646,18 @@ pdf_dict_put_val_drop(fz_context *ctx, pdf_obj *obj, int i, pdf_obj *val)
 }
 
 /* Returns 0 <= i < len for key found. Returns -1-len < i <= -1 for key
- * not found, but with insertion point -1-i. */
+ * not found, but with insertion point -1-i. keyobj is NULL, or the
+ * dynamic name object whose name is key. */
 static int
-pdf_dict_finds(fz_context *ctx, pdf_obj *obj, const char *key)
+pdf_dict_finds(fz_context *ctx, pdf_obj *obj, const char *key, pdf_obj *keyobj)
 {
 	int len = DICT(obj)->len;
+	if (DICT(obj)->hash)
+	{
+		int i = dict_hash_find(obj, keyobj, key);
+		if (i >= 0 || !(obj->flags & PDF_FLAGS_SORTED))
+			return i >= 0 ? i : -1 - len;
+	}
 	if ((obj->flags & PDF_FLAGS_SORTED) && len > 0)
 	{
 		int l = 0;
@@ -1098,8 +1686,13 @@ pdf_dict_finds(fz_context *ctx, pdf_obj *obj, const char *key)
 	{
 		int i;
 		for (i = 0; i < len; i++)
-			if (strcmp(pdf_to_name(ctx, DICT(obj)->items[i].k), key) == 0)
+		{
+			pdf_obj *k = DICT(obj)->items[i].k;
+			if (k == keyobj)
 				return i;
+			if (!names_differ(k, keyobj) && strcmp(pdf_to_name(ctx, k), key) == 0)
+				return i;
+		}
 
 		return -1 - len;
 	}
@@ -1109,6 +1702,12 @@ static int
 pdf_dict_find(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 {
 	int len = DICT(obj)->len;
+	if (DICT(obj)->hash)
+	{
+		int i = dict_hash_find(obj, key, PDF_NAMES[(intptr_t)key]);
+		if (i >= 0 || !(obj->flags & PDF_FLAGS_SORTED))
+			return i >= 0 ? i : -1 - len;
+	}
 	if ((obj->flags & PDF_FLAGS_SORTED) && len > 0)
 	{
 		int l = 0;
@@ -1169,7 +1768,7 @@ pdf_dict_gets(fz_context *ctx, pdf_obj *obj, const char *key)
 	if (!key)
 		return NULL;
 
-	i = pdf_dict_finds(ctx, obj, key);
+	i = pdf_dict_finds(ctx, obj, key, NULL);
 	if (i >= 0)
 		return DICT(obj)->items[i].v;
 	return NULL;
@@ -1239,7 +1838,7 @@ pdf_dict_get(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 	if (key < PDF_OBJ_NAME__LIMIT)
 		i = pdf_dict_find(ctx, obj, key);
 	else
-		i = pdf_dict_finds(ctx, obj, pdf_to_name(ctx, key));
+		i = pdf_dict_finds(ctx, obj, NAME(key)->n, key);
 	if (i >= 0)
 		return DICT(obj)->items[i].v;
 	return NULL;
@@ -1288,7 +1887,7 @@ pdf_dict_get_put(fz_context *ctx, pdf_obj *obj, pdf_obj *key, pdf_obj *val, pdf_
 	if (key < PDF_OBJ_NAME__LIMIT)
 		i = pdf_dict_find(ctx, obj, key);
 	else
-		i = pdf_dict_finds(ctx, obj, pdf_to_name(ctx, key));
+		i = pdf_dict_finds(ctx, obj, NAME(key)->n, key);
 
 	prepare_object_for_alteration(ctx, obj, val);
 
@@ -1308,6 +1907,7 @@ pdf_dict_get_put(fz_context *ctx, pdf_obj *obj, pdf_obj *key, pdf_obj *val, pdf_
 	{
 		if (DICT(obj)->len + 1 > DICT(obj)->cap)
 			pdf_dict_grow(ctx, obj);
+		dict_hash_reserve(ctx, obj, DICT(obj)->len + 1);
 
 		i = -1-i;
 		if ((obj->flags & PDF_FLAGS_SORTED) && DICT(obj)->len > 0)
@@ -1318,6 +1918,13 @@ pdf_dict_get_put(fz_context *ctx, pdf_obj *obj, pdf_obj *key, pdf_obj *val, pdf_
 		DICT(obj)->items[i].k = pdf_keep_obj(ctx, key);
 		DICT(obj)->items[i].v = pdf_keep_obj(ctx, val);
 		DICT(obj)->len ++;
+
+		if (DICT(obj)->hash)
+		{
+			if (i < DICT(obj)->len - 1)
+				dict_hash_shift(obj, i);
+			dict_hash_insert(obj, i);
+		}
 	}
 }
 
@@ -1544,8 +2151,8 @@ pdf_dict_putl_drop(fz_context *ctx, pdf_obj *obj, pdf_obj *val, ...)
 		fz_rethrow(ctx);
 }
 
-void
-pdf_dict_dels(fz_context *ctx, pdf_obj *obj, const char *key)
+static void
+pdf_dict_del_imp(fz_context *ctx, pdf_obj *obj, const char *key, pdf_obj *keyobj)
 {
 	int i;
 
@@ -1556,9 +2163,15 @@ pdf_dict_dels(fz_context *ctx, pdf_obj *obj, const char *key)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "key is null");
 
 	prepare_object_for_alteration(ctx, obj, NULL);
-	i = pdf_dict_finds(ctx, obj, key);
+	i = pdf_dict_finds(ctx, obj, key, keyobj);
 	if (i >= 0)
 	{
+		if (DICT(obj)->hash)
+		{
+			dict_hash_remove(obj, i);
+			if (i < DICT(obj)->len-1)
+				DICT(obj)->hash[dict_hash_slot(obj, DICT(obj)->len-1)] = i + 1;
+		}
 		pdf_drop_obj(ctx, DICT(obj)->items[i].k);
 		pdf_drop_obj(ctx, DICT(obj)->items[i].v);
 		obj->flags &= ~PDF_FLAGS_SORTED;
@@ -1567,6 +2180,12 @@ pdf_dict_dels(fz_context *ctx, pdf_obj *obj, const char *key)
 	}
 }
 
+void
+pdf_dict_dels(fz_context *ctx, pdf_obj *obj, const char *key)
+{
+	pdf_dict_del_imp(ctx, obj, key, NULL);
+}
+
 void
 pdf_dict_del(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 {
@@ -1574,9 +2193,9 @@ pdf_dict_del(fz_context *ctx, pdf_obj *obj, pdf_obj *key)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "key is not a name (%s)", pdf_objkindstr(key));
 
 	if (key < PDF_OBJ_NAME__LIMIT)
-		pdf_dict_dels(ctx, obj, PDF_NAMES[(intptr_t)key]);
+		pdf_dict_del_imp(ctx, obj, PDF_NAMES[(intptr_t)key], NULL);
 	else
-		pdf_dict_dels(ctx, obj, NAME(key)->n);
+		pdf_dict_del_imp(ctx, obj, NAME(key)->n, key);
 }
 
 void
@@ -1589,6 +2208,7 @@ pdf_sort_dict(fz_context *ctx, pdf_obj *obj)
 	{
 		qsort(DICT(obj)->items, DICT(obj)->len, sizeof(struct keyval), keyvalcmp);
 		obj->flags |= PDF_FLAGS_SORTED;
+		dict_hash_refill(obj);
 	}
 }
 
@@ -1722,8 +2342,8 @@ pdf_drop_array(fz_context *ctx, pdf_obj *obj)
 	for (i = 0; i < DICT(obj)->len; i++)
 		pdf_drop_obj(ctx, ARRAY(obj)->items[i]);
 
-	fz_free(ctx, DICT(obj)->items);
-	fz_free(ctx, obj);
+	free_items(ctx, obj, DICT(obj)->items);
+	free_obj(ctx, obj);
 }
 
 static void
@@ -1736,8 +2356,9 @@ pdf_drop_dict(fz_context *ctx, pdf_obj *obj)
 		pdf_drop_obj(ctx, DICT(obj)->items[i].v);
 	}
 
-	fz_free(ctx, DICT(obj)->items);
-	fz_free(ctx, obj);
+	free_items(ctx, obj, DICT(obj)->items);
+	fz_free(ctx, DICT(obj)->hash);
+	free_obj(ctx, obj);
 }
 
 void
@@ -1745,14 +2366,21 @@ pdf_drop_obj(fz_context *ctx, pdf_obj *obj)
 {
 	if (obj >= PDF_OBJ__LIMIT)
 	{
-		if (fz_drop_imp16(ctx, obj, &obj->refs))
+		int drop = 0;
+		if (obj->refs > 0)
+			(void)Memento_dropRef(obj);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		if (obj->refs > 0 && obj->refs < PDF_OBJ_MAX_REFS)
+			drop = --obj->refs == 0;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		if (drop)
 		{
 			if (obj->kind == PDF_ARRAY)
 				pdf_drop_array(ctx, obj);
 			else if (obj->kind == PDF_DICT)
 				pdf_drop_dict(ctx, obj);
 			else
-				fz_free(ctx, obj);
+				free_obj(ctx, obj);
 		}
 	}
 }
@@ -128,12 +128,287 @@ pdf_lookup_page_loc(fz_context *ctx, pdf_document *doc, int needle, pdf_obj **pa
 	return hit;
 }
 
+static int pdf_check_saved_page(fz_context *ctx, pdf_document *doc, int page);
+
 pdf_obj *
 pdf_lookup_page_obj(fz_context *ctx, pdf_document *doc, int needle)
 {
+	if (doc->fwd_page_map && !doc->page_map_stale && needle >= 0 && needle < doc->map_page_count)
+		if (pdf_check_saved_page(ctx, doc, needle))
+			return doc->fwd_page_map[needle];
 	return pdf_lookup_page_loc(ctx, doc, needle, NULL, NULL);
 }
 
+/*
+ * Flattened page tree
+ */
+
+enum
+{
+	MAX_PAGE_TREE_DEPTH = 256
+};
+
+/* Collect the pages beneath node into map. Returns 0 if the tree is
+ * not one that walking it by the counts would give the same answers
+ * for. */
+static int
+pdf_flatten_page_tree_imp(fz_context *ctx, pdf_obj *node, pdf_obj **map, int *len, int max, int depth)
+{
+	pdf_obj *kids = pdf_dict_get(ctx, node, PDF_NAME_Kids);
+	int i, n = pdf_array_len(ctx, kids);
+	int ok = 1;
+
+	if (depth > MAX_PAGE_TREE_DEPTH || pdf_mark_obj(ctx, node))
+		return 0;
+
+	fz_try(ctx)
+	{
+		for (i = 0; ok && i < n; i++)
+		{
+			pdf_obj *kid = pdf_array_get(ctx, kids, i);
+			pdf_obj *type = pdf_dict_get(ctx, kid, PDF_NAME_Type);
+			if (type ? pdf_name_eq(ctx, type, PDF_NAME_Pages) : pdf_dict_get(ctx, kid, PDF_NAME_Kids) && !pdf_dict_get(ctx, kid, PDF_NAME_MediaBox))
+			{
+				int count = pdf_to_int(ctx, pdf_dict_get(ctx, kid, PDF_NAME_Count));
+				int start = *len;
+				ok = pdf_flatten_page_tree_imp(ctx, kid, map, len, max, depth + 1) && *len - start == count;
+			}
+			else if (*len < max)
+				map[(*len)++] = kid;
+			else
+				ok = 0;
+		}
+	}
+	fz_always(ctx)
+		pdf_unmark_obj(ctx, node);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return ok;
+}
+
+static int
+cmp_rev_page_map(const void *va, const void *vb)
+{
+	const pdf_rev_page_map *a = va;
+	const pdf_rev_page_map *b = vb;
+	if (a->object != b->object)
+		return a->object < b->object ? -1 : 1;
+	return a->page - b->page;
+}
+
+/* Take ownership of map (and of unchecked, which flags the pages still
+ * to be checked against the tree), and make the reverse map from it. */
+static void
+pdf_install_page_tree(fz_context *ctx, pdf_document *doc, pdf_obj **map, int count, unsigned char *unchecked)
+{
+	pdf_rev_page_map *rev;
+	int i, n;
+
+	fz_try(ctx)
+		rev = fz_malloc_array(ctx, count, sizeof(*rev));
+	fz_catch(ctx)
+	{
+		for (i = 0; i < count; i++)
+			pdf_drop_obj(ctx, map[i]);
+		fz_free(ctx, map);
+		fz_free(ctx, unchecked);
+		fz_rethrow(ctx);
+	}
+
+	for (i = n = 0; i < count; i++)
+	{
+		if (pdf_is_indirect(ctx, map[i]))
+		{
+			rev[n].object = pdf_to_num(ctx, map[i]);
+			rev[n].page = i;
+			n++;
+		}
+	}
+	qsort(rev, n, sizeof(*rev), cmp_rev_page_map);
+
+	/* A page object that appears more than once has no single page
+	 * number; leave those to the tree walk. */
+	for (i = 1; i < n; i++)
+		if (rev[i].object == rev[i-1].object)
+			rev[i].page = rev[i-1].page = -1;
+
+	doc->fwd_page_map = map;
+	doc->rev_page_map = rev;
+	doc->map_page_count = count;
+	doc->rev_page_count = n;
+	doc->page_map_unchecked = unchecked;
+	doc->page_map_stale = 0;
+}
+
+void
+pdf_load_page_tree(fz_context *ctx, pdf_document *doc)
+{
+	pdf_obj *root, *node;
+	pdf_obj **map;
+	int count, len, ok, i;
+
+	if (doc->fwd_page_map)
+	{
+		if (!doc->page_map_stale)
+			return;
+		pdf_drop_page_tree(ctx, doc);
+	}
+
+	count = pdf_count_pages(ctx, doc);
+	root = pdf_dict_get(ctx, pdf_trailer(ctx, doc), PDF_NAME_Root);
+	node = pdf_dict_get(ctx, root, PDF_NAME_Pages);
+	if (!node || count <= 0)
+		return;
+
+	map = fz_malloc_array(ctx, count, sizeof(*map));
+	len = 0;
+	fz_try(ctx)
+		ok = pdf_flatten_page_tree_imp(ctx, node, map, &len, count, 0) && len == count;
+	fz_catch(ctx)
+	{
+		fz_free(ctx, map);
+		fz_rethrow(ctx);
+	}
+
+	if (!ok)
+	{
+		fz_warn(ctx, "page tree is inconsistent; not indexing it");
+		fz_free(ctx, map);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		pdf_keep_obj(ctx, map[i]);
+	pdf_install_page_tree(ctx, doc, map, count, NULL);
+}
+
+void
+pdf_drop_page_tree(fz_context *ctx, pdf_document *doc)
+{
+	int i;
+
+	for (i = 0; i < doc->map_page_count; i++)
+		pdf_drop_obj(ctx, doc->fwd_page_map[i]);
+	fz_free(ctx, doc->fwd_page_map);
+	fz_free(ctx, doc->rev_page_map);
+	fz_free(ctx, doc->page_map_unchecked);
+	doc->fwd_page_map = NULL;
+	doc->rev_page_map = NULL;
+	doc->page_map_unchecked = NULL;
+	doc->map_page_count = 0;
+	doc->rev_page_count = 0;
+	doc->page_map_stale = 0;
+}
+
+static int
+pdf_lookup_page_number_in_map(fz_context *ctx, pdf_document *doc, int num)
+{
+	int l = 0;
+	int r = doc->rev_page_count - 1;
+
+	while (l <= r)
+	{
+		int m = (l + r) >> 1;
+		int c = num - doc->rev_page_map[m].object;
+		if (c < 0)
+			r = m - 1;
+		else if (c > 0)
+			l = m + 1;
+		else
+			return doc->rev_page_map[m].page;
+	}
+	return -1;
+}
+
+#define PAGE_TREE_MAGIC "%MuPDF page tree 1"
+
+void
+pdf_save_page_tree(fz_context *ctx, pdf_document *doc, fz_output *out)
+{
+	int i;
+
+	/* Never pass on a saved index without checking it. */
+	pdf_load_page_tree(ctx, doc);
+	for (i = 0; i < doc->map_page_count; i++)
+		if (!pdf_check_saved_page(ctx, doc, i))
+			break;
+	pdf_load_page_tree(ctx, doc);
+	if (!doc->fwd_page_map)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot index page tree");
+	for (i = 0; i < doc->map_page_count; i++)
+		if (!pdf_is_indirect(ctx, doc->fwd_page_map[i]))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot save index of direct page object (page %d)", i + 1);
+
+	fz_printf(ctx, out, "%s %Zd %Zd %d\n", PAGE_TREE_MAGIC, doc->file_size, doc->startxref, doc->map_page_count);
+	for (i = 0; i < doc->map_page_count; i++)
+	{
+		fz_write_int32_le(ctx, out, pdf_to_num(ctx, doc->fwd_page_map[i]));
+		fz_write_int32_le(ctx, out, pdf_to_gen(ctx, doc->fwd_page_map[i]));
+	}
+}
+
+int
+pdf_load_saved_page_tree(fz_context *ctx, pdf_document *doc, fz_stream *stm)
+{
+	char line[100];
+	char *s = line;
+	fz_off_t file_size, startxref;
+	int count, xref_len, i;
+	pdf_obj **map;
+	unsigned char *unchecked = NULL;
+
+	fz_var(unchecked);
+
+	fz_read_line(ctx, stm, line, sizeof line);
+	if (strncmp(line, PAGE_TREE_MAGIC " ", sizeof PAGE_TREE_MAGIC))
+		return 0;
+	s += sizeof PAGE_TREE_MAGIC;
+	file_size = fz_atoo(fz_strsep(&s, " "));
+	startxref = fz_atoo(fz_strsep(&s, " "));
+	count = fz_atoi(fz_strsep(&s, " "));
+	if (file_size != doc->file_size || startxref != doc->startxref || count <= 0 || count != pdf_count_pages(ctx, doc))
+		return 0;
+
+	xref_len = pdf_xref_len(ctx, doc);
+	map = fz_calloc(ctx, count, sizeof(*map));
+	fz_try(ctx)
+	{
+		for (i = 0; i < count; i++)
+		{
+			int num = fz_read_int32_le(ctx, stm);
+			int gen = fz_read_int32_le(ctx, stm);
+			if (num <= 0 || num >= xref_len)
+				break;
+			map[i] = pdf_new_indirect(ctx, doc, num, gen);
+		}
+		if (i == count)
+		{
+			unchecked = fz_malloc(ctx, count);
+			memset(unchecked, 1, count);
+		}
+	}
+	fz_catch(ctx)
+	{
+		for (i = 0; i < count; i++)
+			pdf_drop_obj(ctx, map[i]);
+		fz_free(ctx, map);
+		fz_rethrow(ctx);
+	}
+
+	if (i < count)
+	{
+		while (i > 0)
+			pdf_drop_obj(ctx, map[--i]);
+		fz_free(ctx, map);
+		return 0;
+	}
+
+	pdf_drop_page_tree(ctx, doc);
+	pdf_install_page_tree(ctx, doc, map, count, unchecked);
+	return 1;
+}
+
 static int
 pdf_count_pages_before_kid(fz_context *ctx, pdf_document *doc, pdf_obj *parent, int kid_num)
 {
@@ -158,16 +433,15 @@ pdf_count_pages_before_kid(fz_context *ctx, pdf_document *doc, pdf_obj *parent,
 	fz_throw(ctx, FZ_ERROR_GENERIC, "kid not found in parent's kids array");
 }
 
-int
-pdf_lookup_page_number(fz_context *ctx, pdf_document *doc, pdf_obj *node)
+/* Count the pages before node by going up its parents. The object number
+ * of the topmost one is put in topp. */
+static int
+pdf_lookup_page_number_by_parents(fz_context *ctx, pdf_document *doc, pdf_obj *node, int *topp)
 {
 	int needle = pdf_to_num(ctx, node);
 	int total = 0;
 	pdf_obj *parent, *parent2;
 
-	if (!pdf_name_eq(ctx, pdf_dict_get(ctx, node, PDF_NAME_Type), PDF_NAME_Page))
-		fz_throw(ctx, FZ_ERROR_GENERIC, "invalid page object");
-
 	parent2 = parent = pdf_dict_get(ctx, node, PDF_NAME_Parent);
 	fz_var(parent);
 	fz_try(ctx)
@@ -197,9 +471,62 @@ pdf_lookup_page_number(fz_context *ctx, pdf_document *doc, pdf_obj *node)
 		fz_rethrow(ctx);
 	}
 
+	if (topp)
+		*topp = needle;
 	return total;
 }
 
+/* Pages from a saved index are checked against the tree the first time
+ * they are used, in case the file has been changed in a way that kept
+ * its size and last xref, or the index has been edited. If one does not
+ * match, stop using the index. It is not dropped, as callers may still
+ * hold page objects from it. */
+static int
+pdf_check_saved_page(fz_context *ctx, pdf_document *doc, int page)
+{
+	pdf_obj *obj, *root;
+	int ok, top;
+
+	if (!doc->page_map_unchecked || !doc->page_map_unchecked[page])
+		return 1;
+
+	obj = doc->fwd_page_map[page];
+	fz_try(ctx)
+	{
+		root = pdf_dict_getp(ctx, pdf_trailer(ctx, doc), "Root/Pages");
+		ok = pdf_name_eq(ctx, pdf_dict_get(ctx, obj, PDF_NAME_Type), PDF_NAME_Page) &&
+			pdf_lookup_page_number_by_parents(ctx, doc, obj, &top) == page &&
+			top == pdf_to_num(ctx, root);
+	}
+	fz_catch(ctx)
+		ok = 0;
+
+	if (!ok)
+	{
+		fz_warn(ctx, "saved page tree does not match page %d; not using it", page + 1);
+		doc->page_map_stale = 1;
+		return 0;
+	}
+	doc->page_map_unchecked[page] = 0;
+	return 1;
+}
+
+int
+pdf_lookup_page_number(fz_context *ctx, pdf_document *doc, pdf_obj *node)
+{
+	if (!pdf_name_eq(ctx, pdf_dict_get(ctx, node, PDF_NAME_Type), PDF_NAME_Page))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "invalid page object");
+
+	if (doc->rev_page_map && !doc->page_map_stale)
+	{
+		int page = pdf_lookup_page_number_in_map(ctx, doc, pdf_to_num(ctx, node));
+		if (page >= 0 && pdf_check_saved_page(ctx, doc, page))
+			return page;
+	}
+
+	return pdf_lookup_page_number_by_parents(ctx, doc, node, NULL);
+}
+
 int
 pdf_lookup_anchor(fz_context *ctx, pdf_document *doc, const char *name, float *xp, float *yp)
 {
@@ -656,6 +983,7 @@ pdf_delete_page(fz_context *ctx, pdf_document *doc, int at)
 	}
 
 	doc->page_count = 0; /* invalidate cached value */
+	pdf_drop_page_tree(ctx, doc);
 }
 
 void
@@ -745,4 +1073,5 @@ pdf_insert_page(fz_context *ctx, pdf_document *doc, int at, pdf_obj *page_ref)
 	}
 
 	doc->page_count = 0; /* invalidate cached value */
+	pdf_drop_page_tree(ctx, doc);
 }
@@ -8,15 +8,21 @@
 static void
 pdf_sample_composite_shade_function(fz_context *ctx, fz_shade *shade, fz_function *func, float t0, float t1)
 {
-	int i, n;
-	float t;
+	float t[32], v[32 * FZ_MAX_COLORS];
+	int i, j, k, n;
 
 	n = fz_colorspace_n(ctx, shade->colorspace);
-	for (i = 0; i < 256; i++)
+	for (i = 0; i < 256; i += nelem(t))
 	{
-		t = t0 + (i / 255.0f) * (t1 - t0);
-		fz_eval_function(ctx, func, &t, 1, shade->function[i], n);
-		shade->function[i][n] = 1;
+		for (j = 0; j < nelem(t); j++)
+			t[j] = t0 + ((i + j) / 255.0f) * (t1 - t0);
+		fz_eval_function_n(ctx, func, nelem(t), t, 1, v, n);
+		for (j = 0; j < nelem(t); j++)
+		{
+			for (k = 0; k < n; k++)
+				shade->function[i + j][k] = v[j * n + k];
+			shade->function[i + j][n] = 1;
+		}
 	}
 }
 
@@ -52,7 +58,7 @@ pdf_load_function_based_shading(fz_context *ctx, pdf_document *doc, fz_shade *sh
 {
 	pdf_obj *obj;
 	float x0, y0, x1, y1;
-	float fv[2];
+	float fv[(FUNSEGS+1) * 2];
 	fz_matrix matrix;
 	int xx, yy;
 	float *p;
@@ -86,15 +92,14 @@ pdf_load_function_based_shading(fz_context *ctx, pdf_document *doc, fz_shade *sh
 	p = shade->u.f.fn_vals;
 	for (yy = 0; yy <= FUNSEGS; yy++)
 	{
-		fv[1] = y0 + (y1 - y0) * yy / FUNSEGS;
-
 		for (xx = 0; xx <= FUNSEGS; xx++)
 		{
-			fv[0] = x0 + (x1 - x0) * xx / FUNSEGS;
-
-			fz_eval_function(ctx, func, fv, 2, p, n);
-			p += n;
+			fv[xx * 2 + 0] = x0 + (x1 - x0) * xx / FUNSEGS;
+			fv[xx * 2 + 1] = y0 + (y1 - y0) * yy / FUNSEGS;
 		}
+
+		fz_eval_function_n(ctx, func, FUNSEGS+1, fv, 2, p, n);
+		p += (FUNSEGS+1) * n;
 	}
 }
 
@@ -570,7 +570,11 @@ pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compressio
 
 	fz_try(ctx)
 	{
-		if (truncated)
+		/* Data kept in its compressed form is never written to, so
+		 * may share the storage of the file. */
+		if (params)
+			buf = fz_read_shared(ctx, stm, len, truncated);
+		else if (truncated)
 			buf = fz_read_best(ctx, stm, len, truncated);
 		else
 			buf = fz_read_all(ctx, stm, len);
@@ -7,6 +7,7 @@
 /* #define DEBUG_WRITING */
 
 typedef struct pdf_write_state_s pdf_write_state;
+typedef struct write_stream_s write_stream;
 
 /*
 	As part of linearization, we need to keep a list of what objects are used
@@ -86,6 +87,9 @@ struct pdf_write_state_s
 	pdf_obj *hints_length;
 	int page_count;
 	page_objects_list *page_object_lists;
+	/* The following are used when writing with a thread pool */
+	fz_thread_pool *thread_pool;
+	write_stream **prepared;
 };
 
 /*
@@ -1490,12 +1494,15 @@ update_linearization_params(fz_context *ctx, pdf_document *doc, pdf_write_state
  * Make sure we have loaded objects from object streams.
  */
 
-static void preloadobjstms(fz_context *ctx, pdf_document *doc)
+static void preloadobjstms(fz_context *ctx, pdf_document *doc, fz_thread_pool *pool)
 {
 	pdf_obj *obj;
 	int num;
 	int xref_len = pdf_xref_len(ctx, doc);
 
+	if (pool)
+		pdf_prefetch_obj_stms(ctx, doc, pool);
+
 	for (num = 0; num < xref_len; num++)
 	{
 		if (pdf_get_xref_entry(ctx, doc, num)->type == 'o')
@@ -1631,129 +1638,159 @@ static fz_buffer *deflatebuf(fz_context *ctx, unsigned char *p, size_t n)
 	return buf;
 }
 
-static void copystream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int gen, int do_deflate)
+/*
+ * A stream is written in three steps: loading its data and a copy of its
+ * dictionary, encoding the data (deflating and/or hex encoding), and
+ * fixing up the dictionary and printing the lot. The middle step only
+ * works on the buffers, so it can be run ahead of time on a thread pool
+ * (see write_batch below) without changing the output.
+ */
+struct write_stream_s
 {
-	fz_buffer *buf, *tmp;
-	pdf_obj *newlen;
 	pdf_obj *obj;
-	size_t len;
-	unsigned char *data;
+	fz_buffer *buf;
+	int do_deflate;
+	int do_ascii;
+	int deflated;
+	int hexed;
+	int truncated;
+	int error;
+	char message[256];
+};
 
-	buf = pdf_load_raw_stream_number(ctx, doc, num);
+static void loadstream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int do_deflate, int do_expand, write_stream *ws)
+{
+	if (do_expand)
+	{
+		ws->buf = pdf_load_stream_truncated(ctx, doc, num, (opts->continue_on_error ? &ws->truncated : NULL));
+		ws->obj = pdf_copy_dict(ctx, obj_orig);
+		pdf_dict_del(ctx, ws->obj, PDF_NAME_Filter);
+		pdf_dict_del(ctx, ws->obj, PDF_NAME_DecodeParms);
+		ws->do_deflate = do_deflate;
+	}
+	else
+	{
+		ws->buf = pdf_load_raw_stream_number(ctx, doc, num);
+		ws->obj = pdf_copy_dict(ctx, obj_orig);
+		ws->do_deflate = do_deflate && !pdf_dict_get(ctx, ws->obj, PDF_NAME_Filter);
+	}
+	ws->do_ascii = opts->do_ascii;
+}
 
-	obj = pdf_copy_dict(ctx, obj_orig);
+static void encodestream(fz_context *ctx, write_stream *ws)
+{
+	fz_buffer *tmp;
+	unsigned char *data;
+	size_t len;
 
-	len = fz_buffer_storage(ctx, buf, &data);
-	if (do_deflate && !pdf_dict_get(ctx, obj, PDF_NAME_Filter))
+	len = fz_buffer_storage(ctx, ws->buf, &data);
+	if (ws->do_deflate)
 	{
-		size_t clen;
-		unsigned char *cdata;
 		tmp = deflatebuf(ctx, data, len);
-		clen = fz_buffer_storage(ctx, tmp, &cdata);
-		if (clen >= len)
+		if (fz_buffer_storage(ctx, tmp, NULL) >= len)
 		{
 			/* Don't bother compressing, as we gain nothing. */
 			fz_drop_buffer(ctx, tmp);
 		}
 		else
 		{
-			len = clen;
-			data = cdata;
-			pdf_dict_put(ctx, obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
-			fz_drop_buffer(ctx, buf);
-			buf = tmp;
+			fz_drop_buffer(ctx, ws->buf);
+			ws->buf = tmp;
+			ws->deflated = 1;
+			len = fz_buffer_storage(ctx, ws->buf, &data);
 		}
 	}
 
-	if (opts->do_ascii && isbinarystream(ctx, buf))
+	if (ws->do_ascii && isbinarystream(ctx, ws->buf))
 	{
 		tmp = hexbuf(ctx, data, len);
-		fz_drop_buffer(ctx, buf);
-		buf = tmp;
-		len = fz_buffer_storage(ctx, buf, &data);
-
-		addhexfilter(ctx, doc, obj);
+		fz_drop_buffer(ctx, ws->buf);
+		ws->buf = tmp;
+		ws->hexed = 1;
 	}
+}
 
+static void finishstream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, write_stream *ws, int num, int gen)
+{
+	pdf_obj *newlen;
+	unsigned char *data;
+	size_t len;
+
+	if (ws->truncated && opts->errors)
+		(*opts->errors)++;
+
+	if (ws->deflated)
+		pdf_dict_put(ctx, ws->obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+	if (ws->hexed)
+		addhexfilter(ctx, doc, ws->obj);
+
+	len = fz_buffer_storage(ctx, ws->buf, &data);
 	newlen = pdf_new_int(ctx, doc, (int)len);
-	pdf_dict_put(ctx, obj, PDF_NAME_Length, newlen);
+	pdf_dict_put(ctx, ws->obj, PDF_NAME_Length, newlen);
 	pdf_drop_obj(ctx, newlen);
 
 	fz_printf(ctx, opts->out, "%d %d obj\n", num, gen);
-	pdf_print_obj(ctx, opts->out, obj, opts->do_tight);
+	pdf_print_obj(ctx, opts->out, ws->obj, opts->do_tight);
 	fz_puts(ctx, opts->out, "\nstream\n");
 	fz_write(ctx, opts->out, data, len);
 	if (len > 0 && data[len-1] != '\n')
 		fz_putc(ctx, opts->out, '\n');
 	fz_puts(ctx, opts->out, "endstream\nendobj\n\n");
-
-	fz_drop_buffer(ctx, buf);
-	pdf_drop_obj(ctx, obj);
 }
 
-static void expandstream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int gen, int do_deflate)
+static void dropstream(fz_context *ctx, write_stream *ws)
 {
-	fz_buffer *buf, *tmp;
-	pdf_obj *newlen;
-	pdf_obj *obj;
-	int truncated = 0;
-	size_t len;
-	unsigned char *data;
+	if (ws)
+	{
+		fz_drop_buffer(ctx, ws->buf);
+		pdf_drop_obj(ctx, ws->obj);
+	}
+}
 
-	buf = pdf_load_stream_truncated(ctx, doc, num, (opts->continue_on_error ? &truncated : NULL));
-	if (truncated && opts->errors)
-		(*opts->errors)++;
+static void writestream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pdf_obj *obj_orig, int num, int gen, int do_deflate, int do_expand)
+{
+	write_stream ws = { 0 };
 
-	obj = pdf_copy_dict(ctx, obj_orig);
-	pdf_dict_del(ctx, obj, PDF_NAME_Filter);
-	pdf_dict_del(ctx, obj, PDF_NAME_DecodeParms);
+	fz_try(ctx)
+	{
+		loadstream(ctx, doc, opts, obj_orig, num, do_deflate, do_expand, &ws);
+		encodestream(ctx, &ws);
+		finishstream(ctx, doc, opts, &ws, num, gen);
+	}
+	fz_always(ctx)
+		dropstream(ctx, &ws);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
 
-	len = fz_buffer_storage(ctx, buf, &data);
-	if (do_deflate)
+/* Write a stream that write_batch has already loaded and encoded. */
+static void writeprepared(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, write_stream *ws, int num, int gen)
+{
+	fz_try(ctx)
 	{
-		unsigned char *cdata;
-		size_t clen;
-		tmp = deflatebuf(ctx, data, len);
-		clen = fz_buffer_storage(ctx, tmp, &cdata);
-		if (clen >= len)
+		if (ws->error)
 		{
-			/* Don't bother compressing, as we gain nothing. */
-			fz_drop_buffer(ctx, tmp);
+			if (opts->continue_on_error && ws->error != FZ_ERROR_TRYLATER)
+			{
+				/* As writeobject does, without reporting the error again. */
+				fz_printf(ctx, opts->out, "%d %d obj\nnull\nendobj\n", num, gen);
+				if (opts->errors)
+					(*opts->errors)++;
+				fz_warn(ctx, "%s", ws->message);
+			}
+			else
+				fz_throw(ctx, ws->error, "%s", ws->message);
 		}
 		else
-		{
-			len = clen;
-			data = cdata;
-			pdf_dict_put(ctx, obj, PDF_NAME_Filter, PDF_NAME_FlateDecode);
-			fz_drop_buffer(ctx, buf);
-			buf = tmp;
-		}
+			finishstream(ctx, doc, opts, ws, num, gen);
 	}
-
-	if (opts->do_ascii && isbinarystream(ctx, buf))
+	fz_always(ctx)
 	{
-		tmp = hexbuf(ctx, data, len);
-		fz_drop_buffer(ctx, buf);
-		buf = tmp;
-		len = fz_buffer_storage(ctx, buf, &data);
-
-		addhexfilter(ctx, doc, obj);
+		dropstream(ctx, ws);
+		fz_free(ctx, ws);
 	}
-
-	newlen = pdf_new_int(ctx, doc, (int)len);
-	pdf_dict_put(ctx, obj, PDF_NAME_Length, newlen);
-	pdf_drop_obj(ctx, newlen);
-
-	fz_printf(ctx, opts->out, "%d %d obj\n", num, gen);
-	pdf_print_obj(ctx, opts->out, obj, opts->do_tight);
-	fz_puts(ctx, opts->out, "\nstream\n");
-	fz_write(ctx, opts->out, data, len);
-	if (len > 0 && data[len-1] != '\n')
-		fz_putc(ctx, opts->out, '\n');
-	fz_puts(ctx, opts->out, "endstream\nendobj\n\n");
-
-	fz_drop_buffer(ctx, buf);
-	pdf_drop_obj(ctx, obj);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 }
 
 static int is_image_filter(char *s)
@@ -1817,6 +1854,16 @@ static int is_font_stream(fz_context *ctx, pdf_obj *obj)
 	return 0;
 }
 
+static void get_stream_modes(fz_context *ctx, pdf_write_state *opts, pdf_obj *obj, int *do_deflate, int *do_expand)
+{
+	*do_deflate = opts->do_compress;
+	*do_expand = opts->do_expand;
+	if (opts->do_compress_images && is_image_stream(ctx, obj))
+		*do_deflate = 1, *do_expand = 0;
+	if (opts->do_compress_fonts && is_font_stream(ctx, obj))
+		*do_deflate = 1, *do_expand = 0;
+}
+
 static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int gen, int skip_xrefs)
 {
 	pdf_xref_entry *entry;
@@ -1875,18 +1922,21 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 	}
 	else
 	{
+		write_stream *ws = opts->prepared ? opts->prepared[num] : NULL;
+
+		if (ws)
+			opts->prepared[num] = NULL;
+
 		fz_try(ctx)
 		{
-			int do_deflate = opts->do_compress;
-			int do_expand = opts->do_expand;
-			if (opts->do_compress_images && is_image_stream(ctx, obj))
-				do_deflate = 1, do_expand = 0;
-			if (opts->do_compress_fonts && is_font_stream(ctx, obj))
-				do_deflate = 1, do_expand = 0;
-			if (do_expand)
-				expandstream(ctx, doc, opts, obj, num, gen, do_deflate);
+			int do_deflate, do_expand;
+			if (ws)
+				writeprepared(ctx, doc, opts, ws, num, gen);
 			else
-				copystream(ctx, doc, opts, obj, num, gen, do_deflate);
+			{
+				get_stream_modes(ctx, opts, obj, &do_deflate, &do_expand);
+				writestream(ctx, doc, opts, obj, num, gen, do_deflate, do_expand);
+			}
 		}
 		fz_catch(ctx)
 		{
@@ -2223,8 +2273,134 @@ dowriteobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num
 		opts->use_list[num] = 0;
 }
 
+/*
+ * With a thread pool, streams are loaded ahead of the object being
+ * written, in batches in writing order, and their data is encoded by
+ * jobs. Batch n+1 is encoded while batch n is written out. Everything
+ * that touches the document (loading data, editing dictionaries and
+ * printing) is still done by this thread and in the same order as
+ * without a pool, so the output is the same.
+ *
+ * Only objects that are loaded already are read ahead; otherwise an
+ * object that needs repairing could make the file be repaired at a
+ * different point while writing.
+ */
+
+#define WRITE_BATCH_OBJECTS 1024
+#define WRITE_BATCH_BYTES (16 << 20)
+
+typedef struct
+{
+	int *order;
+	int len;
+	int pos; /* Next object to write */
+	int ready; /* End of the batch that has been encoded */
+	int queued; /* End of the batch being encoded */
+} write_pipeline;
+
+static void encode_stream_job(fz_context *ctx, void *arg)
+{
+	write_stream *ws = arg;
+
+	fz_try(ctx)
+		encodestream(ctx, ws);
+	fz_catch(ctx)
+	{
+		ws->error = fz_caught(ctx);
+		fz_strlcpy(ws->message, fz_caught_message(ctx), sizeof ws->message);
+	}
+}
+
+/* Load the stream that writeobject would encode for object num, if any. */
+static write_stream *prepare_stream(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num)
+{
+	pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+	write_stream *ws;
+	pdf_obj *obj = entry->obj;
+	pdf_obj *type;
+	int do_deflate, do_expand;
+
+	if (entry->type != 'n' && entry->type != 'o')
+		return NULL;
+	if (opts->do_garbage && !opts->use_list[num])
+		return NULL;
+	if (opts->do_incremental && !pdf_xref_is_incremental(ctx, doc, num))
+		return NULL;
+	if (!obj || (entry->stm_ofs == 0 && !entry->stm_buf) || (entry->stm_ofs < 0 && !entry->stm_buf))
+		return NULL;
+	type = pdf_dict_get(ctx, obj, PDF_NAME_Type);
+	if (pdf_name_eq(ctx, type, PDF_NAME_ObjStm) || pdf_name_eq(ctx, type, PDF_NAME_XRef))
+		return NULL;
+
+	get_stream_modes(ctx, opts, obj, &do_deflate, &do_expand);
+	if (!do_deflate && !opts->do_ascii)
+		return NULL;
+
+	ws = fz_malloc_struct(ctx, write_stream);
+	fz_try(ctx)
+		loadstream(ctx, doc, opts, obj, num, do_deflate, do_expand, ws);
+	fz_catch(ctx)
+	{
+		if (fz_caught(ctx) == FZ_ERROR_TRYLATER || !opts->continue_on_error)
+		{
+			dropstream(ctx, ws);
+			fz_free(ctx, ws);
+			fz_rethrow(ctx);
+		}
+		/* Reported when the object is written. */
+		ws->error = fz_caught(ctx);
+		fz_strlcpy(ws->message, fz_caught_message(ctx), sizeof ws->message);
+	}
+
+	if (!ws->error && !ws->do_deflate && !ws->do_ascii)
+	{
+		dropstream(ctx, ws);
+		fz_free(ctx, ws);
+		return NULL;
+	}
+	return ws;
+}
+
+static int prepare_batch(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, write_pipeline *pipe, int from)
+{
+	size_t bytes = 0;
+	int i;
+
+	for (i = from; i < pipe->len && i - from < WRITE_BATCH_OBJECTS && bytes < WRITE_BATCH_BYTES; i++)
+	{
+		int num = pipe->order[i];
+		write_stream *ws = prepare_stream(ctx, doc, opts, num);
+		if (ws)
+		{
+			opts->prepared[num] = ws;
+			if (!ws->error)
+			{
+				bytes += fz_buffer_storage(ctx, ws->buf, NULL);
+				fz_thread_pool_submit(ctx, opts->thread_pool, encode_stream_job, ws);
+			}
+		}
+	}
+	return i;
+}
+
+/* Called before each object is written, in writing order. */
+static void write_ahead(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, write_pipeline *pipe)
+{
+	if (!pipe->order)
+		return;
+	if (pipe->pos == pipe->ready)
+	{
+		if (pipe->queued == pipe->ready)
+			pipe->queued = prepare_batch(ctx, doc, opts, pipe, pipe->queued);
+		fz_thread_pool_wait(ctx, opts->thread_pool);
+		pipe->ready = pipe->queued;
+		pipe->queued = prepare_batch(ctx, doc, opts, pipe, pipe->ready);
+	}
+	pipe->pos++;
+}
+
 static void
-writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass)
+writeobjects_imp(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass, write_pipeline *pipe)
 {
 	int num;
 	int xref_len = pdf_xref_len(ctx, doc);
@@ -2235,6 +2411,7 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 		fz_puts(ctx, opts->out, "%%\316\274\341\277\246\n\n");
 	}
 
+	write_ahead(ctx, doc, opts, pipe);
 	dowriteobject(ctx, doc, opts, opts->start, pass);
 
 	if (opts->do_linear)
@@ -2248,7 +2425,10 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 	}
 
 	for (num = opts->start+1; num < xref_len; num++)
+	{
+		write_ahead(ctx, doc, opts, pipe);
 		dowriteobject(ctx, doc, opts, num, pass);
+	}
 	if (opts->do_linear && pass == 1)
 	{
 		fz_off_t offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
@@ -2258,10 +2438,62 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 	{
 		if (pass == 1)
 			opts->ofs_list[num] += opts->hintstream_len;
+		write_ahead(ctx, doc, opts, pipe);
 		dowriteobject(ctx, doc, opts, num, pass);
 	}
 }
 
+static void
+writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass)
+{
+	write_pipeline pipe = { 0 };
+	int num;
+	int xref_len = pdf_xref_len(ctx, doc);
+
+	if (opts->thread_pool && xref_len > 0)
+	{
+		fz_try(ctx)
+		{
+			opts->prepared = fz_calloc(ctx, xref_len, sizeof(*opts->prepared));
+			pipe.order = fz_malloc_array(ctx, xref_len, sizeof(*pipe.order));
+			pipe.order[pipe.len++] = opts->start;
+			for (num = opts->start+1; num < xref_len; num++)
+				pipe.order[pipe.len++] = num;
+			for (num = 1; num < opts->start; num++)
+				pipe.order[pipe.len++] = num;
+		}
+		fz_catch(ctx)
+		{
+			/* Write without reading ahead. */
+			fz_free(ctx, opts->prepared);
+			opts->prepared = NULL;
+			fz_free(ctx, pipe.order);
+			pipe.order = NULL;
+		}
+	}
+
+	fz_try(ctx)
+		writeobjects_imp(ctx, doc, opts, pass, &pipe);
+	fz_always(ctx)
+	{
+		if (pipe.order)
+		{
+			/* Jobs catch their own errors, so this does not throw. */
+			fz_thread_pool_wait(ctx, opts->thread_pool);
+			for (num = 0; num < xref_len; num++)
+			{
+				dropstream(ctx, opts->prepared[num]);
+				fz_free(ctx, opts->prepared[num]);
+			}
+			fz_free(ctx, opts->prepared);
+			opts->prepared = NULL;
+			fz_free(ctx, pipe.order);
+		}
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 static int
 my_log2(int x)
 {
@@ -2769,6 +3001,7 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->rev_renumber_map = fz_malloc_array(ctx, xref_len + 3, sizeof(int));
 	opts->continue_on_error = in_opts->continue_on_error;
 	opts->errors = in_opts->errors;
+	opts->thread_pool = in_opts->thread_pool;
 
 	for (num = 0; num < xref_len; num++)
 	{
@@ -2907,7 +3140,7 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 		if (!opts->do_incremental)
 		{
 			pdf_ensure_solid_xref(ctx, doc, xref_len);
-			preloadobjstms(ctx, doc);
+			preloadobjstms(ctx, doc, in_opts->thread_pool);
 		}
 
 		/* Sweep & mark objects from the trailer */
@@ -16,6 +16,333 @@ static inline int iswhite(int ch)
 		ch == '\014' || ch == '\015' || ch == '\040';
 }
 
+/*
+ * lazily loaded xref subsections
+ *
+ * When lazy loading is enabled, large subsections are only recorded
+ * when the xref is read. Their entries are parsed a chunk at a time
+ * when something first looks one of them up, and the data of an xref
+ * stream is not even decompressed until then.
+ */
+
+enum { LAZY_CHUNK = 256, LAZY_MAX_SUBSECTIONS = 64 };
+
+typedef struct pdf_lazy_xref_stm_s pdf_lazy_xref_stm;
+
+struct pdf_lazy_xref_stm_s
+{
+	int refs;
+	int loading;
+	pdf_obj *dict;
+	fz_off_t stm_ofs;
+	int w0, w1, w2;
+	fz_buffer *data;
+};
+
+struct pdf_xref_lazy_s
+{
+	fz_off_t ofs; /* of the first entry in the file, or in the xref stream data */
+	pdf_lazy_xref_stm *stm; /* NULL for classic xref tables */
+	int pending; /* number of chunks not yet loaded */
+	unsigned char loaded[1]; /* one flag per chunk */
+};
+
+static pdf_xref_lazy *
+new_lazy(fz_context *ctx, int len, fz_off_t ofs, pdf_lazy_xref_stm *stm)
+{
+	int chunks = (len + LAZY_CHUNK - 1) / LAZY_CHUNK;
+	pdf_xref_lazy *lazy = fz_calloc(ctx, 1, sizeof(pdf_xref_lazy) + chunks);
+	lazy->ofs = ofs;
+	lazy->pending = chunks;
+	lazy->stm = stm;
+	if (stm)
+		stm->refs++;
+	return lazy;
+}
+
+static void
+drop_lazy_xref_stm(fz_context *ctx, pdf_lazy_xref_stm *stm)
+{
+	if (stm && --stm->refs == 0)
+	{
+		pdf_drop_obj(ctx, stm->dict);
+		fz_drop_buffer(ctx, stm->data);
+		fz_free(ctx, stm);
+	}
+}
+
+static void
+drop_lazy(fz_context *ctx, pdf_xref_lazy *lazy)
+{
+	if (lazy)
+	{
+		drop_lazy_xref_stm(ctx, lazy->stm);
+		fz_free(ctx, lazy);
+	}
+}
+
+/* Read len classic xref table entries for objects ofs onwards from file. */
+static void
+pdf_read_old_xref_entries(fz_context *ctx, pdf_document *doc, fz_stream *file, pdf_xref_entry *table, fz_off_t ofs, int len, char *scratch)
+{
+	fz_off_t i;
+	size_t n;
+	char *s;
+	int carried;
+
+	/* Xref entries SHOULD be 20 bytes long, but we see 19 byte
+	 * ones more frequently than we'd like (e.g. PCLm drivers).
+	 * Cope with this by 'carrying' data forward. */
+	carried = 0;
+	for (i = ofs; i < ofs + len; i++)
+	{
+		pdf_xref_entry *entry = &table[i-ofs];
+		n = fz_read(ctx, file, (unsigned char *) scratch + carried, 20-carried);
+		if (n != 20-carried)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected EOF in xref table");
+		n += carried;
+		if (!entry->type)
+		{
+			s = scratch;
+
+			/* broken pdfs where line start with white space */
+			while (*s != '\0' && iswhite(*s))
+				s++;
+
+			entry->ofs = fz_atoo(s);
+			entry->gen = fz_atoi(s + 11);
+			entry->num = (int)i;
+			entry->type = s[17];
+			if (s[17] != 'f' && s[17] != 'n' && s[17] != 'o')
+				fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected xref type: %#x (%d %d R)", s[17], entry->num, entry->gen);
+			/* If the last byte of our buffer isn't an EOL (or space), carry one byte forward */
+			carried = s[19] > 32;
+			if (carried)
+				s[0] = s[19];
+			/* When loading lazily, offsets are not checked up front */
+			if (doc->lazy_xref && entry->type == 'n' && entry->ofs == 0)
+				entry->type = 'f';
+		}
+	}
+	if (carried)
+		fz_unread_byte(ctx, file);
+}
+
+/* Parse a well formed 20 byte classic xref entry. Returns 0 if the
+ * entry is not exactly as the spec describes it. If entry is NULL,
+ * the data is only checked. */
+static int
+parse_old_xref_entry(const unsigned char *s, pdf_xref_entry *entry, int num)
+{
+	fz_off_t ofs = 0;
+	int gen = 0;
+	int k;
+
+	for (k = 0; k < 10; k++)
+	{
+		if (s[k] < '0' || s[k] > '9')
+			return 0;
+		ofs = ofs * 10 + s[k] - '0';
+	}
+	for (k = 11; k < 16; k++)
+	{
+		if (s[k] < '0' || s[k] > '9')
+			return 0;
+		gen = gen * 10 + s[k] - '0';
+	}
+	if (s[10] != ' ' || s[16] != ' ' || (s[17] != 'f' && s[17] != 'n') || !iswhite(s[18]) || !iswhite(s[19]))
+		return 0;
+
+	if (entry && !entry->type)
+	{
+		entry->ofs = ofs;
+		entry->gen = gen;
+		entry->num = num;
+		entry->type = s[17];
+		if (entry->type == 'n' && ofs == 0)
+			entry->type = 'f';
+	}
+	return 1;
+}
+
+static void
+read_lazy_old_entries(fz_context *ctx, pdf_document *doc, pdf_xref_subsec *sub, int first, int n)
+{
+	unsigned char data[LAZY_CHUNK * 20];
+	int i;
+
+	fz_seek(ctx, doc->file, sub->lazy->ofs + (fz_off_t)first * 20, SEEK_SET);
+	if (fz_read(ctx, doc->file, data, n * 20) != (size_t)n * 20)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected EOF in xref table");
+	for (i = 0; i < n; i++)
+		if (!parse_old_xref_entry(data + i * 20, &sub->table[first + i], (int)sub->start + first + i))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "malformed xref entry (%d 0 R)", (int)sub->start + first + i);
+}
+
+static void
+read_lazy_stm_entries(fz_context *ctx, pdf_document *doc, pdf_xref_subsec *sub, int first, int n)
+{
+	pdf_lazy_xref_stm *stm = sub->lazy->stm;
+	int w = stm->w0 + stm->w1 + stm->w2;
+	unsigned char *p;
+	size_t len;
+	int i, k;
+
+	if (!stm->data)
+	{
+		pdf_crypt *crypt = doc->crypt;
+		fz_stream *file = NULL;
+
+		if (stm->loading)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "xref stream refers to itself");
+
+		fz_var(file);
+
+		/* Xref streams are never encrypted. When we read them up front
+		 * the document has no crypt yet, so do the same here. */
+		stm->loading = 1;
+		doc->crypt = NULL;
+		fz_try(ctx)
+		{
+			file = pdf_open_stream_with_offset(ctx, doc, 0, stm->dict, stm->stm_ofs);
+			stm->data = fz_read_all(ctx, file, 0);
+		}
+		fz_always(ctx)
+		{
+			fz_drop_stream(ctx, file);
+			doc->crypt = crypt;
+			stm->loading = 0;
+		}
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+
+	len = fz_buffer_storage(ctx, stm->data, &p);
+	if ((size_t)sub->lazy->ofs + (size_t)(first + n) * w > len)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated xref stream");
+	p += sub->lazy->ofs + (size_t)first * w;
+
+	for (i = first; i < first + n; i++)
+	{
+		pdf_xref_entry *entry = &sub->table[i];
+		int a = 0;
+		fz_off_t b = 0;
+		int c = 0;
+		int t;
+
+		for (k = 0; k < stm->w0; k++)
+			a = (a << 8) + *p++;
+		for (k = 0; k < stm->w1; k++)
+			b = (b << 8) + *p++;
+		for (k = 0; k < stm->w2; k++)
+			c = (c << 8) + *p++;
+
+		if (!entry->type)
+		{
+			t = stm->w0 ? a : 1;
+			entry->type = t == 0 ? 'f' : t == 1 ? 'n' : t == 2 ? 'o' : 0;
+			entry->ofs = stm->w1 ? b : 0;
+			entry->gen = stm->w2 ? c : 0;
+			entry->num = (int)sub->start + i;
+			if (entry->type == 'n' && entry->ofs == 0)
+				entry->type = 'f';
+		}
+	}
+}
+
+/* Read a whole classic subsection with the same tolerant parser used
+ * when not loading lazily. Returns 0 on failure. */
+static int
+reread_lazy_subsection(fz_context *ctx, pdf_document *doc, pdf_xref_subsec *sub)
+{
+	char scratch[PDF_LEXBUF_SMALL];
+
+	if (sub->lazy->stm)
+		return 0;
+
+	memset(scratch, 0, sizeof scratch);
+	fz_try(ctx)
+	{
+		fz_seek(ctx, doc->file, sub->lazy->ofs, SEEK_SET);
+		pdf_read_old_xref_entries(ctx, doc, doc->file, sub->table, sub->start, sub->len, scratch);
+	}
+	fz_catch(ctx)
+		return 0;
+	return 1;
+}
+
+/* Load chunk c of a lazy subsection. This never throws; if the entries
+ * cannot be read they are left undefined, and we repair the file if an
+ * object turns out to be missing. */
+static void
+load_lazy_entries(fz_context *ctx, pdf_document *doc, pdf_xref_subsec *sub, int c)
+{
+	pdf_xref_lazy *lazy = sub->lazy;
+	int first = c * LAZY_CHUNK;
+	int n = fz_mini(LAZY_CHUNK, sub->len - first);
+	fz_off_t pos = -1;
+
+	/* Mark the chunk as loaded first, so that we cannot recurse into it */
+	lazy->loaded[c] = 1;
+	lazy->pending--;
+
+	fz_var(pos);
+
+	fz_try(ctx)
+	{
+		/* Leave the file where our caller expects it to be */
+		pos = fz_tell(ctx, doc->file);
+		if (lazy->stm)
+			read_lazy_stm_entries(ctx, doc, sub, first, n);
+		else
+			read_lazy_old_entries(ctx, doc, sub, first, n);
+	}
+	fz_catch(ctx)
+	{
+		if (!reread_lazy_subsection(ctx, doc, sub))
+		{
+			fz_warn(ctx, "ignoring broken xref entries (%d to %d)", (int)sub->start, (int)sub->start + sub->len - 1);
+			doc->lazy_xref_broken = 1;
+		}
+		lazy->pending = 0;
+	}
+
+	if (pos >= 0)
+	{
+		fz_try(ctx)
+			fz_seek(ctx, doc->file, pos, SEEK_SET);
+		fz_catch(ctx)
+			fz_warn(ctx, "cannot seek back after reading xref entries");
+	}
+
+	if (lazy->pending == 0)
+	{
+		drop_lazy(ctx, lazy);
+		sub->lazy = NULL;
+	}
+}
+
+static inline void
+ensure_lazy_entry(fz_context *ctx, pdf_document *doc, pdf_xref_subsec *sub, int num)
+{
+	if (sub->lazy)
+	{
+		int c = (num - (int)sub->start) / LAZY_CHUNK;
+		if (!sub->lazy->loaded[c])
+			load_lazy_entries(ctx, doc, sub, c);
+	}
+}
+
+static void
+ensure_lazy_subsection(fz_context *ctx, pdf_document *doc, pdf_xref_subsec *sub)
+{
+	int c;
+
+	for (c = 0; sub->lazy != NULL; c++)
+		if (!sub->lazy->loaded[c])
+			load_lazy_entries(ctx, doc, sub, c);
+}
+
 /*
  * xref tables
  */
@@ -43,6 +370,7 @@ static void pdf_drop_xref_sections(fz_context *ctx, pdf_document *doc)
 					fz_drop_buffer(ctx, entry->stm_buf);
 				}
 			}
+			drop_lazy(ctx, sub->lazy);
 			fz_free(ctx, sub->table);
 			fz_free(ctx, sub);
 			sub = next_sub;
@@ -166,6 +494,10 @@ ensure_solid_xref(fz_context *ctx, pdf_document *doc, int num, int which)
 	if (sub != NULL && sub->next == NULL && sub->start == 0 && sub->len >= num)
 		return;
 
+	/* The entries are about to move, so read any that we put off */
+	for (sub = xref->subsec; sub != NULL; sub = sub->next)
+		ensure_lazy_subsection(ctx, doc, sub);
+
 	new_sub = fz_malloc_struct(ctx, pdf_xref_subsec);
 	fz_try(ctx)
 	{
@@ -273,6 +605,7 @@ pdf_xref_entry *pdf_get_xref_entry(fz_context *ctx, pdf_document *doc, int i)
 				if (i < sub->start || i >= sub->start + sub->len)
 					continue;
 
+				ensure_lazy_entry(ctx, doc, sub, i);
 				entry = &sub->table[i - sub->start];
 				if (entry->type)
 				{
@@ -464,8 +797,12 @@ void pdf_xref_ensure_incremental_object(fz_context *ctx, pdf_document *doc, int
 			break;
 		for (sub = xref->subsec; sub != NULL; sub = sub->next)
 		{
-			if (sub->start <= num && num < sub->start + sub->len && sub->table[num - sub->start].type)
-				break;
+			if (sub->start <= num && num < sub->start + sub->len)
+			{
+				ensure_lazy_entry(ctx, doc, sub, num);
+				if (sub->table[num - sub->start].type)
+					break;
+			}
 		}
 		if (sub != NULL)
 			break;
@@ -514,6 +851,9 @@ void pdf_replace_xref(fz_context *ctx, pdf_document *doc, pdf_xref_entry *entrie
 		/* The new table completely replaces the previous separate sections */
 		pdf_drop_xref_sections(ctx, doc);
 
+		/* and may have renumbered the pages */
+		pdf_drop_page_tree(ctx, doc);
+
 		sub->table = entries;
 		sub->start = 0;
 		sub->len = n;
@@ -722,6 +1062,53 @@ pdf_xref_size_from_old_trailer(fz_context *ctx, pdf_document *doc, pdf_lexbuf *b
 	return size;
 }
 
+static pdf_xref_subsec *
+pdf_new_xref_subsection(fz_context *ctx, pdf_document *doc, fz_off_t ofs, int len)
+{
+	pdf_xref *xref = &doc->xref_sections[doc->num_xref_sections-1];
+	pdf_xref_subsec *sub;
+	int new_max;
+
+	new_max = xref->num_objects;
+	if (new_max < ofs + len)
+		new_max = ofs + len;
+
+	sub = fz_malloc_struct(ctx, pdf_xref_subsec);
+	fz_try(ctx)
+	{
+		sub->table = fz_calloc(ctx, len, sizeof(pdf_xref_entry));
+		sub->start = ofs;
+		sub->len = len;
+		sub->next = xref->subsec;
+		xref->subsec = sub;
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, sub);
+		fz_rethrow(ctx);
+	}
+	xref->num_objects = new_max;
+	if (doc->max_xref_len < new_max)
+		extend_xref_index(ctx, doc, new_max);
+	return sub;
+}
+
+/* Does a new subsection for objects ofs to ofs+len-1 overlap (or abut)
+ * any that the xref being populated already has? */
+static int
+pdf_xref_subsection_overlaps(fz_context *ctx, pdf_document *doc, fz_off_t ofs, int len)
+{
+	pdf_xref *xref = &doc->xref_sections[doc->num_xref_sections-1];
+	pdf_xref_subsec *sub;
+
+	if (ofs > xref->num_objects)
+		return 0;
+	for (sub = xref->subsec; sub != NULL; sub = sub->next)
+		if (ofs + len > sub->start && ofs <= sub->start + sub->len)
+			return 1;
+	return 0;
+}
+
 static pdf_xref_entry *
 pdf_xref_find_subsection(fz_context *ctx, pdf_document *doc, fz_off_t ofs, int len)
 {
@@ -736,43 +1123,36 @@ pdf_xref_find_subsection(fz_context *ctx, pdf_document *doc, fz_off_t ofs, int l
 	 * Case 3) We might have an overlapping one - Create a 'solid'
 	 * subsection and return that. */
 
+	/* Subsections usually come in order, so check whether this one
+	 * starts beyond all the ones we have before looking through them. */
+	if (ofs > xref->num_objects)
+		return pdf_new_xref_subsection(ctx, doc, ofs, len)->table;
+
 	/* Sanity check */
 	for (sub = xref->subsec; sub != NULL; sub = sub->next)
 	{
 		if (ofs >= sub->start && ofs + len <= sub->start + sub->len)
-			return &sub->table[ofs-sub->start]; /* Case 1 */
+		{
+			/* Case 1. The caller only fills in entries that are
+			 * not yet set, so read the ones we put off first. */
+			ensure_lazy_subsection(ctx, doc, sub);
+			return &sub->table[ofs-sub->start];
+		}
 		if (ofs + len > sub->start && ofs <= sub->start + sub->len)
 			break; /* Case 3 */
 	}
 
-	new_max = xref->num_objects;
-	if (new_max < ofs + len)
-		new_max = ofs + len;
-
 	if (sub == NULL)
 	{
 		/* Case 2 */
-		sub = fz_malloc_struct(ctx, pdf_xref_subsec);
-		fz_try(ctx)
-		{
-			sub->table = fz_calloc(ctx, len, sizeof(pdf_xref_entry));
-			sub->start = ofs;
-			sub->len = len;
-			sub->next = xref->subsec;
-			xref->subsec = sub;
-		}
-		fz_catch(ctx)
-		{
-			fz_free(ctx, sub);
-			fz_rethrow(ctx);
-		}
-		xref->num_objects = new_max;
-		if (doc->max_xref_len < new_max)
-			extend_xref_index(ctx, doc, new_max);
+		sub = pdf_new_xref_subsection(ctx, doc, ofs, len);
 	}
 	else
 	{
 		/* Case 3 */
+		new_max = xref->num_objects;
+		if (new_max < ofs + len)
+			new_max = ofs + len;
 		ensure_solid_xref(ctx, doc, new_max, doc->num_xref_sections-1);
 		xref = &doc->xref_sections[doc->num_xref_sections-1];
 		sub = xref->subsec;
@@ -780,6 +1160,38 @@ pdf_xref_find_subsection(fz_context *ctx, pdf_document *doc, fz_off_t ofs, int l
 	return &sub->table[ofs-sub->start];
 }
 
+/* Record a large classic subsection whose entries start at the current
+ * file position without reading it, if it is laid out exactly as the
+ * spec says (so that we can find any entry from its number). On success
+ * the file is left at the end of the subsection. */
+static int
+pdf_lazy_old_xref_subsection(fz_context *ctx, pdf_document *doc, fz_off_t ofs, int len)
+{
+	unsigned char entry[20];
+	pdf_xref_subsec *sub;
+	fz_off_t t;
+
+	if (len <= LAZY_CHUNK || pdf_xref_subsection_overlaps(ctx, doc, ofs, len))
+		return 0;
+
+	t = fz_tell(ctx, doc->file);
+	if (fz_read(ctx, doc->file, entry, 20) != 20 || !parse_old_xref_entry(entry, NULL, 0))
+	{
+		fz_seek(ctx, doc->file, t, SEEK_SET);
+		return 0;
+	}
+	fz_seek(ctx, doc->file, t + (fz_off_t)(len - 1) * 20, SEEK_SET);
+	if (fz_read(ctx, doc->file, entry, 20) != 20 || !parse_old_xref_entry(entry, NULL, 0))
+	{
+		fz_seek(ctx, doc->file, t, SEEK_SET);
+		return 0;
+	}
+
+	sub = pdf_new_xref_subsection(ctx, doc, ofs, len);
+	sub->lazy = new_lazy(ctx, len, t, NULL);
+	return 1;
+}
+
 static pdf_obj *
 pdf_read_old_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 {
@@ -788,13 +1200,10 @@ pdf_read_old_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 	fz_off_t ofs;
 	int len;
 	char *s;
-	size_t n;
 	pdf_token tok;
-	fz_off_t i;
 	int c;
 	int xref_len = pdf_xref_size_from_old_trailer(ctx, doc, buf);
 	pdf_xref_entry *table;
-	int carried;
 
 	fz_skip_space(ctx, doc->file);
 	if (fz_skip_string(ctx, doc->file, "xref"))
@@ -828,41 +1237,11 @@ pdf_read_old_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 			fz_warn(ctx, "broken xref section, proceeding anyway.");
 		}
 
-		table = pdf_xref_find_subsection(ctx, doc, ofs, len);
+		if (doc->lazy_xref && pdf_lazy_old_xref_subsection(ctx, doc, ofs, len))
+			continue;
 
-		/* Xref entries SHOULD be 20 bytes long, but we see 19 byte
-		 * ones more frequently than we'd like (e.g. PCLm drivers).
-		 * Cope with this by 'carrying' data forward. */
-		carried = 0;
-		for (i = ofs; i < ofs + len; i++)
-		{
-			pdf_xref_entry *entry = &table[i-ofs];
-			n = fz_read(ctx, file, (unsigned char *) buf->scratch + carried, 20-carried);
-			if (n != 20-carried)
-				fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected EOF in xref table");
-			n += carried;
-			if (!entry->type)
-			{
-				s = buf->scratch;
-
-				/* broken pdfs where line start with white space */
-				while (*s != '\0' && iswhite(*s))
-					s++;
-
-				entry->ofs = fz_atoo(s);
-				entry->gen = fz_atoi(s + 11);
-				entry->num = (int)i;
-				entry->type = s[17];
-				if (s[17] != 'f' && s[17] != 'n' && s[17] != 'o')
-					fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected xref type: %#x (%d %d R)", s[17], entry->num, entry->gen);
-				/* If the last byte of our buffer isn't an EOL (or space), carry one byte forward */
-				carried = s[19] > 32;
-				if (carried)
-					s[0] = s[19];
-			}
-		}
-		if (carried)
-			fz_unread_byte(ctx, file);
+		table = pdf_xref_find_subsection(ctx, doc, ofs, len);
+		pdf_read_old_xref_entries(ctx, doc, file, table, ofs, len, buf->scratch);
 	}
 
 	tok = pdf_lex(ctx, file, buf);
@@ -912,10 +1291,94 @@ pdf_read_new_xref_section(fz_context *ctx, pdf_document *doc, fz_stream *stm, fz
 			entry->ofs = w1 ? b : 0;
 			entry->gen = w2 ? c : 0;
 			entry->num = i;
+			/* When loading lazily, offsets are not checked up front */
+			if (doc->lazy_xref && entry->type == 'n' && entry->ofs == 0)
+				entry->type = 'f';
+		}
+	}
+
+	doc->has_xref_streams = 1;
+}
+
+static void
+xref_stream_subsection(fz_context *ctx, pdf_obj *index, int size, int t, int *i0, int *i1)
+{
+	if (index)
+	{
+		*i0 = pdf_to_int(ctx, pdf_array_get(ctx, index, 2*t + 0));
+		*i1 = pdf_to_int(ctx, pdf_array_get(ctx, index, 2*t + 1));
+	}
+	else
+	{
+		*i0 = 0;
+		*i1 = size;
+	}
+}
+
+/* Record the subsections of a large xref stream without decompressing
+ * it, if none of them overlap each other or ones we already have.
+ * Streams made of many small subsections (as incremental updates often
+ * are) are not worth deferring, so are read as usual. */
+static int
+pdf_lazy_xref_stream(fz_context *ctx, pdf_document *doc, pdf_obj *dict, fz_off_t stm_ofs, pdf_obj *index, int size, int w0, int w1, int w2)
+{
+	pdf_lazy_xref_stm *stm;
+	int n = index ? pdf_array_len(ctx, index) / 2 : 1;
+	int w = w0 + w1 + w2;
+	int total = 0;
+	fz_off_t data_ofs;
+	int i0, i1, j0, j1;
+	int t, u;
+
+	if (w == 0 || n > LAZY_MAX_SUBSECTIONS)
+		return 0;
+	for (t = 0; t < n; t++)
+	{
+		xref_stream_subsection(ctx, index, size, t, &i0, &i1);
+		if (i0 < 0 || i1 < 0 || i0 > INT_MAX - i1)
+			return 0;
+		if (pdf_xref_subsection_overlaps(ctx, doc, i0, i1))
+			return 0;
+		for (u = 0; u < t; u++)
+		{
+			xref_stream_subsection(ctx, index, size, u, &j0, &j1);
+			if (i0 + i1 > j0 && i0 <= j0 + j1)
+				return 0;
 		}
+		total += fz_mini(i1, INT_MAX - total);
 	}
+	if (total <= LAZY_CHUNK)
+		return 0;
+
+	stm = fz_malloc_struct(ctx, pdf_lazy_xref_stm);
+	stm->refs = 1;
+	stm->dict = pdf_keep_obj(ctx, dict);
+	stm->stm_ofs = stm_ofs;
+	stm->w0 = w0;
+	stm->w1 = w1;
+	stm->w2 = w2;
+
+	fz_try(ctx)
+	{
+		data_ofs = 0;
+		for (t = 0; t < n; t++)
+		{
+			xref_stream_subsection(ctx, index, size, t, &i0, &i1);
+			if (i1 > 0)
+			{
+				pdf_xref_subsec *sub = pdf_new_xref_subsection(ctx, doc, i0, i1);
+				sub->lazy = new_lazy(ctx, i1, data_ofs, stm);
+			}
+			data_ofs += (fz_off_t)i1 * w;
+		}
+	}
+	fz_always(ctx)
+		drop_lazy_xref_stm(ctx, stm);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
 	doc->has_xref_streams = 1;
+	return 1;
 }
 
 /* Entered with file locked, remains locked throughout. */
@@ -975,20 +1438,27 @@ pdf_read_new_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 
 		index = pdf_dict_get(ctx, trailer, PDF_NAME_Index);
 
-		stm = pdf_open_stream_with_offset(ctx, doc, num, trailer, stm_ofs);
-
-		if (!index)
+		if (doc->lazy_xref && pdf_lazy_xref_stream(ctx, doc, trailer, stm_ofs, index, size, w0, w1, w2))
 		{
-			pdf_read_new_xref_section(ctx, doc, stm, 0, size, w0, w1, w2);
+			/* The entries will be read when they are needed */
 		}
 		else
 		{
-			int n = pdf_array_len(ctx, index);
-			for (t = 0; t < n; t += 2)
+			stm = pdf_open_stream_with_offset(ctx, doc, num, trailer, stm_ofs);
+
+			if (!index)
 			{
-				int i0 = pdf_to_int(ctx, pdf_array_get(ctx, index, t + 0));
-				int i1 = pdf_to_int(ctx, pdf_array_get(ctx, index, t + 1));
-				pdf_read_new_xref_section(ctx, doc, stm, i0, i1, w0, w1, w2);
+				pdf_read_new_xref_section(ctx, doc, stm, 0, size, w0, w1, w2);
+			}
+			else
+			{
+				int n = pdf_array_len(ctx, index);
+				for (t = 0; t < n; t += 2)
+				{
+					int i0 = pdf_to_int(ctx, pdf_array_get(ctx, index, t + 0));
+					int i1 = pdf_to_int(ctx, pdf_array_get(ctx, index, t + 1));
+					pdf_read_new_xref_section(ctx, doc, stm, i0, i1, w0, w1, w2);
+				}
 			}
 		}
 		entry = pdf_get_populating_xref_entry(ctx, doc, num);
@@ -1153,7 +1623,14 @@ pdf_prime_xref_index(fz_context *ctx, pdf_document *doc)
 		{
 			int start = subsec->start;
 			int end = subsec->start + subsec->len;
-			for (j = start; j < end; j++)
+			if (subsec->lazy)
+			{
+				/* We don't know which of these are defined here
+				 * yet, so make lookups start their search here. */
+				for (j = start; j < end; j++)
+					idx[j] = i;
+			}
+			else for (j = start; j < end; j++)
 			{
 				char t = subsec->table[j-start].type;
 				if (t != 0 && t != 'f')
@@ -1180,6 +1657,7 @@ pdf_load_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 
 	pdf_read_start_xref(ctx, doc);
 
+	doc->lazy_xref = fz_lazy_loading(ctx);
 	pdf_read_xref_sections(ctx, doc, doc->startxref, buf, 1);
 
 	if (pdf_xref_len(ctx, doc) == 0)
@@ -1199,6 +1677,11 @@ pdf_load_xref(fz_context *ctx, pdf_document *doc, pdf_lexbuf *buf)
 	else if (entry->type != 'f')
 		fz_warn(ctx, "first object in xref is not free");
 
+	/* When loading lazily, entries are checked as they are read, and
+	 * objects that are not where the xref says trigger a repair then. */
+	if (doc->lazy_xref)
+		return;
+
 	/* broken pdfs where object offsets are out of range */
 	xref_len = pdf_xref_len(ctx, doc);
 	for (i = 0; i < xref_len; i++)
@@ -1467,6 +1950,7 @@ pdf_drop_document_imp(fz_context *ctx, pdf_document *doc)
 
 			fz_free(ctx, doc->linear_page_refs);
 		}
+		pdf_drop_page_tree(ctx, doc);
 		fz_free(ctx, doc->hint_page);
 		fz_free(ctx, doc->hint_shared_ref);
 		fz_free(ctx, doc->hint_shared);
@@ -1495,6 +1979,8 @@ pdf_drop_document_imp(fz_context *ctx, pdf_document *doc)
 	fz_always(ctx)
 	{
 		fz_defer_reap_end(ctx);
+		pdf_drop_name_table(ctx, doc);
+		pdf_drop_obj_arena(ctx, doc->obj_arena);
 	}
 	fz_catch(ctx)
 		fz_rethrow(ctx);
@@ -1528,6 +2014,45 @@ pdf_print_xref(fz_context *ctx, pdf_document *doc)
  * compressed object streams
  */
 
+/*
+ * Store obj, found as object onum in object stream num, in the xref.
+ * Takes ownership of obj. Returns the entry if it belongs to that
+ * object stream.
+ */
+static pdf_xref_entry *
+pdf_install_obj_stm_obj(fz_context *ctx, pdf_document *doc, int num, int onum, pdf_obj *obj)
+{
+	pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, onum);
+
+	pdf_set_obj_parent(ctx, obj, onum);
+
+	if (entry->type != 'o' || entry->ofs != num)
+	{
+		pdf_drop_obj(ctx, obj);
+		return NULL;
+	}
+
+	/* If we already have an entry for this object,
+	 * we'd like to drop it and use the new one -
+	 * but this means that anyone currently holding
+	 * a pointer to the old one will be left with a
+	 * stale pointer. Instead, we drop the new one
+	 * and trust that the old one is correct. */
+	if (entry->obj)
+	{
+		if (pdf_objcmp(ctx, entry->obj, obj))
+			fz_warn(ctx, "Encountered new definition for object %d - keeping the original one", onum);
+		pdf_drop_obj(ctx, obj);
+	}
+	else
+	{
+		entry->obj = obj;
+		fz_drop_buffer(ctx, entry->stm_buf);
+		entry->stm_buf = NULL;
+	}
+	return entry;
+}
+
 static pdf_xref_entry *
 pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, int target)
 {
@@ -1593,37 +2118,9 @@ pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, i
 				fz_throw(ctx, FZ_ERROR_GENERIC, "object id (%d 0 R) out of range (0..%d)", numbuf[i], xref_len - 1);
 			}
 
-			entry = pdf_get_xref_entry(ctx, doc, numbuf[i]);
-
-			pdf_set_obj_parent(ctx, obj, numbuf[i]);
-
-			if (entry->type == 'o' && entry->ofs == num)
-			{
-				/* If we already have an entry for this object,
-				 * we'd like to drop it and use the new one -
-				 * but this means that anyone currently holding
-				 * a pointer to the old one will be left with a
-				 * stale pointer. Instead, we drop the new one
-				 * and trust that the old one is correct. */
-				if (entry->obj)
-				{
-					if (pdf_objcmp(ctx, entry->obj, obj))
-						fz_warn(ctx, "Encountered new definition for object %d - keeping the original one", numbuf[i]);
-					pdf_drop_obj(ctx, obj);
-				}
-				else
-				{
-					entry->obj = obj;
-					fz_drop_buffer(ctx, entry->stm_buf);
-					entry->stm_buf = NULL;
-				}
-				if (numbuf[i] == target)
-					ret_entry = entry;
-			}
-			else
-			{
-				pdf_drop_obj(ctx, obj);
-			}
+			entry = pdf_install_obj_stm_obj(ctx, doc, num, numbuf[i], obj);
+			if (entry && numbuf[i] == target)
+				ret_entry = entry;
 		}
 	}
 	fz_always(ctx)
@@ -1640,6 +2137,268 @@ pdf_load_obj_stm(fz_context *ctx, pdf_document *doc, int num, pdf_lexbuf *buf, i
 	return ret_entry;
 }
 
+/*
+ * Object streams can be inflated and parsed on a thread pool ahead of
+ * time. Everything that touches the file or the xref (loading the
+ * stream dictionaries, reading and decrypting the raw data, storing the
+ * objects) happens on the calling thread; the jobs only decode and
+ * parse, and object creation is safe to do from several threads at
+ * once. Any stream that fails in a job is left for pdf_load_obj_stm to
+ * load (and report) on demand, so the outcome is the same either way.
+ */
+
+typedef struct
+{
+	pdf_document *doc;
+	int num;
+	pdf_obj *dict;
+	fz_buffer *raw;
+	int count;
+	int first;
+	int parsed;
+	int *numbuf;
+	pdf_obj **objs;
+} obj_stm_job;
+
+/* Filters that need neither the xref nor the crypt handler to decode. */
+static int
+is_simple_filter(fz_context *ctx, pdf_obj *f)
+{
+	return pdf_name_eq(ctx, f, PDF_NAME_FlateDecode) || pdf_name_eq(ctx, f, PDF_NAME_Fl) ||
+		pdf_name_eq(ctx, f, PDF_NAME_LZWDecode) || pdf_name_eq(ctx, f, PDF_NAME_LZW) ||
+		pdf_name_eq(ctx, f, PDF_NAME_ASCIIHexDecode) || pdf_name_eq(ctx, f, PDF_NAME_AHx) ||
+		pdf_name_eq(ctx, f, PDF_NAME_ASCII85Decode) || pdf_name_eq(ctx, f, PDF_NAME_A85) ||
+		pdf_name_eq(ctx, f, PDF_NAME_RunLengthDecode) || pdf_name_eq(ctx, f, PDF_NAME_RL);
+}
+
+static int
+is_direct_params(fz_context *ctx, pdf_obj *p)
+{
+	int i, n;
+	if (pdf_is_indirect(ctx, p))
+		return 0;
+	n = pdf_dict_len(ctx, p);
+	for (i = 0; i < n; i++)
+		if (pdf_is_indirect(ctx, pdf_dict_get_val(ctx, p, i)))
+			return 0;
+	return 1;
+}
+
+/*
+ * Decoding in a job must not resolve any indirect objects, so only
+ * prefetch streams whose filters and parameters are all direct.
+ */
+static int
+can_prefetch_obj_stm(fz_context *ctx, pdf_obj *dict)
+{
+	pdf_obj *filters = pdf_dict_geta(ctx, dict, PDF_NAME_Filter, PDF_NAME_F);
+	pdf_obj *params = pdf_dict_geta(ctx, dict, PDF_NAME_DecodeParms, PDF_NAME_DP);
+	int i, n;
+
+	if (pdf_is_indirect(ctx, filters) || pdf_is_indirect(ctx, params))
+		return 0;
+	if (pdf_is_name(ctx, filters))
+		return is_simple_filter(ctx, filters) && is_direct_params(ctx, params);
+	n = pdf_array_len(ctx, filters);
+	for (i = 0; i < n; i++)
+	{
+		pdf_obj *f = pdf_array_get(ctx, filters, i);
+		if (pdf_is_indirect(ctx, f) || !is_simple_filter(ctx, f))
+			return 0;
+		if (!is_direct_params(ctx, pdf_array_get(ctx, params, i)))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+parse_obj_stm_job(fz_context *ctx, void *arg)
+{
+	obj_stm_job *job = arg;
+	pdf_lexbuf_large lb;
+	fz_stream *raw = NULL;
+	fz_stream *stm = NULL;
+	fz_buffer *data = NULL;
+	fz_off_t *ofsbuf = NULL;
+	int i;
+
+	fz_var(raw);
+	fz_var(stm);
+	fz_var(data);
+	fz_var(ofsbuf);
+
+	pdf_lexbuf_init(ctx, &lb.base, PDF_LEXBUF_LARGE);
+	fz_try(ctx)
+	{
+		raw = fz_open_buffer(ctx, job->raw);
+		stm = pdf_open_inline_stream(ctx, job->doc, job->dict, fz_buffer_storage(ctx, job->raw, NULL), raw, NULL);
+		data = fz_read_all(ctx, stm, 0);
+		fz_drop_stream(ctx, stm);
+		stm = NULL;
+		stm = fz_open_buffer(ctx, data);
+
+		job->numbuf = fz_calloc(ctx, job->count, sizeof(*job->numbuf));
+		job->objs = fz_calloc(ctx, job->count, sizeof(*job->objs));
+		ofsbuf = fz_calloc(ctx, job->count, sizeof(*ofsbuf));
+
+		for (i = 0; i < job->count; i++)
+		{
+			if (pdf_lex(ctx, stm, &lb.base) != PDF_TOK_INT)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt object stream (%d 0 R)", job->num);
+			job->numbuf[i] = lb.base.i;
+			if (pdf_lex(ctx, stm, &lb.base) != PDF_TOK_INT)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt object stream (%d 0 R)", job->num);
+			ofsbuf[i] = lb.base.i;
+		}
+
+		for (i = 0; i < job->count; i++)
+		{
+			fz_seek(ctx, stm, job->first + ofsbuf[i], SEEK_SET);
+			job->objs[i] = pdf_parse_stm_obj(ctx, job->doc, stm, &lb.base);
+			job->parsed = i + 1;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		fz_drop_stream(ctx, raw);
+		fz_drop_buffer(ctx, data);
+		fz_free(ctx, ofsbuf);
+		pdf_lexbuf_fin(ctx, &lb.base);
+	}
+	fz_catch(ctx)
+	{
+		/* Leave the rest to pdf_load_obj_stm, which will say what went wrong. */
+	}
+}
+
+static void
+drop_obj_stm_job(fz_context *ctx, obj_stm_job *job)
+{
+	int i;
+	for (i = 0; i < job->parsed; i++)
+		pdf_drop_obj(ctx, job->objs[i]);
+	fz_free(ctx, job->objs);
+	fz_free(ctx, job->numbuf);
+	fz_drop_buffer(ctx, job->raw);
+	pdf_drop_obj(ctx, job->dict);
+	memset(job, 0, sizeof *job);
+}
+
+/* Read what a job needs from the file. Returns 0 to leave the stream to be loaded on demand. */
+static int
+prepare_obj_stm_job(fz_context *ctx, pdf_document *doc, int num, obj_stm_job *job)
+{
+	job->doc = doc;
+	job->num = num;
+	fz_try(ctx)
+	{
+		job->dict = pdf_load_object(ctx, doc, num);
+		job->count = pdf_to_int(ctx, pdf_dict_get(ctx, job->dict, PDF_NAME_N));
+		job->first = pdf_to_int(ctx, pdf_dict_get(ctx, job->dict, PDF_NAME_First));
+		if (job->count > 0 && job->first >= 0 && can_prefetch_obj_stm(ctx, job->dict))
+			job->raw = pdf_load_raw_stream_number(ctx, doc, num);
+	}
+	fz_catch(ctx)
+	{
+		if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
+		{
+			drop_obj_stm_job(ctx, job);
+			fz_rethrow(ctx);
+		}
+	}
+	if (!job->raw)
+	{
+		drop_obj_stm_job(ctx, job);
+		return 0;
+	}
+	return 1;
+}
+
+/* Store the objects parsed by a job, stopping where pdf_load_obj_stm would have thrown. */
+static void
+publish_obj_stm_job(fz_context *ctx, pdf_document *doc, obj_stm_job *job)
+{
+	int xref_len = pdf_xref_len(ctx, doc);
+	int i;
+
+	for (i = 0; i < job->parsed; i++)
+	{
+		pdf_obj *obj = job->objs[i];
+		int onum = job->numbuf[i];
+		if (onum <= 0 || onum >= xref_len)
+			break;
+		job->objs[i] = NULL;
+		pdf_install_obj_stm_obj(ctx, doc, job->num, onum, obj);
+	}
+}
+
+void
+pdf_prefetch_obj_stms(fz_context *ctx, pdf_document *doc, fz_thread_pool *pool)
+{
+	obj_stm_job *jobs = NULL;
+	unsigned char *seen = NULL;
+	int *stms = NULL;
+	int nstms = 0;
+	int batch, xref_len;
+	int i, k, n;
+
+	if (!doc || !pool)
+		return;
+
+	fz_var(jobs);
+	fz_var(seen);
+	fz_var(stms);
+	fz_var(n);
+
+	xref_len = pdf_xref_len(ctx, doc);
+	batch = 16 * (fz_thread_pool_size(ctx, pool) + 1);
+	n = 0;
+
+	fz_try(ctx)
+	{
+		/* Find the object streams that still hold unloaded objects. */
+		seen = fz_calloc(ctx, xref_len, 1);
+		stms = fz_calloc(ctx, xref_len, sizeof(*stms));
+		for (i = 1; i < xref_len; i++)
+		{
+			pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, i);
+			if (entry->type == 'o' && !entry->obj && entry->ofs > 0 && entry->ofs < xref_len && !seen[entry->ofs])
+			{
+				seen[entry->ofs] = 1;
+				stms[nstms++] = entry->ofs;
+			}
+		}
+
+		jobs = fz_calloc(ctx, batch, sizeof(*jobs));
+		for (k = 0; k < nstms; k += batch)
+		{
+			for (i = k; i < nstms && i < k + batch; i++)
+				if (prepare_obj_stm_job(ctx, doc, stms[i], &jobs[n]))
+					n++;
+			for (i = 0; i < n; i++)
+				fz_thread_pool_submit(ctx, pool, parse_obj_stm_job, &jobs[i]);
+			fz_thread_pool_wait(ctx, pool);
+			for (i = 0; i < n; i++)
+				publish_obj_stm_job(ctx, doc, &jobs[i]);
+			while (n > 0)
+				drop_obj_stm_job(ctx, &jobs[--n]);
+		}
+	}
+	fz_always(ctx)
+	{
+		while (n > 0)
+			drop_obj_stm_job(ctx, &jobs[--n]);
+		fz_free(ctx, jobs);
+		fz_free(ctx, stms);
+		fz_free(ctx, seen);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
 /*
  * object loading
  */
@@ -1964,6 +2723,14 @@ object_updated:
 	{
 		fz_throw(ctx, FZ_ERROR_TRYLATER, "cannot find object in xref (%d 0 R) - not loaded yet?", num);
 	}
+	else if (doc->lazy_xref_broken && !doc->repair_attempted)
+	{
+		/* Part of the xref we put off reading turned out to be
+		 * broken, so this object may well be there after all. */
+		pdf_repair_xref(ctx, doc);
+		pdf_prime_xref_index(ctx, doc);
+		goto object_updated;
+	}
 	else
 	{
 		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find object in xref (%d 0 R)", num);
@@ -2199,6 +2966,7 @@ pdf_new_document(fz_context *ctx, fz_stream *file)
 
 	pdf_lexbuf_init(ctx, &doc->lexbuf.base, PDF_LEXBUF_LARGE);
 	doc->file = fz_keep_stream(ctx, file);
+	doc->name_table_id = fz_gen_id(ctx);
 
 	return doc;
 }
@@ -0,0 +1,291 @@
+/*
+ * arenatest -- check that arena allocated objects survive their document
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/pdf.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+	With pdf_enable_obj_arena, objects made for a document come from
+	pages owned by the document. Objects still held when the document
+	is dropped must stay valid, including when they grow, and all the
+	memory must be returned once the last of them is dropped. Blocks
+	are counted through the allocator to see that it is.
+
+	An interned name is kept more times than its 16 bit reference
+	count can hold. It must become permanent, rather than wrap and
+	be freed while still in use.
+
+		make check
+*/
+
+static int failed = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "arenatest: %s\n", what);
+		failed = 1;
+	}
+}
+
+/* Allocator counting live blocks */
+
+static int live_blocks = 0;
+
+static void *count_malloc(void *opaque, size_t size)
+{
+	void *p = malloc(size);
+	if (p)
+		live_blocks++;
+	return p;
+}
+
+static void *count_realloc(void *opaque, void *old, size_t size)
+{
+	void *p;
+	if (old == NULL)
+		return count_malloc(opaque, size);
+	if (size == 0)
+	{
+		free(old);
+		live_blocks--;
+		return NULL;
+	}
+	p = realloc(old, size);
+	return p;
+}
+
+static void count_free(void *opaque, void *p)
+{
+	if (p)
+		live_blocks--;
+	free(p);
+}
+
+static fz_alloc_context count_alloc =
+{
+	NULL, count_malloc, count_realloc, count_free
+};
+
+/* Objects */
+
+#define OBJECTS 5000
+#define KEEP_EVERY 7
+#define GROW 100
+
+static pdf_obj *new_item(fz_context *ctx, pdf_document *doc, int i)
+{
+	pdf_obj *dict = pdf_new_dict(ctx, doc, 4);
+	pdf_obj *kids;
+	char buf[32];
+
+	fz_try(ctx)
+	{
+		pdf_dict_puts_drop(ctx, dict, "Index", pdf_new_int(ctx, doc, i));
+		fz_snprintf(buf, sizeof buf, "F%d", i % 64);
+		pdf_dict_puts_drop(ctx, dict, "Name", pdf_new_name(ctx, doc, buf));
+		fz_snprintf(buf, sizeof buf, "object %d", i);
+		pdf_dict_puts_drop(ctx, dict, "Str", pdf_new_string(ctx, doc, buf, strlen(buf)));
+		kids = pdf_new_array(ctx, doc, 3);
+		pdf_dict_puts_drop(ctx, dict, "Kids", kids);
+		pdf_array_push_drop(ctx, kids, pdf_new_int(ctx, doc, i));
+		pdf_array_push_drop(ctx, kids, pdf_new_int(ctx, doc, i + 1));
+		pdf_array_push_drop(ctx, kids, pdf_new_int(ctx, doc, i + 2));
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_obj(ctx, dict);
+		fz_rethrow(ctx);
+	}
+	return dict;
+}
+
+static int item_is(fz_context *ctx, pdf_obj *dict, int i)
+{
+	pdf_obj *kids = pdf_dict_gets(ctx, dict, "Kids");
+	char buf[32];
+
+	fz_snprintf(buf, sizeof buf, "object %d", i);
+	return pdf_to_int(ctx, pdf_dict_gets(ctx, dict, "Index")) == i &&
+		!strcmp(pdf_to_str_buf(ctx, pdf_dict_gets(ctx, dict, "Str")), buf) &&
+		pdf_is_name(ctx, pdf_dict_gets(ctx, dict, "Name")) &&
+		pdf_array_len(ctx, kids) == 3 &&
+		pdf_to_int(ctx, pdf_array_get(ctx, kids, 2)) == i + 2;
+}
+
+static void test_keep_past_document(fz_context *ctx)
+{
+	pdf_document *doc = NULL;
+	pdf_obj *kept[OBJECTS / KEEP_EVERY + 1] = { NULL };
+	pdf_obj *parsed = NULL;
+	pdf_obj *obj = NULL;
+	pdf_obj *name = NULL;
+	int baseline = live_blocks;
+	int nkept = 0;
+	char key[16];
+	int i, ok;
+
+	fz_var(doc);
+	fz_var(parsed);
+	fz_var(obj);
+	fz_var(name);
+	fz_var(nkept);
+
+	fz_try(ctx)
+	{
+		doc = pdf_create_document(ctx);
+		pdf_enable_obj_arena(ctx, doc);
+
+		/* Drop most objects while the arena lives, so later ones reuse their blocks. */
+		for (i = 0; i < OBJECTS; i++)
+		{
+			obj = new_item(ctx, doc, i);
+			if (i % KEEP_EVERY == 0)
+				kept[nkept++] = obj;
+			else
+				pdf_drop_obj(ctx, obj);
+			obj = NULL;
+		}
+		parsed = pdf_new_obj_from_str(ctx, doc, "<</Type/Page/MediaBox[0 0 612 792]/Contents(text)>>");
+
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+
+		ok = 1;
+		for (i = 0; i < nkept; i++)
+			ok &= item_is(ctx, kept[i], i * KEEP_EVERY);
+		check(ok, "kept objects changed when their document was dropped");
+		check(pdf_to_int(ctx, pdf_array_get(ctx, pdf_dict_gets(ctx, parsed, "MediaBox"), 3)) == 792 &&
+			!strcmp(pdf_to_str_buf(ctx, pdf_dict_gets(ctx, parsed, "Contents")), "text"),
+			"parsed object changed when its document was dropped");
+
+		/* Grow the item arrays of kept objects now that the arena is dead.
+		 * New objects cannot name the dropped document. */
+		for (i = 0; i < GROW; i++)
+		{
+			pdf_array_push_drop(ctx, pdf_dict_gets(ctx, kept[1], "Kids"), pdf_new_int(ctx, NULL, i));
+			fz_snprintf(key, sizeof key, "K%d", i);
+			name = pdf_new_name(ctx, NULL, key);
+			pdf_dict_put_drop(ctx, parsed, name, pdf_new_int(ctx, NULL, i));
+			pdf_drop_obj(ctx, name);
+			name = NULL;
+		}
+		ok = pdf_array_len(ctx, pdf_dict_gets(ctx, kept[1], "Kids")) == 3 + GROW;
+		ok &= pdf_to_int(ctx, pdf_array_get(ctx, pdf_dict_gets(ctx, kept[1], "Kids"), 3 + GROW - 1)) == GROW - 1;
+		ok &= pdf_dict_len(ctx, parsed) == 3 + GROW;
+		ok &= pdf_to_int(ctx, pdf_dict_gets(ctx, parsed, "K42")) == 42;
+		ok &= pdf_to_int(ctx, pdf_dict_gets(ctx, kept[1], "Index")) == KEEP_EVERY;
+		check(ok, "kept objects cannot grow once their document is dropped");
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(ctx, obj);
+		pdf_drop_obj(ctx, name);
+		pdf_drop_obj(ctx, parsed);
+		for (i = 0; i < nkept; i++)
+			pdf_drop_obj(ctx, kept[i]);
+		pdf_drop_document(ctx, doc);
+	}
+	fz_catch(ctx)
+	{
+		check(0, fz_caught_message(ctx));
+		return;
+	}
+
+	check(live_blocks == baseline, "memory is not released when the last kept object is dropped");
+}
+
+static void test_drop_before_document(fz_context *ctx)
+{
+	pdf_document *doc = NULL;
+	pdf_obj *obj = NULL;
+	int baseline = live_blocks;
+	int i;
+
+	fz_var(doc);
+	fz_var(obj);
+
+	fz_try(ctx)
+	{
+		doc = pdf_create_document(ctx);
+		pdf_enable_obj_arena(ctx, doc);
+		for (i = 0; i < OBJECTS; i++)
+		{
+			obj = new_item(ctx, doc, i);
+			check(item_is(ctx, obj, i), "arena object does not hold its values");
+			pdf_drop_obj(ctx, obj);
+			obj = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(ctx, obj);
+		pdf_drop_document(ctx, doc);
+	}
+	fz_catch(ctx)
+	{
+		check(0, fz_caught_message(ctx));
+		return;
+	}
+
+	check(live_blocks == baseline, "memory is not released when the document is dropped");
+}
+
+static void test_name_refs(fz_context *ctx)
+{
+	pdf_document *doc = NULL;
+	pdf_obj *name = NULL;
+	pdf_obj *again = NULL;
+	int i;
+
+	fz_var(doc);
+	fz_var(name);
+	fz_var(again);
+
+	fz_try(ctx)
+	{
+		doc = pdf_create_document(ctx);
+		name = pdf_new_name(ctx, doc, "Interned");
+		for (i = 0; i < 70000; i++)
+			pdf_keep_obj(ctx, name);
+		for (i = 0; i < 70000; i++)
+			pdf_drop_obj(ctx, name);
+		again = pdf_new_name(ctx, doc, "Interned");
+		check(again == name, "interned name not shared after many references");
+		check(!strcmp(pdf_to_name(ctx, name), "Interned"), "interned name freed by reference count wrapping");
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(ctx, again);
+		pdf_drop_obj(ctx, name);
+		pdf_drop_document(ctx, doc);
+	}
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+
+	ctx = fz_new_context(&count_alloc, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "arenatest: cannot create context\n");
+		return 1;
+	}
+
+	test_drop_before_document(ctx);
+	test_keep_past_document(ctx);
+	test_name_refs(ctx);
+
+	fz_drop_context(ctx);
+
+	fprintf(stderr, "arenatest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
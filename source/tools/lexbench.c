@@ -0,0 +1,295 @@
+/*
+ * lexbench -- time the PDF lexer on real content streams
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/pdf.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+/*
+	The content streams of the requested pages of each file are decoded
+	into memory once, and then tokenised repeatedly with pdf_lex. The
+	time taken, the number of tokens and bytes per second, and a digest
+	of the token stream (types, numbers, names and strings) are printed.
+
+	To compare two versions of the lexer, build both and run them on the
+	same files; the digests must match:
+
+		build/old/lexbench -n 20 maps.pdf drawings.pdf
+		build/release/lexbench -n 20 maps.pdf drawings.pdf
+
+	Large vector drawings (maps, CAD output, charts) make the best test
+	files, as their content streams are mostly numbers and operators.
+*/
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: lexbench [options] file.pdf [pages]\n"
+		"\t-p -\tpassword\n"
+		"\t-n -\tnumber of times to lex each stream (default: 10)\n"
+		"\t-1\tread the streams one byte per buffer refill, to exercise\n"
+		"\t\tthe slow paths (the digests must not change)\n"
+		);
+	exit(1);
+}
+
+static double gettime(void)
+{
+#ifdef _MSC_VER
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000 / freq.QuadPart;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+#endif
+}
+
+typedef struct
+{
+	unsigned char *data, *end;
+	unsigned char buf[1];
+} trickle_state;
+
+static int
+next_trickle(fz_context *ctx, fz_stream *stm, size_t max)
+{
+	trickle_state *state = stm->state;
+	if (state->data == state->end)
+		return EOF;
+	state->buf[0] = *state->data++;
+	stm->rp = state->buf;
+	stm->wp = state->buf + 1;
+	stm->pos++;
+	return *stm->rp++;
+}
+
+static void
+drop_trickle(fz_context *ctx, void *state)
+{
+	fz_free(ctx, state);
+}
+
+static fz_stream *
+open_trickle(fz_context *ctx, fz_buffer *buf)
+{
+	trickle_state *state = fz_malloc_struct(ctx, trickle_state);
+	size_t len = fz_buffer_storage(ctx, buf, &state->data);
+	state->end = state->data + len;
+	return fz_new_stream(ctx, state, next_trickle, drop_trickle);
+}
+
+static void
+lex_stream(fz_context *ctx, fz_stream *stm, pdf_lexbuf *lb, fz_md5 *md5, int *count)
+{
+	int tok;
+	do
+	{
+		unsigned char t;
+		tok = pdf_lex(ctx, stm, lb);
+		(*count)++;
+		if (!md5)
+			continue;
+		t = tok;
+		fz_md5_update(md5, &t, 1);
+		switch (tok)
+		{
+		case PDF_TOK_INT:
+			fz_md5_update(md5, (unsigned char *)&lb->i, sizeof lb->i);
+			break;
+		case PDF_TOK_REAL:
+			fz_md5_update(md5, (unsigned char *)&lb->f, sizeof lb->f);
+			break;
+		case PDF_TOK_NAME:
+		case PDF_TOK_KEYWORD:
+			fz_md5_update(md5, (unsigned char *)lb->scratch, strlen(lb->scratch));
+			break;
+		case PDF_TOK_STRING:
+			fz_md5_update(md5, (unsigned char *)lb->scratch, lb->len);
+			break;
+		}
+	}
+	while (tok != PDF_TOK_EOF);
+}
+
+static void
+bench(fz_context *ctx, fz_buffer **bufs, int nbufs, int repeats, int trickle)
+{
+	unsigned char digest[16];
+	pdf_lexbuf_large lb;
+	double start, elapsed;
+	size_t bytes = 0;
+	int tokens = 0;
+	fz_md5 md5;
+	int i, k;
+
+	pdf_lexbuf_init(ctx, &lb.base, PDF_LEXBUF_LARGE);
+	fz_try(ctx)
+	{
+		/* Once for the digest, then time the rest. */
+		fz_md5_init(&md5);
+		for (k = 0; k < nbufs; k++)
+		{
+			fz_stream *stm = trickle ? open_trickle(ctx, bufs[k]) : fz_open_buffer(ctx, bufs[k]);
+			fz_try(ctx)
+				lex_stream(ctx, stm, &lb.base, &md5, &tokens);
+			fz_always(ctx)
+				fz_drop_stream(ctx, stm);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+			bytes += fz_buffer_storage(ctx, bufs[k], NULL);
+		}
+		fz_md5_final(&md5, digest);
+
+		tokens = 0;
+		start = gettime();
+		for (i = 0; i < repeats; i++)
+		{
+			for (k = 0; k < nbufs; k++)
+			{
+				fz_stream *stm = trickle ? open_trickle(ctx, bufs[k]) : fz_open_buffer(ctx, bufs[k]);
+				fz_try(ctx)
+					lex_stream(ctx, stm, &lb.base, NULL, &tokens);
+				fz_always(ctx)
+					fz_drop_stream(ctx, stm);
+				fz_catch(ctx)
+					fz_rethrow(ctx);
+			}
+		}
+		elapsed = gettime() - start;
+	}
+	fz_always(ctx)
+		pdf_lexbuf_fin(ctx, &lb.base);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	printf("  %d streams, %zu bytes, %d tokens: %.3f ms, %.1f Mtokens/s, %.1f MB/s ",
+		nbufs, bytes, tokens / repeats, elapsed / repeats,
+		elapsed > 0 ? tokens / elapsed / 1000 : 0,
+		elapsed > 0 ? (double)bytes * repeats / elapsed / 1000 : 0);
+	for (i = 0; i < 16; i++)
+		printf("%02x", digest[i]);
+	printf("\n");
+}
+
+static void
+load_contents(fz_context *ctx, pdf_obj *contents, fz_buffer ***bufs, int *nbufs, int *cap)
+{
+	if (pdf_is_array(ctx, contents))
+	{
+		int i, n = pdf_array_len(ctx, contents);
+		for (i = 0; i < n; i++)
+			load_contents(ctx, pdf_array_get(ctx, contents, i), bufs, nbufs, cap);
+		return;
+	}
+	if (!pdf_is_stream(ctx, contents))
+		return;
+	if (*nbufs == *cap)
+	{
+		*cap = *cap ? *cap * 2 : 64;
+		*bufs = fz_resize_array(ctx, *bufs, *cap, sizeof(fz_buffer *));
+	}
+	(*bufs)[*nbufs] = pdf_load_stream(ctx, contents);
+	(*nbufs)++;
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	pdf_document *doc = NULL;
+	fz_buffer **bufs = NULL;
+	char *password = "";
+	int nbufs = 0, cap = 0;
+	int repeats = 10;
+	int trickle = 0;
+	int errors = 0;
+	int c, i;
+
+	fz_var(doc);
+	fz_var(bufs);
+	fz_var(nbufs);
+
+	while ((c = fz_getopt(argc, argv, "p:n:1")) != -1)
+	{
+		switch (c)
+		{
+		case 'p': password = fz_optarg; break;
+		case 'n': repeats = atoi(fz_optarg); break;
+		case '1': trickle = 1; break;
+		default: usage(); break;
+		}
+	}
+
+	if (fz_optind == argc || repeats < 1)
+		usage();
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot initialise context\n");
+		exit(1);
+	}
+
+	i = fz_optind;
+	while (i < argc)
+	{
+		char *filename = argv[i++];
+		const char *range = "1-N";
+
+		if (i < argc && fz_is_page_range(ctx, argv[i]))
+			range = argv[i++];
+
+		fz_try(ctx)
+		{
+			int page_count, spage, epage;
+
+			doc = pdf_open_document(ctx, filename);
+			if (pdf_needs_password(ctx, doc) && !pdf_authenticate_password(ctx, doc, password))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate password");
+			printf("%s\n", filename);
+
+			page_count = pdf_count_pages(ctx, doc);
+			while ((range = fz_parse_page_range(ctx, range, &spage, &epage, page_count)))
+			{
+				int step = spage <= epage ? 1 : -1;
+				for (c = spage; ; c += step)
+				{
+					pdf_obj *page = pdf_lookup_page_obj(ctx, doc, c - 1);
+					load_contents(ctx, pdf_dict_get(ctx, page, PDF_NAME_Contents), &bufs, &nbufs, &cap);
+					if (c == epage)
+						break;
+				}
+			}
+
+			bench(ctx, bufs, nbufs, repeats, trickle);
+		}
+		fz_always(ctx)
+		{
+			while (nbufs > 0)
+				fz_drop_buffer(ctx, bufs[--nbufs]);
+			pdf_drop_document(ctx, doc);
+			doc = NULL;
+		}
+		fz_catch(ctx)
+		{
+			fprintf(stderr, "lexbench: cannot benchmark '%s'\n", filename);
+			errors++;
+		}
+	}
+
+	fz_free(ctx, bufs);
+	fz_drop_context(ctx);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * listtest -- check that fz_load_display_list fails cleanly
+ * and round-trips what it reads
+ */
+
+#include "mupdf/fitz.h"
+
+#include "../fitz/font-imp.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+	A display list is saved with an Indexed colorspace whose base is
+	itself Indexed, so that the base is a refcounted resource owned
+	by the reader. Every proper prefix of the saved data is then
+	loaded; each load must throw, and must neither drop a reference
+	it does not own nor leak one.
+
+	Freed blocks are filled with a pattern and held back until the
+	end, so that a drop through a dangling pointer (which changes
+	the refcount of the freed object) shows up when the blocks are
+	checked, as does a block freed twice or never freed at all.
+	Every block also carries a guard after its data, so that a write
+	past the end of a block shows up when it is freed.
+
+	A second list uses a Type3 font whose glyph is drawn with another
+	font, so that reading the outer font defines a further font while
+	the outer one is in flight. Enough fonts precede it that the
+	nested definition fills the reader's font table. The loaded list
+	must save back to the same bytes.
+
+	Lastly, a lattice mesh shade is saved with too few vertices per
+	row, which would never finish painting. Loading it must throw.
+
+		make check
+*/
+
+typedef struct block_s block;
+
+struct block_s
+{
+	block *next;
+	size_t size;
+	size_t freed;
+	size_t pad; /* keep the data 16 byte aligned */
+};
+
+#define POISON 0x5a
+#define GUARD 0xa5
+#define GUARD_SIZE 16
+
+static block *freed_blocks = NULL;
+static int live_blocks = 0;
+static int bad_blocks = 0;
+static int overrun_blocks = 0;
+
+static void *check_malloc(void *opaque, size_t size)
+{
+	block *b = malloc(sizeof(block) + size + GUARD_SIZE);
+	if (!b)
+		return NULL;
+	memset((unsigned char *)(b + 1) + size, GUARD, GUARD_SIZE);
+	b->next = NULL;
+	b->size = size;
+	b->freed = 0;
+	live_blocks++;
+	return b + 1;
+}
+
+static void check_free(void *opaque, void *ptr)
+{
+	unsigned char *guard;
+	block *b;
+	int i;
+	if (!ptr)
+		return;
+	b = (block *)ptr - 1;
+	if (b->freed)
+	{
+		bad_blocks++;
+		return;
+	}
+	guard = (unsigned char *)ptr + b->size;
+	for (i = 0; i < GUARD_SIZE; i++)
+		if (guard[i] != GUARD)
+			break;
+	if (i < GUARD_SIZE)
+		overrun_blocks++;
+	memset(ptr, POISON, b->size);
+	b->freed = 1;
+	b->next = freed_blocks;
+	freed_blocks = b;
+	live_blocks--;
+}
+
+static void *check_realloc(void *opaque, void *old, size_t size)
+{
+	void *p = check_malloc(opaque, size);
+	if (p && old)
+	{
+		block *b = (block *)old - 1;
+		memcpy(p, old, fz_minz(b->size, size));
+		check_free(opaque, old);
+	}
+	return p;
+}
+
+static void check_freed_blocks(void)
+{
+	block *b, *next;
+	size_t i;
+
+	for (b = freed_blocks; b; b = next)
+	{
+		unsigned char *p = (unsigned char *)(b + 1);
+		next = b->next;
+		for (i = 0; i < b->size; i++)
+			if (p[i] != POISON)
+				break;
+		if (i < b->size)
+			bad_blocks++;
+		free(b);
+	}
+	freed_blocks = NULL;
+}
+
+static fz_alloc_context check_alloc = { NULL, check_malloc, check_realloc, check_free };
+
+static fz_buffer *save_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 1024);
+	fz_output *out = fz_new_output_with_buffer(ctx, buf);
+	fz_save_display_list(ctx, list, out, NULL, NULL);
+	fz_drop_output(ctx, out);
+	return buf;
+}
+
+static fz_buffer *save_indexed_list(fz_context *ctx)
+{
+	static const fz_rect mediabox = { 0, 0, 100, 100 };
+	static const unsigned char rgb_lookup[2 * 3] = { 0, 0, 0, 255, 128, 0 };
+	unsigned char *inner_lookup, *outer_lookup;
+	fz_colorspace *inner, *outer;
+	fz_display_list *list;
+	fz_device *dev;
+	fz_path *path;
+	fz_buffer *buf;
+	float color[1] = { 200 };
+	int i;
+
+	inner_lookup = fz_malloc(ctx, sizeof rgb_lookup);
+	memcpy(inner_lookup, rgb_lookup, sizeof rgb_lookup);
+	inner = fz_new_indexed_colorspace(ctx, fz_device_rgb(ctx), 1, inner_lookup);
+
+	outer_lookup = fz_malloc(ctx, 256);
+	for (i = 0; i < 256; i++)
+		outer_lookup[i] = i & 1;
+	outer = fz_new_indexed_colorspace(ctx, inner, 255, outer_lookup);
+
+	list = fz_new_display_list(ctx, &mediabox);
+	dev = fz_new_list_device(ctx, list);
+	path = fz_new_path(ctx);
+	fz_rectto(ctx, path, 10, 10, 90, 90);
+	fz_fill_path(ctx, dev, path, 0, &fz_identity, outer, color, 1);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	fz_drop_path(ctx, path);
+	fz_drop_colorspace(ctx, outer);
+
+	buf = save_list(ctx, list);
+	fz_drop_display_list(ctx, list);
+
+	return buf;
+}
+
+#define FILLER_FONTS 15
+
+static fz_display_list *new_text_list(fz_context *ctx, fz_font **fonts, int n)
+{
+	static const fz_rect mediabox = { 0, 0, 100, 100 };
+	float color[1] = { 0 };
+	fz_display_list *list;
+	fz_device *dev;
+	fz_text *text;
+	fz_matrix trm;
+	int i;
+
+	text = fz_new_text(ctx);
+	for (i = 0; i < n; i++)
+	{
+		fz_scale(&trm, 10, 10);
+		fz_pre_translate(&trm, i, 1);
+		fz_show_glyph(ctx, text, fonts[i], &trm, 'A', 'A', 0, 0, FZ_BIDI_LTR, FZ_LANG_UNSET);
+	}
+
+	list = fz_new_display_list(ctx, &mediabox);
+	dev = fz_new_list_device(ctx, list);
+	fz_fill_text(ctx, dev, text, &fz_identity, fz_device_gray(ctx), color, 1);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	fz_drop_text(ctx, text);
+	return list;
+}
+
+static fz_buffer *save_nested_type3_list(fz_context *ctx)
+{
+	fz_font *fonts[FILLER_FONTS + 1];
+	fz_font *inner;
+	fz_display_list *list;
+	fz_buffer *buf;
+	char name[32];
+	int i;
+
+	for (i = 0; i < FILLER_FONTS; i++)
+	{
+		fz_snprintf(name, sizeof name, "Filler%d", i);
+		fonts[i] = fz_new_type3_font(ctx, name, &fz_identity);
+	}
+
+	inner = fz_new_type3_font(ctx, "Inner", &fz_identity);
+	fonts[FILLER_FONTS] = fz_new_type3_font(ctx, "Outer", &fz_identity);
+	fonts[FILLER_FONTS]->t3lists['A'] = new_text_list(ctx, &inner, 1);
+	fonts[FILLER_FONTS]->t3widths['A'] = 1;
+	fz_drop_font(ctx, inner);
+
+	list = new_text_list(ctx, fonts, FILLER_FONTS + 1);
+	for (i = 0; i <= FILLER_FONTS; i++)
+		fz_drop_font(ctx, fonts[i]);
+
+	buf = save_list(ctx, list);
+	fz_drop_display_list(ctx, list);
+	return buf;
+}
+
+static fz_buffer *save_mesh_list(fz_context *ctx, int vprow)
+{
+	static const fz_rect mediabox = { 0, 0, 100, 100 };
+	/* A 2x2 lattice: x, y, r, g, b in 8 bits each. */
+	static const unsigned char vertices[4 * 5] = {
+		0, 0, 255, 0, 0,
+		255, 0, 0, 255, 0,
+		0, 255, 0, 0, 255,
+		255, 255, 255, 255, 255,
+	};
+	fz_display_list *list;
+	fz_device *dev;
+	fz_shade *shade;
+	fz_buffer *buf;
+	int k;
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	shade->type = FZ_MESH_TYPE5;
+	shade->bbox = fz_infinite_rect;
+	shade->matrix = fz_identity;
+	shade->colorspace = fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+	shade->u.m.vprow = vprow;
+	shade->u.m.bpcoord = 8;
+	shade->u.m.bpcomp = 8;
+	shade->u.m.x1 = 100;
+	shade->u.m.y1 = 100;
+	for (k = 0; k < 3; k++)
+		shade->u.m.c1[k] = 1;
+	shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+	shade->buffer->params.type = FZ_IMAGE_RAW;
+	shade->buffer->buffer = fz_new_buffer_from_shared_data(ctx, (const char *)vertices, sizeof vertices);
+
+	list = fz_new_display_list(ctx, &mediabox);
+	dev = fz_new_list_device(ctx, list);
+	fz_fill_shade(ctx, dev, shade, &fz_identity, 1);
+	fz_close_device(ctx, dev);
+	fz_drop_device(ctx, dev);
+	fz_drop_shade(ctx, shade);
+
+	buf = save_list(ctx, list);
+	fz_drop_display_list(ctx, list);
+	return buf;
+}
+
+static int round_trip(fz_context *ctx, fz_buffer *buf)
+{
+	fz_display_list *list = NULL;
+	fz_buffer *copy = NULL;
+	fz_stream *stm;
+	unsigned char *data, *copy_data;
+	size_t len, copy_len;
+	int ok = 0;
+
+	fz_var(list);
+	fz_var(copy);
+
+	len = fz_buffer_storage(ctx, buf, &data);
+	stm = fz_open_memory(ctx, data, len);
+	fz_try(ctx)
+	{
+		list = fz_load_display_list(ctx, stm, NULL, NULL);
+		copy = save_list(ctx, list);
+		copy_len = fz_buffer_storage(ctx, copy, &copy_data);
+		ok = (copy_len == len && !memcmp(copy_data, data, len));
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, copy);
+		fz_drop_display_list(ctx, list);
+		fz_drop_stream(ctx, stm);
+	}
+	fz_catch(ctx)
+		ok = 0;
+	return ok;
+}
+
+static int load_prefix(fz_context *ctx, fz_buffer *buf, size_t len)
+{
+	fz_display_list *list = NULL;
+	fz_stream *stm;
+	unsigned char *data;
+	int ok = 1;
+
+	fz_var(list);
+
+	fz_buffer_storage(ctx, buf, &data);
+	stm = fz_open_memory(ctx, data, len);
+	fz_try(ctx)
+		list = fz_load_display_list(ctx, stm, NULL, NULL);
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+		ok = 0;
+	fz_drop_display_list(ctx, list);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	fz_buffer *buf;
+	size_t i, len;
+	int failed = 0;
+
+	ctx = fz_new_context(&check_alloc, NULL, FZ_STORE_DEFAULT);
+	if (!ctx)
+	{
+		fprintf(stderr, "listtest: cannot create context\n");
+		return 1;
+	}
+
+	fz_try(ctx)
+	{
+		buf = save_indexed_list(ctx);
+		len = fz_buffer_storage(ctx, buf, NULL);
+
+		if (!load_prefix(ctx, buf, len))
+		{
+			fprintf(stderr, "listtest: cannot load the complete list\n");
+			failed = 1;
+		}
+		for (i = 0; i < len; i++)
+		{
+			if (load_prefix(ctx, buf, i))
+			{
+				fprintf(stderr, "listtest: loaded a list truncated to %d of %d bytes\n", (int)i, (int)len);
+				failed = 1;
+			}
+		}
+		fz_drop_buffer(ctx, buf);
+
+		buf = save_nested_type3_list(ctx);
+		if (!round_trip(ctx, buf))
+		{
+			fprintf(stderr, "listtest: cannot round-trip a list with nested type3 fonts\n");
+			failed = 1;
+		}
+		fz_drop_buffer(ctx, buf);
+
+		buf = save_mesh_list(ctx, 2);
+		if (!round_trip(ctx, buf))
+		{
+			fprintf(stderr, "listtest: cannot round-trip a list with a mesh shade\n");
+			failed = 1;
+		}
+		fz_drop_buffer(ctx, buf);
+
+		buf = save_mesh_list(ctx, 0);
+		if (load_prefix(ctx, buf, fz_buffer_storage(ctx, buf, NULL)))
+		{
+			fprintf(stderr, "listtest: loaded a mesh shade with no vertices per row\n");
+			failed = 1;
+		}
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "listtest: %s\n", fz_caught_message(ctx));
+		failed = 1;
+	}
+
+	fz_flush_warnings(ctx);
+	fz_drop_context(ctx);
+
+	check_freed_blocks();
+	if (live_blocks != 0)
+	{
+		fprintf(stderr, "listtest: %d blocks leaked\n", live_blocks);
+		failed = 1;
+	}
+	if (overrun_blocks != 0)
+	{
+		fprintf(stderr, "listtest: %d blocks written past their end\n", overrun_blocks);
+		failed = 1;
+	}
+	if (bad_blocks != 0)
+	{
+		fprintf(stderr, "listtest: %d blocks used after being freed\n", bad_blocks);
+		failed = 1;
+	}
+
+	printf("listtest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
@@ -377,9 +377,15 @@ static int alpha;
 static char *filename;
 static int files = 0;
 static int num_workers = 0;
+static int tile_workers = 0;
+static fz_thread_pool *encode_pool = NULL;
+static int shade_workers = 0;
+static fz_thread_pool *shade_pool = NULL;
 static worker_t *workers;
 
 static const char *layer_config = NULL;
+static int use_obj_arena = 0;
+static const char *glyph_cache_file = NULL;
 
 static struct {
 	int active;
@@ -428,9 +434,10 @@ static void usage(void)
 		"\t-w -\twidth (in pixels) (maximum width if -r is specified)\n"
 		"\t-h -\theight (in pixels) (maximum height if -r is specified)\n"
 		"\t-f -\tfit width and/or height exactly; ignore original aspect ratio\n"
-		"\t-B -\tmaximum band_height (pgm, ppm, pam, png output only)\n"
+		"\t-B -\tmaximum band_height (pgm, ppm, pam, png, pwg output only)\n"
 #ifdef MUDRAW_THREADS
-		"\t-T -\tnumber of threads to use for rendering (banded mode only)\n"
+		"\t-T -\tnumber of threads to use for rendering (by bands, or by tiles if not banded), compressing output and loading object streams\n"
+		"\t-t -\tnumber of threads to use for painting large shadings when not using -T\n"
 #endif
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
@@ -446,8 +453,10 @@ static void usage(void)
 		"\t-A -/-\tnumber of bits of antialiasing (0 to 8) (graphics, text)\n"
 		"\t-l -\tminimum stroked line width (in pixels)\n"
 		"\t-D\tdisable use of display list\n"
+		"\t-a\tallocate PDF objects from a per-document arena\n"
 		"\t-i\tignore errors\n"
 		"\t-L\tlow memory mode (avoid caching, clear objects after each page)\n"
+		"\t-g -\tglyph cache file (shared between runs and processes)\n"
 		"\t-P\tparallel interpretation/rendering\n"
 		"\n"
 		"\t-y l\tList the layer configs to stderr\n"
@@ -518,6 +527,9 @@ file_level_headers(fz_context *ctx)
 
 	if (output_format == OUT_PS)
 		fz_write_ps_file_header(ctx, out);
+
+	if (output_format == OUT_PWG)
+		fz_write_pwg_header(ctx, out);
 }
 
 static void
@@ -543,6 +555,7 @@ file_level_trailers(fz_context *ctx)
 static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, const fz_matrix *ctm, const fz_rect *tbounds, fz_cookie *cookie, int band_start, fz_pixmap *pix, fz_bitmap **bit)
 {
 	fz_device *dev = NULL;
+	int hints = 0;
 
 	*bit = NULL;
 
@@ -553,18 +566,27 @@ static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, cons
 		else
 			fz_clear_pixmap_with_value(ctx, pix, 255);
 
-		dev = fz_new_draw_device(ctx, NULL, pix);
 		if (lowmemory)
-			fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
+			hints |= FZ_NO_CACHE;
 		if (alphabits_graphics == 0)
-			fz_enable_device_hints(ctx, dev, FZ_DONT_INTERPOLATE_IMAGES);
-		if (list)
-			fz_run_display_list(ctx, list, dev, ctm, tbounds, cookie);
+			hints |= FZ_DONT_INTERPOLATE_IMAGES;
+
+		if (list && tile_workers > 0)
+			fz_run_display_list_parallel(ctx, list, ctm, pix, hints, tile_workers, cookie);
 		else
-			fz_run_page(ctx, page, dev, ctm, cookie);
-		fz_close_device(ctx, dev);
-		fz_drop_device(ctx, dev);
-		dev = NULL;
+		{
+			dev = fz_new_draw_device(ctx, NULL, pix);
+			fz_set_draw_device_thread_pool(ctx, dev, shade_pool);
+			if (hints)
+				fz_enable_device_hints(ctx, dev, hints);
+			if (list)
+				fz_run_display_list(ctx, list, dev, ctm, tbounds, cookie);
+			else
+				fz_run_page(ctx, page, dev, ctm, cookie);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+		}
 
 		if (invert)
 			fz_invert_pixmap(ctx, pix);
@@ -891,6 +913,8 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 					bander = fz_new_pkm_band_writer(ctx, out);
 				else if (output_format == OUT_PS)
 					bander = fz_new_ps_band_writer(ctx, out);
+				else if (output_format == OUT_PWG)
+					bander = fz_new_pwg_band_writer(ctx, out, NULL);
 				else if (output_format == OUT_PCL)
 				{
 					if (out_cs == CS_MONO)
@@ -899,7 +923,10 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 						bander = fz_new_color_pcl_band_writer(ctx, out, NULL);
 				}
 				if (bander)
+				{
+					fz_set_band_writer_thread_pool(ctx, bander, encode_pool);
 					fz_write_header(ctx, bander, pix->w, totalheight, pix->n, pix->alpha, pix->xres, pix->yres, ++output_pagenum);
+				}
 			}
 
 			for (band = 0; band < bands; band++)
@@ -921,8 +948,6 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 				{
 					if (bander)
 						fz_write_band(ctx, bander, bit ? bit->stride : pix->stride, band * band_height, drawheight, bit ? bit->samples : pix->samples);
-					else if (output_format == OUT_PWG)
-						fz_write_pixmap_as_pwg(ctx, out, pix, NULL);
 					else if (output_format == OUT_TGA)
 						fz_write_pixmap_as_tga(ctx, out, pix);
 					fz_drop_bitmap(ctx, bit);
@@ -1089,6 +1114,8 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		fz_try(ctx)
 		{
 			list = fz_new_display_list(ctx, fz_bound_page(ctx, page, &bounds));
+			if (band_height)
+				fz_index_display_list(ctx, list);
 			dev = fz_new_list_device(ctx, list);
 			if (lowmemory)
 				fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
@@ -1429,7 +1456,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:Is:A:DiW:H:S:T:U:LvPl:y:")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:Is:A:DaiW:H:S:T:t:U:Lg:vPl:y:")) != -1)
 	{
 		switch (c)
 		{
@@ -1475,6 +1502,7 @@ int mudraw_main(int argc, char **argv)
 			break;
 		}
 		case 'D': uselist = 0; break;
+		case 'a': use_obj_arena = 1; break;
 		case 'l': min_line_width = fz_atof(fz_optarg); break;
 		case 'i': ignore_errors = 1; break;
 
@@ -1484,8 +1512,16 @@ int mudraw_main(int argc, char **argv)
 #else
 			fprintf(stderr, "Threads not enabled in this build\n");
 			break;
+#endif
+		case 't':
+#ifdef MUDRAW_THREADS
+			shade_workers = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
 #endif
 		case 'L': lowmemory = 1; break;
+		case 'g': glyph_cache_file = fz_optarg; break;
 		case 'P': bgprint.active = 1; break;
 
 		case 'y': layer_config = fz_optarg; break;
@@ -1505,9 +1541,12 @@ int mudraw_main(int argc, char **argv)
 			exit(1);
 		}
 
+		/* Without banding, our threads are better spent drawing
+		 * each page in tiles. */
 		if (band_height == 0)
 		{
-			fprintf(stderr, "Using multiple threads without banding is pointless\n");
+			tile_workers = num_workers;
+			num_workers = 0;
 		}
 	}
 
@@ -1531,6 +1570,18 @@ int mudraw_main(int argc, char **argv)
 	fz_set_graphics_aa_level(ctx, alphabits_graphics);
 	fz_set_graphics_min_line_width(ctx, min_line_width);
 
+	/* We only read the files we are given, and don't keep them open
+	 * for long, so mapping them is safe. */
+	fz_tune_file_mapping(ctx, 1);
+
+	if (glyph_cache_file)
+	{
+		fz_try(ctx)
+			fz_attach_glyph_cache_file(ctx, glyph_cache_file, 0);
+		fz_catch(ctx)
+			fz_warn(ctx, "continuing without glyph cache file");
+	}
+
 	if (bgprint.active)
 	{
 		bgprint.ctx = fz_clone_context(ctx);
@@ -1552,6 +1603,15 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	/* The same number of threads again compress the output. */
+	if (num_workers > 0 || tile_workers > 0)
+		encode_pool = fz_new_thread_pool(ctx, fz_maxi(num_workers, tile_workers));
+
+	/* Without band or tile workers, large shadings can still be split
+	 * across threads while the page is drawn. */
+	else if (shade_workers > 0)
+		shade_pool = fz_new_thread_pool(ctx, shade_workers);
+
 	if (layout_css)
 	{
 		fz_buffer *buf = fz_read_file(ctx, layout_css);
@@ -1605,9 +1665,9 @@ int mudraw_main(int argc, char **argv)
 
 	if (band_height)
 	{
-		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG && output_format != OUT_PBM && output_format != OUT_PKM && output_format != OUT_PCL && output_format != OUT_PS)
+		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG && output_format != OUT_PBM && output_format != OUT_PKM && output_format != OUT_PCL && output_format != OUT_PS && output_format != OUT_PWG)
 		{
-			fprintf(stderr, "Banded operation only possible with PAM, PBM, PGM, PKM, PPM, PNM, PCL, PS and PNG outputs\n");
+			fprintf(stderr, "Banded operation only possible with PAM, PBM, PGM, PKM, PPM, PNM, PCL, PS, PWG and PNG outputs\n");
 			exit(1);
 		}
 		if (showmd5)
@@ -1711,6 +1771,8 @@ int mudraw_main(int argc, char **argv)
 				files++;
 
 				doc = fz_open_document(ctx, filename);
+				if (use_obj_arena)
+					pdf_enable_obj_arena(ctx, pdf_specifics(ctx, doc));
 
 				if (fz_needs_password(ctx, doc))
 				{
@@ -1723,6 +1785,10 @@ int mudraw_main(int argc, char **argv)
 				if (layer_config)
 					apply_layer_config(ctx, doc, layer_config);
 
+				/* Drawing every page will load most objects anyway. */
+				if (encode_pool && (fz_optind == argc || !fz_is_page_range(ctx, argv[fz_optind])))
+					pdf_prefetch_obj_stms(ctx, pdf_specifics(ctx, doc), encode_pool);
+
 				if (output_format == OUT_GPROOF)
 				{
 					fz_save_gproof(ctx, filename, doc, output, resolution, "", "");
@@ -1813,6 +1879,9 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	fz_drop_thread_pool(ctx, encode_pool);
+	fz_drop_thread_pool(ctx, shade_pool);
+
 	if (num_workers > 0)
 	{
 		for (i = 0; i < num_workers; i++)
@@ -10,6 +10,7 @@
  * Only supports banding.
  * Supports auto fallback to grey if possible.
  * Supports threading.
+ * Supports pipelining of pages within a memory budget.
  * Suports fallback in low memory cases.
  */
 
@@ -44,6 +45,26 @@
 */
 /* #define MURASTER_CONFIG_BGPRINT 1 */
 
+/*
+	MURASTER_CONFIG_PIPELINE_PAGES: The maximum number of
+	pages that may be interpreted ahead of the page being
+	rendered when pipelining (-m). Regardless of this, we
+	stop interpreting ahead when the memory budget given
+	to -m is exceeded.
+
+	If undefined, we will use a default of 4.
+*/
+/* #define MURASTER_CONFIG_PIPELINE_PAGES 4 */
+
+/*
+	MURASTER_CONFIG_PIPELINE_BANDS: The maximum number of
+	rendered bands that may be waiting for output when
+	pipelining (-m).
+
+	If undefined, we will use a default of 8.
+*/
+/* #define MURASTER_CONFIG_PIPELINE_BANDS 8 */
+
 /*
 	MURASTER_CONFIG_X_RESOLUTION: The default X resolution
 	in dots per inch. If undefined, taken to be 300dpi.
@@ -479,6 +500,11 @@ static void fin_muraster_locks(void)
 #define SEMAPHORE_WAIT(A) do { A = 0; } while (0)
 #define THREAD_INIT(A,B,C) do { A = 0; (void)C; } while (0)
 #define THREAD_FIN(A) do { A = 0; } while (0)
+#define MUTEX int
+#define MUTEX_INIT(A) do { A = 0; } while (0)
+#define MUTEX_FIN(A) do { A = 0; } while (0)
+#define MUTEX_LOCK(A) do { A = 0; } while (0)
+#define MUTEX_UNLOCK(A) do { A = 0; } while (0)
 #define LOCKS_INIT() NULL
 #define LOCKS_FIN() do { } while (0)
 
@@ -511,6 +537,18 @@ static void fin_muraster_locks(void)
 #error "Can't have MURASTER_CONFIG_BGPRINT > 0 without having a threading library!"
 #endif
 
+#ifdef MURASTER_CONFIG_PIPELINE_PAGES
+#define PIPELINE_PAGES MURASTER_CONFIG_PIPELINE_PAGES
+#else
+#define PIPELINE_PAGES 4
+#endif
+
+#ifdef MURASTER_CONFIG_PIPELINE_BANDS
+#define PIPELINE_BANDS MURASTER_CONFIG_PIPELINE_BANDS
+#else
+#define PIPELINE_BANDS 8
+#endif
+
 typedef struct worker_t {
 	fz_context *ctx;
 	int started;
@@ -643,6 +681,331 @@ static struct {
 	char *maxfilename;
 } timing;
 
+/*
+	Pipelined printing (-m). The main thread interprets pages into
+	display lists and queues them for the render thread. The render
+	thread renders each page in turn (using the band workers as usual)
+	and queues the finished bands for the output thread, which feeds
+	them to the band writer. So page N+1 is being interpreted while
+	page N is being rendered and page N-1 is being written out.
+
+	The main thread stops interpreting ahead while the memory in use
+	exceeds the budget given (or when PIPELINE_PAGES pages are
+	already waiting), and the render thread likewise stops handing
+	over bands (or when PIPELINE_BANDS are already waiting). Each
+	stage always has at least one thing to work on, so the budget
+	bounds how far ahead we run, not the memory needed for a page.
+
+	Pages hold no reference to their document, so the document is
+	only ever touched with doc_lock held, and the pipeline is drained
+	before a document is dropped.
+*/
+typedef struct pipeline_page_s pipeline_page;
+
+struct pipeline_page_s
+{
+	pipeline_page *next;
+	int pagenum;
+	char *filename;
+	int interptime;
+	int errors;
+	render_details render;
+};
+
+enum
+{
+	JOB_HEADER,
+	JOB_BAND,
+	JOB_END
+};
+
+typedef struct pipeline_job_s pipeline_job;
+
+struct pipeline_job_s
+{
+	pipeline_job *next;
+	int type;
+	fz_band_writer *bander;
+
+	/* JOB_HEADER */
+	int w, h, n, alpha, xres, yres, pagenum;
+
+	/* JOB_BAND */
+	int stride, band_start, band_height;
+	unsigned char *samples;
+};
+
+static struct {
+	int active;
+	size_t budget;
+	fz_context *render_ctx;
+	fz_context *output_ctx;
+	THREAD render_thread;
+	THREAD output_thread;
+	MUTEX doc_lock;
+
+	/* lock protects everything below here. */
+	MUTEX lock;
+	int status;
+	int closing;
+	int render_done;
+	int output_done;
+	pipeline_page *pages;
+	pipeline_page *pages_tail;
+	int pages_in_flight;
+	pipeline_job *jobs;
+	pipeline_job *jobs_tail;
+	int jobs_in_flight;
+
+	/* Each thread that can block has a flag and a semaphore. A
+	 * thread sets its flag (with lock held) before waiting, and
+	 * anyone who changes the state it may be waiting on clears
+	 * the flag and triggers the semaphore. */
+	int main_waiting;
+	SEMAPHORE main_wake;
+	int render_waiting;
+	SEMAPHORE render_wake;
+	int output_waiting;
+	SEMAPHORE output_wake;
+} pipeline;
+
+/* Called with pipeline.lock held. */
+static void pipeline_wait(int *waiting, SEMAPHORE *wake)
+{
+	*waiting = 1;
+	MUTEX_UNLOCK(pipeline.lock);
+	SEMAPHORE_WAIT(*wake);
+	MUTEX_LOCK(pipeline.lock);
+}
+
+/* Called with pipeline.lock held. */
+static void pipeline_wake(int *waiting, SEMAPHORE *wake)
+{
+	if (*waiting)
+	{
+		*waiting = 0;
+		SEMAPHORE_TRIGGER(*wake);
+	}
+}
+
+static void lock_document(void)
+{
+	if (pipeline.active)
+		MUTEX_LOCK(pipeline.doc_lock);
+}
+
+static void unlock_document(void)
+{
+	if (pipeline.active)
+		MUTEX_UNLOCK(pipeline.doc_lock);
+}
+
+static size_t memory_in_use(void)
+{
+	size_t used;
+
+	/* The trace allocator updates memtrace_current under FZ_LOCK_ALLOC. */
+#if MURASTER_THREADS != 0
+	MUTEX_LOCK(mutexes[FZ_LOCK_ALLOC]);
+#endif
+	used = memtrace_current;
+#if MURASTER_THREADS != 0
+	MUTEX_UNLOCK(mutexes[FZ_LOCK_ALLOC]);
+#endif
+
+	return used;
+}
+
+/* Collect (and clear) any failure reported by the pipeline threads.
+ * Output failures are sticky, as retrying won't help.
+ * Called with pipeline.lock held. */
+static int pipeline_take_status(void)
+{
+	int status = pipeline.status;
+
+	if (status != RENDER_FATAL)
+		pipeline.status = RENDER_OK;
+	return status;
+}
+
+/* Wait until there is room to interpret another page. */
+static void wait_for_pipeline_space(fz_context *ctx)
+{
+	int status;
+
+	if (!pipeline.active)
+		return;
+
+	MUTEX_LOCK(pipeline.lock);
+	while (pipeline.status == RENDER_OK && pipeline.pages_in_flight > 0 &&
+		(pipeline.pages_in_flight >= PIPELINE_PAGES || memory_in_use() > pipeline.budget))
+	{
+		DEBUG_THREADS(("Pipeline waiting for space (%d pages in flight)\n", pipeline.pages_in_flight));
+		pipeline_wait(&pipeline.main_waiting, &pipeline.main_wake);
+	}
+	status = pipeline_take_status();
+	MUTEX_UNLOCK(pipeline.lock);
+
+	if (status != RENDER_OK)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Failed to render page");
+}
+
+/* Wait until every queued page has been rendered and written out. */
+static int wait_for_pipeline_to_drain(void)
+{
+	int status;
+
+	if (!pipeline.active)
+		return RENDER_OK;
+
+	MUTEX_LOCK(pipeline.lock);
+	while (pipeline.pages_in_flight > 0 || pipeline.jobs_in_flight > 0)
+		pipeline_wait(&pipeline.main_waiting, &pipeline.main_wake);
+	status = pipeline_take_status();
+	MUTEX_UNLOCK(pipeline.lock);
+
+	return status;
+}
+
+static void finish_pipeline(fz_context *ctx)
+{
+	if (wait_for_pipeline_to_drain() != RENDER_OK)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Failed to render page");
+}
+
+/* Called from the main thread, with the document lock held. Takes
+ * ownership of the page, list and band writer in render. */
+static void queue_page(fz_context *ctx, int pagenum, int interptime, int errors, render_details *render)
+{
+	pipeline_page *p;
+
+	fz_try(ctx)
+		p = fz_malloc_struct(ctx, pipeline_page);
+	fz_catch(ctx)
+	{
+		fz_drop_page(ctx, render->page);
+		fz_drop_display_list(ctx, render->list);
+		fz_drop_band_writer(ctx, render->bander);
+		fz_rethrow(ctx);
+	}
+	p->pagenum = pagenum;
+	p->filename = filename;
+	p->interptime = interptime;
+	p->errors = errors;
+	p->render = *render;
+
+	MUTEX_LOCK(pipeline.lock);
+	if (pipeline.pages)
+		pipeline.pages_tail->next = p;
+	else
+		pipeline.pages = p;
+	pipeline.pages_tail = p;
+	pipeline.pages_in_flight++;
+	DEBUG_THREADS(("Queued page %d (%d pages in flight)\n", pagenum, pipeline.pages_in_flight));
+	pipeline_wake(&pipeline.render_waiting, &pipeline.render_wake);
+	MUTEX_UNLOCK(pipeline.lock);
+}
+
+/* Called from the render thread. Waits while the output queue is full,
+ * or while we are over budget and the output thread has work to do. */
+static void queue_job(pipeline_job *job)
+{
+	MUTEX_LOCK(pipeline.lock);
+	while (pipeline.jobs_in_flight >= PIPELINE_BANDS ||
+		(pipeline.jobs_in_flight > 0 && job->type == JOB_BAND && memory_in_use() > pipeline.budget))
+		pipeline_wait(&pipeline.render_waiting, &pipeline.render_wake);
+	if (pipeline.jobs)
+		pipeline.jobs_tail->next = job;
+	else
+		pipeline.jobs = job;
+	pipeline.jobs_tail = job;
+	pipeline.jobs_in_flight++;
+	pipeline_wake(&pipeline.output_waiting, &pipeline.output_wake);
+	MUTEX_UNLOCK(pipeline.lock);
+}
+
+/* The band writer calls below go straight to the band writer, unless
+ * we are pipelining, in which case they are queued for the output
+ * thread. */
+static void write_header(fz_context *ctx, render_details *render, int w, int h, int n, int alpha, int xres, int yres, int pagenum)
+{
+	pipeline_job *job;
+
+	if (!pipeline.active)
+	{
+		fz_write_header(ctx, render->bander, w, h, n, alpha, xres, yres, pagenum);
+		return;
+	}
+
+	job = fz_malloc_struct(ctx, pipeline_job);
+	job->type = JOB_HEADER;
+	job->bander = render->bander;
+	job->w = w;
+	job->h = h;
+	job->n = n;
+	job->alpha = alpha;
+	job->xres = xres;
+	job->yres = yres;
+	job->pagenum = pagenum;
+	queue_job(job);
+}
+
+static void write_band(fz_context *ctx, render_details *render, int stride, int band_start, int band_height, const unsigned char *samples)
+{
+	pipeline_job *job;
+	size_t size = (size_t)stride * band_height;
+
+	if (!pipeline.active)
+	{
+		fz_write_band(ctx, render->bander, stride, band_start, band_height, samples);
+		return;
+	}
+
+	/* The renderer reuses its pixmaps, so take a copy of the band. */
+	job = fz_malloc_struct(ctx, pipeline_job);
+	fz_try(ctx)
+		job->samples = fz_malloc(ctx, size);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, job);
+		fz_rethrow(ctx);
+	}
+	memcpy(job->samples, samples, size);
+	job->type = JOB_BAND;
+	job->bander = render->bander;
+	job->stride = stride;
+	job->band_start = band_start;
+	job->band_height = band_height;
+	queue_job(job);
+}
+
+static void drop_band_writer(fz_context *ctx, render_details *render)
+{
+	pipeline_job *job = NULL;
+
+	if (!pipeline.active || render->bander == NULL)
+	{
+		fz_drop_band_writer(ctx, render->bander);
+		return;
+	}
+
+	fz_try(ctx)
+		job = fz_malloc_struct(ctx, pipeline_job);
+	fz_catch(ctx)
+	{
+		/* Let the output thread finish with the band writer, and drop it here. */
+		MUTEX_LOCK(pipeline.lock);
+		while (pipeline.jobs_in_flight > 0)
+			pipeline_wait(&pipeline.render_waiting, &pipeline.render_wake);
+		MUTEX_UNLOCK(pipeline.lock);
+		fz_drop_band_writer(ctx, render->bander);
+		return;
+	}
+	job->type = JOB_END;
+	job->bander = render->bander;
+	queue_job(job);
+}
+
 #define stringify(A) #A
 
 static void usage(void)
@@ -671,6 +1034,8 @@ static void usage(void)
 #if MURASTER_THREADS != 0
 		"\t-T -\tnumber of threads to use for rendering\n"
 		"\t-P\tparallel interpretation/rendering\n"
+		"\t-m -\tpipeline interpretation, rendering and output of pages\n"
+		"\t\twithin a memory budget in bytes (e.g. 256M)\n"
 #endif
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
@@ -790,7 +1155,7 @@ static int dodrawpage(fz_context *ctx, int pagenum, fz_cookie *cookie, render_de
 			pix = fz_new_pixmap_with_bbox(ctx, colorspace, &ibounds, 0);
 			fz_set_pixmap_resolution(ctx, pix, x_resolution, y_resolution);
 		}
-		fz_write_header(ctx, render->bander, pix->w, total_height, pix->n, pix->alpha, pix->xres, pix->yres, pagenum);
+		write_header(ctx, render, pix->w, total_height, pix->n, pix->alpha, pix->xres, pix->yres, pagenum);
 
 		for (band = 0; band < bands; band++)
 		{
@@ -825,7 +1190,7 @@ static int dodrawpage(fz_context *ctx, int pagenum, fz_cookie *cookie, render_de
 			{
 				/* If we get any errors while outputting the bands, retrying won't help. */
 				errors_are_fatal = 1;
-				fz_write_band(ctx, render->bander, bit ? bit->stride : pix->stride, band_start, draw_height, bit ? bit->samples : pix->samples);
+				write_band(ctx, render, bit ? bit->stride : pix->stride, band_start, draw_height, bit ? bit->samples : pix->samples);
 				fz_drop_bitmap(ctx, bit);
 				bit = NULL;
 				errors_are_fatal = 0;
@@ -893,7 +1258,7 @@ static int try_render_page(fz_context *ctx, int pagenum, fz_cookie *cookie, int
 		{
 			int w = render->ibounds.x1 - render->ibounds.x0;
 			int h = render->ibounds.y1 - render->ibounds.y0;
-			fz_write_header(ctx, render->bander, w, h, render->n, 0, 0, 0, 0);
+			write_header(ctx, render, w, h, render->n, 0, 0, 0, 0);
 		}
 		fz_catch(ctx)
 		{
@@ -904,12 +1269,21 @@ static int try_render_page(fz_context *ctx, int pagenum, fz_cookie *cookie, int
 
 	while (1)
 	{
+		/* Rendering without a list reads the document, which the main
+		 * thread may be using if we are pipelining. */
+		int no_list = (render->list == NULL);
+
+		if (no_list)
+			lock_document();
 		status = dodrawpage(ctx, pagenum, cookie, render);
+		if (no_list)
+			unlock_document();
 		if (status == RENDER_OK || status == RENDER_FATAL)
 			break;
 
-		/* If we are bgprinting, then ask the caller to try us again in solo mode. */
-		if (bg && !solo)
+		/* If we are bgprinting, then ask the caller to try us again in solo mode.
+		 * When pipelining, there is nobody to ask, so carry on falling back. */
+		if (bg && !solo && !pipeline.active)
 		{
 			DEBUG_THREADS(("Render failure; trying again in solo mode\n"));
 			return RENDER_RETRY; /* Avoids all the cleanup below! */
@@ -945,9 +1319,11 @@ static int try_render_page(fz_context *ctx, int pagenum, fz_cookie *cookie, int
 		break;
 	}
 
+	lock_document();
 	fz_drop_page(ctx, render->page);
+	unlock_document();
 	fz_drop_display_list(ctx, render->list);
-	fz_drop_band_writer(ctx, render->bander);
+	drop_band_writer(ctx, render);
 
 	if (showtime)
 	{
@@ -956,6 +1332,10 @@ static int try_render_page(fz_context *ctx, int pagenum, fz_cookie *cookie, int
 
 		if (bg)
 		{
+			/* The main thread has moved on by now, so report the page here. */
+			if (pipeline.active)
+				fprintf(stderr, "page %s %d", filename, pagenum);
+
 			if (diff + interptime < timing.min)
 			{
 				timing.min = diff + interptime;
@@ -1304,7 +1684,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		/* Figure out banding */
 		initialise_banding(ctx, &render, is_color);
 
-		if (bgprint.active && showtime)
+		if ((bgprint.active || pipeline.active) && showtime)
 		{
 			int end = gettime();
 			start = end - start;
@@ -1347,11 +1727,15 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	}
 	while (1);
 
-	if (showtime)
+	if (showtime && !pipeline.active)
 	{
 		fprintf(stderr, "page %s %d", filename, pagenum);
 	}
-	if (bgprint.active)
+	if (pipeline.active)
+	{
+		queue_page(ctx, pagenum, start, cookie.errors, &render);
+	}
+	else if (bgprint.active)
 	{
 		bgprint.started = 1;
 		bgprint.solo = 0;
@@ -1405,6 +1789,22 @@ finish_bgprint(fz_context *ctx)
 	}
 }
 
+/* When pipelining, wait until we are allowed to run ahead again. The
+ * interpretation in drawpage then runs alongside the render thread, so
+ * it must hold the document lock. */
+static void drawpage_pipelined(fz_context *ctx, fz_document *doc, int pagenum)
+{
+	wait_for_pipeline_space(ctx);
+
+	lock_document();
+	fz_try(ctx)
+		drawpage(ctx, doc, pagenum);
+	fz_always(ctx)
+		unlock_document();
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 static void drawrange(fz_context *ctx, fz_document *doc, const char *range)
 {
 	int page, spage, epage, pagecount;
@@ -1415,10 +1815,10 @@ static void drawrange(fz_context *ctx, fz_document *doc, const char *range)
 	{
 		if (spage < epage)
 			for (page = spage; page <= epage; page++)
-				drawpage(ctx, doc, page);
+				drawpage_pipelined(ctx, doc, page);
 		else
 			for (page = spage; page >= epage; page--)
-				drawpage(ctx, doc, page);
+				drawpage_pipelined(ctx, doc, page);
 	}
 }
 
@@ -1488,19 +1888,22 @@ trace_realloc(void *arg, void *p_, size_t size)
 static THREAD_RETURN_TYPE worker_thread(void *arg)
 {
 	worker_t *me = (worker_t *)arg;
+	int band_start;
 
 	do
 	{
 		DEBUG_THREADS(("Worker %d waiting\n", me->num));
 		SEMAPHORE_WAIT(me->start);
-		DEBUG_THREADS(("Worker %d woken for band_start %d\n", me->num, me->band_start));
+		/* Once we trigger stop, band_start may be changed under us. */
+		band_start = me->band_start;
+		DEBUG_THREADS(("Worker %d woken for band_start %d\n", me->num, band_start));
 		me->status = RENDER_OK;
-		if (me->band_start >= 0)
-			me->status = drawband(me->ctx, NULL, me->list, &me->ctm, &me->tbounds, &me->cookie, me->band_start, me->pix, &me->bit);
-		DEBUG_THREADS(("Worker %d completed band_start %d (status=%d)\n", me->num, me->band_start, me->status));
+		if (band_start >= 0)
+			me->status = drawband(me->ctx, NULL, me->list, &me->ctm, &me->tbounds, &me->cookie, band_start, me->pix, &me->bit);
+		DEBUG_THREADS(("Worker %d completed band_start %d (status=%d)\n", me->num, band_start, me->status));
 		SEMAPHORE_TRIGGER(me->stop);
 	}
-	while (me->band_start >= 0);
+	while (band_start >= 0);
 	THREAD_RETURN();
 }
 
@@ -1529,6 +1932,101 @@ static THREAD_RETURN_TYPE bgprint_worker(void *arg)
 	while (pagenum >= 0);
 	THREAD_RETURN();
 }
+
+static THREAD_RETURN_TYPE pipeline_render_worker(void *arg)
+{
+	fz_context *ctx = pipeline.render_ctx;
+	fz_cookie cookie;
+	pipeline_page *p;
+	int status;
+
+	(void)arg;
+
+	while (1)
+	{
+		MUTEX_LOCK(pipeline.lock);
+		while (pipeline.pages == NULL && !pipeline.closing)
+			pipeline_wait(&pipeline.render_waiting, &pipeline.render_wake);
+		p = pipeline.pages;
+		if (p == NULL)
+		{
+			/* Closing, and nothing left to render. */
+			pipeline.render_done = 1;
+			pipeline_wake(&pipeline.output_waiting, &pipeline.output_wake);
+			MUTEX_UNLOCK(pipeline.lock);
+			break;
+		}
+		pipeline.pages = p->next;
+		MUTEX_UNLOCK(pipeline.lock);
+
+		DEBUG_THREADS(("Pipeline rendering page %d\n", p->pagenum));
+		memset(&cookie, 0, sizeof(cookie));
+		cookie.errors = p->errors;
+		status = try_render_page(ctx, p->pagenum, &cookie, gettime(), p->interptime, p->filename, 1, 0, &p->render);
+		DEBUG_THREADS(("Pipeline rendered page %d (status=%d)\n", p->pagenum, status));
+		fz_free(ctx, p);
+
+		MUTEX_LOCK(pipeline.lock);
+		if (status != RENDER_OK && pipeline.status != RENDER_FATAL)
+			pipeline.status = status;
+		pipeline.pages_in_flight--;
+		pipeline_wake(&pipeline.main_waiting, &pipeline.main_wake);
+		MUTEX_UNLOCK(pipeline.lock);
+	}
+	THREAD_RETURN();
+}
+
+static THREAD_RETURN_TYPE pipeline_output_worker(void *arg)
+{
+	fz_context *ctx = pipeline.output_ctx;
+	pipeline_job *job;
+	int failed;
+
+	(void)arg;
+
+	while (1)
+	{
+		MUTEX_LOCK(pipeline.lock);
+		while (pipeline.jobs == NULL && !pipeline.render_done)
+			pipeline_wait(&pipeline.output_waiting, &pipeline.output_wake);
+		job = pipeline.jobs;
+		if (job == NULL)
+		{
+			/* Nothing more will be queued. */
+			pipeline.output_done = 1;
+			pipeline_wake(&pipeline.main_waiting, &pipeline.main_wake);
+			MUTEX_UNLOCK(pipeline.lock);
+			break;
+		}
+		pipeline.jobs = job->next;
+		failed = (pipeline.status == RENDER_FATAL);
+		MUTEX_UNLOCK(pipeline.lock);
+
+		fz_try(ctx)
+		{
+			/* Once output has failed, just discard everything. */
+			if (job->type == JOB_HEADER && !failed)
+				fz_write_header(ctx, job->bander, job->w, job->h, job->n, job->alpha, job->xres, job->yres, job->pagenum);
+			else if (job->type == JOB_BAND && !failed)
+				fz_write_band(ctx, job->bander, job->stride, job->band_start, job->band_height, job->samples);
+			else if (job->type == JOB_END)
+				fz_drop_band_writer(ctx, job->bander);
+		}
+		fz_catch(ctx)
+			failed = 1;
+		fz_free(ctx, job->samples);
+		fz_free(ctx, job);
+
+		MUTEX_LOCK(pipeline.lock);
+		if (failed)
+			pipeline.status = RENDER_FATAL;
+		pipeline.jobs_in_flight--;
+		pipeline_wake(&pipeline.render_waiting, &pipeline.render_wake);
+		pipeline_wake(&pipeline.main_waiting, &pipeline.main_wake);
+		MUTEX_UNLOCK(pipeline.lock);
+	}
+	THREAD_RETURN();
+}
 #endif
 
 static void
@@ -1550,6 +2048,29 @@ read_resolution(const char *arg)
 		y_resolution = x_resolution;
 }
 
+#if MURASTER_THREADS != 0
+static size_t
+read_budget(const char *arg)
+{
+	char *end;
+	double budget = fz_strtod(arg, &end);
+
+	switch (*end)
+	{
+	case 'k': case 'K': budget *= 1024; break;
+	case 'm': case 'M': budget *= 1024 * 1024; break;
+	case 'g': case 'G': budget *= 1024 * 1024 * 1024; break;
+	}
+	if (budget < 1)
+	{
+		fprintf(stderr, "Require a positive memory budget\n");
+		exit(1);
+	}
+
+	return (size_t)budget;
+}
+#endif
+
 static int
 read_rotation(const char *arg)
 {
@@ -1578,11 +2099,13 @@ int main(int argc, char **argv)
 	fz_document *doc = NULL;
 	int c, i;
 	fz_context *ctx;
+	size_t store_size;
 	fz_alloc_context alloc_ctx = { NULL, trace_malloc, trace_realloc, trace_free };
 
 	fz_var(doc);
 
 	bgprint.active = 0;			/* set by -P */
+	pipeline.active = 0;			/* set by -m */
 	min_band_height = MIN_BAND_HEIGHT;
 	max_band_memory = BAND_MEMORY;
 	width = 0;
@@ -1591,7 +2114,7 @@ int main(int argc, char **argv)
 	x_resolution = X_RESOLUTION;
 	y_resolution = Y_RESOLUTION;
 
-	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:M:s:A:iW:H:S:T:U:vP")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:M:s:A:iW:H:S:T:U:vPm:")) != -1)
 	{
 		switch (c)
 		{
@@ -1646,6 +2169,15 @@ int main(int argc, char **argv)
 #else
 			fprintf(stderr, "Threads not enabled in this build\n");
 			break;
+#endif
+		case 'm':
+#if MURASTER_THREADS != 0
+			pipeline.active = 1;
+			pipeline.budget = read_budget(fz_optarg);
+			break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
 #endif
 		case 'v': fprintf(stderr, "muraster version %s\n", FZ_VERSION); return 1;
 		}
@@ -1666,7 +2198,16 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	ctx = fz_new_context((showmemory == 0 ? NULL : &alloc_ctx), LOCKS_INIT(), FZ_STORE_DEFAULT);
+	/* Pipelining subsumes background printing. */
+	if (pipeline.active)
+		bgprint.active = 0;
+
+	/* The pipeline needs the trace allocator to measure memory use. Leave
+	 * the other half of the budget for lists, pages and bands in flight. */
+	store_size = FZ_STORE_DEFAULT;
+	if (pipeline.active && pipeline.budget / 2 < store_size)
+		store_size = pipeline.budget / 2;
+	ctx = fz_new_context((showmemory == 0 && !pipeline.active ? NULL : &alloc_ctx), LOCKS_INIT(), store_size);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
@@ -1676,6 +2217,10 @@ int main(int argc, char **argv)
 	fz_set_text_aa_level(ctx, alphabits_text);
 	fz_set_graphics_aa_level(ctx, alphabits_graphics);
 
+	/* We only read the files we are given, and don't keep them open
+	 * for long, so mapping them is safe. */
+	fz_tune_file_mapping(ctx, 1);
+
 	if (bgprint.active)
 	{
 		bgprint.ctx = fz_clone_context(ctx);
@@ -1684,6 +2229,19 @@ int main(int argc, char **argv)
 		THREAD_INIT(bgprint.thread, bgprint_worker, NULL);
 	}
 
+	if (pipeline.active)
+	{
+		pipeline.render_ctx = fz_clone_context(ctx);
+		pipeline.output_ctx = fz_clone_context(ctx);
+		MUTEX_INIT(pipeline.lock);
+		MUTEX_INIT(pipeline.doc_lock);
+		SEMAPHORE_INIT(pipeline.main_wake);
+		SEMAPHORE_INIT(pipeline.render_wake);
+		SEMAPHORE_INIT(pipeline.output_wake);
+		THREAD_INIT(pipeline.render_thread, pipeline_render_worker, NULL);
+		THREAD_INIT(pipeline.output_thread, pipeline_output_worker, NULL);
+	}
+
 	if (num_workers > 0)
 	{
 		workers = fz_calloc(ctx, num_workers, sizeof(*workers));
@@ -1800,11 +2358,16 @@ int main(int argc, char **argv)
 				if (fz_optind < argc && fz_is_page_range(ctx, argv[fz_optind]))
 					drawrange(ctx, doc, argv[fz_optind++]);
 
+				/* Queued pages need their document. */
+				finish_pipeline(ctx);
+
 				fz_drop_document(ctx, doc);
 				doc = NULL;
 			}
 			fz_catch(ctx)
 			{
+				(void)wait_for_pipeline_to_drain();
+
 				if (!ignore_errors)
 					fz_rethrow(ctx);
 
@@ -1830,6 +2393,26 @@ int main(int argc, char **argv)
 		fprintf(stderr, "slowest page %d: %dms\n", timing.maxpage, timing.max);
 	}
 
+	/* The render thread uses the workers, so stop it first. */
+	if (pipeline.active)
+	{
+		MUTEX_LOCK(pipeline.lock);
+		pipeline.closing = 1;
+		pipeline_wake(&pipeline.render_waiting, &pipeline.render_wake);
+		while (!pipeline.output_done)
+			pipeline_wait(&pipeline.main_waiting, &pipeline.main_wake);
+		MUTEX_UNLOCK(pipeline.lock);
+		THREAD_FIN(pipeline.render_thread);
+		THREAD_FIN(pipeline.output_thread);
+		SEMAPHORE_FIN(pipeline.main_wake);
+		SEMAPHORE_FIN(pipeline.render_wake);
+		SEMAPHORE_FIN(pipeline.output_wake);
+		MUTEX_FIN(pipeline.lock);
+		MUTEX_FIN(pipeline.doc_lock);
+		fz_drop_context(pipeline.render_ctx);
+		fz_drop_context(pipeline.output_ctx);
+	}
+
 	if (num_workers > 0)
 	{
 		for (i = 0; i < num_workers; i++)
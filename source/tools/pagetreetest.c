@@ -0,0 +1,321 @@
+/*
+ * pagetreetest -- check that a saved page tree index is only used
+ * while it matches the document
+ */
+
+#include "mupdf/fitz.h"
+#include "mupdf/pdf.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+	A small file is made with its pages spread over two levels of the
+	page tree. Its index is saved with pdf_save_page_tree, and loaded
+	back into a fresh copy of the file, which must then give the same
+	page objects and numbers as walking the tree.
+
+	The same index must be refused by a file that has had an update
+	appended. A file of the same size and with its xref in the same
+	place, but with two pages swapped in the tree, passes the checks
+	done on loading, as do indexes edited to swap two pages or to
+	list a non-page object; lookups must still give the tree's
+	answers.
+
+		make check
+*/
+
+#define PAGES 6
+
+static int failed = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "pagetreetest: %s\n", what);
+		failed = 1;
+	}
+}
+
+static int
+buffer_len(fz_context *ctx, fz_buffer *buf)
+{
+	unsigned char *data;
+	return (int)fz_buffer_storage(ctx, buf, &data);
+}
+
+static fz_buffer *
+copy_buffer(fz_context *ctx, fz_buffer *buf)
+{
+	unsigned char *data;
+	size_t len = fz_buffer_storage(ctx, buf, &data);
+	fz_buffer *copy = fz_new_buffer(ctx, len + 256);
+	fz_write_buffer(ctx, copy, data, len);
+	return copy;
+}
+
+/* Objects 1 and 2 are the catalog and the root of the page tree, 3 and 4
+ * are its two kids, and the pages are 5 onwards, the first half under 3
+ * and the rest under 4. With swap set, the first two pages change places
+ * without changing the length of anything. */
+static fz_buffer *
+make_file(fz_context *ctx, int swap, int *startxrefp)
+{
+	fz_buffer *buf = fz_new_buffer(ctx, 4096);
+	int ofs[5 + PAGES];
+	int i, startxref;
+
+	fz_try(ctx)
+	{
+		fz_buffer_printf(ctx, buf, "%%PDF-1.4\n");
+		ofs[1] = buffer_len(ctx, buf);
+		fz_buffer_printf(ctx, buf, "1 0 obj\n<</Type/Catalog/Pages 2 0 R>>\nendobj\n");
+		ofs[2] = buffer_len(ctx, buf);
+		fz_buffer_printf(ctx, buf, "2 0 obj\n<</Type/Pages/Kids[3 0 R 4 0 R]/Count %d>>\nendobj\n", PAGES);
+		ofs[3] = buffer_len(ctx, buf);
+		fz_buffer_printf(ctx, buf, "3 0 obj\n<</Type/Pages/Parent 2 0 R/Kids[%d 0 R %d 0 R %d 0 R]/Count 3>>\nendobj\n",
+			swap ? 6 : 5, swap ? 5 : 6, 7);
+		ofs[4] = buffer_len(ctx, buf);
+		fz_buffer_printf(ctx, buf, "4 0 obj\n<</Type/Pages/Parent 2 0 R/Kids[8 0 R 9 0 R 10 0 R]/Count 3>>\nendobj\n");
+		for (i = 0; i < PAGES; i++)
+		{
+			ofs[5 + i] = buffer_len(ctx, buf);
+			fz_buffer_printf(ctx, buf, "%d 0 obj\n<</Type/Page/Parent %d 0 R/MediaBox[0 0 %d 100]>>\nendobj\n",
+				5 + i, i < 3 ? 3 : 4, 100 + i);
+		}
+		startxref = buffer_len(ctx, buf);
+		fz_buffer_printf(ctx, buf, "xref\n0 %d\n0000000000 65535 f \n", 5 + PAGES);
+		for (i = 1; i < 5 + PAGES; i++)
+			fz_buffer_printf(ctx, buf, "%010d 00000 n \n", ofs[i]);
+		fz_buffer_printf(ctx, buf, "trailer\n<</Size %d/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n", 5 + PAGES, startxref);
+		*startxrefp = startxref;
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+static pdf_document *
+open_file(fz_context *ctx, fz_buffer *buf)
+{
+	fz_stream *stm = fz_open_buffer(ctx, buf);
+	pdf_document *doc = NULL;
+
+	fz_try(ctx)
+		doc = pdf_open_document_with_stream(ctx, stm);
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return doc;
+}
+
+/* Load an index into a fresh copy of file. */
+static pdf_document *
+open_with_index(fz_context *ctx, fz_buffer *file, fz_buffer *index, int *loaded)
+{
+	pdf_document *doc = open_file(ctx, file);
+	fz_stream *stm = NULL;
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		stm = fz_open_buffer(ctx, index);
+		*loaded = pdf_load_saved_page_tree(ctx, doc, stm);
+	}
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+	{
+		pdf_drop_document(ctx, doc);
+		fz_rethrow(ctx);
+	}
+	return doc;
+}
+
+static void
+check_page_number(fz_context *ctx, pdf_document *doc, int num, int page, const char *what)
+{
+	pdf_obj *obj = pdf_new_indirect(ctx, doc, num, 0);
+	char msg[100];
+
+	fz_snprintf(msg, sizeof msg, "%s: wrong page number for page %d", what, page + 1);
+	fz_try(ctx)
+		check(pdf_lookup_page_number(ctx, doc, obj) == page, msg);
+	fz_always(ctx)
+		pdf_drop_obj(ctx, obj);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Check that every lookup in doc gives the answer that walking the tree of
+ * the same file does. Reverse lookups go first for half the pages, so that
+ * both kinds of lookup are the first to use some saved pages. */
+static void
+check_lookups(fz_context *ctx, pdf_document *doc, fz_buffer *file, const char *what)
+{
+	pdf_document *walk = NULL;
+	char msg[100];
+	int i, k, num;
+
+	fz_var(walk);
+
+	fz_try(ctx)
+	{
+		walk = open_file(ctx, file);
+		for (k = 0; k < PAGES; k++)
+		{
+			i = (k * 5) % PAGES;
+			num = pdf_to_num(ctx, pdf_lookup_page_obj(ctx, walk, i));
+			if (i & 1)
+				check_page_number(ctx, doc, num, i, what);
+			fz_snprintf(msg, sizeof msg, "%s: wrong object for page %d", what, i + 1);
+			check(pdf_to_num(ctx, pdf_lookup_page_obj(ctx, doc, i)) == num, msg);
+			check_page_number(ctx, doc, num, i, what);
+		}
+	}
+	fz_always(ctx)
+		pdf_drop_document(ctx, walk);
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+}
+
+static void
+edit_index(fz_context *ctx, fz_buffer *index, int page, int num)
+{
+	unsigned char *data;
+	size_t len = fz_buffer_storage(ctx, index, &data);
+	unsigned char *entry = data + len - (PAGES - page) * 8;
+	entry[0] = num;
+	entry[1] = entry[2] = entry[3] = 0;
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	fz_buffer *file = NULL;
+	fz_buffer *swapped = NULL;
+	fz_buffer *updated = NULL;
+	fz_buffer *index = NULL;
+	fz_buffer *edited = NULL;
+	pdf_document *doc = NULL;
+	fz_output *out = NULL;
+	int startxref, len, loaded;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "pagetreetest: cannot create context\n");
+		return 1;
+	}
+
+	fz_var(file);
+	fz_var(swapped);
+	fz_var(updated);
+	fz_var(index);
+	fz_var(edited);
+	fz_var(doc);
+	fz_var(out);
+
+	fz_try(ctx)
+	{
+		file = make_file(ctx, 0, &startxref);
+		swapped = make_file(ctx, 1, &startxref);
+		check(buffer_len(ctx, file) == buffer_len(ctx, swapped), "swapping pages changed the length of the file");
+
+		/* Save the index of the file, and load it into a fresh copy. */
+		doc = open_file(ctx, file);
+		index = fz_new_buffer(ctx, 256);
+		out = fz_new_output_with_buffer(ctx, index);
+		pdf_save_page_tree(ctx, doc, out);
+		fz_drop_output(ctx, out);
+		out = NULL;
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+
+		doc = open_with_index(ctx, file, index, &loaded);
+		check(loaded, "saved index refused by the file it was saved from");
+		check_lookups(ctx, doc, file, "saved index");
+		check(doc->fwd_page_map && !doc->page_map_stale, "saved index not used");
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+
+		/* A file with an update appended must refuse the index. */
+		updated = copy_buffer(ctx, file);
+		fz_buffer_printf(ctx, updated, "5 0 obj\n<</Type/Page/Parent 3 0 R/MediaBox[0 0 50 50]>>\nendobj\n");
+		len = buffer_len(ctx, updated);
+		fz_buffer_printf(ctx, updated, "xref\n5 1\n%010d 00000 n \n", buffer_len(ctx, file));
+		fz_buffer_printf(ctx, updated, "trailer\n<</Size %d/Root 1 0 R/Prev %d>>\nstartxref\n%d\n%%%%EOF\n",
+			5 + PAGES, startxref, len);
+		doc = open_with_index(ctx, updated, index, &loaded);
+		check(!loaded, "saved index used for a file that has been updated");
+		check_lookups(ctx, doc, updated, "updated file");
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+
+		/* A file that only differs in its page tree passes the checks
+		 * on loading, but must not give the old answers. */
+		doc = open_with_index(ctx, swapped, index, &loaded);
+		check_lookups(ctx, doc, swapped, "file with swapped pages");
+		check(doc->page_map_stale, "saved index still used for a file with swapped pages");
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+
+		/* Nor must an index that has had two pages swapped... */
+		edited = copy_buffer(ctx, index);
+		edit_index(ctx, edited, 3, 9);
+		edit_index(ctx, edited, 4, 8);
+		doc = open_with_index(ctx, file, edited, &loaded);
+		check_lookups(ctx, doc, file, "index with swapped pages");
+		check(doc->page_map_stale, "index with swapped pages still used");
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+
+		/* ...or one that lists a page tree node as a page. */
+		fz_drop_buffer(ctx, edited);
+		edited = NULL;
+		edited = copy_buffer(ctx, index);
+		edit_index(ctx, edited, 0, 3);
+		doc = open_with_index(ctx, file, edited, &loaded);
+		check_lookups(ctx, doc, file, "index with a non-page object");
+		check(doc->page_map_stale, "index with a non-page object still used");
+
+		/* Saving again must not pass the bad index on. */
+		fz_drop_buffer(ctx, index);
+		index = NULL;
+		index = fz_new_buffer(ctx, 256);
+		out = fz_new_output_with_buffer(ctx, index);
+		pdf_save_page_tree(ctx, doc, out);
+		fz_drop_output(ctx, out);
+		out = NULL;
+		pdf_drop_document(ctx, doc);
+		doc = NULL;
+		doc = open_with_index(ctx, file, index, &loaded);
+		check(loaded, "index saved from a bad one refused");
+		check_lookups(ctx, doc, file, "index saved from a bad one");
+		check(doc->fwd_page_map && !doc->page_map_stale, "index saved from a bad one not used");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		pdf_drop_document(ctx, doc);
+		fz_drop_buffer(ctx, edited);
+		fz_drop_buffer(ctx, index);
+		fz_drop_buffer(ctx, updated);
+		fz_drop_buffer(ctx, swapped);
+		fz_drop_buffer(ctx, file);
+	}
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+
+	fz_drop_context(ctx);
+
+	fprintf(stderr, "pagetreetest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
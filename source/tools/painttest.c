@@ -0,0 +1,242 @@
+/*
+ * painttest -- check that the vector span painters give exactly the
+ * same results as the plain C ones
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/draw-imp.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+	The painters are compiled into this test a second time with
+	FZ_NO_SIMD, under other names, to compare the library's painters
+	against. Random spans of every width up to a few vector groups
+	are painted with both, from unaligned pointers, for every
+	combination of components, destination and source alpha, and
+	constant alpha that has a painter. The results (and the bytes
+	around them) must be identical.
+
+		make check
+*/
+
+#define FZ_NO_SIMD
+#define fz_get_solid_color_painter ref_get_solid_color_painter
+#define fz_get_span_color_painter ref_get_span_color_painter
+#define fz_get_span_painter ref_get_span_painter
+#define fz_paint_pixmap_with_bbox ref_paint_pixmap_with_bbox
+#define fz_paint_pixmap ref_paint_pixmap
+#define fz_paint_pixmap_with_mask ref_paint_pixmap_with_mask
+#define fz_paint_glyph_mask ref_paint_glyph_mask
+#define fz_paint_glyph_alpha ref_paint_glyph_alpha
+#define fz_paint_glyph_solid ref_paint_glyph_solid
+#define fz_paint_glyph ref_paint_glyph
+#include "../fitz/draw-paint.c"
+#undef fz_get_solid_color_painter
+#undef fz_get_span_color_painter
+#undef fz_get_span_painter
+#undef fz_paint_pixmap_with_bbox
+#undef fz_paint_pixmap
+#undef fz_paint_pixmap_with_mask
+#undef fz_paint_glyph_mask
+#undef fz_paint_glyph_alpha
+#undef fz_paint_glyph_solid
+#undef fz_paint_glyph
+
+#define ROUNDS 20000
+#define MAX_W 70
+#define MAX_N 6
+#define PAD 16
+#define SIZE (PAD + MAX_W * MAX_N + PAD)
+
+static int failed = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "painttest: %s\n", what);
+		failed = 1;
+	}
+}
+
+static unsigned int seed = 1;
+
+static int
+random_byte(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 255;
+}
+
+/* Alphas of 0 and 255 take their own paths, so make them common. */
+static int
+random_alpha(void)
+{
+	switch (random_byte() & 3)
+	{
+	case 0: return 0;
+	case 1: return 255;
+	default: return random_byte();
+	}
+}
+
+/* Fill w pixels of n samples, the last of which is alpha if a is set, with
+ * premultiplied values. The padding either side is random too. */
+static void
+random_pixels(byte *buf, int offset, int w, int n, int a)
+{
+	int i, k, alpha;
+
+	for (i = 0; i < SIZE; i++)
+		buf[i] = random_byte();
+	buf += offset;
+	for (i = 0; i < w; i++, buf += n)
+	{
+		if (!a)
+			continue;
+		alpha = random_alpha();
+		for (k = 0; k < n - 1; k++)
+			buf[k] = alpha ? random_byte() % (alpha + 1) : 0;
+		buf[n - 1] = alpha;
+	}
+}
+
+/* The color channels (not counting alpha) to try. */
+static const int channels[] = { 0, 1, 3, 4, 5 };
+
+static void
+report(const char *what, int n, int da, int sa, int alpha, int w, int offset)
+{
+	char msg[200];
+	fz_snprintf(msg, sizeof msg, "%s differs for n=%d da=%d sa=%d alpha=%d w=%d offset=%d",
+		what, n, da, sa, alpha, w, offset);
+	check(0, msg);
+}
+
+static void
+test_solid_color(int round)
+{
+	byte color[MAX_N + 1];
+	byte dst[SIZE], ref[SIZE];
+	fz_solid_color_painter_t *fn, *rfn;
+	int n = channels[round % nelem(channels)];
+	int da = n == 0 || (random_byte() & 1);
+	int w = 1 + random_byte() % MAX_W;
+	int offset = random_byte() % PAD;
+	int k;
+
+	for (k = 0; k < n; k++)
+		color[k] = random_byte();
+	color[n] = random_alpha();
+
+	fn = fz_get_solid_color_painter(n + da, color, da);
+	rfn = ref_get_solid_color_painter(n + da, color, da);
+	if (!fn || !rfn)
+	{
+		if (!fn != !rfn)
+			report("solid color painter choice", n, da, 0, color[n], w, offset);
+		return;
+	}
+
+	random_pixels(dst, offset, w, n + da, da);
+	memcpy(ref, dst, SIZE);
+	fn(dst + offset, n + da, w, color, da);
+	rfn(ref + offset, n + da, w, color, da);
+	if (memcmp(dst, ref, SIZE))
+		report("solid color", n, da, 0, color[n], w, offset);
+}
+
+static void
+test_span_color(int round)
+{
+	byte color[MAX_N + 1];
+	byte dst[SIZE], ref[SIZE], mask[SIZE];
+	fz_span_color_painter_t *fn, *rfn;
+	int n = channels[round % nelem(channels)];
+	int da = n == 0 || (random_byte() & 1);
+	int w = 1 + random_byte() % MAX_W;
+	int offset = random_byte() % PAD;
+	int moffset = random_byte() % PAD;
+	int k;
+
+	for (k = 0; k < n; k++)
+		color[k] = random_byte();
+	color[n] = random_alpha();
+
+	fn = fz_get_span_color_painter(n + da, da, color);
+	rfn = ref_get_span_color_painter(n + da, da, color);
+	if (!fn || !rfn)
+	{
+		if (!fn != !rfn)
+			report("span color painter choice", n, da, 0, color[n], w, offset);
+		return;
+	}
+
+	random_pixels(dst, offset, w, n + da, da);
+	for (k = 0; k < SIZE; k++)
+		mask[k] = random_alpha();
+	/* Whole runs of empty mask are skipped, so make some. */
+	if (random_byte() & 1)
+		memset(mask + moffset, 0, random_byte() % (w + 1));
+	memcpy(ref, dst, SIZE);
+	fn(dst + offset, mask + moffset, n + da, w, color, da);
+	rfn(ref + offset, mask + moffset, n + da, w, color, da);
+	if (memcmp(dst, ref, SIZE))
+		report("span with color", n, da, 0, color[n], w, offset);
+}
+
+static void
+test_span(int round)
+{
+	byte dst[SIZE], ref[SIZE], src[SIZE];
+	fz_span_painter_t *fn, *rfn;
+	int n = channels[round % nelem(channels)];
+	int da = n == 0 || (random_byte() & 1);
+	int sa = n == 0 || (random_byte() & 1);
+	int alpha = random_alpha();
+	int w = 1 + random_byte() % MAX_W;
+	int offset = random_byte() % PAD;
+	int soffset = random_byte() % PAD;
+
+	fn = fz_get_span_painter(da, sa, n, alpha);
+	rfn = ref_get_span_painter(da, sa, n, alpha);
+	if (!fn || !rfn)
+	{
+		if (!fn != !rfn)
+			report("span painter choice", n, da, sa, alpha, w, offset);
+		return;
+	}
+
+	random_pixels(dst, offset, w, n + da, da);
+	random_pixels(src, soffset, w, n + sa, sa);
+	/* Opaque spans take a shortcut. */
+	if (sa && (random_byte() & 1))
+	{
+		int i;
+		for (i = 0; i < w; i++)
+			src[soffset + i * (n + 1) + n] = 255;
+	}
+	memcpy(ref, dst, SIZE);
+	fn(dst + offset, da, src + soffset, sa, n, w, alpha);
+	rfn(ref + offset, da, src + soffset, sa, n, w, alpha);
+	if (memcmp(dst, ref, SIZE))
+		report("span", n, da, sa, alpha, w, offset);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; i < ROUNDS && !failed; i++)
+	{
+		test_solid_color(i);
+		test_span_color(i);
+		test_span(i);
+	}
+
+	fprintf(stderr, "painttest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
@@ -11,6 +11,43 @@
 
 #include "mupdf/pdf.h"
 
+#ifdef _MSC_VER
+#include <windows.h>
+#define PDFCLEAN_THREADS
+#define MUTEX CRITICAL_SECTION
+#define MUTEX_INIT(A) InitializeCriticalSection(&A)
+#define MUTEX_FIN(A) DeleteCriticalSection(&A)
+#define MUTEX_LOCK(A) EnterCriticalSection(&A)
+#define MUTEX_UNLOCK(A) LeaveCriticalSection(&A)
+#elif defined(HAVE_PTHREADS)
+#include <pthread.h>
+#define PDFCLEAN_THREADS
+#define MUTEX pthread_mutex_t
+#define MUTEX_INIT(A) (void)pthread_mutex_init(&A, NULL)
+#define MUTEX_FIN(A) (void)pthread_mutex_destroy(&A)
+#define MUTEX_LOCK(A) (void)pthread_mutex_lock(&A)
+#define MUTEX_UNLOCK(A) (void)pthread_mutex_unlock(&A)
+#endif
+
+#ifdef PDFCLEAN_THREADS
+static MUTEX mutexes[FZ_LOCK_MAX];
+
+static void pdfclean_lock(void *user, int lock)
+{
+	MUTEX_LOCK(mutexes[lock]);
+}
+
+static void pdfclean_unlock(void *user, int lock)
+{
+	MUTEX_UNLOCK(mutexes[lock]);
+}
+
+static fz_locks_context pdfclean_locks =
+{
+	NULL, pdfclean_lock, pdfclean_unlock
+};
+#endif
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -27,6 +64,7 @@ static void usage(void)
 		"\t-f\tcompress font streams\n"
 		"\t-i\tcompress image streams\n"
 		"\t-s\tclean content streams\n"
+		"\t-T -\tnumber of threads to load and compress streams with\n"
 		"\tpages\tcomma separated list of page numbers and ranges\n"
 		);
 	exit(1);
@@ -38,14 +76,18 @@ int pdfclean_main(int argc, char **argv)
 	char *outfile = "out.pdf";
 	char *password = "";
 	int c;
+	int num_threads = 0;
 	pdf_write_options opts = { 0 };
 	int errors = 0;
 	fz_context *ctx;
+#ifdef PDFCLEAN_THREADS
+	int i;
+#endif
 
 	opts.continue_on_error = 1;
 	opts.errors = &errors;
 
-	while ((c = fz_getopt(argc, argv, "adfgilp:sz")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgilp:szT:")) != -1)
 	{
 		switch (c)
 		{
@@ -59,6 +101,13 @@ int pdfclean_main(int argc, char **argv)
 		case 'g': opts.do_garbage += 1; break;
 		case 'l': opts.do_linear += 1; break;
 		case 's': opts.do_clean += 1; break;
+		case 'T':
+#ifdef PDFCLEAN_THREADS
+			num_threads = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
+#endif
 		default: usage(); break;
 		}
 	}
@@ -77,7 +126,13 @@ int pdfclean_main(int argc, char **argv)
 		outfile = argv[fz_optind++];
 	}
 
+#ifdef PDFCLEAN_THREADS
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		MUTEX_INIT(mutexes[i]);
+	ctx = fz_new_context(NULL, &pdfclean_locks, FZ_STORE_UNLIMITED);
+#else
 	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+#endif
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
@@ -86,13 +141,21 @@ int pdfclean_main(int argc, char **argv)
 
 	fz_try(ctx)
 	{
+		if (num_threads > 0)
+			opts.thread_pool = fz_new_thread_pool(ctx, num_threads);
 		pdf_clean_file(ctx, infile, outfile, password, &opts, &argv[fz_optind], argc - fz_optind);
 	}
 	fz_catch(ctx)
 	{
 		errors++;
 	}
+	fz_drop_thread_pool(ctx, opts.thread_pool);
 	fz_drop_context(ctx);
 
+#ifdef PDFCLEAN_THREADS
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		MUTEX_FIN(mutexes[i]);
+#endif
+
 	return errors != 0;
 }
@@ -0,0 +1,215 @@
+/*
+ * scalebench -- time the smooth scaler on real images
+ */
+
+#include "mupdf/fitz.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+/*
+	Each image is converted to each of the requested colorspaces and
+	then scaled down repeatedly, printing the time taken per scale and
+	the MD5 of the result.
+
+	The vector row scalers are chosen when the library is built, so to
+	compare them against the plain C versions, build twice and run
+	both on the same set of images:
+
+		make build=release
+		make build=release XCFLAGS=-DFZ_NO_SIMD OUT=build/nosimd
+		build/release/scalebench scans/ *.jpg
+		build/nosimd/scalebench scans/ *.jpg
+
+	(Remove the space from "/ *.jpg"; it is only there to keep this
+	comment well formed.) The digests should be the same for both.
+
+	Scanned pages make the best test images: they are large, and the
+	usual reason for scaling them is to make thumbnails or to fit them
+	to the screen. 'mutool extract' will pull the images out of a
+	scanned PDF.
+*/
+
+static const float default_factors[] = { 0.5f, 0.2f, 0.0625f };
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: scalebench [options] image...\n"
+		"\t-w -\tscale to this width (default: 1/2, 1/5 and 1/16 of the image)\n"
+		"\t-n -\tnumber of times to scale each image (default: 10)\n"
+		"\t-c -\tcomma separated colorspaces (gray, grayalpha, rgb, rgba, cmyk, cmykalpha)\n"
+		"\t\t(default: gray,rgb,rgba,cmyk)\n"
+		);
+	exit(1);
+}
+
+static double gettime(void)
+{
+#ifdef _MSC_VER
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000 / freq.QuadPart;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+#endif
+}
+
+static fz_pixmap *
+convert(fz_context *ctx, fz_pixmap *src, const char *name)
+{
+	fz_colorspace *cs;
+	int alpha = 0;
+	fz_pixmap *dst;
+
+	if (!strcmp(name, "gray") || !strcmp(name, "grayalpha"))
+		cs = fz_device_gray(ctx);
+	else if (!strcmp(name, "rgb") || !strcmp(name, "rgba"))
+		cs = fz_device_rgb(ctx);
+	else if (!strcmp(name, "cmyk") || !strcmp(name, "cmykalpha"))
+		cs = fz_device_cmyk(ctx);
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown colorspace '%s'", name);
+	if (strstr(name, "alpha") || !strcmp(name, "rgba"))
+		alpha = 1;
+
+	dst = fz_new_pixmap(ctx, cs, src->w, src->h, alpha);
+	fz_try(ctx)
+		fz_convert_pixmap(ctx, dst, src);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, dst);
+		fz_rethrow(ctx);
+	}
+	return dst;
+}
+
+static void
+bench(fz_context *ctx, fz_pixmap *pix, const char *name, int w, int repeats)
+{
+	fz_pixmap *out = NULL;
+	unsigned char digest[16];
+	double start, elapsed;
+	int h, i;
+
+	h = (int)((double)pix->h * w / pix->w + 0.5);
+	if (h < 1)
+		h = 1;
+
+	/* Once to warm up the caches, and for the digest. */
+	out = fz_scale_pixmap(ctx, pix, 0, 0, w, h, NULL);
+	if (!out)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot scale to %dx%d", w, h);
+	fz_md5_pixmap(ctx, out, digest);
+	fz_drop_pixmap(ctx, out);
+
+	start = gettime();
+	for (i = 0; i < repeats; i++)
+	{
+		out = fz_scale_pixmap(ctx, pix, 0, 0, w, h, NULL);
+		fz_drop_pixmap(ctx, out);
+	}
+	elapsed = gettime() - start;
+
+	printf("  %-10s n=%d %5dx%-5d -> %5dx%-5d %9.3f ms ",
+		name, pix->n, pix->w, pix->h, w, h, elapsed / repeats);
+	for (i = 0; i < 16; i++)
+		printf("%02x", digest[i]);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	char *colorspaces = "gray,rgb,rgba,cmyk";
+	int width = 0;
+	int repeats = 10;
+	int errors = 0;
+	int c, i;
+
+	while ((c = fz_getopt(argc, argv, "w:n:c:")) != -1)
+	{
+		switch (c)
+		{
+		case 'w': width = atoi(fz_optarg); break;
+		case 'n': repeats = atoi(fz_optarg); break;
+		case 'c': colorspaces = fz_optarg; break;
+		default: usage(); break;
+		}
+	}
+
+	if (fz_optind == argc || repeats < 1)
+		usage();
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot initialise context\n");
+		exit(1);
+	}
+
+	for (i = fz_optind; i < argc; i++)
+	{
+		fz_image *image = NULL;
+		fz_pixmap *pix = NULL;
+		fz_pixmap *conv = NULL;
+		char *list = NULL;
+
+		fz_var(image);
+		fz_var(pix);
+		fz_var(conv);
+		fz_var(list);
+
+		fz_try(ctx)
+		{
+			char *name, *rest;
+
+			image = fz_new_image_from_file(ctx, argv[i]);
+			pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+			printf("%s\n", argv[i]);
+
+			list = rest = fz_strdup(ctx, colorspaces);
+			while ((name = fz_strsep(&rest, ",")) != NULL)
+			{
+				if (!*name)
+					continue;
+				conv = convert(ctx, pix, name);
+				if (width > 0)
+					bench(ctx, conv, name, width, repeats);
+				else
+				{
+					int k;
+					for (k = 0; k < (int)nelem(default_factors); k++)
+						bench(ctx, conv, name, fz_maxi(1, (int)(conv->w * default_factors[k])), repeats);
+				}
+				fz_drop_pixmap(ctx, conv);
+				conv = NULL;
+			}
+		}
+		fz_always(ctx)
+		{
+			fz_free(ctx, list);
+			fz_drop_pixmap(ctx, conv);
+			fz_drop_pixmap(ctx, pix);
+			fz_drop_image(ctx, image);
+		}
+		fz_catch(ctx)
+		{
+			fprintf(stderr, "scalebench: cannot benchmark '%s'\n", argv[i]);
+			errors++;
+		}
+	}
+
+	fz_drop_context(ctx);
+	return errors ? 1 : 0;
+}
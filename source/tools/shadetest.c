@@ -0,0 +1,396 @@
+/*
+ * shadetest -- check that mesh shadings paint the same on a pool
+ * and that their patches meet without cracks
+ */
+
+#include "mupdf/fitz.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/*
+	Type 6 and 7 shadings are made up as a grid of patches, whose
+	poles are taken from one wavy lattice so that neighbouring
+	patches share their edges exactly (though every other patch
+	walks them the other way round), and whose corner colours
+	change sharply from patch to patch, so that patches and edges
+	are cut into different numbers of pieces.
+
+	Each shading is drawn with and without a thread pool, and the
+	pixmaps must be identical. Wavy meshes are cut into small
+	triangles, which are painted in tiles. Flat ones, stretched out
+	tall, have large triangles, which are painted in one pass without
+	a pool and in bands with one.
+
+	The triangles of each shading are also collected, and every edge
+	used by only one triangle must lie on the outside of the grid,
+	which is a plain square. An edge anywhere else is a crack.
+
+		make check
+*/
+
+static int failed = 0;
+static char mesh[64];
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "shadetest: %s: %s\n", mesh, what);
+		failed = 1;
+	}
+}
+
+/* Locks, so that the pool can start threads. */
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t mutexes[FZ_LOCK_MAX];
+
+static void test_lock(void *user, int lock)
+{
+	pthread_mutex_lock(&mutexes[lock]);
+}
+
+static void test_unlock(void *user, int lock)
+{
+	pthread_mutex_unlock(&mutexes[lock]);
+}
+
+static fz_locks_context test_locks = { NULL, test_lock, test_unlock };
+
+static fz_locks_context *init_locks(void)
+{
+	int i;
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+	return &test_locks;
+}
+
+static void fin_locks(void)
+{
+	int i;
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_destroy(&mutexes[i]);
+}
+#else
+static fz_locks_context *init_locks(void) { return NULL; }
+static void fin_locks(void) { }
+#endif
+
+/* Making patch meshes */
+
+#define SIZE 100
+#define BPCOORD 16
+#define BPCOMP 8
+
+typedef struct
+{
+	fz_buffer *buf;
+	int bits, n;
+} bit_writer;
+
+static void put_bits(fz_context *ctx, bit_writer *w, unsigned int value, int n)
+{
+	while (n--)
+	{
+		w->bits = (w->bits << 1) | ((value >> n) & 1);
+		if (++w->n == 8)
+		{
+			fz_write_buffer_byte(ctx, w->buf, w->bits);
+			w->bits = 0;
+			w->n = 0;
+		}
+	}
+}
+
+/* Lattice point a, b of a grid of n by n patches. The outside of
+ * the grid is kept straight. */
+static void lattice(int n, int wavy, int a, int b, float *x, float *y)
+{
+	int m = 3 * n;
+	*x = (float)SIZE * a / m;
+	*y = (float)SIZE * b / m;
+	if (!wavy)
+		return;
+	if (a > 0 && a < m)
+		*x += 0.4f * SIZE / m * sinf(b * 1.3f + a * 0.7f);
+	if (b > 0 && b < m)
+		*y += 0.4f * SIZE / m * cosf(a * 1.1f - b * 0.5f);
+}
+
+static void put_point(fz_context *ctx, bit_writer *w, int n, int wavy, int a, int b)
+{
+	float x, y;
+	lattice(n, wavy, a, b, &x, &y);
+	put_bits(ctx, w, (unsigned int)(x / SIZE * 65535 + 0.5f), BPCOORD);
+	put_bits(ctx, w, (unsigned int)(y / SIZE * 65535 + 0.5f), BPCOORD);
+}
+
+static void put_color(fz_context *ctx, bit_writer *w, int n, int wavy, int i, int j)
+{
+	put_bits(ctx, w, 255 * i / n, BPCOMP);
+	put_bits(ctx, w, 255 * j / n, BPCOMP);
+	put_bits(ctx, w, wavy && ((i + j) & 1) ? 255 : 0, BPCOMP);
+}
+
+static fz_shade *new_patch_shade(fz_context *ctx, int type, int n, int wavy)
+{
+	/* Poles in the order they are given in, as u, v. */
+	static const int coons[16][2] = {
+		{ 0, 0 }, { 0, 1 }, { 0, 2 }, { 0, 3 }, { 1, 3 }, { 2, 3 },
+		{ 3, 3 }, { 3, 2 }, { 3, 1 }, { 3, 0 }, { 2, 0 }, { 1, 0 },
+		{ 1, 1 }, { 1, 2 }, { 2, 2 }, { 2, 1 }
+	};
+	static const int corners[4][2] = { { 0, 0 }, { 0, 1 }, { 1, 1 }, { 1, 0 } };
+	bit_writer w = { 0 };
+	fz_shade *shade;
+	int i, j, k;
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	shade->type = type;
+	shade->bbox = fz_infinite_rect;
+	shade->matrix = fz_identity;
+	shade->colorspace = fz_keep_colorspace(ctx, fz_device_rgb(ctx));
+	shade->u.m.bpflag = 8;
+	shade->u.m.bpcoord = BPCOORD;
+	shade->u.m.bpcomp = BPCOMP;
+	shade->u.m.x1 = SIZE;
+	shade->u.m.y1 = SIZE;
+	for (k = 0; k < 3; k++)
+		shade->u.m.c1[k] = 1;
+
+	fz_try(ctx)
+	{
+		shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+		shade->buffer->params.type = FZ_IMAGE_RAW;
+		shade->buffer->buffer = w.buf = fz_new_buffer(ctx, 1024);
+		for (j = 0; j < n; j++)
+		{
+			for (i = 0; i < n; i++)
+			{
+				/* Every other patch is flipped, so that shared edges
+				 * are walked both ways. */
+				int flip = (i + j) & 1;
+				put_bits(ctx, &w, 0, 8);
+				for (k = 0; k < (type == FZ_MESH_TYPE6 ? 12 : 16); k++)
+					put_point(ctx, &w, n, wavy, 3 * i + coons[k][0], 3 * j + (flip ? 3 - coons[k][1] : coons[k][1]));
+				for (k = 0; k < 4; k++)
+					put_color(ctx, &w, n, wavy, i + corners[k][0], j + (flip ? 1 - corners[k][1] : corners[k][1]));
+			}
+		}
+		put_bits(ctx, &w, 0, 8 - w.n);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+
+	return shade;
+}
+
+/* Painting with and without a pool */
+
+static fz_pixmap *draw_shade(fz_context *ctx, fz_shade *shade, float sx, float sy, fz_thread_pool *pool)
+{
+	fz_irect bbox = { 0, 0, 0, 0 };
+	fz_pixmap *pix;
+	fz_device *dev;
+	fz_matrix ctm;
+
+	bbox.x1 = SIZE * sx;
+	bbox.y1 = SIZE * sy;
+	fz_scale(&ctm, sx, sy);
+
+	pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), &bbox, 0);
+	fz_clear_pixmap_with_value(ctx, pix, 255);
+	dev = fz_new_draw_device(ctx, NULL, pix);
+	fz_set_draw_device_thread_pool(ctx, dev, pool);
+	fz_try(ctx)
+	{
+		fz_fill_shade(ctx, dev, shade, &ctm, 1);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+	return pix;
+}
+
+static void test_pool(fz_context *ctx, fz_thread_pool *pool, fz_shade *shade, float sx, float sy)
+{
+	fz_pixmap *plain, *pooled;
+
+	plain = draw_shade(ctx, shade, sx, sy, NULL);
+	fz_try(ctx)
+	{
+		pooled = draw_shade(ctx, shade, sx, sy, pool);
+		check(!memcmp(plain->samples, pooled->samples, (size_t)plain->stride * plain->h),
+			"painting on a pool gives different pixels");
+		fz_drop_pixmap(ctx, pooled);
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, plain);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Looking for cracks */
+
+typedef struct
+{
+	fz_point a, b;
+} edge;
+
+typedef struct
+{
+	edge *edges;
+	int len, max;
+} edge_list;
+
+static int cmp_point(const fz_point *a, const fz_point *b)
+{
+	if (a->x != b->x)
+		return a->x < b->x ? -1 : 1;
+	if (a->y != b->y)
+		return a->y < b->y ? -1 : 1;
+	return 0;
+}
+
+static int cmp_edge(const void *a_, const void *b_)
+{
+	const edge *a = a_;
+	const edge *b = b_;
+	int c = cmp_point(&a->a, &b->a);
+	return c ? c : cmp_point(&a->b, &b->b);
+}
+
+static void add_edge(fz_context *ctx, edge_list *list, const fz_point *a, const fz_point *b)
+{
+	edge *e;
+
+	if (list->len == list->max)
+	{
+		int max = list->max ? list->max * 2 : 1024;
+		list->edges = fz_resize_array(ctx, list->edges, max, sizeof(edge));
+		list->max = max;
+	}
+	e = &list->edges[list->len++];
+	if (cmp_point(a, b) < 0)
+		e->a = *a, e->b = *b;
+	else
+		e->a = *b, e->b = *a;
+}
+
+static void prepare_vertex(fz_context *ctx, void *arg, fz_vertex *v, const float *c)
+{
+	memcpy(v->c, c, 3 * sizeof(float));
+}
+
+static void collect_edges(fz_context *ctx, void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex *cv)
+{
+	edge_list *list = arg;
+	add_edge(ctx, list, &av->p, &bv->p);
+	add_edge(ctx, list, &bv->p, &cv->p);
+	add_edge(ctx, list, &cv->p, &av->p);
+}
+
+static int on_outside(const fz_point *p)
+{
+	return fabsf(p->x) < 1e-3f || fabsf(p->x - SIZE) < 1e-3f ||
+		fabsf(p->y) < 1e-3f || fabsf(p->y - SIZE) < 1e-3f;
+}
+
+static void test_cracks(fz_context *ctx, fz_shade *shade)
+{
+	edge_list list = { NULL, 0, 0 };
+	int i, k, cracks = 0;
+
+	fz_try(ctx)
+	{
+		fz_process_shade(ctx, shade, &fz_identity, prepare_vertex, collect_edges, &list);
+		qsort(list.edges, list.len, sizeof(edge), cmp_edge);
+		for (i = 0; i < list.len; i = k)
+		{
+			for (k = i + 1; k < list.len; k++)
+				if (cmp_edge(&list.edges[i], &list.edges[k]))
+					break;
+			/* Zero length edges come from degenerate triangles. */
+			if (k == i + 1 && cmp_point(&list.edges[i].a, &list.edges[i].b) &&
+				!(on_outside(&list.edges[i].a) && on_outside(&list.edges[i].b)))
+				cracks++;
+		}
+		check(list.len > 0, "no triangles");
+		check(cracks == 0, "patches do not meet");
+	}
+	fz_always(ctx)
+		fz_free(ctx, list.edges);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static void test_mesh(fz_context *ctx, fz_thread_pool *pool, int type, int n, int wavy, float sx, float sy)
+{
+	fz_shade *shade = new_patch_shade(ctx, type, n, wavy);
+
+	fz_snprintf(mesh, sizeof mesh, "type %d, %dx%d %s patches", type, n, n, wavy ? "wavy" : "flat");
+	fz_try(ctx)
+	{
+		test_cracks(ctx, shade);
+		test_pool(ctx, pool, shade, sx, sy);
+	}
+	fz_always(ctx)
+		fz_drop_shade(ctx, shade);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	fz_thread_pool *pool = NULL;
+	fz_context *ctx;
+
+	fz_var(pool);
+
+	ctx = fz_new_context(NULL, init_locks(), FZ_STORE_DEFAULT);
+	if (!ctx)
+	{
+		fprintf(stderr, "shadetest: cannot create context\n");
+		return 1;
+	}
+
+	fz_try(ctx)
+	{
+		pool = fz_new_thread_pool(ctx, 3);
+		test_mesh(ctx, pool, FZ_MESH_TYPE6, 2, 1, 4, 4);
+		test_mesh(ctx, pool, FZ_MESH_TYPE6, 8, 1, 20, 20);
+		test_mesh(ctx, pool, FZ_MESH_TYPE6, 8, 0, 4, 100);
+		test_mesh(ctx, pool, FZ_MESH_TYPE7, 2, 1, 4, 4);
+		test_mesh(ctx, pool, FZ_MESH_TYPE7, 8, 1, 20, 20);
+		test_mesh(ctx, pool, FZ_MESH_TYPE7, 8, 0, 4, 100);
+	}
+	fz_always(ctx)
+		fz_drop_thread_pool(ctx, pool);
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "shadetest: %s\n", fz_caught_message(ctx));
+		failed = 1;
+	}
+
+	fz_drop_context(ctx);
+	fin_locks();
+
+	printf("shadetest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
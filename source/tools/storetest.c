@@ -0,0 +1,451 @@
+/*
+ * storetest -- check that cached derived objects leave the store
+ */
+
+#include "mupdf/fitz.h"
+#include "../fitz/colorspace-imp.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+/*
+	Tables derived from a function or a colorspace are kept in the
+	store, keyed on the object they were made from. Once the last
+	reference from outside the store is dropped, the store must reap
+	them, and the object with them, even if the store never fills
+	up. The store is created unlimited, so nothing is ever evicted
+	for space; anything that leaves it has been reaped.
+
+	Sampled functions must also agree with the function they were
+	made from: exactly at grid points, and within the error of the
+	interpolation between them, both when evaluated directly and
+	when used to convert pixmaps in tint transform colorspaces.
+	Pixmap converters likewise must agree with fz_convert_color, and
+	Lab, which no affordable grid can follow, must not be sampled.
+
+		make check
+*/
+
+static int failed = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "storetest: %s\n", what);
+		failed = 1;
+	}
+}
+
+/* Function lookup tables */
+
+static int functions_freed = 0;
+
+static void ramp_evaluate(fz_context *ctx, fz_function *func, const float *in, float *out)
+{
+	out[0] = in[0];
+	out[1] = 1 - in[0];
+	out[2] = in[0] * in[0];
+}
+
+static void drop_ramp(fz_context *ctx, fz_storable *func)
+{
+	functions_freed++;
+	fz_free(ctx, func);
+}
+
+static fz_function *new_ramp(fz_context *ctx)
+{
+	fz_function *func = fz_malloc_struct(ctx, fz_function);
+	FZ_INIT_KEY_STORABLE(func, 1, drop_ramp);
+	func->size = sizeof(*func);
+	func->m = 1;
+	func->n = 3;
+	func->evaluate = ramp_evaluate;
+	return func;
+}
+
+static void test_function_lut(fz_context *ctx)
+{
+	fz_function *func;
+	fz_function_lut *lut, *again;
+
+	func = new_ramp(ctx);
+	lut = fz_find_function_lut(ctx, func);
+	check(lut != NULL, "function lut was not made");
+	again = fz_find_function_lut(ctx, func);
+	check(again == lut, "function lut was not found in the store");
+	fz_drop_function_lut(ctx, again);
+
+	/* Now only we and the store hold the table. */
+	check(lut->storable.refs == 2, "function lut is not in the store");
+	fz_drop_function(ctx, func);
+	check(functions_freed == 1, "function lut was not reaped with its function");
+	check(lut->storable.refs == 1, "function lut is still in the store");
+	fz_drop_function_lut(ctx, lut);
+}
+
+/* Sampled function values */
+
+static unsigned int seed = 1;
+
+static float random_unit(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xffff) / 65535.0f;
+}
+
+/* A smooth function of any number of inputs, with some curvature. */
+static void tint_evaluate(fz_context *ctx, fz_function *func, const float *in, float *out)
+{
+	float sum = 0;
+	int k;
+
+	for (k = 0; k < func->m; k++)
+		sum += in[k];
+	out[0] = sum / func->m;
+	out[1] = in[0] * in[func->m > 1 ? 1 : 0];
+	out[2] = 1 - in[func->m - 1];
+}
+
+static void drop_tint(fz_context *ctx, fz_storable *func)
+{
+	fz_free(ctx, func);
+}
+
+static fz_function *new_tint(fz_context *ctx, int m)
+{
+	fz_function *func = fz_malloc_struct(ctx, fz_function);
+	FZ_INIT_KEY_STORABLE(func, 1, drop_tint);
+	func->size = sizeof(*func);
+	func->m = m;
+	func->n = 3;
+	func->evaluate = tint_evaluate;
+	return func;
+}
+
+static float lut_error(fz_context *ctx, fz_function *func, fz_function_lut *lut, const float *in)
+{
+	float want[3], got[3], err = 0;
+	int k;
+
+	fz_eval_function(ctx, func, in, func->m, want, 3);
+	fz_eval_function_lut(ctx, lut, in, got);
+	for (k = 0; k < 3; k++)
+		err = fz_max(err, fabsf(want[k] - got[k]));
+	return err;
+}
+
+/* The interpolation error of in[0]*in[1] over a cell is at most
+ * spacing^2/4; the other outputs are linear. */
+static void test_function_lut_values(fz_context *ctx, int m)
+{
+	fz_function *func = new_tint(ctx, m);
+	fz_function_lut *lut = NULL;
+	float in[FZ_FN_MAXM];
+	float grid_err = 0, between_err = 0, spacing;
+	int points = 1;
+	int i, j, k;
+
+	fz_var(lut);
+
+	fz_try(ctx)
+	{
+		lut = fz_find_function_lut(ctx, func);
+		check(lut != NULL, "function lut was not made");
+		if (lut)
+		{
+			spacing = 1.0f / (lut->size - 1);
+			for (k = 0; k < m; k++)
+				points *= lut->size;
+
+			for (i = 0; i < points; i++)
+			{
+				for (j = i, k = 0; k < m; k++, j /= lut->size)
+					in[k] = (j % lut->size) * spacing;
+				grid_err = fz_max(grid_err, lut_error(ctx, func, lut, in));
+			}
+
+			for (i = 0; i < 4096; i++)
+			{
+				for (k = 0; k < m; k++)
+					in[k] = random_unit();
+				between_err = fz_max(between_err, lut_error(ctx, func, lut, in));
+			}
+
+			check(grid_err < 1e-5f, "function lut differs from its function at grid points");
+			check(between_err <= spacing * spacing / 4 + 1e-5f, "function lut differs from its function between grid points");
+		}
+	}
+	fz_always(ctx)
+	{
+		if (lut)
+			fz_drop_function_lut(ctx, lut);
+		fz_drop_function(ctx, func);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Too coarse a grid would be worse than evaluating the function. */
+static void test_function_lut_limit(fz_context *ctx)
+{
+	fz_function *func = new_tint(ctx, 7);
+	fz_function_lut *lut = fz_find_function_lut(ctx, func);
+
+	check(lut == NULL, "function lut was made with too few points on each axis");
+	if (lut)
+		fz_drop_function_lut(ctx, lut);
+	fz_drop_function(ctx, func);
+}
+
+static void tint_to_rgb(fz_context *ctx, fz_colorspace *cs, const float *src, float *dst)
+{
+	fz_eval_function(ctx, cs->tint, src, cs->n, dst, 3);
+}
+
+static void drop_tint_colorspace(fz_context *ctx, fz_colorspace *cs)
+{
+	fz_drop_function(ctx, cs->data);
+}
+
+/* Convert a pixmap in a tint transform colorspace with m components,
+ * and compare it against the tint transform evaluated exactly. A
+ * single component goes through the separation lookup table, up to 6
+ * through the hash of interpolated colours, and more through the hash
+ * of exactly evaluated colours. */
+static void test_tint_conversion(fz_context *ctx, int m, int tolerance)
+{
+	fz_function *func = new_tint(ctx, m);
+	fz_colorspace *cs = NULL;
+	fz_pixmap *src = NULL;
+	fz_pixmap *dst = NULL;
+	unsigned char *s, *d;
+	float srcv[FZ_MAX_COLORS], rgb[3];
+	int w = 256, h = 4;
+	int i, k, diff, err = 0;
+
+	fz_var(cs);
+	fz_var(src);
+	fz_var(dst);
+
+	fz_try(ctx)
+	{
+		cs = fz_new_colorspace(ctx, "Tint", m, tint_to_rgb, NULL, drop_tint_colorspace, func, 0);
+		func = NULL;
+		cs->tint_base = fz_device_rgb(ctx);
+		cs->tint = cs->data;
+
+		src = fz_new_pixmap(ctx, cs, w, h, 0);
+		dst = fz_new_pixmap(ctx, fz_device_rgb(ctx), w, h, 0);
+		s = fz_pixmap_samples(ctx, src);
+		for (i = 0; i < w * h; i++)
+			for (k = 0; k < m; k++)
+				*s++ = (m == 1 ? i : random_unit() * 255);
+
+		fz_convert_pixmap(ctx, dst, src);
+
+		s = fz_pixmap_samples(ctx, src);
+		d = fz_pixmap_samples(ctx, dst);
+		for (i = 0; i < w * h; i++)
+		{
+			for (k = 0; k < m; k++)
+				srcv[k] = *s++ / 255.0f;
+			fz_eval_function(ctx, cs->tint, srcv, m, rgb, 3);
+			for (k = 0; k < 3; k++)
+			{
+				diff = *d++ - (int)(fz_clamp(rgb[k], 0, 1) * 255);
+				err = fz_maxi(err, diff < 0 ? -diff : diff);
+			}
+		}
+		check(err <= tolerance, m == 1 ?
+			"separation pixmap differs from its tint transform" :
+			"devicen pixmap differs from its tint transform");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, src);
+		fz_drop_pixmap(ctx, dst);
+		fz_drop_colorspace(ctx, cs);
+		if (func)
+			fz_drop_function(ctx, func);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Pixmap converters */
+
+static int colorspaces_freed = 0;
+
+static void mix_to_rgb(fz_context *ctx, fz_colorspace *cs, const float *src, float *dst)
+{
+	dst[0] = (src[1] + src[2]) / 2;
+	dst[1] = (src[0] + src[2]) / 2;
+	dst[2] = (src[0] + src[1]) / 2;
+}
+
+static void drop_mix(fz_context *ctx, fz_colorspace *cs)
+{
+	colorspaces_freed++;
+}
+
+static void test_pixmap_converter(fz_context *ctx)
+{
+	fz_colorspace *cs;
+	fz_pixmap_converter *pc, *again;
+
+	cs = fz_new_colorspace(ctx, "Mix", 3, mix_to_rgb, NULL, drop_mix, &colorspaces_freed, 0);
+	pc = fz_find_pixmap_converter(ctx, fz_device_rgb(ctx), cs);
+	check(pc != NULL, "pixmap converter was not made");
+	again = fz_find_pixmap_converter(ctx, fz_device_rgb(ctx), cs);
+	check(again == pc, "pixmap converter was not found in the store");
+	fz_drop_pixmap_converter(ctx, again);
+
+	fz_drop_colorspace(ctx, cs);
+	check(colorspaces_freed == 1, "pixmap converter was not reaped with its colorspace");
+	fz_drop_pixmap_converter(ctx, pc);
+}
+
+static void ink_to_rgb(fz_context *ctx, fz_colorspace *cs, const float *src, float *dst)
+{
+	dst[0] = (1 - src[0]) * (1 - src[3]);
+	dst[1] = (1 - src[1]) * (1 - src[3]);
+	dst[2] = (1 - src[2]) * (1 - src[3]);
+}
+
+/* Convert random pixels in cs to RGB, with a converter if pc is set and
+ * with fz_convert_pixmap otherwise, and return the largest difference
+ * from fz_convert_color. */
+static int convert_error(fz_context *ctx, fz_colorspace *cs, fz_pixmap_converter *pc)
+{
+	fz_pixmap *src = NULL;
+	fz_pixmap *dst = NULL;
+	unsigned char *s, *d;
+	float srcv[4], rgb[3];
+	int lab = fz_colorspace_is_lab(ctx, cs);
+	int n = fz_colorspace_n(ctx, cs);
+	int w = 256, h = 64;
+	int i, k, diff, err = 0;
+
+	fz_var(src);
+	fz_var(dst);
+
+	fz_try(ctx)
+	{
+		src = fz_new_pixmap(ctx, cs, w, h, 0);
+		dst = fz_new_pixmap(ctx, fz_device_rgb(ctx), w, h, 0);
+		s = fz_pixmap_samples(ctx, src);
+		for (i = 0; i < w * h * n; i++)
+			*s++ = random_unit() * 255;
+
+		if (pc)
+			fz_convert_pixmap_with_converter(ctx, pc, dst, src);
+		else
+			fz_convert_pixmap(ctx, dst, src);
+
+		s = fz_pixmap_samples(ctx, src);
+		d = fz_pixmap_samples(ctx, dst);
+		for (i = 0; i < w * h; i++)
+		{
+			for (k = 0; k < n; k++, s++)
+				srcv[k] = !lab ? *s / 255.0f : k == 0 ? *s / 255.0f * 100 : *s - 128;
+			fz_convert_color(ctx, fz_device_rgb(ctx), rgb, cs, srcv);
+			for (k = 0; k < 3; k++)
+			{
+				diff = *d++ - (int)(fz_clamp(rgb[k], 0, 1) * 255);
+				err = fz_maxi(err, diff < 0 ? -diff : diff);
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, src);
+		fz_drop_pixmap(ctx, dst);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return err;
+}
+
+/* The grid points are rounded down to 8 bits, and the weights to 1/256,
+ * so allow 2 either way for smooth spaces. */
+static void test_pixmap_converter_values(fz_context *ctx)
+{
+	fz_colorspace *mix = NULL;
+	fz_colorspace *ink = NULL;
+	fz_pixmap_converter *pc = NULL;
+
+	fz_var(mix);
+	fz_var(ink);
+	fz_var(pc);
+
+	fz_try(ctx)
+	{
+		mix = fz_new_colorspace(ctx, "Mix", 3, mix_to_rgb, NULL, NULL, NULL, 0);
+		pc = fz_find_pixmap_converter(ctx, fz_device_rgb(ctx), mix);
+		check(pc && convert_error(ctx, mix, pc) <= 2, "3 component pixmap converter differs from fz_convert_color");
+		if (pc)
+			fz_drop_pixmap_converter(ctx, pc);
+		pc = NULL;
+
+		ink = fz_new_colorspace(ctx, "Ink", 4, ink_to_rgb, NULL, NULL, NULL, 0);
+		pc = fz_find_pixmap_converter(ctx, fz_device_rgb(ctx), ink);
+		check(pc && convert_error(ctx, ink, pc) <= 2, "4 component pixmap converter differs from fz_convert_color");
+		if (pc)
+			fz_drop_pixmap_converter(ctx, pc);
+		pc = NULL;
+
+		pc = fz_find_pixmap_converter(ctx, fz_device_rgb(ctx), fz_device_lab(ctx));
+		check(pc == NULL, "lab is sampled by a pixmap converter");
+		check(convert_error(ctx, fz_device_lab(ctx), NULL) <= 1, "lab pixmap differs from fz_convert_color");
+	}
+	fz_always(ctx)
+	{
+		if (pc)
+			fz_drop_pixmap_converter(ctx, pc);
+		fz_drop_colorspace(ctx, mix);
+		fz_drop_colorspace(ctx, ink);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "storetest: cannot create context\n");
+		return 1;
+	}
+
+	fz_try(ctx)
+	{
+		test_function_lut(ctx);
+		test_function_lut_values(ctx, 1);
+		test_function_lut_values(ctx, 3);
+		test_function_lut_limit(ctx);
+		test_tint_conversion(ctx, 1, 1);
+		/* 6 points on each axis: (0.2^2/4) * 255 from interpolation, and 1 from rounding. */
+		test_tint_conversion(ctx, 5, 4);
+		/* Not sampled at all, so only rounding. */
+		test_tint_conversion(ctx, 8, 1);
+		test_pixmap_converter(ctx);
+		test_pixmap_converter_values(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "storetest: %s\n", fz_caught_message(ctx));
+		failed = 1;
+	}
+
+	fz_drop_context(ctx);
+
+	printf("storetest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}
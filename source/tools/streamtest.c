@@ -0,0 +1,193 @@
+/*
+ * streamtest -- check that fz_open_null reads the same over every
+ * kind of stream
+ */
+
+#include "mupdf/fitz.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+	fz_open_null over a memory mapped file points straight at the
+	mapping instead of copying through the null filter. Every other
+	stream must still get the null filter, which only moves its
+	chain as it reads. Both must read the same bytes and leave the
+	chain at the end of the range once everything has been read, as
+	inline images rely on, including for ranges of ranges.
+
+		make check
+*/
+
+#define DATA_LEN 10000
+#define TEMP_FILE "streamtest.tmp"
+
+static int failed = 0;
+
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "streamtest: %s\n", what);
+		failed = 1;
+	}
+}
+
+static unsigned char data[DATA_LEN];
+
+/* Read a null stream of len bytes at offset within chain, which starts at
+ * base within the data, and check what comes out. The chain is kept, so
+ * that its position can be checked too. */
+static void
+check_range(fz_context *ctx, fz_stream *chain, int base, int offset, int len, int expect_len, const char *what)
+{
+	fz_stream *stm = NULL;
+	unsigned char buf[DATA_LEN + 1];
+	char msg[100];
+	size_t n;
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		stm = fz_open_null(ctx, fz_keep_stream(ctx, chain), len, offset);
+		n = fz_read(ctx, stm, buf, sizeof buf);
+		fz_snprintf(msg, sizeof msg, "%s: wrong data for %d bytes at %d", what, len, offset);
+		check(n == (size_t)expect_len && !memcmp(buf, data + base + offset, n), msg);
+		if (expect_len > 0)
+		{
+			fz_snprintf(msg, sizeof msg, "%s: chain not left at the end of %d bytes at %d", what, len, offset);
+			check(fz_tell(ctx, chain) == offset + expect_len, msg);
+		}
+	}
+	fz_always(ctx)
+		fz_drop_stream(ctx, stm);
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+}
+
+static void
+check_ranges(fz_context *ctx, fz_stream *chain, const char *what)
+{
+	fz_stream *outer = NULL;
+	unsigned char buf[100];
+	char msg[100];
+	size_t n;
+
+	fz_var(outer);
+
+	check_range(ctx, chain, 0, 0, DATA_LEN, DATA_LEN, what);
+	check_range(ctx, chain, 0, 1234, 3000, 3000, what);
+	check_range(ctx, chain, 0, DATA_LEN - 10, 100, 10, what);
+	check_range(ctx, chain, 0, DATA_LEN + 10, 100, 0, what);
+	check_range(ctx, chain, 0, 500, -1, 0, what);
+
+	/* A range of a range reads relative to the outer range, which
+	 * must still read properly after being moved. */
+	fz_try(ctx)
+	{
+		outer = fz_open_null(ctx, fz_keep_stream(ctx, chain), 3000, 1000);
+		fz_seek(ctx, outer, 200, 0);
+		n = fz_read(ctx, outer, buf, 10);
+		fz_snprintf(msg, sizeof msg, "%s: wrong data after seeking in a range", what);
+		check(n == 10 && !memcmp(buf, data + 1200, 10), msg);
+		check_range(ctx, outer, 1000, 300, 50, 50, what);
+	}
+	fz_always(ctx)
+		fz_drop_stream(ctx, outer);
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+}
+
+static void
+test_buffer(fz_context *ctx)
+{
+	fz_buffer *buf = NULL;
+	fz_stream *chain = NULL;
+	fz_stream *stm = NULL;
+
+	fz_var(buf);
+	fz_var(chain);
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer_from_shared_data(ctx, (const char *)data, DATA_LEN);
+		chain = fz_open_buffer(ctx, buf);
+		check_ranges(ctx, chain, "buffer");
+
+		/* The null filter does not touch its chain until it is read. */
+		fz_seek(ctx, chain, 42, 0);
+		stm = fz_open_null(ctx, fz_keep_stream(ctx, chain), 100, 1000);
+		check(fz_tell(ctx, chain) == 42, "buffer: chain moved by opening a null stream");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, stm);
+		fz_drop_stream(ctx, chain);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+}
+
+static void
+test_file(fz_context *ctx, int map)
+{
+	fz_stream *chain = NULL;
+	FILE *f;
+
+	fz_var(chain);
+
+	f = fopen(TEMP_FILE, "wb");
+	if (!f || fwrite(data, 1, DATA_LEN, f) != DATA_LEN)
+	{
+		check(0, "cannot write " TEMP_FILE);
+		if (f)
+			fclose(f);
+		return;
+	}
+	fclose(f);
+
+	fz_tune_file_mapping(ctx, map);
+	fz_try(ctx)
+	{
+		chain = fz_open_file(ctx, TEMP_FILE);
+		check_ranges(ctx, chain, map ? "mapped file" : "file");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_stream(ctx, chain);
+		fz_tune_file_mapping(ctx, 0);
+	}
+	fz_catch(ctx)
+		check(0, fz_caught_message(ctx));
+
+	remove(TEMP_FILE);
+}
+
+int main(int argc, char **argv)
+{
+	fz_context *ctx;
+	int i;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "streamtest: cannot create context\n");
+		return 1;
+	}
+
+	for (i = 0; i < DATA_LEN; i++)
+		data[i] = (unsigned char)(i * 7 + i / 251);
+
+	test_buffer(ctx);
+	test_file(ctx, 0);
+	test_file(ctx, 1);
+
+	fz_drop_context(ctx);
+
+	fprintf(stderr, "streamtest: %s\n", failed ? "FAIL" : "ok");
+	return failed;
+}